@@ -0,0 +1,255 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-7-25
+//  Author: daohu527
+
+
+
+#include "modules/tools/ilego_loam/benchmark/fixture.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+
+namespace apollo {
+namespace tools {
+
+namespace {
+
+constexpr float kSensorHeight = 1.8f;
+constexpr float kMaxRange = 100.0f;
+constexpr float kRangeNoise = 0.02f;
+constexpr float kDropout = 0.01f;
+
+struct Box {
+  float min[3];
+  float max[3];
+};
+
+struct Cylinder {
+  float x;
+  float y;
+  float radius;
+  float z_min;
+  float z_max;
+};
+
+struct Obstacles {
+  // ground z = slope_x * x + slope_y * y
+  float slope_x = 0.0f;
+  float slope_y = 0.0f;
+  std::vector<Box> boxes;
+  std::vector<Cylinder> cylinders;
+
+  float Ground(float x, float y) const { return slope_x * x + slope_y * y; }
+};
+
+uint32_t Hash(int a, int b, uint32_t salt) {
+  uint32_t h = static_cast<uint32_t>(a) * 73856093u ^
+               static_cast<uint32_t>(b) * 19349663u ^ salt * 83492791u;
+  h ^= h >> 13;
+  h *= 0x5bd1e995u;
+  h ^= h >> 15;
+  return h;
+}
+
+// [0, 1)
+float Unit(uint32_t h) {
+  return static_cast<float>(h & 0xffffff) / static_cast<float>(0x1000000);
+}
+
+int FloorDiv(float x, float cell) {
+  return static_cast<int>(std::floor(x / cell));
+}
+
+// Buildings of 36m blocks on both sides of a 20m street along x, with
+// parked cars in 8m slots and poles every 12m
+void AddUrban(float cx, Obstacles* obstacles) {
+  constexpr float kBlock = 36.0f;
+  for (int k = FloorDiv(cx - kMaxRange, kBlock);
+       k <= FloorDiv(cx + kMaxRange, kBlock); ++k) {
+    const float x0 = k * kBlock;
+    for (int side = 0; side < 2; ++side) {
+      const float length = 24.0f + 10.0f * Unit(Hash(k, side, 1));
+      const float height = 8.0f + 16.0f * Unit(Hash(k, side, 2));
+      const float y0 = side == 0 ? 10.0f : -22.0f;
+      obstacles->boxes.push_back(
+          {{x0, y0, 0.0f}, {x0 + length, y0 + 12.0f, height}});
+    }
+  }
+
+  constexpr float kSlot = 8.0f;
+  for (int k = FloorDiv(cx - kMaxRange, kSlot);
+       k <= FloorDiv(cx + kMaxRange, kSlot); ++k) {
+    const float x0 = k * kSlot;
+    for (int side = 0; side < 2; ++side) {
+      if (Unit(Hash(k, side, 3)) < 0.5f)
+        continue;
+      const float y0 = side == 0 ? 6.0f : -7.8f;
+      obstacles->boxes.push_back({{x0, y0, 0.0f}, {x0 + 4.2f, y0 + 1.8f, 1.5f}});
+    }
+  }
+
+  constexpr float kPole = 12.0f;
+  for (int k = FloorDiv(cx - kMaxRange, kPole);
+       k <= FloorDiv(cx + kMaxRange, kPole); ++k) {
+    obstacles->cylinders.push_back({k * kPole, 8.5f, 0.15f, 0.0f, 6.0f});
+    obstacles->cylinders.push_back({k * kPole + 6.0f, -8.5f, 0.15f, 0.0f, 6.0f});
+  }
+}
+
+// Trees in 15m cells of a sloped field, a third of the cells has one
+void AddOpen(float cx, float cy, Obstacles* obstacles) {
+  constexpr float kCell = 15.0f;
+  obstacles->slope_x = 0.03f;
+  obstacles->slope_y = 0.01f;
+  for (int i = FloorDiv(cx - kMaxRange, kCell);
+       i <= FloorDiv(cx + kMaxRange, kCell); ++i) {
+    for (int j = FloorDiv(cy - kMaxRange, kCell);
+         j <= FloorDiv(cy + kMaxRange, kCell); ++j) {
+      if (Unit(Hash(i, j, 5)) >= 0.3f)
+        continue;
+      const float x = (i + Unit(Hash(i, j, 6))) * kCell;
+      const float y = (j + Unit(Hash(i, j, 7))) * kCell;
+      const float z = obstacles->Ground(x, y);
+      obstacles->cylinders.push_back({x, y, 0.2f + 0.3f * Unit(Hash(i, j, 8)),
+                                      z, z + 4.0f + 6.0f * Unit(Hash(i, j, 9))});
+    }
+  }
+}
+
+// Distance to the first surface along the unit direction d from o, or
+// kMaxRange if there is none
+float CastRay(const Obstacles& obstacles, const float o[3], const float d[3]) {
+  float best = kMaxRange;
+
+  // ground plane
+  const float denominator =
+      d[2] - obstacles.slope_x * d[0] - obstacles.slope_y * d[1];
+  if (denominator < 0.0f) {
+    const float t = (obstacles.Ground(o[0], o[1]) - o[2]) / denominator;
+    if (t > 0.0f)
+      best = std::min(best, t);
+  }
+
+  for (const Box& box : obstacles.boxes) {
+    float t_near = 0.0f;
+    float t_far = best;
+    for (int k = 0; k < 3 && t_near <= t_far; ++k) {
+      if (std::abs(d[k]) < 1e-9f) {
+        if (o[k] < box.min[k] || o[k] > box.max[k])
+          t_near = std::numeric_limits<float>::max();
+        continue;
+      }
+      float t0 = (box.min[k] - o[k]) / d[k];
+      float t1 = (box.max[k] - o[k]) / d[k];
+      if (t0 > t1)
+        std::swap(t0, t1);
+      t_near = std::max(t_near, t0);
+      t_far = std::min(t_far, t1);
+    }
+    if (t_near <= t_far && t_near > 0.0f)
+      best = t_near;
+  }
+
+  const float a = d[0] * d[0] + d[1] * d[1];
+  if (a > 1e-9f) {
+    for (const Cylinder& cylinder : obstacles.cylinders) {
+      const float px = o[0] - cylinder.x;
+      const float py = o[1] - cylinder.y;
+      const float b = px * d[0] + py * d[1];
+      const float c = px * px + py * py - cylinder.radius * cylinder.radius;
+      const float discriminant = b * b - a * c;
+      if (discriminant < 0.0f)
+        continue;
+      const float t = (-b - std::sqrt(discriminant)) / a;
+      if (t <= 0.0f || t >= best)
+        continue;
+      const float z = o[2] + t * d[2];
+      if (z >= cylinder.z_min && z <= cylinder.z_max)
+        best = t;
+    }
+  }
+  return best;
+}
+
+}  // namespace
+
+const char* SceneName(Scene scene) {
+  switch (scene) {
+    case Scene::URBAN:
+      return "urban";
+    case Scene::OPEN:
+      return "open";
+  }
+  return "unknown";
+}
+
+void MakeScan(const SensorProfile& profile, Scene scene, float x, float y,
+              float yaw, uint32_t seed, apollo::drivers::PointCloud* cloud) {
+  Obstacles obstacles;
+  if (scene == Scene::URBAN)
+    AddUrban(x, &obstacles);
+  else
+    AddOpen(x, y, &obstacles);
+
+  std::mt19937 rng(seed);
+  std::normal_distribution<float> noise(0.0f, kRangeNoise);
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+  const float origin[3] = {x, y, obstacles.Ground(x, y) + kSensorHeight};
+  const float cos_yaw = std::cos(yaw);
+  const float sin_yaw = std::sin(yaw);
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+
+  cloud->Clear();
+  auto* points = cloud->mutable_point();
+  points->Reserve(profile.n_scan * profile.horizon_scan);
+  for (int col = 0; col < profile.horizon_scan; ++col) {
+    const float azimuth = 2 * M_PI * col / profile.horizon_scan - M_PI;
+    for (int ring = 0; ring < profile.n_scan; ++ring) {
+      const float elevation = profile.vertical_angles[ring] / 180.0f * M_PI;
+      // sensor frame direction, and rotated into the scene
+      const float ds[3] = {std::cos(elevation) * std::cos(azimuth),
+                           std::cos(elevation) * std::sin(azimuth),
+                           std::sin(elevation)};
+      const float dw[3] = {cos_yaw * ds[0] - sin_yaw * ds[1],
+                           sin_yaw * ds[0] + cos_yaw * ds[1], ds[2]};
+      const float range = CastRay(obstacles, origin, dw);
+
+      auto* point = points->Add();
+      if (range >= kMaxRange || uniform(rng) < kDropout) {
+        point->set_x(nan);
+        point->set_y(nan);
+        point->set_z(nan);
+        point->set_intensity(0);
+        continue;
+      }
+      const float measured = range + noise(rng);
+      point->set_x(ds[0] * measured);
+      point->set_y(ds[1] * measured);
+      point->set_z(ds[2] * measured);
+      point->set_intensity(static_cast<uint32_t>(uniform(rng) * 100));
+    }
+  }
+  cloud->set_width(points->size());
+  cloud->set_height(1);
+  cloud->set_is_dense(false);
+}
+
+}  // namespace tools
+}  // namespace apollo
@@ -0,0 +1,55 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-7-25
+//  Author: daohu527
+
+
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "modules/drivers/proto/pointcloud.pb.h"
+
+#include "modules/tools/ilego_loam/src/sensor_profile.h"
+
+namespace apollo {
+namespace tools {
+
+// Synthetic lidar scans for the benchmarks.
+//
+// The scenes are made of boxes, vertical cylinders and a ground plane
+// placed by a hash of their grid cell, so a scene is the same everywhere
+// it is seen from and two scans of nearby poses overlap like real ones.
+// Each ring of the profile is ray cast at every column, the points come in
+// column order like a spinning sensor, with range noise and dropouts as
+// NaN points.
+enum class Scene {
+  // street canyon with buildings, parked cars and poles
+  URBAN = 0,
+  // sloped field with sparse trees
+  OPEN,
+};
+
+const char* SceneName(Scene scene);
+
+// Sensor at (x, y) 1.8m above the ground, heading yaw, in the scene frame.
+// The same arguments give the same scan.
+void MakeScan(const SensorProfile& profile, Scene scene, float x, float y,
+              float yaw, uint32_t seed, apollo::drivers::PointCloud* cloud);
+
+}  // namespace tools
+}  // namespace apollo
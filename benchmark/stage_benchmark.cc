@@ -0,0 +1,543 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-7-25
+//  Author: daohu527
+
+
+
+// Benchmarks of the ilego_loam stages on the synthetic scans of
+// fixture.h, for 16, 32 and 64 ring sensors in an urban and an open scene.
+//
+//   bazel run -c opt //modules/tools/ilego_loam/benchmark -- \
+//       --benchmark_filter=Segmentation
+//
+// BM_FrameLatency runs the stages of a frame one after the other and
+// reports the p50 and p99 frame latency and the allocations per frame,
+// without and with the FrameTelemetry of --publish_telemetry, whose
+// overhead is the difference of the two.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "Eigen/Dense"
+
+#include "modules/tools/ilego_loam/benchmark/fixture.h"
+#include "modules/tools/ilego_loam/src/component_labeler.h"
+#include "modules/tools/ilego_loam/src/feature_extractor.h"
+#include "modules/tools/ilego_loam/src/lib/projection_table.h"
+#include "modules/tools/ilego_loam/src/lib/scan_context.h"
+#include "modules/tools/ilego_loam/src/lib/voxel_filter.h"
+#include "modules/tools/ilego_loam/src/lib/voxel_hash_map.h"
+#include "modules/tools/ilego_loam/src/range_image.h"
+#include "modules/tools/ilego_loam/src/registration.h"
+#include "modules/tools/ilego_loam/src/scan_matcher.h"
+#include "modules/tools/ilego_loam/src/sensor_profile.h"
+#include "modules/tools/ilego_loam/src/telemetry.h"
+#include "modules/tools/ilego_loam/src/utility.h"
+
+// Allocations of the whole binary, BM_FrameLatency counts the ones of its
+// frames. Deallocations go to free as usual.
+static std::atomic<uint64_t> allocation_count{0};
+
+void* operator new(std::size_t size) {
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+namespace apollo {
+namespace tools {
+namespace {
+
+using Cloud = pcl::PointCloud<PointType>;
+
+const char* const kSensors[] = {"VLP-16", "HDL-32E", "HDL-64E"};
+const Scene kScenes[] = {Scene::URBAN, Scene::OPEN};
+
+// Key frames of the loop closure and the map of the scan to map matching
+// are taken every kKeyFrameStep meters along x
+constexpr float kKeyFrameStep = 2.0f;
+constexpr int kLoopKeyFrames = 50;
+constexpr int kMapKeyFrames = 20;
+constexpr int kMatchIterations = 10;
+constexpr int kLatencyFrames = 20;
+
+struct Sensor {
+  SensorProfile profile;
+  lib::ProjectionTable table;
+};
+
+const Sensor& GetSensor(int sensor) {
+  static std::map<int, std::unique_ptr<Sensor>> cache;
+  auto& entry = cache[sensor];
+  if (!entry) {
+    entry.reset(new Sensor());
+    LoadSensorProfile(kSensors[sensor], &entry->profile);
+    entry->table.Init(entry->profile.vertical_angles, entry->profile.ang_res_x,
+                      entry->profile.horizon_scan);
+  }
+  return *entry;
+}
+
+// Scan of a sensor at x along the path of a scene, cached
+const apollo::drivers::PointCloud& GetScan(int sensor, int scene, float x,
+                                           float y = 0.0f, float yaw = 0.0f) {
+  using Key = std::tuple<int, int, float, float, float>;
+  static std::map<Key, std::unique_ptr<apollo::drivers::PointCloud>> cache;
+  auto& entry = cache[Key(sensor, scene, x, y, yaw)];
+  if (!entry) {
+    entry.reset(new apollo::drivers::PointCloud());
+    MakeScan(GetSensor(sensor).profile, kScenes[scene], x, y, yaw,
+             static_cast<uint32_t>(std::hash<float>()(x + 1000 * scene)),
+             entry.get());
+  }
+  return *entry;
+}
+
+void SetLabel(benchmark::State& state, const std::string& suffix = "") {
+  state.SetLabel(std::string(kSensors[state.range(0)]) + "/" +
+                 SceneName(kScenes[state.range(1)]) + suffix);
+}
+
+void AllFixtures(benchmark::internal::Benchmark* b) {
+  for (int sensor = 0; sensor < 3; ++sensor) {
+    for (int scene = 0; scene < 2; ++scene)
+      b->Args({sensor, scene});
+  }
+}
+
+void Project(const Sensor& sensor, const apollo::drivers::PointCloud& cloud,
+             RangeImage* image) {
+  image->Reset();
+  DispatchGeometry(sensor.profile, [&](auto rows, auto cols) {
+    constexpr int kRows = decltype(rows)::value;
+    constexpr int kCols = decltype(cols)::value;
+    ProjectPointCloud<kRows, kCols>(cloud, sensor.profile, sensor.table, image);
+  });
+}
+
+void RemoveGround(const Sensor& sensor, RangeImage* image) {
+  DispatchGeometry(sensor.profile, [&](auto rows, auto cols) {
+    constexpr int kRows = decltype(rows)::value;
+    constexpr int kCols = decltype(cols)::value;
+    GroundRemoval<kRows, kCols>(sensor.profile, image);
+  });
+}
+
+int Segment(const Sensor& sensor, ComponentLabeler* labeler,
+            RangeImage* image) {
+  int segments = 0;
+  DispatchGeometry(sensor.profile, [&](auto rows, auto cols) {
+    constexpr int kRows = decltype(rows)::value;
+    constexpr int kCols = decltype(cols)::value;
+    segments = labeler->Label<kRows, kCols>(image);
+  });
+  return segments;
+}
+
+void InitImage(const Sensor& sensor, RangeImage* image) {
+  image->Resize(sensor.profile.n_scan, sensor.profile.horizon_scan,
+                sensor.profile.ground_scan_ind + 1);
+}
+
+// Stand in for the features of FeatureAssociation: corners are the points
+// off the ground on a 1m grid, surfs all points on a 0.4m grid
+void MakeFeatures(const apollo::drivers::PointCloud& scan, float x,
+                  Cloud* corners, Cloud* surfs) {
+  // scratch kept across calls, the benchmarks run on one thread
+  static Cloud all;
+  static Cloud high;
+  all.clear();
+  high.clear();
+  for (const auto& p : scan.point()) {
+    if (IsNaN(p))
+      continue;
+    PointType point;
+    point.x = p.x() + x;
+    point.y = p.y();
+    point.z = p.z();
+    point.intensity = p.intensity();
+    all.points.push_back(point);
+  }
+  for (const PointType& point : all.points) {
+    if (point.z > -1.5f)
+      high.points.push_back(point);
+  }
+  lib::VoxelFilter<PointType>(1.0f, 1.0f, 1.0f).Filter(high, corners);
+  lib::VoxelFilter<PointType>(0.4f, 0.4f, 0.4f).Filter(all, surfs);
+}
+
+void BM_ProjectPointCloud(benchmark::State& state) {
+  const Sensor& sensor = GetSensor(state.range(0));
+  const auto& scan = GetScan(state.range(0), state.range(1), 0.0f);
+  RangeImage image;
+  InitImage(sensor, &image);
+  for (auto _ : state) {
+    Project(sensor, scan, &image);
+    benchmark::DoNotOptimize(image.dirty_index().data());
+  }
+  state.counters["points"] = scan.point_size();
+  SetLabel(state);
+}
+BENCHMARK(BM_ProjectPointCloud)->Apply(AllFixtures)->Unit(benchmark::kMicrosecond);
+
+void BM_GroundRemoval(benchmark::State& state) {
+  const Sensor& sensor = GetSensor(state.range(0));
+  RangeImage image;
+  InitImage(sensor, &image);
+  Project(sensor, GetScan(state.range(0), state.range(1), 0.0f), &image);
+  // Only the ground flags and the labels of ground cells are written, so
+  // running it again on the same image does the same work
+  for (auto _ : state) {
+    RemoveGround(sensor, &image);
+    benchmark::DoNotOptimize(image.ground());
+  }
+  SetLabel(state);
+}
+BENCHMARK(BM_GroundRemoval)->Apply(AllFixtures)->Unit(benchmark::kMicrosecond);
+
+void BM_CloudSegmentation(benchmark::State& state) {
+  const Sensor& sensor = GetSensor(state.range(0));
+  RangeImage image;
+  InitImage(sensor, &image);
+  Project(sensor, GetScan(state.range(0), state.range(1), 0.0f), &image);
+  RemoveGround(sensor, &image);
+  const int cells = sensor.profile.n_scan * sensor.profile.horizon_scan;
+  const std::vector<int> labels(image.label(), image.label() + cells);
+
+  ComponentLabeler labeler;
+  labeler.Init(sensor.profile);
+  int segments = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    std::copy(labels.begin(), labels.end(), image.mutable_label());
+    state.ResumeTiming();
+    segments = Segment(sensor, &labeler, &image);
+  }
+  state.counters["segments"] = segments;
+  SetLabel(state);
+}
+BENCHMARK(BM_CloudSegmentation)->Apply(AllFixtures)->Unit(benchmark::kMicrosecond);
+
+// Smoothness, occlusion and the feature picks of FeatureAssociation on the
+// segmented cloud and ring info of the image projection
+void BM_ExtractFeatures(benchmark::State& state) {
+  const Sensor& sensor = GetSensor(state.range(0));
+  RangeImage image;
+  InitImage(sensor, &image);
+  Project(sensor, GetScan(state.range(0), state.range(1), 0.0f), &image);
+  RemoveGround(sensor, &image);
+  ComponentLabeler labeler;
+  labeler.Init(sensor.profile);
+  Segment(sensor, &labeler, &image);
+
+  cloud_msgs::CloudInfo info;
+  Cloud segmented;
+  Cloud outliers;
+  DispatchGeometry(sensor.profile, [&](auto rows, auto cols) {
+    constexpr int kRows = decltype(rows)::value;
+    constexpr int kCols = decltype(cols)::value;
+    ExtractSegmentedCloud<kRows, kCols>(sensor.profile, image, &info,
+                                        &segmented, &outliers);
+  });
+
+  FeatureExtractor extractor;
+  extractor.Init();
+  Cloud corner_sharp;
+  Cloud corner_less_sharp;
+  Cloud surf_flat;
+  Cloud surf_less_flat;
+  for (auto _ : state) {
+    extractor.CalculateSmoothness(info, segmented.size());
+    extractor.MarkOccludedPoints(info);
+    extractor.ExtractFeatures(info, segmented, &corner_sharp,
+                              &corner_less_sharp, &surf_flat, &surf_less_flat);
+    benchmark::DoNotOptimize(surf_less_flat.points.data());
+  }
+  state.counters["points"] = segmented.size();
+  state.counters["corners"] = corner_less_sharp.size();
+  state.counters["surfs"] = surf_less_flat.size();
+  SetLabel(state);
+}
+BENCHMARK(BM_ExtractFeatures)->Apply(AllFixtures)->Unit(benchmark::kMicrosecond);
+
+// Map of the key frames before and after x = 0
+struct MatchMap {
+  lib::VoxelHashMap<PointType> corners{1.0f};
+  lib::VoxelHashMap<PointType> surfs{1.0f};
+};
+
+const MatchMap& GetMatchMap(int sensor, int scene) {
+  static std::map<std::pair<int, int>, std::unique_ptr<MatchMap>> cache;
+  auto& entry = cache[std::make_pair(sensor, scene)];
+  if (!entry) {
+    entry.reset(new MatchMap());
+    Cloud corners;
+    Cloud surfs;
+    for (int i = 0; i < kMapKeyFrames; ++i) {
+      const float x = (i - kMapKeyFrames / 2) * kKeyFrameStep;
+      Cloud frame_corners;
+      Cloud frame_surfs;
+      MakeFeatures(GetScan(sensor, scene, x), x, &frame_corners, &frame_surfs);
+      corners += frame_corners;
+      surfs += frame_surfs;
+    }
+    lib::VoxelFilter<PointType>(0.2f, 0.2f, 0.2f).Filter(corners, &corners);
+    lib::VoxelFilter<PointType>(0.4f, 0.4f, 0.4f).Filter(surfs, &surfs);
+    entry->corners.Insert(corners);
+    entry->surfs.Insert(surfs);
+  }
+  return *entry;
+}
+
+// Gauss-Newton iterations of Scan2MapOptimization, the pose is solved from
+// the normal equations of each iteration
+int MatchScan(ScanMatcher* matcher, const MatchMap& map, const Cloud& corners,
+              const Cloud& surfs, float transform[6]) {
+  int iterations = 0;
+  for (; iterations < kMatchIterations; ++iterations) {
+    const NormalEquation& equation =
+        matcher->Accumulate(transform, corners, map.corners, surfs, map.surfs);
+    if (equation.count < 50)
+      break;
+    const NormalEquation::Vector6d dx = equation.FullAtA().ldlt().solve(equation.atb);
+    for (int k = 0; k < 6; ++k)
+      transform[k] += static_cast<float>(dx[k]);
+    if (dx.norm() < 1e-4)
+      break;
+  }
+  return iterations;
+}
+
+void BM_Scan2MapOptimization(benchmark::State& state) {
+  const MatchMap& map = GetMatchMap(state.range(0), state.range(1));
+  Cloud corners;
+  Cloud surfs;
+  // between two key frames of the map, in the scan frame
+  MakeFeatures(GetScan(state.range(0), state.range(1), 1.0f), 0.0f, &corners,
+               &surfs);
+  ScanMatcher matcher;
+  matcher.Init();
+  int iterations = 0;
+  for (auto _ : state) {
+    float transform[6] = {0, 0, 0, 1.0f, 0, 0};
+    iterations = MatchScan(&matcher, map, corners, surfs, transform);
+    benchmark::DoNotOptimize(transform);
+  }
+  state.counters["iterations"] = iterations;
+  state.counters["corners"] = corners.size();
+  state.counters["surfs"] = surfs.size();
+  SetLabel(state);
+}
+BENCHMARK(BM_Scan2MapOptimization)->Apply(AllFixtures)->Unit(benchmark::kMillisecond);
+
+void AddToContext(const apollo::drivers::PointCloud& scan,
+                  lib::ScanContext* context) {
+  for (const auto& p : scan.point()) {
+    if (!IsNaN(p))
+      context->Add(p.x(), p.y(), p.z());
+  }
+}
+
+// DetectLoopClosure of the mapping: the scan context search over the key
+// frames and the registration against the clouds around the best one
+void BM_DetectLoopClosure(benchmark::State& state) {
+  const int sensor = state.range(0);
+  const int scene = state.range(1);
+  lib::ScanContextIndex index;
+  for (int i = 0; i < kLoopKeyFrames; ++i) {
+    lib::ScanContext context(80.0f, 1.8f);
+    AddToContext(GetScan(sensor, scene, i * kKeyFrameStep), &context);
+    index.Add(i, context);
+  }
+
+  // A revisit of key frame 20 from the side, turned by 0.3 rad
+  const int revisit = 20;
+  const auto& query_scan =
+      GetScan(sensor, scene, revisit * kKeyFrameStep + 0.7f, 0.4f, 0.3f);
+  lib::ScanContext query(80.0f, 1.8f);
+  AddToContext(query_scan, &query);
+  // the downsampled key frame clouds are registered, as in the mapping
+  Cloud corners;
+  Cloud source;
+  MakeFeatures(query_scan, 0.0f, &corners, &source);
+
+  Registration registration;
+  registration.Init();
+  int64_t target_key = -1;
+  Registration::Result result;
+  for (auto _ : state) {
+    auto candidates = index.Search(query, 10, [](int) { return true; });
+    if (candidates.empty())
+      continue;
+    const int closest = candidates.front().id;
+    // The target stays while the closest key frame does not change, like
+    // in the mapping
+    if (!registration.HasTarget(closest)) {
+      state.PauseTiming();
+      Cloud target;
+      for (int i = std::max(closest - 2, 0);
+           i <= std::min(closest + 2, kLoopKeyFrames - 1); ++i) {
+        Cloud corners;
+        Cloud surfs;
+        MakeFeatures(GetScan(sensor, scene, i * kKeyFrameStep),
+                     i * kKeyFrameStep, &corners, &surfs);
+        target += surfs;
+      }
+      registration.SetTarget(closest, target);
+      target_key = closest;
+      state.ResumeTiming();
+    }
+    const Eigen::Affine3f guess =
+        Eigen::Translation3f(closest * kKeyFrameStep, 0.0f, 0.0f) *
+        Eigen::AngleAxisf(2 * M_PI * candidates.front().shift /
+                              lib::ScanContext::kSectors,
+                          Eigen::Vector3f::UnitZ());
+    result = registration.Align(source, guess);
+  }
+  state.counters["closest"] = target_key;
+  state.counters["fitness"] = result.fitness;
+  SetLabel(state);
+}
+BENCHMARK(BM_DetectLoopClosure)->Apply(AllFixtures)->Unit(benchmark::kMillisecond);
+
+double Percentile(std::vector<double> samples, double p) {
+  if (samples.empty())
+    return 0.0;
+  const size_t n = static_cast<size_t>(p * (samples.size() - 1) + 0.5);
+  std::nth_element(samples.begin(), samples.begin() + n, samples.end());
+  return samples[n];
+}
+
+void LatencyFixtures(benchmark::internal::Benchmark* b) {
+  for (int sensor = 0; sensor < 3; ++sensor) {
+    for (int scene = 0; scene < 2; ++scene) {
+      for (int telemetry = 0; telemetry < 2; ++telemetry)
+        b->Args({sensor, scene, telemetry});
+    }
+  }
+}
+
+// A frame through projection, ground removal, segmentation, the features
+// and the scan to map matching. All buffers are kept across frames like
+// in the components, so the allocations are the ones of a steady state.
+// With telemetry every stage is timed and the message is serialized as for
+// a reader in another process.
+void BM_FrameLatency(benchmark::State& state) {
+  const int sensor_index = state.range(0);
+  const int scene = state.range(1);
+  cloud_msgs::FrameTelemetry telemetry;
+  cloud_msgs::FrameTelemetry* stages = state.range(2) ? &telemetry : nullptr;
+  std::string serialized;
+  const Sensor& sensor = GetSensor(sensor_index);
+  const MatchMap& map = GetMatchMap(sensor_index, scene);
+  std::vector<const apollo::drivers::PointCloud*> scans;
+  for (int i = 0; i < kLatencyFrames; ++i) {
+    const float x = (i - kLatencyFrames / 2) * kKeyFrameStep + 1.0f;
+    scans.push_back(&GetScan(sensor_index, scene, x));
+  }
+
+  RangeImage image;
+  InitImage(sensor, &image);
+  ComponentLabeler labeler;
+  labeler.Init(sensor.profile);
+  ScanMatcher matcher;
+  matcher.Init();
+  Cloud corners;
+  Cloud surfs;
+
+  std::vector<double> latencies;
+  uint64_t allocations = 0;
+  size_t frame = 0;
+  for (auto _ : state) {
+    const auto& scan = *scans[frame % scans.size()];
+    const float x = (static_cast<int>(frame % scans.size()) -
+                     kLatencyFrames / 2) * kKeyFrameStep + 1.0f;
+    const uint64_t allocations_before = allocation_count.load();
+    const auto start = std::chrono::steady_clock::now();
+
+    if (stages) {
+      StartTelemetry(scan.header().timestamp_sec(),
+                     cloud_msgs::FrameTelemetry::IMAGE_PROJECTION, stages);
+    }
+    {
+      StageTimer timer(stages, cloud_msgs::FrameTelemetry::PROJECT);
+      Project(sensor, scan, &image);
+    }
+    {
+      StageTimer timer(stages, cloud_msgs::FrameTelemetry::GROUND);
+      RemoveGround(sensor, &image);
+    }
+    {
+      StageTimer timer(stages, cloud_msgs::FrameTelemetry::SEGMENT);
+      const int segments = Segment(sensor, &labeler, &image);
+      if (stages)
+        stages->set_segments(segments);
+    }
+    {
+      StageTimer timer(stages, cloud_msgs::FrameTelemetry::FEATURES);
+      MakeFeatures(scan, 0.0f, &corners, &surfs);
+    }
+    float transform[6] = {0, 0, 0, x, 0, 0};
+    {
+      StageTimer timer(stages, cloud_msgs::FrameTelemetry::MATCH);
+      MatchScan(&matcher, map, corners, surfs, transform);
+    }
+    benchmark::DoNotOptimize(transform);
+    if (stages) {
+      stages->set_input_points(scan.point_size());
+      stages->set_corner_features(corners.size());
+      stages->set_surf_features(surfs.size());
+      stages->SerializeToString(&serialized);
+      benchmark::DoNotOptimize(serialized.data());
+    }
+
+    const auto end = std::chrono::steady_clock::now();
+    allocations += allocation_count.load() - allocations_before;
+    latencies.push_back(
+        std::chrono::duration<double, std::milli>(end - start).count());
+    ++frame;
+  }
+  state.counters["p50_ms"] = Percentile(latencies, 0.5);
+  state.counters["p99_ms"] = Percentile(latencies, 0.99);
+  state.counters["allocs_per_frame"] =
+      frame > 0 ? static_cast<double>(allocations) / frame : 0.0;
+  SetLabel(state, stages ? "/telemetry" : "");
+}
+// Every scan of the sequence twice, enough samples for the percentiles
+BENCHMARK(BM_FrameLatency)
+    ->Apply(LatencyFixtures)
+    ->Iterations(2 * kLatencyFrames)
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace
+}  // namespace tools
+}  // namespace apollo
+
+BENCHMARK_MAIN();
@@ -23,7 +23,80 @@
 DEFINE_string(lidar_topic, "/apollo/sensor/lidar32/compensator/PointCloud2",
     "lidar topic");
 
+DEFINE_string(sensor_model, "VLP-16",
+    "lidar model: VLP-16, HDL-32E, HDL-64E, VLS-128, OS1-16 or OS1-64");
+
+DEFINE_string(imu_topic, "/apollo/sensor/gnss/corrected_imu",
+    "imu topic, the orientation of the corrected imu deskews the scans");
+
+DEFINE_string(map_directory, "/tmp/",
+    "directory the mapping saves the final map and trajectory to");
+
 DEFINE_bool(use_cloud_ring, false, "use cloud ring or not");
+DEFINE_bool(use_projection_table, false,
+    "bin points with precomputed angle tables instead of atan2");
+DEFINE_string(sensor_vertical_angles, "",
+    "comma separated ring elevations in degrees, ascending, "
+    "empty means uniform rings from ang_bottom and ang_res_y");
+
+DEFINE_int32(segmentation_threads, 1,
+    "number of row bands labeled in parallel, 1 means serial");
+
+DEFINE_int32(feature_threads, 1,
+    "number of threads extracting ring features, 1 means serial");
+
+DEFINE_int32(mapping_threads, 1,
+    "number of threads matching the scan to the map, 1 means serial");
+
+DEFINE_bool(mapping_pipeline, false,
+    "run the scan to map match and the pose graph update of the mapping on "
+    "their own threads, overlapping consecutive frames");
+
+DEFINE_int32(keyframe_memory_mb, 0,
+    "memory of the key frame clouds, the least recently used ones over it "
+    "are spilled to keyframe_spill_file, 0 means no limit");
+
+DEFINE_string(keyframe_spill_file, "/tmp/ilego_loam_keyframes.bin",
+    "file the key frame clouds are spilled to");
+
+DEFINE_int32(isam_batch_size, 1,
+    "key frames added to the pose graph per iSAM update, a loop closure "
+    "updates at once");
+
+DEFINE_double(isam_relinearize_threshold, 0.01,
+    "iSAM2 relinearizes a variable whose delta is over the threshold");
+
+DEFINE_int32(isam_relinearize_skip, 1,
+    "iSAM2 checks the variables for relinearization every that many updates");
+
+DEFINE_int32(loop_threads, 1,
+    "number of threads registering loop closure candidates, 1 means serial");
+
+DEFINE_int32(loop_candidates, 10,
+    "key frames compared in full by their scan context for a loop closure, "
+    "0 searches by distance only");
+
+DEFINE_double(scan_context_threshold, 0.3,
+    "largest scan context distance of a loop closure candidate");
+
+DEFINE_bool(publish_debug_clouds, false,
+    "always publish the debug clouds, otherwise only when they have a reader");
+
+DEFINE_bool(publish_telemetry, true,
+    "publish the per frame timings and counters of the components on "
+    "/ilego_loam/telemetry");
+
+DEFINE_bool(load_shedding, true,
+    "feature association and mapping extract fewer features while they are "
+    "slower than the lidar, and all of them again once they catch up");
+
+DEFINE_int32(scan_queue_size, 1,
+    "pending scans of the lidar and segmented cloud readers, with 1 a late "
+    "component skips to the newest scan");
+
+DEFINE_bool(replay_lockstep, false,
+    "the replay runs every frame through all the stages before the next one, "
+    "the results do not depend on the thread timing");
 
 DEFINE_double(sensor_minimum_range, 1.0, "");
 DEFINE_double(sensor_mount_angle, .0, "");
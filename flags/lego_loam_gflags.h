@@ -25,7 +25,31 @@
 
 DECLARE_string(lidar_topic);
 
+DECLARE_string(sensor_model);
+DECLARE_string(imu_topic);
+DECLARE_string(map_directory);
+
 DECLARE_bool(use_cloud_ring);
+DECLARE_bool(use_projection_table);
+DECLARE_string(sensor_vertical_angles);
+
+DECLARE_int32(segmentation_threads);
+DECLARE_int32(feature_threads);
+DECLARE_int32(mapping_threads);
+DECLARE_bool(mapping_pipeline);
+DECLARE_int32(keyframe_memory_mb);
+DECLARE_string(keyframe_spill_file);
+DECLARE_int32(isam_batch_size);
+DECLARE_double(isam_relinearize_threshold);
+DECLARE_int32(isam_relinearize_skip);
+DECLARE_int32(loop_threads);
+DECLARE_int32(loop_candidates);
+DECLARE_double(scan_context_threshold);
+DECLARE_bool(publish_debug_clouds);
+DECLARE_bool(publish_telemetry);
+DECLARE_bool(load_shedding);
+DECLARE_int32(scan_queue_size);
+DECLARE_bool(replay_lockstep);
 
 DECLARE_double(sensor_minimum_range);
 DECLARE_double(sensor_mount_angle);
@@ -0,0 +1,82 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-7-25
+//  Author: daohu527
+
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include "Eigen/Geometry"
+
+#include "modules/localization/proto/localization.pb.h"
+
+namespace apollo {
+namespace tools {
+
+// The odometry and the mapping run in the camera frame of LOAM, x left,
+// y up and z forward, while the lidar and the imu are x forward, y left and
+// z up. A transform (rx, ry, rz, tx, ty, tz) of the camera frame rotates by
+// rz, rx and then ry, R = Ry(ry) * Rx(rx) * Rz(rz), and then moves by t.
+
+inline Eigen::Matrix3f CameraRotation(float rx, float ry, float rz) {
+  return (Eigen::AngleAxisf(ry, Eigen::Vector3f::UnitY()) *
+          Eigen::AngleAxisf(rx, Eigen::Vector3f::UnitX()) *
+          Eigen::AngleAxisf(rz, Eigen::Vector3f::UnitZ())).toRotationMatrix();
+}
+
+// The angles of CameraRotation, rx is in [-pi/2, pi/2]
+inline Eigen::Vector3f CameraAngles(const Eigen::Matrix3f& rotation) {
+  return Eigen::Vector3f(
+      std::asin(std::max(-1.0f, std::min(1.0f, -rotation(1, 2)))),
+      std::atan2(rotation(0, 2), rotation(2, 2)),
+      std::atan2(rotation(1, 0), rotation(1, 1)));
+}
+
+// The camera frame angles of an orientation of the lidar frame. Its roll,
+// pitch and yaw about x, y and z are rz, rx and ry.
+inline Eigen::Vector3f CameraAngles(const Eigen::Quaterniond& orientation) {
+  const Eigen::Matrix3d r = orientation.toRotationMatrix();
+  const double roll = std::atan2(r(2, 1), r(2, 2));
+  const double pitch = std::asin(std::max(-1.0, std::min(1.0, -r(2, 0))));
+  const double yaw = std::atan2(r(1, 0), r(0, 0));
+  return Eigen::Vector3f(pitch, yaw, roll);
+}
+
+// Writes a camera frame pose as the pose of the lidar in the lidar axes of
+// the first scan
+inline void CameraPoseToLocalization(
+    const float transform[6], double timestamp,
+    apollo::localization::LocalizationEstimate* localization) {
+  const Eigen::Quaterniond orientation(
+      Eigen::AngleAxisd(transform[1], Eigen::Vector3d::UnitZ()) *
+      Eigen::AngleAxisd(transform[0], Eigen::Vector3d::UnitY()) *
+      Eigen::AngleAxisd(transform[2], Eigen::Vector3d::UnitX()));
+  localization->mutable_header()->set_timestamp_sec(timestamp);
+  localization->set_measurement_time(timestamp);
+  auto* pose = localization->mutable_pose();
+  pose->mutable_position()->set_x(transform[5]);
+  pose->mutable_position()->set_y(transform[3]);
+  pose->mutable_position()->set_z(transform[4]);
+  pose->mutable_orientation()->set_qx(orientation.x());
+  pose->mutable_orientation()->set_qy(orientation.y());
+  pose->mutable_orientation()->set_qz(orientation.z());
+  pose->mutable_orientation()->set_qw(orientation.w());
+}
+
+}  // namespace tools
+}  // namespace apollo
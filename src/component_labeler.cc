@@ -0,0 +1,210 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+//  Created Date: 2022-6-20
+//  Author: daohu527
+
+
+#include "modules/tools/ilego_loam/src/component_labeler.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "modules/tools/ilego_loam/src/utility.h"
+
+namespace apollo {
+namespace tools {
+
+void ComponentLabeler::Init(const SensorProfile& profile, int num_threads) {
+  n_scan_ = profile.n_scan;
+  horizon_scan_ = profile.horizon_scan;
+  // each band needs at least two rows to have vertical edges of its own
+  num_threads_ = std::max(1, std::min(num_threads, n_scan_ / 2));
+  pool_.Resize(num_threads_);
+
+  ratio_x_ = std::sin(segmentTheta) /
+      std::sin(profile.segment_alpha_x() + segmentTheta);
+  ratio_y_ = std::sin(segmentTheta) /
+      std::sin(profile.segment_alpha_y() + segmentTheta);
+
+  const int cells = n_scan_ * horizon_scan_;
+  parent_.resize(cells);
+  root_.resize(cells);
+  size_.resize(cells);
+  line_count_.resize(cells);
+  last_row_.resize(cells);
+  root_label_.resize(cells);
+}
+
+template <int kCols>
+void ComponentLabeler::UnionRows(const RangeImage& image, int row_begin,
+                                 int row_end) {
+  const int horizon_scan = kCols > 0 ? kCols : horizon_scan_;
+  const float* range = image.range();
+  const int* label = image.label();
+
+  for (int i = row_begin; i < row_end; ++i) {
+    const int row = i * horizon_scan;
+    for (int j = 0; j < horizon_scan; ++j) {
+      if (label[row + j] == LABEL_INIT)
+        parent_[row + j] = row + j;
+    }
+  }
+
+  for (int i = row_begin; i < row_end; ++i) {
+    const int row = i * horizon_scan;
+    for (int j = 0; j < horizon_scan; ++j) {
+      const int index = row + j;
+      if (label[index] != LABEL_INIT)
+        continue;
+
+      // right neighbor, wraps around at the seam
+      const int right = j + 1 < horizon_scan ? index + 1 : row;
+      if (label[right] == LABEL_INIT) {
+        auto [d2, d1] = std::minmax(range[index], range[right]);
+        if (d2 > d1 * ratio_x_)
+          Union(index, right);
+      }
+
+      // upper neighbor
+      const int upper = index + horizon_scan;
+      if (i + 1 < row_end && label[upper] == LABEL_INIT) {
+        auto [d2, d1] = std::minmax(range[index], range[upper]);
+        if (d2 > d1 * ratio_y_)
+          Union(index, upper);
+      }
+    }
+  }
+}
+
+template <int kCols>
+void ComponentLabeler::UnionBorder(const RangeImage& image, int row) {
+  const int horizon_scan = kCols > 0 ? kCols : horizon_scan_;
+  const float* range = image.range();
+  const int* label = image.label();
+
+  const int upper_row = row * horizon_scan;
+  const int lower_row = upper_row - horizon_scan;
+  for (int j = 0; j < horizon_scan; ++j) {
+    const int lower = lower_row + j;
+    const int upper = upper_row + j;
+    if (label[lower] != LABEL_INIT || label[upper] != LABEL_INIT)
+      continue;
+    auto [d2, d1] = std::minmax(range[lower], range[upper]);
+    if (d2 > d1 * ratio_y_)
+      Union(lower, upper);
+  }
+}
+
+template <int kCols>
+void ComponentLabeler::FlattenRows(const RangeImage& image, int row_begin,
+                                   int row_end) {
+  const int horizon_scan = kCols > 0 ? kCols : horizon_scan_;
+  const int* label = image.label();
+  for (int index = row_begin * horizon_scan; index < row_end * horizon_scan;
+       ++index) {
+    if (label[index] == LABEL_INIT)
+      root_[index] = FindRoot(index);
+  }
+}
+
+template <int kCols>
+int ComponentLabeler::Finalize(RangeImage* image) {
+  const int horizon_scan = kCols > 0 ? kCols : horizon_scan_;
+  const int cells = n_scan_ * horizon_scan;
+  int* label = image->mutable_label();
+
+  // Roots come first in row-major order, so their statistics are
+  // initialized before any other cell of the component is visited.
+  for (int index = 0; index < cells; ++index) {
+    if (label[index] != LABEL_INIT)
+      continue;
+    const int row = index / horizon_scan;
+    const int root = root_[index];
+    if (root == index) {
+      // the row of the seed is not counted, see the class comment
+      size_[root] = 1;
+      line_count_[root] = 0;
+      last_row_[root] = -1;
+      continue;
+    }
+    ++size_[root];
+    if (last_row_[root] != row) {
+      last_row_[root] = row;
+      ++line_count_[root];
+    }
+  }
+
+  int label_count = 1;
+  for (int index = 0; index < cells; ++index) {
+    if (label[index] != LABEL_INIT)
+      continue;
+    const int root = root_[index];
+    if (root == index) {
+      bool feasible_segment = size_[root] >= 30 ||
+          (size_[root] >= segmentValidPointNum &&
+           line_count_[root] >= segmentValidLineNum);
+      root_label_[root] = feasible_segment ? label_count++ : LABEL_INVALID;
+    }
+    label[index] = root_label_[root];
+  }
+  return label_count - 1;
+}
+
+template <int kRows, int kCols>
+int ComponentLabeler::Label(RangeImage* image) {
+  const int n_scan = kRows > 0 ? kRows : n_scan_;
+  if (num_threads_ <= 1) {
+    UnionRows<kCols>(*image, 0, n_scan);
+    FlattenRows<kCols>(*image, 0, n_scan);
+    return Finalize<kCols>(image);
+  }
+
+  // The bands only union cells of their own rows, so they never touch the
+  // same part of parent_
+  auto run_bands = [&](auto&& band_func) {
+    pool_.ParallelFor(num_threads_, [&](int band) {
+      band_func(band * n_scan / num_threads_, (band + 1) * n_scan / num_threads_);
+    });
+  };
+
+  run_bands([this, image](int row_begin, int row_end) {
+    UnionRows<kCols>(*image, row_begin, row_end);
+  });
+
+  for (int band = 1; band < num_threads_; ++band)
+    UnionBorder<kCols>(*image, band * n_scan / num_threads_);
+
+  run_bands([this, image](int row_begin, int row_end) {
+    FlattenRows<kCols>(*image, row_begin, row_end);
+  });
+
+  return Finalize<kCols>(image);
+}
+
+#define INSTANTIATE_COMPONENT_LABELER(ROWS, COLS)                           \
+  template int ComponentLabeler::Label<ROWS, COLS>(RangeImage*);
+
+// keep in sync with DispatchGeometry
+INSTANTIATE_COMPONENT_LABELER(16, 1800)
+INSTANTIATE_COMPONENT_LABELER(32, 1800)
+INSTANTIATE_COMPONENT_LABELER(64, 1800)
+INSTANTIATE_COMPONENT_LABELER(128, 1800)
+INSTANTIATE_COMPONENT_LABELER(0, 0)
+
+#undef INSTANTIATE_COMPONENT_LABELER
+
+}  // namespace tools
+}  // namespace apollo
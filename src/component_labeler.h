@@ -0,0 +1,118 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+//  Created Date: 2022-6-20
+//  Author: daohu527
+
+
+#pragma once
+
+#include <vector>
+
+#include "modules/tools/ilego_loam/src/lib/thread_pool.h"
+#include "modules/tools/ilego_loam/src/range_image.h"
+#include "modules/tools/ilego_loam/src/sensor_profile.h"
+
+namespace apollo {
+namespace tools {
+
+// Connected component labeling for CloudSegmentation.
+//
+// Two neighbor cells with ranges d1 >= d2 belong to the same segment if
+//   atan2(d2 * sin(alpha), d1 - d2 * cos(alpha)) > segmentTheta
+// which is the same as
+//   d2 > d1 * sin(segmentTheta) / sin(alpha + segmentTheta)
+// so each edge is a single comparison against a precomputed ratio.
+//
+// Components are built with union-find over row scans, the root of a
+// component is always its first cell in row-major order. Labels are then
+// given in row-major order of the roots, the same order as a flood fill
+// started from each unlabeled cell. Columns wrap at the 0/horizon_scan
+// seam. segmentValidLineNum is checked against the rows of the cells other
+// than the root, as LeGO-LOAM only flags the rows of the cells it adds to
+// the seed.
+//
+// With more than one thread the image is split into row bands which are
+// labeled concurrently on a lib::ThreadPool, the bands are then stitched
+// along their borders. Union-find components do not depend on the order
+// of the unions, so labels are identical to the serial path.
+class ComponentLabeler {
+ public:
+  void Init(const SensorProfile& profile, int num_threads = 1);
+
+  // Labels the LABEL_INIT cells of the image, cells of segments too small
+  // to be kept are labeled LABEL_INVALID. Returns the number of segments.
+  template <int kRows, int kCols>
+  int Label(RangeImage* image);
+
+ private:
+  template <int kCols>
+  void UnionRows(const RangeImage& image, int row_begin, int row_end);
+
+  // union the vertical edges between row - 1 and row
+  template <int kCols>
+  void UnionBorder(const RangeImage& image, int row);
+
+  template <int kCols>
+  void FlattenRows(const RangeImage& image, int row_begin, int row_end);
+
+  template <int kCols>
+  int Finalize(RangeImage* image);
+
+  int Find(int index) {
+    while (parent_[index] != index) {
+      parent_[index] = parent_[parent_[index]];
+      index = parent_[index];
+    }
+    return index;
+  }
+
+  // read only version of Find, safe to call from several threads
+  int FindRoot(int index) const {
+    while (parent_[index] != index)
+      index = parent_[index];
+    return index;
+  }
+
+  void Union(int a, int b) {
+    a = Find(a);
+    b = Find(b);
+    if (a < b) {
+      parent_[b] = a;
+    } else if (b < a) {
+      parent_[a] = b;
+    }
+  }
+
+  int n_scan_ = 0;
+  int horizon_scan_ = 0;
+  int num_threads_ = 1;
+  lib::ThreadPool pool_;
+
+  // edge ratios of horizontal and vertical neighbors
+  float ratio_x_ = 0;
+  float ratio_y_ = 0;
+
+  // indexed by cell, only valid for the LABEL_INIT cells of a frame
+  std::vector<int> parent_;
+  std::vector<int> root_;
+  std::vector<int> size_;
+  std::vector<int> line_count_;
+  std::vector<int> last_row_;
+  std::vector<int> root_label_;
+};
+
+}  // namespace tools
+}  // namespace apollo
@@ -0,0 +1,278 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-7-25
+//  Author: daohu527
+
+
+#include "modules/tools/ilego_loam/src/component_labeler.h"
+
+#include <cmath>
+#include <queue>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "modules/tools/ilego_loam/src/utility.h"
+
+namespace apollo {
+namespace tools {
+
+constexpr int kRows = 8;
+constexpr int kCols = 60;
+
+SensorProfile TestProfile() {
+  SensorProfile profile;
+  profile.name = "test";
+  profile.n_scan = kRows;
+  profile.horizon_scan = kCols;
+  profile.ang_res_x = 360.0f / kCols;
+  profile.ang_res_y = 2.0f;
+  return profile;
+}
+
+// The flood fill of LeGO-LOAM's labelComponents, seeded in row-major
+// order, with the atan2 criterion evaluated as is. Only the rows of the
+// neighbors it adds are counted for segmentValidLineNum.
+std::vector<int> FloodFillLabels(const SensorProfile& profile,
+                                 const RangeImage& image) {
+  const int rows = profile.n_scan;
+  const int cols = profile.horizon_scan;
+  std::vector<int> label(image.label(), image.label() + rows * cols);
+  const float* range = image.range();
+  int label_count = 1;
+  for (int seed = 0; seed < rows * cols; ++seed) {
+    if (label[seed] != LABEL_INIT)
+      continue;
+    std::vector<int> segment{seed};
+    std::vector<bool> line(rows, false);
+    label[seed] = label_count;
+    std::queue<int> queue;
+    queue.push(seed);
+    while (!queue.empty()) {
+      const int index = queue.front();
+      queue.pop();
+      const int row = index / cols;
+      const int col = index % cols;
+      const std::pair<int, int> neighbors[] = {{-1, 0}, {0, 1}, {0, -1}, {1, 0}};
+      for (const auto& neighbor : neighbors) {
+        const int r = row + neighbor.first;
+        if (r < 0 || r >= rows)
+          continue;
+        const int c = (col + neighbor.second + cols) % cols;
+        const int other = c + r * cols;
+        if (label[other] != LABEL_INIT)
+          continue;
+        const float d1 = std::max(range[index], range[other]);
+        const float d2 = std::min(range[index], range[other]);
+        const float alpha = neighbor.first == 0 ? profile.segment_alpha_x()
+                                                : profile.segment_alpha_y();
+        const float angle = std::atan2(d2 * std::sin(alpha),
+                                       d1 - d2 * std::cos(alpha));
+        if (angle > segmentTheta) {
+          label[other] = label_count;
+          line[r] = true;
+          segment.push_back(other);
+          queue.push(other);
+        }
+      }
+    }
+    int line_count = 0;
+    for (bool hit : line)
+      line_count += hit;
+    const int size = segment.size();
+    if (size >= 30 ||
+        (size >= segmentValidPointNum && line_count >= segmentValidLineNum)) {
+      ++label_count;
+    } else {
+      for (int index : segment)
+        label[index] = LABEL_INVALID;
+    }
+  }
+  return label;
+}
+
+// Column blocks of smooth range shared by a few rows, with jumps between
+// them and some cells empty
+void FillRandomImage(std::mt19937* rng, RangeImage* image) {
+  std::uniform_real_distribution<float> base(2.0f, 40.0f);
+  std::uniform_real_distribution<float> noise(-0.005f, 0.005f);
+  std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+  image->Reset();
+  std::vector<float> block(image->cols());
+  for (int row = 0; row < image->rows(); ++row) {
+    if (row % 3 == 0) {
+      float range = base(*rng);
+      for (int col = 0; col < image->cols(); ++col) {
+        if (unit(*rng) < 0.1f)
+          range = base(*rng);
+        block[col] = range;
+      }
+    }
+    for (int col = 0; col < image->cols(); ++col) {
+      if (unit(*rng) < 0.05f)
+        continue;
+      image->Set(row, col, 0, 0, 0, block[col] * (1.0f + noise(*rng)));
+    }
+  }
+}
+
+class ComponentLabelerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    profile_ = TestProfile();
+    labeler_.Init(profile_);
+    image_.Resize(kRows, kCols, 0);
+  }
+
+  int Label() { return labeler_.Label<0, 0>(&image_); }
+
+  SensorProfile profile_;
+  ComponentLabeler labeler_;
+  RangeImage image_;
+};
+
+TEST_F(ComponentLabelerTest, MatchesFloodFill) {
+  std::mt19937 rng(7);
+  int segments = 0;
+  for (int frame = 0; frame < 50; ++frame) {
+    FillRandomImage(&rng, &image_);
+    const std::vector<int> expected = FloodFillLabels(profile_, image_);
+    int max_label = 0;
+    for (int label : expected) {
+      if (label != LABEL_INVALID)
+        max_label = std::max(max_label, label);
+    }
+    EXPECT_EQ(Label(), max_label);
+    const std::vector<int> labels(image_.label(),
+                                  image_.label() + kRows * kCols);
+    EXPECT_EQ(labels, expected) << "frame " << frame;
+    segments += max_label;
+  }
+  // the images have several segments each
+  EXPECT_GT(segments, 100);
+}
+
+TEST_F(ComponentLabelerTest, SkipsTheRowOfTheSeed) {
+  // The seed in row 0 only touches the segment below it, the other cells
+  // are in rows 1 and 2. LeGO-LOAM counts 2 rows and drops the segment.
+  image_.Set(0, 10, 0, 0, 0, 5.0f);
+  for (int row = 1; row < 3; ++row) {
+    for (int col = 9; col < 12; ++col)
+      image_.Set(row, col, 0, 0, 0, 5.0f);
+  }
+  EXPECT_EQ(Label(), 0);
+  const int* label = image_.label();
+  EXPECT_EQ(label[10], LABEL_INVALID);
+  EXPECT_EQ(label[kCols + 10], LABEL_INVALID);
+
+  // a second cell in the row of the seed counts it
+  image_.Reset();
+  for (int row = 0; row < 3; ++row) {
+    for (int col = 9; col < 11; ++col)
+      image_.Set(row, col, 0, 0, 0, 5.0f);
+  }
+  EXPECT_EQ(Label(), 1);
+  EXPECT_EQ(label[10], 1);
+}
+
+TEST_F(ComponentLabelerTest, AngleCriterion) {
+  // Two cells of one row, d2 / d1 just above and below the ratio where
+  // the atan2 angle is segmentTheta, in a full row so the segment is kept
+  const float alpha = profile_.segment_alpha_x();
+  const float ratio = std::sin(segmentTheta) / std::sin(alpha + segmentTheta);
+  for (float scale : {1.001f, 0.999f}) {
+    image_.Reset();
+    const float d1 = 10.0f;
+    const float d2 = d1 * ratio * scale;
+    for (int col = 0; col < kCols; ++col)
+      image_.Set(0, col, 0, 0, 0, col < kCols / 2 ? d1 : d2);
+    Label();
+    const int* label = image_.label();
+    const float angle = std::atan2(d2 * std::sin(alpha), d1 - d2 * std::cos(alpha));
+    EXPECT_EQ(label[kCols / 2 - 1] == label[kCols / 2], angle > segmentTheta)
+        << "scale " << scale;
+  }
+}
+
+TEST_F(ComponentLabelerTest, WrapsAtTheSeam) {
+  // One segment across the 0 / kCols - 1 seam, its two halves only touch
+  // across it
+  for (int row = 0; row < 3; ++row) {
+    for (int col = 0; col < 5; ++col)
+      image_.Set(row, col, 0, 0, 0, 5.0f);
+    for (int col = kCols - 5; col < kCols; ++col)
+      image_.Set(row, col, 0, 0, 0, 5.0f);
+  }
+  EXPECT_EQ(Label(), 1);
+  const int* label = image_.label();
+  EXPECT_EQ(label[0], 1);
+  EXPECT_EQ(label[kCols - 1], 1);
+  EXPECT_EQ(label[2 * kCols + kCols - 5], 1);
+}
+
+TEST_F(ComponentLabelerTest, LabelsInRowMajorOrderOfTheFirstCell) {
+  // segment b starts in row 0 to the right of segment a, which starts in
+  // row 1 but reaches column 0 first
+  for (int row = 0; row < 3; ++row) {
+    for (int col = 40; col < 50; ++col)
+      image_.Set(row, col, 0, 0, 0, 20.0f);
+  }
+  for (int row = 1; row < 4; ++row) {
+    for (int col = 2; col < 12; ++col)
+      image_.Set(row, col, 0, 0, 0, 3.0f);
+  }
+  // too small to be a segment
+  image_.Set(6, 30, 0, 0, 0, 8.0f);
+  EXPECT_EQ(Label(), 2);
+  const int* label = image_.label();
+  EXPECT_EQ(label[40], 1);
+  EXPECT_EQ(label[kCols + 2], 2);
+  EXPECT_EQ(label[6 * kCols + 30], LABEL_INVALID);
+  // cells without a point are left alone
+  EXPECT_EQ(label[5 * kCols], LABEL_NONE);
+}
+
+TEST(ComponentLabelerThreadTest, ParallelMatchesSerial) {
+  SensorProfile profile = TestProfile();
+  profile.n_scan = 32;
+  ComponentLabeler serial;
+  serial.Init(profile, 1);
+  RangeImage serial_image;
+  serial_image.Resize(profile.n_scan, profile.horizon_scan, 0);
+  // 3 threads do not divide the rows evenly, 16 are clamped to 2 rows a band
+  for (int num_threads : {2, 3, 4, 16}) {
+    ComponentLabeler parallel;
+    parallel.Init(profile, num_threads);
+    RangeImage parallel_image;
+    parallel_image.Resize(profile.n_scan, profile.horizon_scan, 0);
+    std::mt19937 serial_rng(num_threads);
+    std::mt19937 parallel_rng(num_threads);
+    for (int frame = 0; frame < 20; ++frame) {
+      FillRandomImage(&serial_rng, &serial_image);
+      FillRandomImage(&parallel_rng, &parallel_image);
+      const int serial_count = serial.Label<0, 0>(&serial_image);
+      const int parallel_count = parallel.Label<0, 0>(&parallel_image);
+      EXPECT_EQ(serial_count, parallel_count);
+      const int cells = profile.n_scan * profile.horizon_scan;
+      EXPECT_EQ(std::vector<int>(serial_image.label(), serial_image.label() + cells),
+                std::vector<int>(parallel_image.label(), parallel_image.label() + cells))
+          << num_threads << " threads, frame " << frame;
+    }
+  }
+}
+
+}  // namespace tools
+}  // namespace apollo
@@ -0,0 +1,46 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-7-25
+//  Author: daohu527
+
+
+
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "cyber/cyber.h"
+#include "cyber/proto/component_conf.pb.h"
+
+namespace apollo {
+namespace tools {
+
+// Inits a component created in code instead of by a dag, e.g. a stage of
+// the fused component or of the replay. Its node is called name.
+template <typename ComponentT>
+bool InitComponent(const std::string& name,
+                   const std::shared_ptr<ComponentT>& component) {
+  cyber::proto::ComponentConfig config;
+  config.set_name(name);
+  if (!component->Initialize(config)) {
+    AERROR << "Failed to init " << name;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace tools
+}  // namespace apollo
@@ -27,453 +27,998 @@
 //  Created Date: 2022-5-5
 //  Author: daohu527
 
-#include "src/feature_association.h"
+#include "modules/tools/ilego_loam/src/feature_association.h"
 
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+#include <Eigen/Eigenvalues>
 #include <Eigen/Geometry>
 
-#include "src/utility.h"
+#include "modules/tools/ilego_loam/flags/lego_loam_gflags.h"
+#include "modules/tools/ilego_loam/src/camera_frame.h"
+#include "modules/tools/ilego_loam/src/trace.h"
+#include "modules/tools/ilego_loam/src/utility.h"
 
 namespace apollo {
 namespace tools {
 
-bool FeatureAssociation::Init() {
-  sub_imu_ = node_->CreateReader<>(
-    FLAGS_imu_topic,
-    [&](const ImuPtr& imu_msg){
-      ImuHandler(imu_msg);
-  });
-  return true;
+// Number of range image columns sharing one deskew transform, 10 columns
+// of a 1800 column sensor is about 0.5ms of a 10Hz scan
+constexpr int kDeskewBucketColumns = 10;
+
+// Feature budgets of the load levels, the first one is of the paper. The
+// sharp corners are kept longest, they hold the odometry together.
+constexpr FeatureBudget kFeatureBudgets[] = {
+  {2, 20, 4},
+  {2, 10, 2},
+  {1, 5, 1},
+};
+
+// Indexes the points of cloud by their position in it
+void IndexCloud(const pcl::PointCloud<PointType>& cloud,
+                lib::VoxelHashMap<IndexedPoint>* index) {
+  index->Clear();
+  for (size_t i = 0; i < cloud.points.size(); ++i) {
+    const PointType& point = cloud.points[i];
+    index->Insert(IndexedPoint{point.x, point.y, point.z, static_cast<int>(i)});
+  }
 }
 
-void FeatureAssociation::ImuHandler(const ImuPtr& imu_msg) {
-  auto orientation = imu_msg->orientation();
-  Eigen::Quaternion<double> q(orientation.w(),
-                              orientation.x(),
-                              orientation.y(),
-                              orientation.z());
-  Eigen::Vector3d euler = q.toRotationMatrix().eulerAngles(2, 1, 0);
-
-  Pose& pose = pose_arr_[imu_pointer_last];
-
-  pose.roll = euler[0];
-  pose.yaw  = euler[1];
-  pose.pitch = euler[2];
-
-  // pose.linear_acceleration = imu_msg->linear_acceleration();
+float SquaredDistance(const PointType& a, const PointType& b) {
+  return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y) +
+         (a.z - b.z) * (a.z - b.z);
+}
 
-  pose.angular_velocity[0] = imu_msg->angular_velocity().x();
-  pose.angular_velocity[1] = imu_msg->angular_velocity().y();
-  pose.angular_velocity[2] = imu_msg->angular_velocity().z();
+bool FeatureAssociation::Init() {
+  if (!LoadSensorProfile(&sensor_profile_))
+    return false;
+
+  segmented_cloud_.reset(new pcl::PointCloud<PointType>());
+  outlier_cloud_.reset(new pcl::PointCloud<PointType>());
+  corner_points_sharp_.reset(new pcl::PointCloud<PointType>());
+  corner_points_less_sharp_.reset(new pcl::PointCloud<PointType>());
+  surf_points_flat_.reset(new pcl::PointCloud<PointType>());
+  surf_points_less_flat_.reset(new pcl::PointCloud<PointType>());
+  laser_cloud_corner_last_.reset(new pcl::PointCloud<PointType>());
+  laser_cloud_surf_last_.reset(new pcl::PointCloud<PointType>());
+  feature_extractor_.Init(FLAGS_feature_threads);
+  num_threads_ = std::max(1, FLAGS_feature_threads);
+  pool_.Resize(num_threads_);
+  match_chunks_.resize(num_threads_);
+
+  // The messages of one scan are written at once, a few scans cover a
+  // reader that is late
+  constexpr double kSyncTolerance = 1e-3;
+  segmented_sync_.reset(new SegmentedSync(
+      FLAGS_scan_queue_size + 2, kSyncTolerance,
+      [this](const std::shared_ptr<cloud_msgs::PackedCloud>& cloud_msg,
+             const std::shared_ptr<cloud_msgs::CloudInfo>& info_msg,
+             const std::shared_ptr<cloud_msgs::PackedCloud>& outlier_msg) {
+        SegmentedCloudHandler(cloud_msg, info_msg, outlier_msg);
+      }));
+
+  if (segmented_readers_) {
+    cyber::ReaderConfig reader_config;
+    reader_config.channel_name = "/segmented_cloud";
+    reader_config.pending_queue_size = FLAGS_scan_queue_size;
+    sub_segmented_cloud_ = node_->CreateReader<cloud_msgs::PackedCloud>(
+      reader_config,
+      [&](const std::shared_ptr<cloud_msgs::PackedCloud>& cloud_msg){
+        segmented_sync_->Add<0>(cloud_msg->header().timestamp_sec(), cloud_msg);
+    });
+    reader_config.channel_name = "/segmented_cloud_info";
+    sub_segmented_cloud_info_ = node_->CreateReader<cloud_msgs::CloudInfo>(
+      reader_config,
+      [&](const std::shared_ptr<cloud_msgs::CloudInfo>& info_msg){
+        segmented_sync_->Add<1>(info_msg->header().timestamp_sec(), info_msg);
+    });
+    reader_config.channel_name = "/outlier_cloud";
+    sub_outlier_cloud_ = node_->CreateReader<cloud_msgs::PackedCloud>(
+      reader_config,
+      [&](const std::shared_ptr<cloud_msgs::PackedCloud>& outlier_msg){
+        segmented_sync_->Add<2>(outlier_msg->header().timestamp_sec(), outlier_msg);
+    });
+  }
 
-  imu_pointer_last = (imu_pointer_last + 1) % IMU_QUE_LENGTH;
+  if (imu_reader_) {
+    sub_imu_ = node_->CreateReader<apollo::localization::CorrectedImu>(
+      FLAGS_imu_topic,
+      [&](const std::shared_ptr<apollo::localization::CorrectedImu>& imu_msg){
+        ImuHandler(imu_msg);
+    });
+  }
 
-  AccumulateIMUShiftAndRotation();
+  pub_corner_points_sharp_ = node_->CreateWriter<apollo::drivers::PointCloud>("/laser_cloud_sharp");
+  pub_corner_points_less_sharp_ = node_->CreateWriter<apollo::drivers::PointCloud>("/laser_cloud_less_sharp");
+  pub_surf_points_flat_ = node_->CreateWriter<apollo::drivers::PointCloud>("/laser_cloud_flat");
+  pub_surf_points_less_flat_ = node_->CreateWriter<apollo::drivers::PointCloud>("/laser_cloud_less_flat");
+
+  pub_laser_cloud_corner_last_ = node_->CreateWriter<cloud_msgs::PackedCloud>("/laser_cloud_corner_last");
+  pub_laser_cloud_surf_last_ = node_->CreateWriter<cloud_msgs::PackedCloud>("/laser_cloud_surf_last");
+  pub_outlier_cloud_last_ = node_->CreateWriter<cloud_msgs::PackedCloud>("/outlier_cloud_last");
+  pub_laser_odometry_ = node_->CreateWriter<apollo::localization::LocalizationEstimate>("/laser_odom_to_init");
+  pub_telemetry_ = node_->CreateWriter<cloud_msgs::FrameTelemetry>(
+      kTelemetryChannel);
+  laser_cloud_out_.mutable_header()->set_frame_id("camera");
+  return true;
 }
 
-void FeatureAssociation::AccumulateIMUShiftAndRotation() {
-  Pose& pre = pose_arr_[imu_pointer_last - 1];
-  Pose& cur = pose_arr_[imu_pointer_last];
-
-  // todo(zero):
-  // acc
-
-  double time_interval = cur.timestamp - pre.timestamp;
-  if (time_interval < SCAN_PERIOD) {
-    cur.position = pre.position + pre.velocity * time_interval + acc * time_interval * time_interval / 2;
-    cur.velocity = pre.velocity + acc * time_interval;
-    cur.angular = pre.angular + pre.angular_velocity * time_interval;
+void FeatureAssociation::SegmentedCloudHandler(
+    const std::shared_ptr<cloud_msgs::PackedCloud>& cloud_msg,
+    const std::shared_ptr<cloud_msgs::CloudInfo>& info_msg,
+    const std::shared_ptr<cloud_msgs::PackedCloud>& outlier_msg) {
+  // The blobs are read as they are, no per point decoding
+  if (!UnpackPointCloud(*cloud_msg, segmented_cloud_.get()) ||
+      !UnpackPointCloud(*outlier_msg, outlier_cloud_.get())) {
+    AWARN << "Malformed segmented cloud or outliers, point_count: "
+          << cloud_msg->point_count() << ", "
+          << outlier_msg->point_count();
+    return;
   }
+  // every point of the segmented cloud has its column and range, the fields
+  // are sized for the whole range image
+  if (info_msg->segmented_cloud_col_ind_size() <
+          static_cast<int>(segmented_cloud_->size()) ||
+      info_msg->segmented_cloud_range_size() <
+          static_cast<int>(segmented_cloud_->size())) {
+    AWARN << "Segmented cloud info does not match the cloud at "
+          << cloud_msg->header().timestamp_sec();
+    return;
+  }
+  seg_info_ = info_msg;
+  outlier_scan_ = outlier_cloud_;
+  time_scan_cur_ = cloud_msg->header().timestamp_sec();
+  PopImuBefore(time_scan_cur_);
+  RunFeatureAssociation();
 }
 
-void FeatureAssociation::AdjustDistortion() {
-
+void FeatureAssociation::SegmentedFrameHandler(const SegmentedFramePtr& frame) {
+  // The frame is shared, only the segmented cloud is deskewed in a copy
+  *segmented_cloud_ = frame->segmented_cloud;
+  seg_info_ = std::shared_ptr<const cloud_msgs::CloudInfo>(frame, &frame->info);
+  outlier_scan_ =
+      pcl::PointCloud<PointType>::ConstPtr(frame, &frame->outlier_cloud);
+  time_scan_cur_ = frame->timestamp;
+  PopImuBefore(time_scan_cur_);
+  RunFeatureAssociation();
 }
 
-void FeatureAssociation::CalculateSmoothness() {
-  int cloud_size = segmented_cloud_->points.size();
-  for (int i = 5; i < cloud_size - 5; ++i) {
-    auto iter = segInfo.segmented_cloud_range.begin() + i;
-    auto init_value = -11 * segInfo.segmented_cloud_range[i];
-    float diff_range = std::accumulate(iter - 5, iter + 6, init_value);
-    cloudCurvature[i] = diff_range * diff_range;
-    cloudNeighborPicked[i] = 0;
-    cloudLabel[i] = 0;
-    cloudSmoothness[i].value = cloudCurvature[i];
-    cloudSmoothness[i].ind = i;
-  }
-}
-
-void FeatureAssociation::MarkOccludedPoints() {
-  int cloud_size = segmented_cloud_->points.size();
-  for (int i = 5; i < cloud_size - 6; ++i) {
-    float depth1 = segInfo.segmented_cloud_range[i];
-    float depth2 = segInfo.segmented_cloud_range[i + 1];
-    int column_diff = std::abs(segInfo.segmented_cloud_col_ind[i+1] -
-                          segInfo.segmented_cloud_col_ind[i]);
-    if (column_diff < 10) {
-      if (depth1 - depth2 > 0.3) {
-        cloudNeighborPicked[i - 5] = 1;
-        cloudNeighborPicked[i - 4] = 1;
-        cloudNeighborPicked[i - 3] = 1;
-        cloudNeighborPicked[i - 2] = 1;
-        cloudNeighborPicked[i - 1] = 1;
-        cloudNeighborPicked[i] = 1;
-      } else if (depth2 - depth1 > 0.3) {
-        cloudNeighborPicked[i + 1] = 1;
-        cloudNeighborPicked[i + 2] = 1;
-        cloudNeighborPicked[i + 3] = 1;
-        cloudNeighborPicked[i + 4] = 1;
-        cloudNeighborPicked[i + 5] = 1;
-        cloudNeighborPicked[i + 6] = 1;
-      }
-    }
-
-    float diff1 = std::abs(segInfo.segmented_cloud_range[i-1] - segInfo.segmented_cloud_range[i]);
-    float diff2 = std::abs(segInfo.segmented_cloud_range[i+1] - segInfo.segmented_cloud_range[i]);
-    float threshold = 0.02 * segInfo.segmented_cloud_range[i];
-    if (diff1 > threshold && diff2 > threshold) {
-      cloudNeighborPicked[i] = 1;
-    }
-  }
+void FeatureAssociation::SetOdometryCallback(OdometryCallback callback) {
+  odometry_callback_ = std::move(callback);
 }
 
-void FeatureAssociation::PickCornerPointsSharp(int start, int end) {
-  // todo(zero): new function
-  int largest_picked_num = 0;
-  for (int i = end; i > start; --i) {
-    int ind = cloudSmoothness[i].ind;
-    if (cloudNeighborPicked[ind] == 0 &&
-        cloudCurvature[ind] > edgeThreshold &&
-        segInfo.segmented_cloud_ground_flag[ind] == false) {
-      ++largest_picked_num;
-      if (largest_picked_num <= 2) {
-        cloudLabel[ind] = 2;
-        cornerPointsSharp->push_back(segmentedCloud->points[ind]);
-        cornerPointsLessSharp->push_back(segmentedCloud->points[ind]);
-      } else if (largest_picked_num <= 20) {
-        cloudLabel[ind] = 1;
-        cornerPointsLessSharp->push_back(segmentedCloud->points[ind]);
-      } else {
-        break;
-      }
-
-      cloudNeighborPicked[ind] = 1;
-      for (int j = 1; j <= 5; ++j) {
-        int column_diff = std::abs(int(segInfo.segmented_cloud_col_ind[ind + j] - segInfo.segmented_cloud_col_ind[ind + j - 1]));
-        if (column_diff > 10)
-          break;
-        cloudNeighborPicked[ind + j] = 1;
-      }
+void FeatureAssociation::SetInProcessFrames() {
+  segmented_readers_ = false;
+}
 
-      for (int j = -1; j >= -5; --j) {
-        int column_diff = std::abs(int(segInfo.segmentedCloudColInd[ind + j] - segInfo.segmentedCloudColInd[ind + j + 1]));
-        if (column_diff > 10)
-          break;
-        cloudNeighborPicked[ind + j] = 1;
-      }
-    }
-  }
+void FeatureAssociation::SetOffline() {
+  segmented_readers_ = false;
+  imu_reader_ = false;
 }
 
-void FeatureAssociation::PickSurfPointsFlat(
-    int start, int end, int max_pick_num = 4) {
-  int smallest_picked_num = 0;
-  for (int i = start; i <= end; ++i) {
-    int ind = cloudSmoothness[i].ind;
-    if (cloudNeighborPicked[ind] == 0 &&
-        cloudCurvature[ind] < surfThreshold &&
-        segInfo.segmented_cloud_ground_flag[ind] == true) {
-      cloudLabel[ind] = -1;
-      surfPointsFlat->push_back(segmentedCloud->points[ind]);
-      ++smallest_picked_num;
-      if (smallest_picked_num >= max_pick_num) {
-        break;
-      }
+void FeatureAssociation::ImuHandler(
+    const std::shared_ptr<apollo::localization::CorrectedImu>& imu_msg) {
+  const auto& imu = imu_msg->imu();
+  const auto& orientation = imu.orientation();
+  Eigen::Quaterniond q(orientation.qw(), orientation.qx(), orientation.qy(),
+                       orientation.qz());
+  // e.g. an ins that is not aligned yet
+  if (!imu.has_orientation() || !(q.norm() > 0.5)) {
+    AWARN_EVERY(100) << "Imu message without orientation at "
+                     << imu_msg->header().timestamp_sec();
+    return;
+  }
+  q.normalize();
 
-      cloudNeighborPicked[ind] = 1;
-      for (int j = 1; j <= 5; j++) {
-        int column_diff = std::abs(int(segInfo.segmentedCloudColInd[ind + j] - segInfo.segmentedCloudColInd[ind + j - 1]));
-        if (column_diff > 10) break;
-        cloudNeighborPicked[ind + j] = 1;
-      }
+  Pose pose;
+  pose.timestamp = imu_msg->header().timestamp_sec();
+  pose.orientation = q;
 
-      for (int j = -1; j >= -5; j--) {
-        int column_diff = std::abs(int(segInfo.segmentedCloudColInd[ind + j] - segInfo.segmentedCloudColInd[ind + j + 1]));
-        if (column_diff > 10) break;
-        cloudNeighborPicked[ind + j] = 1;
-      }
-    }
+  // Never block the imu reader, the lidar thread frees the buffer
+  if (!imu_buffer_.push_back(pose)) {
+    AWARN_EVERY(100) << "Imu buffer is full, drop imu message at "
+                     << pose.timestamp;
   }
 }
 
-void FeatureAssociation::ExtractFeatures() {
-  cornerPointsSharp->clear();
-  cornerPointsLessSharp->clear();
-  surfPointsFlat->clear();
-  surfPointsLessFlat->clear();
-
-  for (int i = 0; i < N_SCAN; ++i) {
-    surfPointsLessFlatScan->clear();
-    // Divide the circle into 6 equal parts,
-    // select 4 surface features and 2 line feature for each direction
-    for (int round_id = 0; round_id < 6; ++round_id) {
-      int sp = (segInfo.start_ring_index[i] * (6 - round_id) + segInfo.end_ring_index[i] * round_id) / 6;
-      int ep = (segInfo.start_ring_index[i] * (5 - round_id) + segInfo.end_ring_index[i] * (round_id + 1)) / 6 - 1;
+void FeatureAssociation::PopImuBefore(double timestamp) {
+  // Keep the last pose before timestamp to interpolate the scan start
+  auto first = imu_buffer_.lower_bound(
+      timestamp, [](const Pose& pose) { return pose.timestamp; });
+  if (first != imu_buffer_.begin())
+    --first;
+  imu_buffer_.pop_front(first);
+}
 
-      if (sp >= ep) continue;
+bool FeatureAssociation::InterpolateImu(double timestamp,
+                                        Eigen::Quaterniond* orientation) {
+  if (imu_buffer_.empty())
+    return false;
+
+  auto after = imu_buffer_.lower_bound(
+      timestamp, [](const Pose& pose) { return pose.timestamp; });
+  // Clamp to the nearest imu pose outside of the imu messages
+  if (after == imu_buffer_.begin() || after == imu_buffer_.end()) {
+    const Pose& pose = after == imu_buffer_.end() ? imu_buffer_.back() : *after;
+    *orientation = pose.orientation;
+    return true;
+  }
 
-      std::sort(cloudSmoothness.begin() + sp, cloudSmoothness.begin() + ep,
-        [](const smoothness_t& l, const smoothness_t& r){
-          return l.value < r.value;
-        });
+  const Pose& back = *after;
+  const Pose& front = *(after - 1);
+  double ratio = (timestamp - front.timestamp) /
+      (back.timestamp - front.timestamp);
+  *orientation = front.orientation.slerp(ratio, back.orientation);
+  return true;
+}
 
-      PickCornerPointsSharp(sp, ep);
-      PickSurfPointsFlat(sp, ep, 4);
+void FeatureAssociation::AdjustDistortion() {
+  const int horizon_scan = sensor_profile_.horizon_scan;
+  const int bucket_num =
+      (horizon_scan + kDeskewBucketColumns - 1) / kDeskewBucketColumns;
+  deskew_transforms_.resize(bucket_num);
+  deskew_rel_time_.resize(bucket_num);
+
+  // The imu pose is interpolated once per bucket of columns instead of once
+  // per point. Column j has the azimuth atan2(x, y) = (j - horizon_scan / 2)
+  // * ang_res_x, the same angle as the scan start and end orientation.
+  const double start_orientation = seg_info_->start_orientation();
+  const double orientation_diff = seg_info_->orientation_diff();
+  const double ang_res = sensor_profile_.ang_res_x / 180.0 * M_PI;
+
+  // The points are rotated to the imu attitude of the scan end, by
+  // rotation only. Their translation over the scan is left to the
+  // odometry, see TransformToStart.
+  Eigen::Quaterniond start_orientation_imu;
+  Eigen::Quaterniond end_orientation_imu;
+  bool has_imu =
+      InterpolateImu(time_scan_cur_, &start_orientation_imu) &&
+      InterpolateImu(time_scan_cur_ + SCAN_PERIOD, &end_orientation_imu);
+  const Eigen::Quaterniond end_inverse = end_orientation_imu.conjugate();
+
+  has_scan_imu_ = has_imu;
+  imu_start_.setZero();
+  imu_end_.setZero();
+  imu_end_from_start_.setIdentity();
+  if (has_imu) {
+    imu_start_ = CameraAngles(start_orientation_imu);
+    imu_end_ = CameraAngles(end_orientation_imu);
+    imu_end_from_start_ =
+        CameraRotation(imu_end_[0], imu_end_[1], imu_end_[2]).transpose() *
+        CameraRotation(imu_start_[0], imu_start_[1], imu_start_[2]);
+  }
 
-      for (int k = sp; k <= ep; ++k) {
-        if (cloudLabel[k] <= 0) {
-          surfPointsLessFlatScan->push_back(segmentedCloud->points[k]);
-        }
-      }
+  for (int b = 0; b < bucket_num; ++b) {
+    double center = (b + 0.5) * kDeskewBucketColumns - horizon_scan / 2;
+    double orientation = center * ang_res;
+    while (orientation < start_orientation)
+      orientation += 2 * M_PI;
+    while (orientation > start_orientation + 2 * M_PI)
+      orientation -= 2 * M_PI;
+    float rel_time = std::min((orientation - start_orientation) /
+                              orientation_diff, 1.0);
+    deskew_rel_time_[b] = rel_time;
+
+    Eigen::Matrix4f& transform = deskew_transforms_[b];
+    transform.setIdentity();
+    Eigen::Quaterniond point_orientation;
+    if (has_imu && InterpolateImu(time_scan_cur_ + rel_time * SCAN_PERIOD,
+                                  &point_orientation)) {
+      // p_end = R_end^-1 * R_point * p
+      transform.topLeftCorner<3, 3>() =
+          (end_inverse * point_orientation).toRotationMatrix().cast<float>();
     }
+  }
 
-    surfPointsLessFlatScanDS->clear();
-    downSizeFilter.setInputCloud(surfPointsLessFlatScan);
-    downSizeFilter.filter(*surfPointsLessFlatScanDS);
-
-    *surfPointsLessFlat += *surfPointsLessFlatScanDS;
+  // Points of a ring are ordered by column, so consecutive points mostly
+  // share a bucket. Each point is one 4x4 by 4 product, which Eigen
+  // vectorizes on the aligned xyz1 data of pcl::PointXYZI.
+  auto& points = segmented_cloud_->points;
+  for (size_t i = 0; i < points.size(); ++i) {
+    const int b = seg_info_->segmented_cloud_col_ind(i) / kDeskewBucketColumns;
+    PointType& point = points[i];
+    point.data[3] = 1.0f;
+    const Eigen::Vector4f deskewed =
+        deskew_transforms_[b] * point.getVector4fMap();
+    // to the camera frame, see camera_frame.h
+    point.x = deskewed.y();
+    point.y = deskewed.z();
+    point.z = deskewed.x();
+    // ring index in the integer part, time since scan start in the fraction
+    point.intensity = static_cast<int>(point.intensity) +
+        SCAN_PERIOD * deskew_rel_time_[b];
   }
 }
 
 void FeatureAssociation::PublishCloud() {
-  ToDriverPointCloud(cornerPointsSharp, laserCloudOutMsg);
-  pubCornerPointsSharp.publish(laserCloudOutMsg);
-
-  pubCornerPointsLessSharp.publish(laserCloudOutMsg);
-  pubSurfPointsFlat.publish(laserCloudOutMsg);
-  pubSurfPointsLessFlat.publish(laserCloudOutMsg);
+  laser_cloud_out_.mutable_header()->set_timestamp_sec(time_scan_cur_);
+  PublishPointCloud(corner_points_sharp_, pub_corner_points_sharp_);
+  PublishPointCloud(corner_points_less_sharp_, pub_corner_points_less_sharp_);
+  PublishPointCloud(surf_points_flat_, pub_surf_points_flat_);
+  PublishPointCloud(surf_points_less_flat_, pub_surf_points_less_flat_);
 }
 
-void CheckSystemInitialization(){
-  // todo(daohu527):
-  pcl::PointCloud<PointType>::Ptr laserCloudTemp = cornerPointsLessSharp;
-  cornerPointsLessSharp = laserCloudCornerLast;
-  laserCloudCornerLast = laserCloudTemp;
-
-  laserCloudTemp = surfPointsLessFlat;
-  surfPointsLessFlat = laserCloudSurfLast;
-  laserCloudSurfLast = laserCloudTemp;
-
-  kdtreeCornerLast->setInputCloud(laserCloudCornerLast);
-  kdtreeSurfLast->setInputCloud(laserCloudSurfLast);
-
-  laserCloudCornerLastNum = laserCloudCornerLast->points.size();
-  laserCloudSurfLastNum = laserCloudSurfLast->points.size();
+bool FeatureAssociation::NeedPublish(const DriverWriterPtr& writer) const {
+  return FLAGS_publish_debug_clouds || writer->HasReader();
+}
 
-  sensor_msgs::PointCloud2 laserCloudCornerLast2;
-  pcl::toROSMsg(*laserCloudCornerLast, laserCloudCornerLast2);
-  laserCloudCornerLast2.header.stamp = cloudHeader.stamp;
-  laserCloudCornerLast2.header.frame_id = "/camera";
-  pubLaserCloudCornerLast.publish(laserCloudCornerLast2);
+void FeatureAssociation::PublishPointCloud(const PointCloudPtr& cloud,
+                                           const DriverWriterPtr& writer) {
+  if (!NeedPublish(writer))
+    return;
+  ToDriverPointCloud(cloud, laser_cloud_out_);
+  writer->Write(laser_cloud_out_);
+}
 
-  sensor_msgs::PointCloud2 laserCloudSurfLast2;
-  pcl::toROSMsg(*laserCloudSurfLast, laserCloudSurfLast2);
-  laserCloudSurfLast2.header.stamp = cloudHeader.stamp;
-  laserCloudSurfLast2.header.frame_id = "/camera";
-  pubLaserCloudSurfLast.publish(laserCloudSurfLast2);
+void FeatureAssociation::CheckSystemInitialization() {
+  // The first scan is only the last scan of the second one
+  std::swap(corner_points_less_sharp_, laser_cloud_corner_last_);
+  std::swap(surf_points_less_flat_, laser_cloud_surf_last_);
+  UpdateLastIndex();
 
-  transformSum[0] += imuPitchStart;
-  transformSum[2] += imuRollStart;
+  // the odometry starts with the pitch and roll of the imu, the scan is
+  // deskewed to the attitude of its end
+  transform_sum_[0] += imu_end_[0];
+  transform_sum_[2] += imu_end_[2];
 
-  systemInitedLM = true;
+  system_inited_lm_ = true;
 }
 
-void UpdateInitialGuess() {
-  // todo(daohu527):
-  imuPitchLast = imuPitchCur;
-  imuYawLast = imuYawCur;
-  imuRollLast = imuRollCur;
+void FeatureAssociation::UpdateInitialGuess() {
+  // The rotation of the imu over the scan, otherwise the motion of the last
+  // scan is the guess of this one
+  if (has_scan_imu_) {
+    // p_end = R_cur * p_start + t, R_cur^-1 = CameraRotation(-transform_cur_)
+    const Eigen::Vector3f delta = CameraAngles(imu_end_from_start_.transpose());
+    transform_cur_[0] = -delta[0];
+    transform_cur_[1] = -delta[1];
+    transform_cur_[2] = -delta[2];
+  }
+}
 
-  imuShiftFromStartX = imuShiftFromStartXCur;
-  imuShiftFromStartY = imuShiftFromStartYCur;
-  imuShiftFromStartZ = imuShiftFromStartZCur;
+void FeatureAssociation::TransformToStart(const PointType& pi,
+                                          PointType* po) const {
+  // time since the scan start in the fraction of the intensity, see
+  // AdjustDistortion
+  const float s = (pi.intensity - static_cast<int>(pi.intensity)) / SCAN_PERIOD;
+  // A scan deskewed by the imu is already in the attitude of its end, only
+  // its translation is still spread over the scan
+  const float r = has_scan_imu_ ? 1.0f : s;
+
+  const float rx = r * transform_cur_[0];
+  const float ry = r * transform_cur_[1];
+  const float rz = r * transform_cur_[2];
+  const float tx = s * transform_cur_[3];
+  const float ty = s * transform_cur_[4];
+  const float tz = s * transform_cur_[5];
+
+  const float x1 = cos(rz) * (pi.x - tx) + sin(rz) * (pi.y - ty);
+  const float y1 = -sin(rz) * (pi.x - tx) + cos(rz) * (pi.y - ty);
+  const float z1 = (pi.z - tz);
+
+  const float x2 = x1;
+  const float y2 = cos(rx) * y1 + sin(rx) * z1;
+  const float z2 = -sin(rx) * y1 + cos(rx) * z1;
+
+  po->x = cos(ry) * x2 - sin(ry) * z2;
+  po->y = y2;
+  po->z = sin(ry) * x2 + cos(ry) * z2;
+  po->intensity = pi.intensity;
+}
 
-  imuVeloFromStartX = imuVeloFromStartXCur;
-  imuVeloFromStartY = imuVeloFromStartYCur;
-  imuVeloFromStartZ = imuVeloFromStartZCur;
+void FeatureAssociation::TransformToEnd(const PointType& pi,
+                                        PointType* po) const {
+  PointType start;
+  TransformToStart(pi, &start);
+
+  const float rx = transform_cur_[0];
+  const float ry = transform_cur_[1];
+  const float rz = transform_cur_[2];
+  const float tx = transform_cur_[3];
+  const float ty = transform_cur_[4];
+  const float tz = transform_cur_[5];
+
+  const float x4 = cos(ry) * start.x + sin(ry) * start.z;
+  const float y4 = start.y;
+  const float z4 = -sin(ry) * start.x + cos(ry) * start.z;
+
+  const float x5 = x4;
+  const float y5 = cos(rx) * y4 - sin(rx) * z4;
+  const float z5 = sin(rx) * y4 + cos(rx) * z4;
+
+  po->x = cos(rz) * x5 - sin(rz) * y5 + tx;
+  po->y = sin(rz) * x5 + cos(rz) * y5 + ty;
+  po->z = z5 + tz;
+  po->intensity = static_cast<int>(pi.intensity);
+}
 
-  if (imuAngularFromStartX != 0 || imuAngularFromStartY != 0 || imuAngularFromStartZ != 0){
-    transformCur[0] = - imuAngularFromStartY;
-    transformCur[1] = - imuAngularFromStartZ;
-    transformCur[2] = - imuAngularFromStartX;
+struct FeatureAssociation::SurfJacobian {
+  explicit SurfJacobian(const float transform[6]) {
+    const float srx = sin(transform[0]);
+    crx = cos(transform[0]);
+    const float sry = sin(transform[1]);
+    const float cry = cos(transform[1]);
+    const float srz = sin(transform[2]);
+    const float crz = cos(transform[2]);
+    const float tx = transform[3];
+    const float ty = transform[4];
+    const float tz = transform[5];
+
+    a1 = crx * sry * srz;
+    a2 = crx * crz * sry;
+    a3 = srx * sry;
+    a4 = tx * a1 - ty * a2 - tz * a3;
+    a5 = srx * srz;
+    a6 = crz * srx;
+    a7 = ty * a6 - tz * crx - tx * a5;
+    a8 = crx * cry * srz;
+    a9 = crx * cry * crz;
+    a10 = cry * srx;
+    a11 = tz * a10 + ty * a9 - tx * a8;
+
+    const float b1 = -crz * sry - cry * srx * srz;
+    b2 = cry * crz * srx - sry * srz;
+    const float b5 = cry * crz - srx * sry * srz;
+    b6 = cry * srz + crz * srx * sry;
+
+    c1 = -b6;
+    c2 = b5;
+    c3 = tx * b6 - ty * b5;
+    c4 = -crx * crz;
+    c5 = crx * srz;
+    c6 = ty * c5 + tx * -c4;
+    c7 = b2;
+    c8 = -b1;
+    c9 = tx * -b2 - ty * -b1;
   }
 
-  if (imuVeloFromStartX != 0 || imuVeloFromStartY != 0 || imuVeloFromStartZ != 0){
-    transformCur[3] -= imuVeloFromStartX * scanPeriod;
-    transformCur[4] -= imuVeloFromStartY * scanPeriod;
-    transformCur[5] -= imuVeloFromStartZ * scanPeriod;
+  Eigen::Vector3f operator()(const PointType& point_ori,
+                             const PointType& coeff) const {
+    const float arx = (-a1 * point_ori.x + a2 * point_ori.y + a3 * point_ori.z + a4) * coeff.x
+                    + (a5 * point_ori.x - a6 * point_ori.y + crx * point_ori.z + a7) * coeff.y
+                    + (a8 * point_ori.x - a9 * point_ori.y - a10 * point_ori.z + a11) * coeff.z;
+    const float arz = (c1 * point_ori.x + c2 * point_ori.y + c3) * coeff.x
+                    + (c4 * point_ori.x - c5 * point_ori.y + c6) * coeff.y
+                    + (c7 * point_ori.x + c8 * point_ori.y + c9) * coeff.z;
+    const float aty = -b6 * coeff.x + c4 * coeff.y + b2 * coeff.z;
+    return Eigen::Vector3f(arx, arz, aty);
   }
-}
 
-void UpdateTransformation() {
-  if (laserCloudCornerLastNum < 10 || laserCloudSurfLastNum < 100)
-    return;
+  float crx;
+  float a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11;
+  float b2, b6;
+  float c1, c2, c3, c4, c5, c6, c7, c8, c9;
+};
+
+struct FeatureAssociation::CornerJacobian {
+  explicit CornerJacobian(const float transform[6]) {
+    srx = sin(transform[0]);
+    const float crx = cos(transform[0]);
+    const float sry = sin(transform[1]);
+    const float cry = cos(transform[1]);
+    const float srz = sin(transform[2]);
+    const float crz = cos(transform[2]);
+    const float tx = transform[3];
+    const float ty = transform[4];
+    const float tz = transform[5];
+
+    b1 = -crz * sry - cry * srx * srz;
+    b2 = cry * crz * srx - sry * srz;
+    b3 = crx * cry;
+    b4 = tx * -b1 + ty * -b2 + tz * b3;
+    b5 = cry * crz - srx * sry * srz;
+    b6 = cry * srz + crz * srx * sry;
+    b7 = crx * sry;
+    b8 = tz * b7 - ty * b6 - tx * b5;
+
+    c5 = crx * srz;
+  }
 
-  for (int iterCount1 = 0; iterCount1 < 25; iterCount1++) {
-    laserCloudOri->clear();
-    coeffSel->clear();
+  Eigen::Vector3f operator()(const PointType& point_ori,
+                             const PointType& coeff) const {
+    const float ary = (b1 * point_ori.x + b2 * point_ori.y - b3 * point_ori.z + b4) * coeff.x
+                    + (b5 * point_ori.x + b6 * point_ori.y - b7 * point_ori.z + b8) * coeff.z;
+    const float atx = -b5 * coeff.x + c5 * coeff.y + b1 * coeff.z;
+    const float atz = b7 * coeff.x - srx * coeff.y - b3 * coeff.z;
+    return Eigen::Vector3f(ary, atx, atz);
+  }
 
-    findCorrespondingSurfFeatures(iterCount1);
+  float srx;
+  float b1, b2, b3, b4, b5, b6, b7, b8;
+  float c5;
+};
+
+void FeatureAssociation::FindCorrespondingSurfFeatures(
+    int iter_count, const SurfJacobian& jacobian, int begin, int end,
+    MatchChunk* chunk) {
+  const auto& last = laser_cloud_surf_last_->points;
+  const int last_num = last.size();
+
+  std::vector<IndexedPoint>& point_search = chunk->point_search;
+  std::vector<float>& point_search_sq_dis = chunk->point_search_sq_dis;
+  PointType point_sel;
+  PointType coeff;
+  for (int i = begin; i < end; ++i) {
+    TransformToStart(surf_points_flat_->points[i], &point_sel);
+
+    // The plane is searched again every 5 iterations, the nearest point and
+    // the nearest ones of its own ring and of a neighboring ring
+    if (iter_count % 5 == 0) {
+      int closest_point_ind = -1;
+      int min_point_ind2 = -1;
+      int min_point_ind3 = -1;
+      const IndexedPoint query{point_sel.x, point_sel.y, point_sel.z, -1};
+      if (surf_last_index_.NearestKSearch(query, 1,
+                                          std::sqrt(nearestFeatureSearchSqDist),
+                                          &point_search,
+                                          &point_search_sq_dis) > 0) {
+        closest_point_ind = point_search[0].index;
+        const int closest_point_scan = int(last[closest_point_ind].intensity);
+
+        float min_point_sq_dis2 = nearestFeatureSearchSqDist;
+        float min_point_sq_dis3 = nearestFeatureSearchSqDist;
+        for (int j = closest_point_ind + 1; j < last_num; ++j) {
+          if (int(last[j].intensity) > closest_point_scan + 2.5)
+            break;
+          const float point_sq_dis = SquaredDistance(last[j], point_sel);
+          if (int(last[j].intensity) <= closest_point_scan) {
+            if (point_sq_dis < min_point_sq_dis2) {
+              min_point_sq_dis2 = point_sq_dis;
+              min_point_ind2 = j;
+            }
+          } else if (point_sq_dis < min_point_sq_dis3) {
+            min_point_sq_dis3 = point_sq_dis;
+            min_point_ind3 = j;
+          }
+        }
+        for (int j = closest_point_ind - 1; j >= 0; --j) {
+          if (int(last[j].intensity) < closest_point_scan - 2.5)
+            break;
+          const float point_sq_dis = SquaredDistance(last[j], point_sel);
+          if (int(last[j].intensity) >= closest_point_scan) {
+            if (point_sq_dis < min_point_sq_dis2) {
+              min_point_sq_dis2 = point_sq_dis;
+              min_point_ind2 = j;
+            }
+          } else if (point_sq_dis < min_point_sq_dis3) {
+            min_point_sq_dis3 = point_sq_dis;
+            min_point_ind3 = j;
+          }
+        }
+      }
+      point_search_surf_ind1_[i] = closest_point_ind;
+      point_search_surf_ind2_[i] = min_point_ind2;
+      point_search_surf_ind3_[i] = min_point_ind3;
+    }
 
-    if (laserCloudOri->points.size() < 10)
+    if (point_search_surf_ind2_[i] < 0 || point_search_surf_ind3_[i] < 0)
       continue;
-    if (calculateTransformationSurf(iterCount1) == false)
-      break;
+    const PointType& tripod1 = last[point_search_surf_ind1_[i]];
+    const PointType& tripod2 = last[point_search_surf_ind2_[i]];
+    const PointType& tripod3 = last[point_search_surf_ind3_[i]];
+
+    float pa = (tripod2.y - tripod1.y) * (tripod3.z - tripod1.z) -
+               (tripod3.y - tripod1.y) * (tripod2.z - tripod1.z);
+    float pb = (tripod2.z - tripod1.z) * (tripod3.x - tripod1.x) -
+               (tripod3.z - tripod1.z) * (tripod2.x - tripod1.x);
+    float pc = (tripod2.x - tripod1.x) * (tripod3.y - tripod1.y) -
+               (tripod3.x - tripod1.x) * (tripod2.y - tripod1.y);
+    float pd = -(pa * tripod1.x + pb * tripod1.y + pc * tripod1.z);
+
+    const float ps = sqrt(pa * pa + pb * pb + pc * pc);
+    if (ps == 0)
+      continue;
+    pa /= ps;
+    pb /= ps;
+    pc /= ps;
+    pd /= ps;
+
+    const float pd2 = pa * point_sel.x + pb * point_sel.y + pc * point_sel.z + pd;
+    float s = 1;
+    if (iter_count >= 5) {
+      s = 1 - 1.8 * fabs(pd2) / sqrt(sqrt(point_sel.x * point_sel.x +
+                                          point_sel.y * point_sel.y +
+                                          point_sel.z * point_sel.z));
+    }
+    if (s > 0.1 && pd2 != 0) {
+      coeff.x = s * pa;
+      coeff.y = s * pb;
+      coeff.z = s * pc;
+      coeff.intensity = s * pd2;
+      chunk->Add(jacobian(surf_points_flat_->points[i], coeff),
+                 -0.05f * coeff.intensity);
+    }
   }
+}
 
-  for (int iterCount2 = 0; iterCount2 < 25; iterCount2++) {
-    laserCloudOri->clear();
-    coeffSel->clear();
-
-    findCorrespondingCornerFeatures(iterCount2);
+void FeatureAssociation::FindCorrespondingCornerFeatures(
+    int iter_count, const CornerJacobian& jacobian, int begin, int end,
+    MatchChunk* chunk) {
+  const auto& last = laser_cloud_corner_last_->points;
+  const int last_num = last.size();
+
+  std::vector<IndexedPoint>& point_search = chunk->point_search;
+  std::vector<float>& point_search_sq_dis = chunk->point_search_sq_dis;
+  PointType point_sel;
+  PointType coeff;
+  for (int i = begin; i < end; ++i) {
+    TransformToStart(corner_points_sharp_->points[i], &point_sel);
+
+    // The line is searched again every 5 iterations, the nearest point and
+    // the nearest one of a neighboring ring
+    if (iter_count % 5 == 0) {
+      int closest_point_ind = -1;
+      int min_point_ind2 = -1;
+      const IndexedPoint query{point_sel.x, point_sel.y, point_sel.z, -1};
+      if (corner_last_index_.NearestKSearch(query, 1,
+                                            std::sqrt(nearestFeatureSearchSqDist),
+                                            &point_search,
+                                            &point_search_sq_dis) > 0) {
+        closest_point_ind = point_search[0].index;
+        const int closest_point_scan = int(last[closest_point_ind].intensity);
+
+        float min_point_sq_dis2 = nearestFeatureSearchSqDist;
+        for (int j = closest_point_ind + 1; j < last_num; ++j) {
+          if (int(last[j].intensity) > closest_point_scan + 2.5)
+            break;
+          const float point_sq_dis = SquaredDistance(last[j], point_sel);
+          if (int(last[j].intensity) > closest_point_scan &&
+              point_sq_dis < min_point_sq_dis2) {
+            min_point_sq_dis2 = point_sq_dis;
+            min_point_ind2 = j;
+          }
+        }
+        for (int j = closest_point_ind - 1; j >= 0; --j) {
+          if (int(last[j].intensity) < closest_point_scan - 2.5)
+            break;
+          const float point_sq_dis = SquaredDistance(last[j], point_sel);
+          if (int(last[j].intensity) < closest_point_scan &&
+              point_sq_dis < min_point_sq_dis2) {
+            min_point_sq_dis2 = point_sq_dis;
+            min_point_ind2 = j;
+          }
+        }
+      }
+      point_search_corner_ind1_[i] = closest_point_ind;
+      point_search_corner_ind2_[i] = min_point_ind2;
+    }
 
-    if (laserCloudOri->points.size() < 10)
+    if (point_search_corner_ind2_[i] < 0)
       continue;
-    if (calculateTransformationCorner(iterCount2) == false)
-      break;
+    const PointType& tripod1 = last[point_search_corner_ind1_[i]];
+    const PointType& tripod2 = last[point_search_corner_ind2_[i]];
+
+    const float x0 = point_sel.x;
+    const float y0 = point_sel.y;
+    const float z0 = point_sel.z;
+    const float x1 = tripod1.x;
+    const float y1 = tripod1.y;
+    const float z1 = tripod1.z;
+    const float x2 = tripod2.x;
+    const float y2 = tripod2.y;
+    const float z2 = tripod2.z;
+
+    const float m11 = ((x0 - x1) * (y0 - y2) - (x0 - x2) * (y0 - y1));
+    const float m22 = ((x0 - x1) * (z0 - z2) - (x0 - x2) * (z0 - z1));
+    const float m33 = ((y0 - y1) * (z0 - z2) - (y0 - y2) * (z0 - z1));
+
+    const float a012 = sqrt(m11 * m11 + m22 * m22 + m33 * m33);
+    const float l12 = sqrt((x1 - x2) * (x1 - x2) + (y1 - y2) * (y1 - y2) +
+                           (z1 - z2) * (z1 - z2));
+    if (a012 == 0 || l12 == 0)
+      continue;
+
+    const float la = ((y1 - y2) * m11 + (z1 - z2) * m22) / a012 / l12;
+    const float lb = -((x1 - x2) * m11 - (z1 - z2) * m33) / a012 / l12;
+    const float lc = -((x1 - x2) * m22 + (y1 - y2) * m33) / a012 / l12;
+    const float ld2 = a012 / l12;
+
+    float s = 1;
+    if (iter_count >= 5) {
+      s = 1 - 1.8 * fabs(ld2);
+    }
+    if (s > 0.1 && ld2 != 0) {
+      coeff.x = s * la;
+      coeff.y = s * lb;
+      coeff.z = s * lc;
+      coeff.intensity = s * ld2;
+      chunk->Add(jacobian(corner_points_sharp_->points[i], coeff),
+                 -0.05f * coeff.intensity);
+    }
   }
 }
 
-void IntegrateTransformation() {
-  float rx, ry, rz, tx, ty, tz;
-  AccumulateRotation(transformSum[0], transformSum[1], transformSum[2],
-                     -transformCur[0], -transformCur[1], -transformCur[2], rx, ry, rz);
+Eigen::Vector3f FeatureAssociation::SolveStep(int iter_count,
+                                              const Eigen::Matrix3f& ata,
+                                              const Eigen::Vector3f& atb) {
+  Eigen::Vector3f step = ata.colPivHouseholderQr().solve(atb);
+
+  // Directions with small eigenvalues are not constrained by the scene,
+  // the update is projected out of them
+  if (iter_count == 0) {
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f> solver(ata);
+    const float eign_thre = 10;
+    is_degenerate_ = false;
+    mat_p_.setZero();
+    // eigenvalues are ascending
+    int i = 0;
+    for (; i < 3; ++i) {
+      if (solver.eigenvalues()(i) < eign_thre)
+        is_degenerate_ = true;
+      else
+        break;
+    }
+    for (; i < 3; ++i)
+      mat_p_ += solver.eigenvectors().col(i) * solver.eigenvectors().col(i).transpose();
+  }
 
-  float x1 = cos(rz) * (transformCur[3] - imuShiftFromStartX) - sin(rz) * (transformCur[4] - imuShiftFromStartY);
-  float y1 = sin(rz) * (transformCur[3] - imuShiftFromStartX) + cos(rz) * (transformCur[4] - imuShiftFromStartY);
-  float z1 = transformCur[5] - imuShiftFromStartZ;
+  if (is_degenerate_)
+    step = mat_p_ * step;
+  return step;
+}
 
-  float x2 = x1;
-  float y2 = cos(rx) * y1 - sin(rx) * z1;
-  float z2 = sin(rx) * y1 + cos(rx) * z1;
+void FeatureAssociation::MatchChunks(
+    int point_num, const std::function<void(int, int, MatchChunk*)>& find) {
+  pool_.ParallelFor(num_threads_, [&, this](int chunk) {
+    MatchChunk* match = &match_chunks_[chunk];
+    match->Clear();
+    find(point_num * chunk / num_threads_,
+         point_num * (chunk + 1) / num_threads_, match);
+  });
 
-  tx = transformSum[3] - (cos(ry) * x2 + sin(ry) * z2);
-  ty = transformSum[4] - y2;
-  tz = transformSum[5] - (-sin(ry) * x2 + cos(ry) * z2);
+  match_total_.Clear();
+  for (const MatchChunk& match : match_chunks_) {
+    match_total_.ata += match.ata;
+    match_total_.atb += match.atb;
+    match_total_.count += match.count;
+  }
+}
 
-  PluginIMURotation(rx, ry, rz, imuPitchStart, imuYawStart, imuRollStart,
-                    imuPitchLast, imuYawLast, imuRollLast, rx, ry, rz);
+bool FeatureAssociation::CalculateTransformationSurf(int iter_count) {
+  // rx, rz and ty
+  const Eigen::Vector3f step = SolveStep(iter_count,
+                                         match_total_.ata.cast<float>(),
+                                         match_total_.atb.cast<float>());
+
+  transform_cur_[0] += step(0);
+  transform_cur_[2] += step(1);
+  transform_cur_[4] += step(2);
+  for (int i = 0; i < 6; ++i) {
+    if (std::isnan(transform_cur_[i]))
+      transform_cur_[i] = 0;
+  }
 
-  transformSum[0] = rx;
-  transformSum[1] = ry;
-  transformSum[2] = rz;
-  transformSum[3] = tx;
-  transformSum[4] = ty;
-  transformSum[5] = tz;
+  const float delta_r = sqrt(pow(step(0) * 180 / M_PI, 2) +
+                             pow(step(1) * 180 / M_PI, 2));
+  const float delta_t = sqrt(pow(step(2) * 100, 2));
+  return delta_r >= 0.1 || delta_t >= 0.1;
 }
 
-void PublishOdometry() {
-  geometry_msgs::Quaternion geoQuat = tf::createQuaternionMsgFromRollPitchYaw(transformSum[2], -transformSum[0], -transformSum[1]);
-
-  laserOdometry.header.stamp = cloudHeader.stamp;
-  laserOdometry.pose.pose.orientation.x = -geoQuat.y;
-  laserOdometry.pose.pose.orientation.y = -geoQuat.z;
-  laserOdometry.pose.pose.orientation.z = geoQuat.x;
-  laserOdometry.pose.pose.orientation.w = geoQuat.w;
-  laserOdometry.pose.pose.position.x = transformSum[3];
-  laserOdometry.pose.pose.position.y = transformSum[4];
-  laserOdometry.pose.pose.position.z = transformSum[5];
-  pubLaserOdometry.publish(laserOdometry);
+bool FeatureAssociation::CalculateTransformationCorner(int iter_count) {
+  // ry, tx and tz
+  const Eigen::Vector3f step = SolveStep(iter_count,
+                                         match_total_.ata.cast<float>(),
+                                         match_total_.atb.cast<float>());
+
+  transform_cur_[1] += step(0);
+  transform_cur_[3] += step(1);
+  transform_cur_[5] += step(2);
+  for (int i = 0; i < 6; ++i) {
+    if (std::isnan(transform_cur_[i]))
+      transform_cur_[i] = 0;
+  }
 
-  laserOdometryTrans.stamp_ = cloudHeader.stamp;
-  laserOdometryTrans.setRotation(tf::Quaternion(-geoQuat.y, -geoQuat.z, geoQuat.x, geoQuat.w));
-  laserOdometryTrans.setOrigin(tf::Vector3(transformSum[3], transformSum[4], transformSum[5]));
-  tfBroadcaster.sendTransform(laserOdometryTrans);
+  const float delta_r = sqrt(pow(step(0) * 180 / M_PI, 2));
+  const float delta_t = sqrt(pow(step(1) * 100, 2) + pow(step(2) * 100, 2));
+  return delta_r >= 0.1 || delta_t >= 0.1;
 }
 
-void PublishCloudsLast() {
-  updateImuRollPitchYawStartSinCos();
-
-  int cornerPointsLessSharpNum = cornerPointsLessSharp->points.size();
-  for (int i = 0; i < cornerPointsLessSharpNum; i++) {
-    TransformToEnd(&cornerPointsLessSharp->points[i], &cornerPointsLessSharp->points[i]);
+int FeatureAssociation::UpdateTransformation() {
+  if (laser_cloud_corner_last_->points.size() < 10 ||
+      laser_cloud_surf_last_->points.size() < 100)
+    return 0;
+
+  // The ground gives rx, rz and ty first, then the corners ry, tx and tz
+  const int surf_num = surf_points_flat_->points.size();
+  point_search_surf_ind1_.assign(surf_num, -1);
+  point_search_surf_ind2_.assign(surf_num, -1);
+  point_search_surf_ind3_.assign(surf_num, -1);
+  int iter_count1 = 0;
+  for (; iter_count1 < 25; ++iter_count1) {
+    const SurfJacobian jacobian(transform_cur_);
+    MatchChunks(surf_num, [&, this](int begin, int end, MatchChunk* chunk) {
+      FindCorrespondingSurfFeatures(iter_count1, jacobian, begin, end, chunk);
+    });
+
+    if (match_total_.count < 10)
+      continue;
+    if (!CalculateTransformationSurf(iter_count1)) {
+      ++iter_count1;
+      break;
+    }
   }
 
-  int surfPointsLessFlatNum = surfPointsLessFlat->points.size();
-  for (int i = 0; i < surfPointsLessFlatNum; i++) {
-    TransformToEnd(&surfPointsLessFlat->points[i], &surfPointsLessFlat->points[i]);
+  const int corner_num = corner_points_sharp_->points.size();
+  point_search_corner_ind1_.assign(corner_num, -1);
+  point_search_corner_ind2_.assign(corner_num, -1);
+  int iter_count2 = 0;
+  for (; iter_count2 < 25; ++iter_count2) {
+    const CornerJacobian jacobian(transform_cur_);
+    MatchChunks(corner_num, [&, this](int begin, int end, MatchChunk* chunk) {
+      FindCorrespondingCornerFeatures(iter_count2, jacobian, begin, end, chunk);
+    });
+
+    if (match_total_.count < 10)
+      continue;
+    if (!CalculateTransformationCorner(iter_count2)) {
+      ++iter_count2;
+      break;
+    }
   }
+  return iter_count1 + iter_count2;
+}
 
-  pcl::PointCloud<PointType>::Ptr laserCloudTemp = cornerPointsLessSharp;
-  cornerPointsLessSharp = laserCloudCornerLast;
-  laserCloudCornerLast = laserCloudTemp;
-
-  laserCloudTemp = surfPointsLessFlat;
-  surfPointsLessFlat = laserCloudSurfLast;
-  laserCloudSurfLast = laserCloudTemp;
+void FeatureAssociation::IntegrateTransformation() {
+  // The pose of the scan end is the one of the last scan end moved by the
+  // inverse of the motion over the scan
+  const Eigen::Matrix3f rotation =
+      CameraRotation(transform_sum_[0], transform_sum_[1], transform_sum_[2]) *
+      CameraRotation(-transform_cur_[0], -transform_cur_[1], -transform_cur_[2]);
+  const Eigen::Vector3f translation =
+      Eigen::Vector3f(transform_sum_[3], transform_sum_[4], transform_sum_[5]) -
+      rotation * Eigen::Vector3f(transform_cur_[3], transform_cur_[4],
+                                 transform_cur_[5]);
+  const Eigen::Vector3f angles = CameraAngles(rotation);
+
+  for (int i = 0; i < 3; ++i) {
+    transform_sum_[i] = angles[i];
+    transform_sum_[i + 3] = translation[i];
+  }
+}
 
-  laserCloudCornerLastNum = laserCloudCornerLast->points.size();
-  laserCloudSurfLastNum = laserCloudSurfLast->points.size();
+void FeatureAssociation::UpdateLastIndex() {
+  // The last scan is replaced every frame, the voxel buffers are reused
+  IndexCloud(*laser_cloud_corner_last_, &corner_last_index_);
+  IndexCloud(*laser_cloud_surf_last_, &surf_last_index_);
+}
 
-  if (laserCloudCornerLastNum > 10 && laserCloudSurfLastNum > 100) {
-    kdtreeCornerLast->setInputCloud(laserCloudCornerLast);
-    kdtreeSurfLast->setInputCloud(laserCloudSurfLast);
+void FeatureAssociation::AdjustOutlierCloud() {
+  // to the camera frame like the segmented cloud, in place when the
+  // outliers were unpacked into outlier_cloud_
+  const auto& points = outlier_scan_->points;
+  outlier_cloud_->resize(points.size());
+  for (size_t i = 0; i < points.size(); ++i) {
+    PointType point = points[i];
+    const float x = point.x;
+    point.x = point.y;
+    point.y = point.z;
+    point.z = x;
+    outlier_cloud_->points[i] = point;
   }
+}
 
-  frameCount++;
-
-  if (frameCount >= skipFrameNum + 1) {
-    frameCount = 0;
+void FeatureAssociation::PublishOdometry() {
+  CameraPoseToLocalization(transform_sum_, time_scan_cur_, &laser_odometry_);
+  pub_laser_odometry_->Write(laser_odometry_);
+}
 
-    adjustOutlierCloud();
-    sensor_msgs::PointCloud2 outlierCloudLast2;
-    pcl::toROSMsg(*outlierCloud, outlierCloudLast2);
-    outlierCloudLast2.header.stamp = cloudHeader.stamp;
-    outlierCloudLast2.header.frame_id = "/camera";
-    pubOutlierCloudLast.publish(outlierCloudLast2);
+void FeatureAssociation::PublishCloudsLast() {
+  for (PointType& point : corner_points_less_sharp_->points)
+    TransformToEnd(point, &point);
+  for (PointType& point : surf_points_less_flat_->points)
+    TransformToEnd(point, &point);
 
-    sensor_msgs::PointCloud2 laserCloudCornerLast2;
-    pcl::toROSMsg(*laserCloudCornerLast, laserCloudCornerLast2);
-    laserCloudCornerLast2.header.stamp = cloudHeader.stamp;
-    laserCloudCornerLast2.header.frame_id = "/camera";
-    pubLaserCloudCornerLast.publish(laserCloudCornerLast2);
+  std::swap(corner_points_less_sharp_, laser_cloud_corner_last_);
+  std::swap(surf_points_less_flat_, laser_cloud_surf_last_);
+  UpdateLastIndex();
 
-    sensor_msgs::PointCloud2 laserCloudSurfLast2;
-    pcl::toROSMsg(*laserCloudSurfLast, laserCloudSurfLast2);
-    laserCloudSurfLast2.header.stamp = cloudHeader.stamp;
-    laserCloudSurfLast2.header.frame_id = "/camera";
-    pubLaserCloudSurfLast.publish(laserCloudSurfLast2);
+  if (++frame_count_ < skipFrameNum + 1)
+    return;
+  frame_count_ = 0;
+
+  AdjustOutlierCloud();
+  if (odometry_callback_) {
+    auto frame = std::make_shared<OdometryFrame>();
+    frame->timestamp = time_scan_cur_;
+    std::copy(transform_sum_, transform_sum_ + 6, frame->transform_sum);
+    frame->corner_last = *laser_cloud_corner_last_;
+    frame->surf_last = *laser_cloud_surf_last_;
+    frame->outlier_last = *outlier_cloud_;
+    odometry_callback_(frame);
+    return;
   }
+
+  // New messages every frame, readers in the same process get the pointers
+  // without serialization
+  laser_cloud_out_.mutable_header()->set_timestamp_sec(time_scan_cur_);
+  auto publish_packed = [this](const PointCloudPtr& cloud,
+                               const PackedWriterPtr& writer) {
+    auto packed = std::make_shared<cloud_msgs::PackedCloud>();
+    PackPointCloud(*cloud, laser_cloud_out_.header(), packed.get());
+    writer->Write(packed);
+  };
+  publish_packed(outlier_cloud_, pub_outlier_cloud_last_);
+  publish_packed(laser_cloud_corner_last_, pub_laser_cloud_corner_last_);
+  publish_packed(laser_cloud_surf_last_, pub_laser_cloud_surf_last_);
 }
 
-void FeatureAssociation::RunFeatureAssociation() {
-  // 1. Feature Extraction
-  AdjustDistortion();
+void FeatureAssociation::PublishTelemetry() {
+  if (!FLAGS_publish_telemetry)
+    return;
+  telemetry_.set_input_points(segmented_cloud_->size());
+  telemetry_.set_corner_features(corner_points_sharp_->size());
+  telemetry_.set_surf_features(surf_points_flat_->size());
+  telemetry_.set_load_level(load_shedder_.level());
+  pub_telemetry_->Write(telemetry_);
+}
 
-  CalculateSmoothness();
+void FeatureAssociation::ShedLoad(uint64_t start_us) {
+  if (!FLAGS_load_shedding)
+    return;
+  const int previous = load_shedder_.level();
+  const int level = load_shedder_.Update((MonotonicMicros() - start_us) * 1e-6);
+  if (level == previous)
+    return;
+  AINFO << "Feature association load level " << level << ", "
+        << load_shedder_.average() * 1e3 << "ms per scan";
+  feature_extractor_.set_budget(kFeatureBudgets[level]);
+}
 
-  MarkOccludedPoints();
+void FeatureAssociation::RunFeatureAssociation() {
+  LOAM_TRACE_SCOPE("FeatureAssociation::RunFeatureAssociation");
+  const uint64_t start_us = MonotonicMicros();
+  cloud_msgs::FrameTelemetry* stages =
+      FLAGS_publish_telemetry ? &telemetry_ : nullptr;
+  if (stages) {
+    StartTelemetry(time_scan_cur_,
+                   cloud_msgs::FrameTelemetry::FEATURE_ASSOCIATION, stages);
+  }
 
-  ExtractFeatures();
+  // 1. Feature Extraction
+  {
+    StageTimer timer(stages, cloud_msgs::FrameTelemetry::DESKEW);
+    AdjustDistortion();
+  }
+  {
+    StageTimer timer(stages, cloud_msgs::FrameTelemetry::SMOOTHNESS);
+    feature_extractor_.CalculateSmoothness(*seg_info_,
+                                           segmented_cloud_->size());
+    feature_extractor_.MarkOccludedPoints(*seg_info_);
+  }
+  {
+    StageTimer timer(stages, cloud_msgs::FrameTelemetry::FEATURES);
+    feature_extractor_.ExtractFeatures(
+        *seg_info_, *segmented_cloud_, corner_points_sharp_.get(),
+        corner_points_less_sharp_.get(), surf_points_flat_.get(),
+        surf_points_less_flat_.get());
+  }
 
   PublishCloud();
 
-
-  if (!systemInitedLM) {
+  if (!system_inited_lm_) {
     CheckSystemInitialization();
+    PublishTelemetry();
+    ShedLoad(start_us);
     return;
   }
 
-  UpdateInitialGuess();
+  {
+    StageTimer timer(stages, cloud_msgs::FrameTelemetry::ODOMETRY);
+    UpdateInitialGuess();
 
-  UpdateTransformation();
+    telemetry_.set_lm_iterations(UpdateTransformation());
 
-  IntegrateTransformation();
+    IntegrateTransformation();
+  }
 
   PublishOdometry();
 
   // cloud to mapOptimization
   PublishCloudsLast();
+  PublishTelemetry();
+  ShedLoad(start_us);
 }
 
 }  // namespace tools
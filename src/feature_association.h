@@ -29,33 +29,256 @@
 
 #pragma once
 
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <Eigen/Geometry>
+#include <Eigen/StdVector>
+
 #include "cyber/cyber.h"
+#include "modules/drivers/proto/pointcloud.pb.h"
+#include "modules/localization/proto/imu.pb.h"
+#include "modules/localization/proto/localization.pb.h"
+
+#include "modules/tools/ilego_loam/src/feature_extractor.h"
+#include "modules/tools/ilego_loam/src/frames.h"
+#include "modules/tools/ilego_loam/src/lib/circular_buffer.h"
+#include "modules/tools/ilego_loam/src/lib/load_shedder.h"
+#include "modules/tools/ilego_loam/src/lib/thread_pool.h"
+#include "modules/tools/ilego_loam/src/lib/timestamp_sync.h"
+#include "modules/tools/ilego_loam/src/lib/voxel_hash_map.h"
+#include "modules/tools/ilego_loam/src/packed_cloud.h"
+#include "modules/tools/ilego_loam/src/sensor_profile.h"
+#include "modules/tools/ilego_loam/src/telemetry.h"
 
 namespace apollo {
 namespace tools {
 
+// Attitude of the imu. Only the rotation is used, the acceleration
+// includes gravity and integrating it would move the points by meters.
 struct Pose {
   double timestamp;
-  double roll;
-  double pitch;
-  double yaw;
-  Eigen::Vector3d linear_acceleration;
-  Eigen::Vector3d angular_velocity;
-
-  Eigen::Vector3d position;
-  Eigen::Vector3d velocity;
-  Eigen::Vector3d angle;
+  Eigen::Quaterniond orientation;
 };
 
+// A point of the last scan in the correspondence search, with its index in
+// the last cloud to walk to the points of the neighboring rings
+struct IndexedPoint {
+  float x;
+  float y;
+  float z;
+  int index;
+};
 
 class FeatureAssociation final : public cyber::Component<> {
  public:
   bool Init() override;
 
+  // Handlers of the readers. The segmented cloud, its info and its outliers
+  // of one scan come on three channels and are matched by their timestamp
+  // first. The imu handler may run on another thread than the cloud handler.
+  void SegmentedCloudHandler(
+      const std::shared_ptr<cloud_msgs::PackedCloud>& cloud_msg,
+      const std::shared_ptr<cloud_msgs::CloudInfo>& info_msg,
+      const std::shared_ptr<cloud_msgs::PackedCloud>& outlier_msg);
+  void ImuHandler(
+      const std::shared_ptr<apollo::localization::CorrectedImu>& imu_msg);
+  // The same as SegmentedCloudHandler for a frame of ImageProjection in the
+  // same process
+  void SegmentedFrameHandler(const SegmentedFramePtr& frame);
+
+  // With a callback the scans for the mapping go to it instead of the
+  // "last" cloud channels. Not thread safe, set it before the first cloud.
+  using OdometryCallback = std::function<void(const OdometryFramePtr&)>;
+  void SetOdometryCallback(OdometryCallback callback);
+
+  // The readers a driver in the same process does not want, a reader of
+  // the same channels would run the handlers on another thread. Set them
+  // before Init. In-process frames only come through
+  // SegmentedFrameHandler, offline also the imu only through ImuHandler.
+  void SetInProcessFrames();
+  void SetOffline();
+
  private:
-  Pose pose_arr_[IMU_QUE_LENGTH];
+  using DriverWriterPtr =
+      std::shared_ptr<cyber::Writer<apollo::drivers::PointCloud>>;
+
+  void RunFeatureAssociation();
+  // Called from the lidar thread, drops the imu poses that are no longer
+  // needed to deskew a scan starting at timestamp
+  void PopImuBefore(double timestamp);
+  // Imu attitude at timestamp, slerp between the two nearest imu messages
+  bool InterpolateImu(double timestamp, Eigen::Quaterniond* orientation);
+  void AdjustDistortion();
+  // Debug clouds of the features, only when they have a reader
+  void PublishCloud();
+
+  void CheckSystemInitialization();
+  void UpdateInitialGuess();
+  // Moves a point of the scan to the scan start, by the part of
+  // transform_cur_ up to its time
+  void TransformToStart(const PointType& pi, PointType* po) const;
+  // Moves a point of the scan to the scan end
+  void TransformToEnd(const PointType& pi, PointType* po) const;
+  // Jacobian rows of the surf residuals by rx, rz and ty, and of the corner
+  // residuals by ry, tx and tz, at transform_cur_
+  struct SurfJacobian;
+  struct CornerJacobian;
+  // Normal equations of the 3 dof of one feature type, summed over the
+  // matched points of a chunk, and the search buffers of the chunk
+  struct MatchChunk {
+    void Clear() {
+      ata.setZero();
+      atb.setZero();
+      count = 0;
+    }
+
+    void Add(const Eigen::Vector3f& jacobian, float residual) {
+      const Eigen::Vector3d row = jacobian.cast<double>();
+      ata += row * row.transpose();
+      atb += row * residual;
+      ++count;
+    }
+
+    Eigen::Matrix3d ata = Eigen::Matrix3d::Zero();
+    Eigen::Vector3d atb = Eigen::Vector3d::Zero();
+    int count = 0;
+    std::vector<IndexedPoint> point_search;
+    std::vector<float> point_search_sq_dis;
+  };
+  // Match the points [begin, end) of the sharp or flat features to the
+  // last scan and sum their residuals into chunk
+  void FindCorrespondingSurfFeatures(int iter_count,
+                                     const SurfJacobian& jacobian, int begin,
+                                     int end, MatchChunk* chunk);
+  void FindCorrespondingCornerFeatures(int iter_count,
+                                       const CornerJacobian& jacobian,
+                                       int begin, int end, MatchChunk* chunk);
+  // Runs find on the chunks of point_num points and sums them into
+  // match_total_ in chunk order
+  void MatchChunks(int point_num,
+                   const std::function<void(int, int, MatchChunk*)>& find);
+  // One Gauss-Newton step of the ground, rx, rz and ty, and of the corner
+  // points, ry, tx and tz, from match_total_. Return false once the step is
+  // small.
+  bool CalculateTransformationSurf(int iter_count);
+  bool CalculateTransformationCorner(int iter_count);
+  // Solves the normal equations of the 3 dof of one feature type, without
+  // the directions a degenerate scene does not constrain
+  Eigen::Vector3f SolveStep(int iter_count, const Eigen::Matrix3f& ata,
+                            const Eigen::Vector3f& atb);
+  // Returns the LM iterations of the surf and the corner steps
+  int UpdateTransformation();
+  void IntegrateTransformation();
+  void UpdateLastIndex();
+  void AdjustOutlierCloud();
+  void PublishOdometry();
+  // Hands every skipFrameNum + 1 scan on to the mapping
+  void PublishCloudsLast();
+  void PublishTelemetry();
+  // Sets the feature budget of the next scan by the time of this one, which
+  // started at start_us
+  void ShedLoad(uint64_t start_us);
+
+  bool NeedPublish(const DriverWriterPtr& writer) const;
+  void PublishPointCloud(const PointCloudPtr& cloud,
+                         const DriverWriterPtr& writer);
+
+  using SegmentedSync =
+      lib::TimestampSync<cloud_msgs::PackedCloud, cloud_msgs::CloudInfo,
+                         cloud_msgs::PackedCloud>;
+  std::unique_ptr<SegmentedSync> segmented_sync_;
+  std::shared_ptr<cyber::Reader<cloud_msgs::PackedCloud>> sub_segmented_cloud_;
+  std::shared_ptr<cyber::Reader<cloud_msgs::CloudInfo>> sub_segmented_cloud_info_;
+  std::shared_ptr<cyber::Reader<cloud_msgs::PackedCloud>> sub_outlier_cloud_;
+  std::shared_ptr<cyber::Reader<apollo::localization::CorrectedImu>> sub_imu_;
+  DriverWriterPtr pub_corner_points_sharp_;
+  DriverWriterPtr pub_corner_points_less_sharp_;
+  DriverWriterPtr pub_surf_points_flat_;
+  DriverWriterPtr pub_surf_points_less_flat_;
+  using PackedWriterPtr =
+      std::shared_ptr<cyber::Writer<cloud_msgs::PackedCloud>>;
+  PackedWriterPtr pub_laser_cloud_corner_last_;
+  PackedWriterPtr pub_laser_cloud_surf_last_;
+  PackedWriterPtr pub_outlier_cloud_last_;
+  std::shared_ptr<cyber::Writer<apollo::localization::LocalizationEstimate>>
+      pub_laser_odometry_;
+  std::shared_ptr<cyber::Writer<cloud_msgs::FrameTelemetry>> pub_telemetry_;
+  cloud_msgs::FrameTelemetry telemetry_;
+  apollo::localization::LocalizationEstimate laser_odometry_;
+  // reused for every published cloud, keeps its points allocated
+  apollo::drivers::PointCloud laser_cloud_out_;
+
+  // Written by the imu reader and read by the lidar reader, which run on
+  // different threads
+  lib::CircularBuffer<Pose, IMU_QUE_LENGTH> imu_buffer_;
+
+  SensorProfile sensor_profile_;
+  double time_scan_cur_ = 0;
+  // Deskew rotation to the imu attitude of the scan end and relative time
+  // of each column bucket, see AdjustDistortion
+  std::vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f>>
+      deskew_transforms_;
+  std::vector<float> deskew_rel_time_;
+  // Imu of the scan in the camera frame, the attitude at the scan start
+  // and end. All zero without imu.
+  bool has_scan_imu_ = false;
+  Eigen::Vector3f imu_start_ = Eigen::Vector3f::Zero();
+  Eigen::Vector3f imu_end_ = Eigen::Vector3f::Zero();
+  // Rotates a point from the imu attitude of the scan start to the one of
+  // the end, the guess of the odometry rotation
+  Eigen::Matrix3f imu_end_from_start_ = Eigen::Matrix3f::Identity();
+
+  // Info and outliers of the scan, shared with the frame or the message
+  // they came with. The outliers go to outlier_cloud_ in the camera frame.
+  std::shared_ptr<const cloud_msgs::CloudInfo> seg_info_;
+  pcl::PointCloud<PointType>::ConstPtr outlier_scan_;
+  FeatureExtractor feature_extractor_;
+  // A scan has one lidar period, over it less features are picked
+  lib::LoadShedder load_shedder_{SCAN_PERIOD, 2};
 
   PointCloudPtr segmented_cloud_;
+  PointCloudPtr outlier_cloud_;
+  PointCloudPtr corner_points_sharp_;
+  PointCloudPtr corner_points_less_sharp_;
+  PointCloudPtr surf_points_flat_;
+  PointCloudPtr surf_points_less_flat_;
+  // The features of the last scan in the frame of its end
+  PointCloudPtr laser_cloud_corner_last_;
+  PointCloudPtr laser_cloud_surf_last_;
+  // correspondence search in the features of the last scan
+  lib::VoxelHashMap<IndexedPoint> corner_last_index_{1.0f};
+  lib::VoxelHashMap<IndexedPoint> surf_last_index_{1.0f};
+  // The features are matched in chunks on a lib::ThreadPool, each chunk
+  // sums its own normal equations, which are added in chunk order so the
+  // step does not depend on scheduling
+  int num_threads_ = 1;
+  lib::ThreadPool pool_;
+  std::vector<MatchChunk> match_chunks_{1};
+  MatchChunk match_total_;
+  // The points of the last scan the features were matched to, kept for 5
+  // iterations
+  std::vector<int> point_search_corner_ind1_;
+  std::vector<int> point_search_corner_ind2_;
+  std::vector<int> point_search_surf_ind1_;
+  std::vector<int> point_search_surf_ind2_;
+  std::vector<int> point_search_surf_ind3_;
+  // Update projection of a degenerate scene, found in the first iteration
+  bool is_degenerate_ = false;
+  Eigen::Matrix3f mat_p_ = Eigen::Matrix3f::Identity();
+
+  bool system_inited_lm_ = false;
+  // Motion of the last scan, from its start to its end, and the odometry
+  // pose of the scan end
+  float transform_cur_[6] = {0};
+  float transform_sum_[6] = {0};
+  // the first scan with odometry goes on to the mapping
+  int frame_count_ = skipFrameNum;
+
+  OdometryCallback odometry_callback_;
+  bool segmented_readers_ = true;
+  bool imu_reader_ = true;
 };
 
 CYBER_REGISTER_COMPONENT(FeatureAssociation)
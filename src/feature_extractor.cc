@@ -0,0 +1,246 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-7-25
+//  Author: daohu527
+
+#include "modules/tools/ilego_loam/src/feature_extractor.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <numeric>
+
+namespace apollo {
+namespace tools {
+
+void FeatureExtractor::Init(int num_threads) {
+  num_threads_ = std::max(1, num_threads);
+  pool_.Resize(num_threads_);
+}
+
+void FeatureExtractor::CalculateSmoothness(const cloud_msgs::CloudInfo& info,
+                                           int cloud_size) {
+  cloud_curvature_.assign(cloud_size, 0.0f);
+  cloud_neighbor_picked_.assign(cloud_size, 0);
+  cloud_label_.assign(cloud_size, 0);
+  if (cloud_size < 11)
+    return;
+
+  // Sum of the 11 ranges around i, moved by one point per step instead of
+  // summing the whole window again. The float ranges of a scan are summed
+  // exactly in a double, so the running sum does not drift from the sum of
+  // the window.
+  const float* range = info.segmented_cloud_range().data();
+  double window_sum = std::accumulate(range, range + 11, 0.0);
+  for (int i = 5; i < cloud_size - 5; ++i) {
+    float diff_range = window_sum - 11 * range[i];
+    cloud_curvature_[i] = diff_range * diff_range;
+    if (i + 6 < cloud_size)
+      window_sum += static_cast<double>(range[i + 6]) - range[i - 5];
+  }
+}
+
+void FeatureExtractor::MarkOccludedPoints(const cloud_msgs::CloudInfo& info) {
+  int cloud_size = cloud_curvature_.size();
+  for (int i = 5; i < cloud_size - 6; ++i) {
+    float depth1 = info.segmented_cloud_range(i);
+    float depth2 = info.segmented_cloud_range(i + 1);
+    int column_diff = std::abs(int(info.segmented_cloud_col_ind(i + 1) -
+                                   info.segmented_cloud_col_ind(i)));
+    if (column_diff < 10) {
+      if (depth1 - depth2 > 0.3) {
+        for (int j = i - 5; j <= i; ++j)
+          cloud_neighbor_picked_[j] = 1;
+      } else if (depth2 - depth1 > 0.3) {
+        for (int j = i + 1; j <= i + 6; ++j)
+          cloud_neighbor_picked_[j] = 1;
+      }
+    }
+
+    float diff1 = std::abs(info.segmented_cloud_range(i - 1) -
+                           info.segmented_cloud_range(i));
+    float diff2 = std::abs(info.segmented_cloud_range(i + 1) -
+                           info.segmented_cloud_range(i));
+    float threshold = 0.02 * info.segmented_cloud_range(i);
+    if (diff1 > threshold && diff2 > threshold) {
+      cloud_neighbor_picked_[i] = 1;
+    }
+  }
+}
+
+void FeatureExtractor::MarkNeighborPicked(const cloud_msgs::CloudInfo& info,
+                                          int ind, int first, int last) {
+  cloud_neighbor_picked_[ind] = 1;
+  for (int j = 1; j <= 5 && ind + j <= last; ++j) {
+    int column_diff = std::abs(int(info.segmented_cloud_col_ind(ind + j) -
+                                   info.segmented_cloud_col_ind(ind + j - 1)));
+    if (column_diff > 10)
+      break;
+    cloud_neighbor_picked_[ind + j] = 1;
+  }
+
+  for (int j = -1; j >= -5 && ind + j >= first; --j) {
+    int column_diff = std::abs(int(info.segmented_cloud_col_ind(ind + j) -
+                                   info.segmented_cloud_col_ind(ind + j + 1)));
+    if (column_diff > 10)
+      break;
+    cloud_neighbor_picked_[ind + j] = 1;
+  }
+}
+
+void FeatureExtractor::PickCornerPointsSharp(
+    const cloud_msgs::CloudInfo& info, const pcl::PointCloud<PointType>& cloud,
+    int start, int end, int first, int last, RingFeatures* ring) {
+  // Only the candidates are ordered, and only as far as they are picked,
+  // with a max heap on the curvature. Ties go to the larger index, the
+  // order of a walk down the sector sorted by curvature and index.
+  auto& candidates = ring->candidates;
+  candidates.clear();
+  for (int ind = start; ind <= end; ++ind) {
+    if (cloud_neighbor_picked_[ind] == 0 &&
+        cloud_curvature_[ind] > edgeThreshold &&
+        !info.segmented_cloud_ground_flag(ind))
+      candidates.push_back(ind);
+  }
+  auto less_curvature = [this](int l, int r) {
+    return cloud_curvature_[l] < cloud_curvature_[r] ||
+           (cloud_curvature_[l] == cloud_curvature_[r] && l < r);
+  };
+  std::make_heap(candidates.begin(), candidates.end(), less_curvature);
+
+  int largest_picked_num = 0;
+  while (!candidates.empty()) {
+    std::pop_heap(candidates.begin(), candidates.end(), less_curvature);
+    int ind = candidates.back();
+    candidates.pop_back();
+    // picked as the neighbor of a sharper point
+    if (cloud_neighbor_picked_[ind] != 0)
+      continue;
+
+    ++largest_picked_num;
+    if (largest_picked_num <= budget_.corner_sharp) {
+      cloud_label_[ind] = 2;
+      ring->corner_sharp.push_back(cloud.points[ind]);
+      ring->corner_less_sharp.push_back(cloud.points[ind]);
+    } else if (largest_picked_num <= budget_.corner_less_sharp) {
+      cloud_label_[ind] = 1;
+      ring->corner_less_sharp.push_back(cloud.points[ind]);
+    } else {
+      break;
+    }
+    MarkNeighborPicked(info, ind, first, last);
+  }
+}
+
+void FeatureExtractor::PickSurfPointsFlat(
+    const cloud_msgs::CloudInfo& info, const pcl::PointCloud<PointType>& cloud,
+    int start, int end, int first, int last, RingFeatures* ring) {
+  auto& candidates = ring->candidates;
+  candidates.clear();
+  for (int ind = start; ind <= end; ++ind) {
+    if (cloud_neighbor_picked_[ind] == 0 &&
+        cloud_curvature_[ind] < surfThreshold &&
+        info.segmented_cloud_ground_flag(ind))
+      candidates.push_back(ind);
+  }
+  // min heap on the curvature, ties go to the smaller index
+  auto greater_curvature = [this](int l, int r) {
+    return cloud_curvature_[l] > cloud_curvature_[r] ||
+           (cloud_curvature_[l] == cloud_curvature_[r] && l > r);
+  };
+  std::make_heap(candidates.begin(), candidates.end(), greater_curvature);
+
+  int smallest_picked_num = 0;
+  while (!candidates.empty()) {
+    std::pop_heap(candidates.begin(), candidates.end(), greater_curvature);
+    int ind = candidates.back();
+    candidates.pop_back();
+    if (cloud_neighbor_picked_[ind] != 0)
+      continue;
+
+    cloud_label_[ind] = -1;
+    ring->surf_flat.push_back(cloud.points[ind]);
+    ++smallest_picked_num;
+    if (smallest_picked_num >= budget_.surf_flat) {
+      break;
+    }
+    MarkNeighborPicked(info, ind, first, last);
+  }
+}
+
+void FeatureExtractor::ExtractRingFeatures(
+    const cloud_msgs::CloudInfo& info, const pcl::PointCloud<PointType>& cloud,
+    int i, RingFeatures* ring) {
+  ring->corner_sharp.clear();
+  ring->corner_less_sharp.clear();
+  ring->surf_flat.clear();
+  ring->surf_less_flat_scan.clear();
+
+  const int first = info.start_ring_index(i);
+  const int last = info.end_ring_index(i);
+  // Divide the circle into 6 equal parts,
+  // select 4 surface features and 2 line feature for each direction, less
+  // under load, see set_budget
+  for (int round_id = 0; round_id < 6; ++round_id) {
+    int sp = (first * (6 - round_id) + last * round_id) / 6;
+    int ep = (first * (5 - round_id) + last * (round_id + 1)) / 6 - 1;
+
+    if (sp >= ep) continue;
+
+    PickCornerPointsSharp(info, cloud, sp, ep, first, last, ring);
+    PickSurfPointsFlat(info, cloud, sp, ep, first, last, ring);
+
+    for (int k = sp; k <= ep; ++k) {
+      if (cloud_label_[k] <= 0) {
+        ring->surf_less_flat_scan.push_back(cloud.points[k]);
+      }
+    }
+  }
+
+  ring->down_size_filter.Filter(ring->surf_less_flat_scan,
+                                &ring->surf_less_flat_scan_ds);
+}
+
+void FeatureExtractor::ExtractFeatures(
+    const cloud_msgs::CloudInfo& info, const pcl::PointCloud<PointType>& cloud,
+    pcl::PointCloud<PointType>* corner_sharp,
+    pcl::PointCloud<PointType>* corner_less_sharp,
+    pcl::PointCloud<PointType>* surf_flat,
+    pcl::PointCloud<PointType>* surf_less_flat) {
+  corner_sharp->clear();
+  corner_less_sharp->clear();
+  surf_flat->clear();
+  surf_less_flat->clear();
+
+  const int ring_num = info.start_ring_index_size();
+  if (static_cast<int>(ring_features_.size()) < ring_num)
+    ring_features_.resize(ring_num);
+
+  // the marks of a ring stay in its pick range, see the class comment
+  pool_.ParallelFor(ring_num, [this, &info, &cloud](int i) {
+    ExtractRingFeatures(info, cloud, i, &ring_features_[i]);
+  });
+
+  for (int i = 0; i < ring_num; ++i) {
+    const RingFeatures& ring = ring_features_[i];
+    *corner_sharp += ring.corner_sharp;
+    *corner_less_sharp += ring.corner_less_sharp;
+    *surf_flat += ring.surf_flat;
+    *surf_less_flat += ring.surf_less_flat_scan_ds;
+  }
+}
+
+}  // namespace tools
+}  // namespace apollo
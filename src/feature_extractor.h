@@ -0,0 +1,122 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Copyright 2013, Ji Zhang, Carnegie Mellon University
+// Further contributions copyright (c) 2016, Southwest Research Institute
+// All rights reserved.
+//
+//
+// This is an implementation of the algorithm described in the following papers:
+//   J. Zhang and S. Singh. LOAM: Lidar Odometry and Mapping in Real-time.
+//     Robotics: Science and Systems Conference (RSS). Berkeley, CA, July 2014.
+//   T. Shan and B. Englot. LeGO-LOAM: Lightweight and Ground-Optimized Lidar Odometry and Mapping on Variable Terrain
+//      IEEE/RSJ International Conference on Intelligent Robots and Systems (IROS). October 2018.
+
+
+//  Created Date: 2022-7-25
+//  Author: daohu527
+
+#pragma once
+
+#include <vector>
+
+#include "modules/tools/ilego_loam/proto/cloud_info.pb.h"
+
+#include "modules/tools/ilego_loam/src/lib/thread_pool.h"
+#include "modules/tools/ilego_loam/src/lib/voxel_filter.h"
+#include "modules/tools/ilego_loam/src/utility.h"
+
+namespace apollo {
+namespace tools {
+
+// Features picked in each sixth of a ring
+struct FeatureBudget {
+  int corner_sharp;
+  int corner_less_sharp;
+  int surf_flat;
+};
+
+// Features of one ring, rings are extracted independently and merged in
+// ring order
+struct RingFeatures {
+  pcl::PointCloud<PointType> corner_sharp;
+  pcl::PointCloud<PointType> corner_less_sharp;
+  pcl::PointCloud<PointType> surf_flat;
+  pcl::PointCloud<PointType> surf_less_flat_scan;
+  pcl::PointCloud<PointType> surf_less_flat_scan_ds;
+  lib::VoxelFilter<PointType> down_size_filter{0.2f, 0.2f, 0.2f};
+  // scratch heap of point indices
+  std::vector<int> candidates;
+};
+
+// Sharp and flat points of a segmented scan for FeatureAssociation.
+//
+// The points of ring i are the ones from start_ring_index(i) - 4 to
+// end_ring_index(i) + 5 of the cloud info, features are picked between
+// start and end index and a pick marks up to 5 points on each side as
+// picked. Those marks are kept to the ring's own pick range: a point
+// outside it is never a candidate, but the marks of the first points of a
+// ring would reach the last point of the ring before. So each ring reads
+// and writes only its own points, the rings are extracted on a
+// lib::ThreadPool and merged in ring order, the same as the serial path.
+class FeatureExtractor {
+ public:
+  void Init(int num_threads = 1);
+
+  void set_budget(const FeatureBudget& budget) { budget_ = budget; }
+  const FeatureBudget& budget() const { return budget_; }
+
+  // Curvature of the points of a scan of cloud_size points, and the ones
+  // not to pick next to an occlusion or on a beam parallel to a surface
+  void CalculateSmoothness(const cloud_msgs::CloudInfo& info, int cloud_size);
+  void MarkOccludedPoints(const cloud_msgs::CloudInfo& info);
+
+  const std::vector<float>& curvature() const { return cloud_curvature_; }
+
+  // Picks the features of the scan, after the smoothness of the same scan
+  void ExtractFeatures(const cloud_msgs::CloudInfo& info,
+                       const pcl::PointCloud<PointType>& cloud,
+                       pcl::PointCloud<PointType>* corner_sharp,
+                       pcl::PointCloud<PointType>* corner_less_sharp,
+                       pcl::PointCloud<PointType>* surf_flat,
+                       pcl::PointCloud<PointType>* surf_less_flat);
+
+ private:
+  // Marks ind and its neighbors up to 5 points away, within [first, last]
+  void MarkNeighborPicked(const cloud_msgs::CloudInfo& info, int ind,
+                          int first, int last);
+  void PickCornerPointsSharp(const cloud_msgs::CloudInfo& info,
+                             const pcl::PointCloud<PointType>& cloud,
+                             int start, int end, int first, int last,
+                             RingFeatures* ring);
+  void PickSurfPointsFlat(const cloud_msgs::CloudInfo& info,
+                          const pcl::PointCloud<PointType>& cloud,
+                          int start, int end, int first, int last,
+                          RingFeatures* ring);
+  void ExtractRingFeatures(const cloud_msgs::CloudInfo& info,
+                           const pcl::PointCloud<PointType>& cloud, int i,
+                           RingFeatures* ring);
+
+  lib::ThreadPool pool_;
+  int num_threads_ = 1;
+  FeatureBudget budget_{2, 20, 4};
+
+  std::vector<float> cloud_curvature_;
+  std::vector<int> cloud_neighbor_picked_;
+  std::vector<int> cloud_label_;
+  std::vector<RingFeatures> ring_features_;
+};
+
+}  // namespace tools
+}  // namespace apollo
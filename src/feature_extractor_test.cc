@@ -0,0 +1,322 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-7-25
+//  Author: daohu527
+
+#include "modules/tools/ilego_loam/src/feature_extractor.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace apollo {
+namespace tools {
+
+// A segmented scan of rings with ring_points[i] points, laid out like
+// ImageProjection's cloud info. Ranges are noisy with jumps, the lower
+// rings are ground.
+void MakeScan(const std::vector<int>& ring_points, unsigned seed,
+              cloud_msgs::CloudInfo* info,
+              pcl::PointCloud<PointType>* cloud) {
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> noise(-0.05f, 0.05f);
+  std::uniform_int_distribution<int> jump(0, 40);
+  std::uniform_int_distribution<int> gap(1, 3);
+  info->Clear();
+  cloud->clear();
+  const int rings = ring_points.size();
+  for (int i = 0; i < rings; ++i) {
+    info->add_start_ring_index(cloud->size() - 1 + 5);
+    float range = 10.0f;
+    int column = 0;
+    for (int j = 0; j < ring_points[i]; ++j) {
+      if (jump(rng) == 0)
+        range = 5.0f + 10.0f * std::fabs(noise(rng)) * 20.0f;
+      const float r = range + noise(rng);
+      const float angle = column * 0.2f * M_PI / 180.0f;
+      PointType point;
+      point.x = r * std::cos(angle);
+      point.y = r * std::sin(angle);
+      point.z = 0.1f * i;
+      point.intensity = i;
+      cloud->push_back(point);
+      info->add_segmented_cloud_ground_flag(i < 2);
+      info->add_segmented_cloud_col_ind(column);
+      info->add_segmented_cloud_range(r);
+      column += gap(rng);
+    }
+    info->add_end_ring_index(cloud->size() - 1 - 5);
+  }
+}
+
+struct Features {
+  pcl::PointCloud<PointType> corner_sharp;
+  pcl::PointCloud<PointType> corner_less_sharp;
+  pcl::PointCloud<PointType> surf_flat;
+  pcl::PointCloud<PointType> surf_less_flat;
+};
+
+Features Extract(FeatureExtractor* extractor,
+                 const cloud_msgs::CloudInfo& info,
+                 const pcl::PointCloud<PointType>& cloud) {
+  Features features;
+  extractor->CalculateSmoothness(info, cloud.size());
+  extractor->MarkOccludedPoints(info);
+  extractor->ExtractFeatures(info, cloud, &features.corner_sharp,
+                             &features.corner_less_sharp, &features.surf_flat,
+                             &features.surf_less_flat);
+  return features;
+}
+
+void ExpectSameCloud(const pcl::PointCloud<PointType>& expected,
+                     const pcl::PointCloud<PointType>& actual) {
+  ASSERT_EQ(expected.size(), actual.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    EXPECT_EQ(expected.points[i].x, actual.points[i].x) << i;
+    EXPECT_EQ(expected.points[i].y, actual.points[i].y) << i;
+    EXPECT_EQ(expected.points[i].z, actual.points[i].z) << i;
+    EXPECT_EQ(expected.points[i].intensity, actual.points[i].intensity) << i;
+  }
+}
+
+// Rounds the ranges to multiples of step, so whole stretches of a ring
+// have the same curvature
+void QuantizeRanges(float step, cloud_msgs::CloudInfo* info) {
+  for (float& range : *info->mutable_segmented_cloud_range())
+    range = std::max(step, std::round(range / step) * step);
+}
+
+// LeGO-LOAM's feature extraction: the curvature of each window summed
+// with std::accumulate, and each sector sorted by curvature and walked
+// down for the corners and up for the flat points. The sort breaks ties
+// by index and the neighbor marks stay in the pick range of the ring, as
+// FeatureExtractor documents.
+class ReferenceExtractor {
+ public:
+  Features Extract(const cloud_msgs::CloudInfo& info,
+                   const pcl::PointCloud<PointType>& cloud,
+                   const FeatureBudget& budget) {
+    const int size = cloud.size();
+    const float* range = info.segmented_cloud_range().data();
+    curvature_.assign(size, 0.0f);
+    picked_.assign(size, 0);
+    label_.assign(size, 0);
+    for (int i = 5; i < size - 5; ++i) {
+      float diff_range =
+          std::accumulate(range + i - 5, range + i + 6, 0.0) - 11 * range[i];
+      curvature_[i] = diff_range * diff_range;
+    }
+    for (int i = 5; i < size - 6; ++i) {
+      int column_diff = std::abs(int(info.segmented_cloud_col_ind(i + 1) -
+                                     info.segmented_cloud_col_ind(i)));
+      if (column_diff < 10) {
+        if (range[i] - range[i + 1] > 0.3) {
+          for (int j = i - 5; j <= i; ++j)
+            picked_[j] = 1;
+        } else if (range[i + 1] - range[i] > 0.3) {
+          for (int j = i + 1; j <= i + 6; ++j)
+            picked_[j] = 1;
+        }
+      }
+      float diff1 = std::abs(range[i - 1] - range[i]);
+      float diff2 = std::abs(range[i + 1] - range[i]);
+      if (diff1 > 0.02 * range[i] && diff2 > 0.02 * range[i])
+        picked_[i] = 1;
+    }
+
+    Features features;
+    lib::VoxelFilter<PointType> filter(0.2f, 0.2f, 0.2f);
+    pcl::PointCloud<PointType> less_flat_scan;
+    pcl::PointCloud<PointType> less_flat_scan_ds;
+    for (int i = 0; i < info.start_ring_index_size(); ++i) {
+      const int first = info.start_ring_index(i);
+      const int last = info.end_ring_index(i);
+      less_flat_scan.clear();
+      for (int round_id = 0; round_id < 6; ++round_id) {
+        int sp = (first * (6 - round_id) + last * round_id) / 6;
+        int ep = (first * (5 - round_id) + last * (round_id + 1)) / 6 - 1;
+        if (sp >= ep)
+          continue;
+        std::vector<int> sorted(ep - sp + 1);
+        std::iota(sorted.begin(), sorted.end(), sp);
+        std::sort(sorted.begin(), sorted.end(), [this](int l, int r) {
+          return curvature_[l] < curvature_[r] ||
+                 (curvature_[l] == curvature_[r] && l < r);
+        });
+
+        int largest_picked_num = 0;
+        for (auto it = sorted.rbegin(); it != sorted.rend(); ++it) {
+          int ind = *it;
+          if (picked_[ind] != 0 || curvature_[ind] <= edgeThreshold ||
+              info.segmented_cloud_ground_flag(ind))
+            continue;
+          ++largest_picked_num;
+          if (largest_picked_num <= budget.corner_sharp) {
+            label_[ind] = 2;
+            features.corner_sharp.push_back(cloud.points[ind]);
+            features.corner_less_sharp.push_back(cloud.points[ind]);
+          } else if (largest_picked_num <= budget.corner_less_sharp) {
+            label_[ind] = 1;
+            features.corner_less_sharp.push_back(cloud.points[ind]);
+          } else {
+            break;
+          }
+          MarkNeighbors(info, ind, first, last);
+        }
+
+        int smallest_picked_num = 0;
+        for (int ind : sorted) {
+          if (picked_[ind] != 0 || curvature_[ind] >= surfThreshold ||
+              !info.segmented_cloud_ground_flag(ind))
+            continue;
+          label_[ind] = -1;
+          features.surf_flat.push_back(cloud.points[ind]);
+          if (++smallest_picked_num >= budget.surf_flat)
+            break;
+          MarkNeighbors(info, ind, first, last);
+        }
+
+        for (int k = sp; k <= ep; ++k) {
+          if (label_[k] <= 0)
+            less_flat_scan.push_back(cloud.points[k]);
+        }
+      }
+      filter.Filter(less_flat_scan, &less_flat_scan_ds);
+      features.surf_less_flat += less_flat_scan_ds;
+    }
+    return features;
+  }
+
+  const std::vector<float>& curvature() const { return curvature_; }
+
+ private:
+  void MarkNeighbors(const cloud_msgs::CloudInfo& info, int ind, int first,
+                     int last) {
+    picked_[ind] = 1;
+    for (int j = 1; j <= 5 && ind + j <= last; ++j) {
+      if (std::abs(int(info.segmented_cloud_col_ind(ind + j) -
+                       info.segmented_cloud_col_ind(ind + j - 1))) > 10)
+        break;
+      picked_[ind + j] = 1;
+    }
+    for (int j = -1; j >= -5 && ind + j >= first; --j) {
+      if (std::abs(int(info.segmented_cloud_col_ind(ind + j) -
+                       info.segmented_cloud_col_ind(ind + j + 1))) > 10)
+        break;
+      picked_[ind + j] = 1;
+    }
+  }
+
+  std::vector<float> curvature_;
+  std::vector<int> picked_;
+  std::vector<int> label_;
+};
+
+TEST(FeatureExtractorTest, MatchesSortedSectorWalk) {
+  const std::vector<int> ring_points = {1800, 1800, 1200, 900, 40, 12, 1800,
+                                        1800};
+  cloud_msgs::CloudInfo info;
+  pcl::PointCloud<PointType> cloud;
+  for (unsigned seed = 0; seed < 4; ++seed) {
+    MakeScan(ring_points, seed, &info, &cloud);
+    // the later scans have long ties, many of them at curvature 0
+    if (seed >= 2)
+      QuantizeRanges(seed == 2 ? 0.05f : 0.5f, &info);
+    for (const FeatureBudget& budget :
+         {FeatureBudget{2, 20, 4}, FeatureBudget{1, 5, 2}}) {
+      ReferenceExtractor reference;
+      const Features expected = reference.Extract(info, cloud, budget);
+      FeatureExtractor extractor;
+      extractor.set_budget(budget);
+      const Features actual = Extract(&extractor, info, cloud);
+
+      // the running sum over several thousand points
+      EXPECT_EQ(reference.curvature(), extractor.curvature()) << seed;
+      EXPECT_FALSE(expected.corner_less_sharp.empty());
+      EXPECT_FALSE(expected.surf_flat.empty());
+      ExpectSameCloud(expected.corner_sharp, actual.corner_sharp);
+      ExpectSameCloud(expected.corner_less_sharp, actual.corner_less_sharp);
+      ExpectSameCloud(expected.surf_flat, actual.surf_flat);
+      ExpectSameCloud(expected.surf_less_flat, actual.surf_less_flat);
+    }
+  }
+}
+
+TEST(FeatureExtractorTest, ParallelMatchesSerial) {
+  // short rings too, down to none with points to pick
+  const std::vector<int> ring_points = {900, 900, 800, 40, 12, 3, 0, 900,
+                                        700, 650, 11, 900, 500, 900, 20, 900};
+  cloud_msgs::CloudInfo info;
+  pcl::PointCloud<PointType> cloud;
+  for (unsigned seed = 0; seed < 5; ++seed) {
+    MakeScan(ring_points, seed, &info, &cloud);
+    FeatureExtractor serial;
+    const Features expected = Extract(&serial, info, cloud);
+    EXPECT_FALSE(expected.corner_sharp.empty());
+    EXPECT_FALSE(expected.surf_flat.empty());
+
+    for (int num_threads : {2, 3, 4, 16}) {
+      FeatureExtractor parallel;
+      parallel.Init(num_threads);
+      // twice, the second scan reuses the rings of the first
+      for (int k = 0; k < 2; ++k) {
+        const Features actual = Extract(&parallel, info, cloud);
+        ExpectSameCloud(expected.corner_sharp, actual.corner_sharp);
+        ExpectSameCloud(expected.corner_less_sharp, actual.corner_less_sharp);
+        ExpectSameCloud(expected.surf_flat, actual.surf_flat);
+        ExpectSameCloud(expected.surf_less_flat, actual.surf_less_flat);
+      }
+    }
+  }
+}
+
+TEST(FeatureExtractorTest, FeaturesStayInTheirRing) {
+  cloud_msgs::CloudInfo info;
+  pcl::PointCloud<PointType> cloud;
+  MakeScan({600, 600, 600, 600}, 7, &info, &cloud);
+  FeatureExtractor extractor;
+  const Features features = Extract(&extractor, info, cloud);
+  // Merged in ring order, each from the pick range of its ring
+  int ring = 0;
+  for (const PointType& point : features.corner_less_sharp.points) {
+    EXPECT_GE(static_cast<int>(point.intensity), ring);
+    ring = point.intensity;
+  }
+  for (const PointType& point : features.surf_flat.points)
+    EXPECT_LT(point.intensity, 2);
+  for (const PointType& point : features.corner_less_sharp.points)
+    EXPECT_GE(point.intensity, 2);
+}
+
+TEST(FeatureExtractorTest, BudgetLimitsThePicks) {
+  cloud_msgs::CloudInfo info;
+  pcl::PointCloud<PointType> cloud;
+  MakeScan({900, 900, 900, 900}, 3, &info, &cloud);
+  FeatureExtractor extractor;
+  extractor.set_budget({1, 3, 1});
+  const Features features = Extract(&extractor, info, cloud);
+  // per sixth of a ring, the corners of the 2 rings above the ground
+  EXPECT_LE(features.corner_sharp.size(), 2u * 6u);
+  EXPECT_LE(features.corner_less_sharp.size(), 2u * 6u * 3u);
+  EXPECT_LE(features.surf_flat.size(), 2u * 6u);
+  EXPECT_FALSE(features.corner_sharp.empty());
+}
+
+}  // namespace tools
+}  // namespace apollo
@@ -0,0 +1,59 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-7-25
+//  Author: daohu527
+
+
+
+#pragma once
+
+#include <memory>
+
+#include "modules/tools/ilego_loam/proto/cloud_info.pb.h"
+
+#include "modules/tools/ilego_loam/src/utility.h"
+
+namespace apollo {
+namespace tools {
+
+// Frames handed from stage to stage when the stages share a process, see
+// ilego_loam_component.h. A frame is not changed once it is handed on, so
+// a stage can keep it while the one before moves on to the next frame.
+
+// Segmented scan of ImageProjection for FeatureAssociation
+struct SegmentedFrame {
+  double timestamp = 0.0;
+  cloud_msgs::CloudInfo info;
+  pcl::PointCloud<PointType> segmented_cloud;
+  pcl::PointCloud<PointType> outlier_cloud;
+};
+
+using SegmentedFramePtr = std::shared_ptr<const SegmentedFrame>;
+
+// Scan of FeatureAssociation for MapOptmization, every skipFrameNum + 1
+// scans. The clouds are in the frame of the scan end.
+struct OdometryFrame {
+  double timestamp = 0.0;
+  // odometry pose of the scan
+  float transform_sum[6] = {0};
+  pcl::PointCloud<PointType> corner_last;
+  pcl::PointCloud<PointType> surf_last;
+  pcl::PointCloud<PointType> outlier_last;
+};
+
+using OdometryFramePtr = std::shared_ptr<const OdometryFrame>;
+
+}  // namespace tools
+}  // namespace apollo
@@ -0,0 +1,52 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-7-25
+//  Author: daohu527
+
+
+
+#include "modules/tools/ilego_loam/src/ilego_loam_component.h"
+
+#include <string>
+
+#include "modules/tools/ilego_loam/src/component_util.h"
+
+namespace apollo {
+namespace tools {
+
+bool ILegoLoamComponent::Init() {
+  image_projection_ = std::make_shared<ImageProjection>();
+  feature_association_ = std::make_shared<FeatureAssociation>();
+  map_optmization_ = std::make_shared<MapOptmization>();
+
+  // The callbacks are set before the stages start, the last stage first,
+  // so the first scan already finds the whole chain
+  image_projection_->SetFrameCallback([this](const SegmentedFramePtr& frame) {
+    feature_association_->SegmentedFrameHandler(frame);
+  });
+  feature_association_->SetInProcessFrames();
+  feature_association_->SetOdometryCallback(
+      [this](const OdometryFramePtr& frame) {
+        map_optmization_->OdometryFrameHandler(frame);
+      });
+
+  const std::string& name = node_->Name();
+  return InitComponent(name + "_map_optmization", map_optmization_) &&
+         InitComponent(name + "_feature_association", feature_association_) &&
+         InitComponent(name + "_image_projection", image_projection_);
+}
+
+}  // namespace tools
+}  // namespace apollo
@@ -0,0 +1,55 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-7-25
+//  Author: daohu527
+
+
+
+#pragma once
+
+#include <memory>
+
+#include "cyber/cyber.h"
+
+#include "modules/tools/ilego_loam/src/feature_association.h"
+#include "modules/tools/ilego_loam/src/image_projection.h"
+#include "modules/tools/ilego_loam/src/map_optmization.h"
+
+namespace apollo {
+namespace tools {
+
+// ImageProjection, FeatureAssociation and MapOptmization in one component.
+//
+// The stages hand each scan on as a shared frame (see frames.h) instead of
+// writing it to a channel, nothing is serialized or copied into a message.
+// The projection and the odometry run one after the other on the thread
+// of the lidar reader, at the rate of the lidar. Every skipFrameNum + 1
+// scan goes on to the mapping, which runs on its own thread and takes the
+// newest scan when it is free, so a slow mapping never holds back the
+// odometry.
+class ILegoLoamComponent final : public cyber::Component<> {
+ public:
+  bool Init() override;
+
+ private:
+  std::shared_ptr<ImageProjection> image_projection_;
+  std::shared_ptr<FeatureAssociation> feature_association_;
+  std::shared_ptr<MapOptmization> map_optmization_;
+};
+
+CYBER_REGISTER_COMPONENT(ILegoLoamComponent)
+
+}  // namespace tools
+}  // namespace apollo
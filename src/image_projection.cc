@@ -35,10 +35,6 @@
 namespace apollo {
 namespace tools {
 
-static constexpr int8_t dirs[4][2] = {{-1, 0}, {0, 1}, {0, -1}, {1, 0}};
-static constexpr int LABEL_INIT = 0;
-static constexpr int LABEL_INVALID = INT_MAX;
-
 static const pcl::PointXYZI nan_point(
     std::numeric_limits<float>::quiet_NaN(),
     std::numeric_limits<float>::quiet_NaN(),
@@ -51,37 +47,66 @@ ImageProjection::ImageProjection() {}
 ImageProjection::~ImageProjection() {}
 
 bool ImageProjection::Init() {
-  sub_laser_cloud = node_->CreateReader<apollo::drivers::PointCloud>(
-      FLAGS_lidar_topic,
-      [&](const DriverPointCloudPtr& point_cloud){
-        // todo(zero): check need lock???
-        // std::lock_guard<std::mutex> lock(mutex_);
-        CloudHandler(point_cloud);
-      });
+  // A scan that waits in the queue is stale by the time it is projected, a
+  // late projection skips to the newest scan
+  if (!offline) {
+    cyber::ReaderConfig reader_config;
+    reader_config.channel_name = FLAGS_lidar_topic;
+    reader_config.pending_queue_size = FLAGS_scan_queue_size;
+    sub_laser_cloud = node_->CreateReader<apollo::drivers::PointCloud>(
+        reader_config,
+        [&](const DriverPointCloudPtr& point_cloud){
+          CloudHandler(point_cloud);
+        });
+  }
 
   pub_full_cloud = node_->CreateWriter<apollo::drivers::PointCloud>("/full_cloud_projected");
   pub_full_info_cloud = node_->CreateWriter<apollo::drivers::PointCloud>("/full_cloud_info");
 
   pub_ground_cloud = node_->CreateWriter<apollo::drivers::PointCloud>("/ground_cloud");
-  pub_segmented_cloud = node_->CreateWriter<apollo::drivers::PointCloud>("/segmented_cloud");
+  pub_segmented_cloud = node_->CreateWriter<cloud_msgs::PackedCloud>("/segmented_cloud");
   pub_segmented_cloud_pure = node_->CreateWriter<apollo::drivers::PointCloud>("/segmented_cloud_pure");
   pub_segmented_cloud_info = node_->CreateWriter<cloud_msgs::CloudInfo>("/segmented_cloud_info");
-  pub_outlier_cloud = node_->CreateWriter<apollo::drivers::PointCloud>("/outlier_cloud");
+  pub_outlier_cloud = node_->CreateWriter<cloud_msgs::PackedCloud>("/outlier_cloud");
+  pub_telemetry = node_->CreateWriter<cloud_msgs::FrameTelemetry>(kTelemetryChannel);
+
+  if (!LoadSensorProfile(&sensor_profile))
+    return false;
+
+  if (!InitProjectionTable())
+    return false;
 
   AllocateMemory();
   ResetParameters();
   return true;
 }
 
+void ImageProjection::SetFrameCallback(FrameCallback callback) {
+  frame_callback = std::move(callback);
+}
+
+void ImageProjection::SetOffline() {
+  offline = true;
+}
+
+bool ImageProjection::InitProjectionTable() {
+  if (!projection_table.Init(sensor_profile.vertical_angles,
+                             sensor_profile.ang_res_x,
+                             sensor_profile.horizon_scan)) {
+    AERROR << "Sensor vertical angles must be ascending";
+    return false;
+  }
+  return true;
+}
+
 void ImageProjection::AllocateMemory() {
-  laser_cloud_in.reset(new pcl::PointCloud<PointType>());
-  // laser_cloud_in_ring.reset(new pcl::PointCloud<PointXYZIR>());
-  laser_cloud_in_ring.reset(new pcl::PointCloud<PointType>());
+  const int n_scan = sensor_profile.n_scan;
+  const int horizon_scan = sensor_profile.horizon_scan;
 
   full_cloud.reset(new pcl::PointCloud<PointType>());
   full_info_cloud.reset(new pcl::PointCloud<PointType>());
-  full_cloud->points.resize(N_SCAN * HORIZON_SCAN);
-  full_info_cloud->points.resize(N_SCAN * HORIZON_SCAN);
+  full_cloud->points.resize(n_scan * horizon_scan);
+  full_info_cloud->points.resize(n_scan * horizon_scan);
 
   ground_cloud.reset(new pcl::PointCloud<PointType>());
 
@@ -90,288 +115,245 @@ void ImageProjection::AllocateMemory() {
   outlier_cloud.reset(new pcl::PointCloud<PointType>());
 
   // todo(zero): need to set default value
-  seg_msg.mutable_start_ring_index()->Resize(N_SCAN, 0);
-  seg_msg.mutable_end_ring_index()->Resize(N_SCAN, 0);
+  seg_msg.mutable_start_ring_index()->Resize(n_scan, 0);
+  seg_msg.mutable_end_ring_index()->Resize(n_scan, 0);
+
+  seg_msg.mutable_segmented_cloud_ground_flag()->Resize(n_scan * horizon_scan, false);
+  seg_msg.mutable_segmented_cloud_col_ind()->Resize(n_scan * horizon_scan, 0);
+  seg_msg.mutable_segmented_cloud_range()->Resize(n_scan * horizon_scan, 0);
 
-  seg_msg.mutable_segmented_cloud_ground_flag()->Resize(N_SCAN * HORIZON_SCAN, false);
-  seg_msg.mutable_segmented_cloud_col_ind()->Resize(N_SCAN * HORIZON_SCAN, 0);
-  seg_msg.mutable_segmented_cloud_range()->Resize(N_SCAN * HORIZON_SCAN, 0);
+  // Keep the range image allocated across frames, only the cells written
+  // in a frame are reset after it.
+  range_image.Resize(n_scan, horizon_scan, sensor_profile.ground_scan_ind + 1);
+  component_labeler.Init(sensor_profile, FLAGS_segmentation_threads);
 
-  cluster.reserve(N_SCAN * HORIZON_SCAN);
+  std::fill(full_cloud->points.begin(), full_cloud->points.end(), nan_point);
+  std::fill(full_info_cloud->points.begin(), full_info_cloud->points.end(), nan_point);
 }
 
 void ImageProjection::ResetParameters() {
-  laser_cloud_in->clear();
-  laser_cloud_in_ring->clear();
   ground_cloud->clear();
   segmented_cloud->clear();
   segmented_cloud_pure->clear();
   outlier_cloud->clear();
 
-  range_mat = cv::Mat(N_SCAN, HORIZON_SCAN, CV_32F, cv::Scalar::all(FLT_MAX));
-  ground_mat = cv::Mat(N_SCAN, HORIZON_SCAN, CV_8S, cv::Scalar::all(0));
-  label_mat = cv::Mat(N_SCAN, HORIZON_SCAN, CV_32S, cv::Scalar::all(LABEL_INIT));
-  label_count = 1;
-
-  std::fill(full_cloud->points.begin(), full_cloud->points.end(), nan_point);
-  std::fill(full_info_cloud->points.begin(), full_info_cloud->points.end(), nan_point);
+  // Only the cells touched by the last frame need to be cleared
+  if (full_cloud_filled) {
+    for (int index : range_image.dirty_index()) {
+      full_cloud->points[index] = nan_point;
+      full_info_cloud->points[index] = nan_point;
+    }
+    full_cloud_filled = false;
+  }
+  range_image.Reset();
 }
 
 void ImageProjection::CopyPointCloud(const DriverPointCloudPtr& laser_cloud_msg) {
   cloud_header.CopyFrom(laser_cloud_msg->header());
-  ToPclPointCloud(laser_cloud_msg, laser_cloud_in);
-  std::vector<int> indices;
-  pcl::removeNaNFromPointCloud(*laser_cloud_in, *laser_cloud_in, indices);
-  if (FLAGS_use_cloud_ring) {
-    ToPclPointCloud(laser_cloud_msg, laser_cloud_in_ring);
-    ACHECK(laser_cloud_in_ring->is_dense) <<
-        "Point cloud is not in dense format, please remove NaN points first!";
-  }
 }
 
-void ImageProjection::FindStartEndAngle() {
-  seg_msg.set_start_orientation(atan2(laser_cloud_in->points.front().x, laser_cloud_in->points.front().y));
-  seg_msg.set_end_orientation(atan2(laser_cloud_in->points.back().x, laser_cloud_in->points.back().y) + 2 * M_PI);
+bool ImageProjection::FindStartEndAngle(const DriverPointCloudPtr& laser_cloud_msg) {
+  // The driver cloud may contain NaN points, use the first and last valid
+  // points instead of filtering the whole cloud.
+  int size = laser_cloud_msg->point_size();
+  int front = 0;
+  while (front < size && IsNaN(laser_cloud_msg->point(front)))
+    ++front;
+  int back = size - 1;
+  while (back > front && IsNaN(laser_cloud_msg->point(back)))
+    --back;
+
+  if (front >= back) {
+    AWARN << "Point cloud has not enough valid points: " << size;
+    return false;
+  }
+
+  const auto& front_point = laser_cloud_msg->point(front);
+  const auto& back_point = laser_cloud_msg->point(back);
+  seg_msg.set_start_orientation(atan2(front_point.x(), front_point.y()));
+  seg_msg.set_end_orientation(atan2(back_point.x(), back_point.y()) + 2 * M_PI);
 
   seg_msg.set_orientation_diff(seg_msg.end_orientation() - seg_msg.start_orientation());
   CHECK(seg_msg.orientation_diff() < 3 * M_PI) << "Point cloud orientation diff >= 3*M_PI";
   CHECK(seg_msg.orientation_diff() > M_PI) << "Point cloud orientation diff <= M_PI";
+  return true;
 }
 
-void ImageProjection::ProjectPointCloud() {
-  for (size_t i = 0; i < laser_cloud_in->points.size(); ++i) {
-    PointType this_point = laser_cloud_in->points[i];
-
-    size_t row_idn;
-    if (FLAGS_use_cloud_ring) {
-      // todo(zero): add ring?
-      // row_idn = laser_cloud_in_ring->points[i].ring;
-      row_idn = 0;
-    } else {
-      float vertical_angle = atan2(this_point.z, sqrt(this_point.x*this_point.x + this_point.y*this_point.y)) * 180 / M_PI;
-      row_idn = (vertical_angle + ang_bottom) / ang_res_y;
-    }
-
-    if (row_idn >= N_SCAN)
-      continue;
-
-    float horizon_angle = atan2(this_point.x, this_point.y) * 180 / M_PI;
-    // todo(zero): horizon_angle [-180, 180]
-    size_t column_idn = round(horizon_angle / ang_res_x) + HORIZON_SCAN / 2;
-    if (column_idn >= HORIZON_SCAN)
-      column_idn -= HORIZON_SCAN;
-
-    if (column_idn >= HORIZON_SCAN)
-      continue;
-
-    float range = sqrt(this_point.x*this_point.x + this_point.y*this_point.y + this_point.z*this_point.z);
-    if (range < FLAGS_sensor_minimum_range)
-      continue;
-
-    range_mat.at<float>(row_idn, column_idn) = range;
-    this_point.intensity = static_cast<float>(row_idn) +
-        static_cast<float>(column_idn) / 10000;
-
-    size_t index = column_idn + row_idn * HORIZON_SCAN;
-
-    full_cloud->points[index] = this_point;
-    full_info_cloud->points[index] = this_point;
-    full_info_cloud->points[index].intensity = range;
-  }
-}
-
-void ImageProjection::GroundRemoval() {
-  for (size_t i = 0; i < groundScanInd; ++i) {
-    for (size_t j = 0; j < HORIZON_SCAN; ++j) {
-      size_t lower_ind = j + i * HORIZON_SCAN;
-      size_t upper_ind = j + (i + 1) * HORIZON_SCAN;
-
-      if (IsNaN(full_cloud->points[lower_ind]) ||
-          IsNaN(full_cloud->points[upper_ind])) {
-        ground_mat.at<int8_t>(i, j) = -1;
-        continue;
-      }
-
-      float diffx = full_cloud->points[upper_ind].x - full_cloud->points[lower_ind].x;
-      float diffy = full_cloud->points[upper_ind].y - full_cloud->points[lower_ind].y;
-      float diffz = full_cloud->points[upper_ind].z - full_cloud->points[lower_ind].z;
-
-      float angle = atan2(diffz, sqrt(diffx*diffx + diffy*diffy)) * 180 / M_PI;
+template <int kRows, int kCols>
+void ImageProjection::ExtractGroundCloud() {
+  const int horizon_scan = kCols > 0 ? kCols : sensor_profile.horizon_scan;
+  const int ground_scan_ind = sensor_profile.ground_scan_ind;
 
-      if (fabs(angle - FLAGS_sensor_mount_angle) <= 10) {
-        ground_mat.at<int8_t>(i, j) = 1;
-        ground_mat.at<int8_t>(i + 1, j) = 1;
-      }
+  const int8_t* ground = range_image.ground();
+  for (int i = 0; i <= ground_scan_ind; ++i) {
+    for (int j = 0; j < horizon_scan; ++j) {
+      if (ground[j + i * horizon_scan] == 1)
+        ground_cloud->push_back(GetPoint(j + i * horizon_scan));
     }
   }
+}
 
-  for (size_t i = 0; i < N_SCAN; ++i) {
-    for (size_t j = 0; j < HORIZON_SCAN; ++j) {
-      if (ground_mat.at<int8_t>(i, j) == 1 || range_mat.at<float>(i, j) == FLT_MAX) {
-        label_mat.at<int>(i, j) = -1;
+template <int kRows, int kCols>
+void ImageProjection::ExtractSegmentedCloud() {
+  const int n_scan = kRows > 0 ? kRows : sensor_profile.n_scan;
+  const int horizon_scan = kCols > 0 ? kCols : sensor_profile.horizon_scan;
+  tools::ExtractSegmentedCloud<kRows, kCols>(sensor_profile, range_image,
+                                             &seg_msg, segmented_cloud.get(),
+                                             outlier_cloud.get());
+
+  const int* label = range_image.label();
+  if (!NeedPublish(pub_segmented_cloud_pure))
+    return;
+  for (int i = 0; i < n_scan; ++i) {
+    for (int j = 0; j < horizon_scan; ++j) {
+      const int index = j + i * horizon_scan;
+      if (label[index] > 0 && label[index] != LABEL_INVALID) {
+        segmented_cloud_pure->push_back(GetPoint(index));
+        segmented_cloud_pure->points.back().intensity = label[index];
       }
     }
   }
-
-  for (size_t i = 0; i <= groundScanInd; ++i) {
-    for (size_t j = 0; j < HORIZON_SCAN; ++j) {
-      if (ground_mat.at<int8_t>(i, j) == 1)
-        ground_cloud->push_back(full_cloud->points[j + i * HORIZON_SCAN]);
-    }
-  }
 }
 
-void ImageProjection::CloudSegmentation() {
-  for (size_t i = 0; i < N_SCAN; ++i) {
-    for (size_t j = 0; j < HORIZON_SCAN; ++j) {
-      if (label_mat.at<int>(i, j) == LABEL_INIT)
-        LabelComponents(i, j);
-    }
+void ImageProjection::FillFullCloud() {
+  if (!NeedPublish(pub_full_cloud) && !NeedPublish(pub_full_info_cloud))
+    return;
+  full_cloud_filled = true;
+  // Empty cells of the full clouds are kept as NaN points
+  for (int index : range_image.dirty_index()) {
+    full_cloud->points[index] = GetPoint(index);
+    full_info_cloud->points[index] = full_cloud->points[index];
+    full_info_cloud->points[index].intensity = range_image.range()[index];
   }
+}
 
-  int size_of_seg_cloud = 0;
-  for (size_t i = 0; i < N_SCAN; ++i) {
-    seg_msg.set_start_ring_index(i, size_of_seg_cloud - 1 + 5);
-    for (size_t j = 0; j < HORIZON_SCAN; ++j) {
-      if (label_mat.at<int>(i, j) > 0 || ground_mat.at<int8_t>(i, j) == 1) {
-        if (label_mat.at<int>(i, j) == LABEL_INVALID) {
-          if (i > groundScanInd && j % 5 == 0) {
-            outlier_cloud->push_back(full_cloud->points[j + i * HORIZON_SCAN]);
-          }
-          continue;
-        }
-
-        if (ground_mat.at<int8_t>(i, j) == 1) {
-          if (j%5 != 0 && j > 5 && j < HORIZON_SCAN-5)
-            continue;
-        }
-
-        seg_msg.set_segmented_cloud_ground_flag(size_of_seg_cloud, ground_mat.at<int8_t>(i, j) == 1);
-        seg_msg.set_segmented_cloud_col_ind(size_of_seg_cloud, j);
-        seg_msg.set_segmented_cloud_range(size_of_seg_cloud, range_mat.at<float>(i, j));
-        segmented_cloud->push_back(full_cloud->points[j + i * HORIZON_SCAN]);
-        ++size_of_seg_cloud;
-        AINFO << "size_of_seg_cloud: " << size_of_seg_cloud;
-      }
-    }
-    seg_msg.set_end_ring_index(i, size_of_seg_cloud - 1 - 5);
-  }
+void ImageProjection::PublishTelemetry(int point_in) {
+  const uint32_t sequence_num = cloud_header.sequence_num();
+  if (has_sequence_num && sequence_num > last_sequence_num)
+    telemetry.set_dropped(sequence_num - last_sequence_num - 1);
+  last_sequence_num = sequence_num;
+  has_sequence_num = true;
+
+  telemetry.set_input_points(point_in);
+  telemetry.set_projected_points(range_image.dirty_index().size());
+  telemetry.set_ground_points(ground_cloud->size());
+  pub_telemetry->Write(telemetry);
+}
 
-  for (size_t i = 0; i < N_SCAN; ++i) {
-    for (size_t j = 0; j < HORIZON_SCAN; ++j) {
-      if (label_mat.at<int>(i, j) > 0 && label_mat.at<int>(i, j) != LABEL_INVALID) {
-        segmented_cloud_pure->push_back(full_cloud->points[j + i*HORIZON_SCAN]);
-        segmented_cloud_pure->points.back().intensity = label_mat.at<int>(i, j);
-      }
-    }
-  }
+PointType ImageProjection::GetPoint(int index) const {
+  return CellPoint(range_image, index);
 }
 
-void ImageProjection::PublishCloud() {
+SegmentedFramePtr ImageProjection::PublishCloud() {
   // todo(zero): check the header
   seg_msg.mutable_header()->set_time(cloud_header.timestamp_sec());
-  pub_segmented_cloud_info->Write(seg_msg);
+  seg_msg.mutable_header()->set_timestamp_sec(cloud_header.timestamp_sec());
 
-  apollo::drivers::PointCloud laser_cloud_temp;
-  ToDriverPointCloud(outlier_cloud, laser_cloud_temp);
   laser_cloud_temp.mutable_header()->set_timestamp_sec(cloud_header.timestamp_sec());
   laser_cloud_temp.mutable_header()->set_frame_id("base_link");
-  pub_outlier_cloud->Write(laser_cloud_temp);
-
-  laser_cloud_temp.mutable_point()->Clear();
-  ToDriverPointCloud(segmented_cloud, laser_cloud_temp);
-  pub_segmented_cloud->Write(laser_cloud_temp);
-
-  laser_cloud_temp.mutable_point()->Clear();
-  ToDriverPointCloud(full_cloud, laser_cloud_temp);
-  pub_full_cloud->Write(laser_cloud_temp);
-
-  laser_cloud_temp.mutable_point()->Clear();
-  ToDriverPointCloud(full_info_cloud, laser_cloud_temp);
-  pub_full_info_cloud->Write(laser_cloud_temp);
-
-  laser_cloud_temp.mutable_point()->Clear();
-  ToDriverPointCloud(ground_cloud, laser_cloud_temp);
-  pub_ground_cloud->Write(laser_cloud_temp);
-
-  laser_cloud_temp.mutable_point()->Clear();
-  ToDriverPointCloud(segmented_cloud_pure, laser_cloud_temp);
-  pub_segmented_cloud_pure->Write(laser_cloud_temp);
-}
-
-void ImageProjection::LabelComponents(int row, int col) {
-  bool line_count_flag[N_SCAN] = {false};
-
-  st.push({row, col});
-  cluster.clear();
-
-  while(!st.empty()) {
-    auto& [c_row, c_col] = st.top();
-    st.pop();
-
-    cluster.push_back({c_row, c_col});
-    label_mat.at<int>(c_row, c_col) = label_count;
 
-    for (int i = 0; i < 4; ++i) {
-      int n_row = c_row + dirs[i][0];
-      int n_col = c_col + dirs[i][1];
-
-      if (n_row >= 0 && n_row < N_SCAN && n_col >= 0 && n_col < HORIZON_SCAN &&
-          label_mat.at<int>(n_row, n_col) == LABEL_INIT) {
-        auto [d2, d1] = std::minmax(range_mat.at<float>(c_row, c_col),
-            range_mat.at<float>(n_row, n_col));
-
-        float alpha = dirs[i][0] == 0 ? segmentAlphaX : segmentAlphaY;
-        float angle = atan2(d2 * sin(alpha), d1 - d2 * cos(alpha));
-
-        if (angle > segmentTheta) {
-          st.push({n_row, n_col});
-          label_mat.at<int>(n_row, n_col) = label_count;
-          line_count_flag[n_row] = true;
-        }
-      }
-    }
+  SegmentedFramePtr segmented_frame;
+  if (frame_callback) {
+    // The scan moves into the frame, the next scan fills the emptied
+    // scratch clouds and info again
+    auto frame = std::make_shared<SegmentedFrame>();
+    frame->timestamp = cloud_header.timestamp_sec();
+    frame->info.Swap(&seg_msg);
+    frame->segmented_cloud.swap(*segmented_cloud);
+    frame->outlier_cloud.swap(*outlier_cloud);
+    segmented_frame = frame;
+  } else {
+    pub_segmented_cloud_info->Write(seg_msg);
+    // segmented cloud and outliers are always needed by feature
+    // association. New messages are written every frame, readers in the
+    // same process get the pointers without serialization.
+    auto packed_cloud = std::make_shared<cloud_msgs::PackedCloud>();
+    PackPointCloud(*segmented_cloud, laser_cloud_temp.header(), packed_cloud.get());
+    pub_segmented_cloud->Write(packed_cloud);
+    auto packed_outliers = std::make_shared<cloud_msgs::PackedCloud>();
+    PackPointCloud(*outlier_cloud, laser_cloud_temp.header(), packed_outliers.get());
+    pub_outlier_cloud->Write(packed_outliers);
   }
 
-  bool feasible_segment = false;
-  if (cluster.size() >= 30) {
-    feasible_segment = true;
-  } else if (cluster.size() >= segmentValidPointNum) {
-    int line_count = 0;
-    for (size_t i = 0; i < N_SCAN; ++i) {
-      if (line_count_flag[i]) {
-        ++line_count;
-      }
-    }
+  PublishPointCloud(full_cloud, pub_full_cloud);
+  PublishPointCloud(full_info_cloud, pub_full_info_cloud);
+  PublishPointCloud(ground_cloud, pub_ground_cloud);
+  PublishPointCloud(segmented_cloud_pure, pub_segmented_cloud_pure);
+  return segmented_frame;
+}
 
-    if (line_count >= segmentValidLineNum)
-      feasible_segment = true;
-  }
+bool ImageProjection::NeedPublish(
+    const std::shared_ptr<cyber::Writer<apollo::drivers::PointCloud>>& writer) const {
+  return FLAGS_publish_debug_clouds || writer->HasReader();
+}
 
-  if (feasible_segment) {
-    ++label_count;
-  } else {
-    for (auto& [l_row, l_col] : cluster) {
-      label_mat.at<int>(l_row, l_col) = LABEL_INVALID;
-    }
-  }
+void ImageProjection::PublishPointCloud(
+    const PointCloudPtr& cloud,
+    const std::shared_ptr<cyber::Writer<apollo::drivers::PointCloud>>& writer) {
+  if (!NeedPublish(writer))
+    return;
+  ToDriverPointCloud(cloud, laser_cloud_temp);
+  writer->Write(laser_cloud_temp);
 }
 
 void ImageProjection::CloudHandler(const DriverPointCloudPtr& laser_cloud_msg) {
-  // 1. convert ros message to pcl point cloud
+  LOAM_TRACE_SCOPE("ImageProjection::CloudHandler");
+  cloud_msgs::FrameTelemetry* stages =
+      FLAGS_publish_telemetry ? &telemetry : nullptr;
+  if (stages) {
+    StartTelemetry(laser_cloud_msg->header().timestamp_sec(),
+                   cloud_msgs::FrameTelemetry::IMAGE_PROJECTION, stages);
+  }
+  // 1. copy message header
   CopyPointCloud(laser_cloud_msg);
   // 2. start and end angle of a scan
-  FindStartEndAngle();
-  // 3. range image projection
-  ProjectPointCloud();
-  // 4. mark ground points
-  GroundRemoval();
-  // 5. point cloud segmentation
-  CloudSegmentation();
+  if (!FindStartEndAngle(laser_cloud_msg))
+    return;
+  DispatchGeometry(sensor_profile, [&](auto rows, auto cols) {
+    constexpr int kRows = decltype(rows)::value;
+    constexpr int kCols = decltype(cols)::value;
+    // 3. range image projection
+    {
+      LOAM_TRACE_SCOPE("ProjectPointCloud");
+      StageTimer timer(stages, cloud_msgs::FrameTelemetry::PROJECT);
+      ProjectPointCloud<kRows, kCols>(*laser_cloud_msg, sensor_profile,
+                                      projection_table, &range_image);
+    }
+    // 4. mark ground points
+    {
+      LOAM_TRACE_SCOPE("GroundRemoval");
+      StageTimer timer(stages, cloud_msgs::FrameTelemetry::GROUND);
+      GroundRemoval<kRows, kCols>(sensor_profile, &range_image);
+      ExtractGroundCloud<kRows, kCols>();
+    }
+    // 5. point cloud segmentation
+    {
+      LOAM_TRACE_SCOPE("CloudSegmentation");
+      StageTimer timer(stages, cloud_msgs::FrameTelemetry::SEGMENT);
+      const int segments = component_labeler.Label<kRows, kCols>(&range_image);
+      ExtractSegmentedCloud<kRows, kCols>();
+      if (stages) {
+        stages->set_segments(segments);
+        // before the clouds are handed on with the frame
+        stages->set_segmented_points(segmented_cloud->size());
+        stages->set_outlier_points(outlier_cloud->size());
+      }
+    }
+  });
   // 6. publish all clouds
-  PublishCloud();
+  SegmentedFramePtr frame;
+  {
+    StageTimer timer(stages, cloud_msgs::FrameTelemetry::PUBLISH);
+    FillFullCloud();
+    frame = PublishCloud();
+  }
+  if (stages)
+    PublishTelemetry(laser_cloud_msg->point_size());
   // 7. reset parameters for next iteration
   ResetParameters();
+  // 8. the next stage in the same process, outside of the timings above
+  if (frame)
+    frame_callback(frame);
 }
 
 
@@ -30,14 +30,26 @@
 
 #pragma once
 
+#include <functional>
 #include <limits>
 #include <memory>
-#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
 
 
 #include "cyber/cyber.h"
 #include "modules/tools/ilego_loam/proto/cloud_info.pb.h"
-
+#include "modules/tools/ilego_loam/proto/frame_telemetry.pb.h"
+#include "modules/tools/ilego_loam/proto/packed_cloud.pb.h"
+
+#include "modules/tools/ilego_loam/src/component_labeler.h"
+#include "modules/tools/ilego_loam/src/frames.h"
+#include "modules/tools/ilego_loam/src/lib/projection_table.h"
+#include "modules/tools/ilego_loam/src/packed_cloud.h"
+#include "modules/tools/ilego_loam/src/range_image.h"
+#include "modules/tools/ilego_loam/src/sensor_profile.h"
+#include "modules/tools/ilego_loam/src/telemetry.h"
+#include "modules/tools/ilego_loam/src/trace.h"
 #include "modules/tools/ilego_loam/src/utility.h"
 
 
@@ -51,20 +63,45 @@ class ImageProjection final : public cyber::Component<> {
 
   bool Init() override;
 
- private:
+  // Handler of the lidar reader, also called directly by the replay driver
   void CloudHandler(const DriverPointCloudPtr& laser_cloud_msg);
 
+  // With a callback the segmented frame goes to it instead of
+  // /segmented_cloud and /segmented_cloud_info, to run the next stage in
+  // the same process. Not thread safe, set it before the first cloud.
+  using FrameCallback = std::function<void(const SegmentedFramePtr&)>;
+  void SetFrameCallback(FrameCallback callback);
+  // No lidar reader, the clouds only come through CloudHandler, for the
+  // replay driver. Set it before Init.
+  void SetOffline();
+
+ private:
+
   void CopyPointCloud(const DriverPointCloudPtr& laser_cloud_msg);
-  void FindStartEndAngle();
-  void ProjectPointCloud();
-  void GroundRemoval();
-  void CloudSegmentation();
-  void PublishCloud();
+  bool FindStartEndAngle(const DriverPointCloudPtr& laser_cloud_msg);
+  // kRows and kCols are the range image size for common sensors, 0 means
+  // the size is only known at runtime from sensor_profile
+  template <int kRows, int kCols>
+  void ExtractGroundCloud();
+  template <int kRows, int kCols>
+  void ExtractSegmentedCloud();
+  void FillFullCloud();
+  PointType GetPoint(int index) const;
+  // Debug clouds are only built and published when their channel has a
+  // reader or publish_debug_clouds is set
+  bool NeedPublish(
+      const std::shared_ptr<cyber::Writer<apollo::drivers::PointCloud>>& writer) const;
+  void PublishPointCloud(
+      const PointCloudPtr& cloud,
+      const std::shared_ptr<cyber::Writer<apollo::drivers::PointCloud>>& writer);
+  // Returns the frame for frame_callback, null if the clouds went to the
+  // channels
+  SegmentedFramePtr PublishCloud();
+  void PublishTelemetry(int point_in);
   void ResetParameters();
 
-  void LabelComponents(int row, int col);
-
   void AllocateMemory();
+  bool InitProjectionTable();
 
  private:
   std::shared_ptr<cyber::Reader<apollo::drivers::PointCloud>> sub_laser_cloud;
@@ -72,14 +109,11 @@ class ImageProjection final : public cyber::Component<> {
   std::shared_ptr<cyber::Writer<apollo::drivers::PointCloud>> pub_full_cloud;
   std::shared_ptr<cyber::Writer<apollo::drivers::PointCloud>> pub_full_info_cloud;
   std::shared_ptr<cyber::Writer<apollo::drivers::PointCloud>> pub_ground_cloud;
-  std::shared_ptr<cyber::Writer<apollo::drivers::PointCloud>> pub_segmented_cloud;
+  std::shared_ptr<cyber::Writer<cloud_msgs::PackedCloud>> pub_segmented_cloud;
   std::shared_ptr<cyber::Writer<apollo::drivers::PointCloud>> pub_segmented_cloud_pure;
   std::shared_ptr<cyber::Writer<cloud_msgs::CloudInfo>> pub_segmented_cloud_info;
-  std::shared_ptr<cyber::Writer<apollo::drivers::PointCloud>> pub_outlier_cloud;
-
-  PointCloudPtr laser_cloud_in;
-  // PointCloudRPtr laser_cloud_in_ring;
-  PointCloudPtr laser_cloud_in_ring;
+  std::shared_ptr<cyber::Writer<cloud_msgs::PackedCloud>> pub_outlier_cloud;
+  std::shared_ptr<cyber::Writer<cloud_msgs::FrameTelemetry>> pub_telemetry;
 
   PointCloudPtr full_cloud;
   PointCloudPtr full_info_cloud;
@@ -88,18 +122,25 @@ class ImageProjection final : public cyber::Component<> {
   PointCloudPtr segmented_cloud;
   PointCloudPtr segmented_cloud_pure;
   PointCloudPtr outlier_cloud;
+  bool full_cloud_filled = false;
 
-  cv::Mat range_mat;
-  cv::Mat label_mat;
-  cv::Mat ground_mat;
+  RangeImage range_image;
+  ComponentLabeler component_labeler;
 
-  int label_count;
+  SensorProfile sensor_profile;
+  lib::ProjectionTable projection_table;
 
   cloud_msgs::CloudInfo seg_msg;
+  cloud_msgs::FrameTelemetry telemetry;
+  // sequence_num of the last cloud, to count the dropped ones
+  uint32_t last_sequence_num = 0;
+  bool has_sequence_num = false;
+  // reused for every published cloud, keeps its points allocated
+  apollo::drivers::PointCloud laser_cloud_temp;
   apollo::common::Header cloud_header;
 
-  std::stack<std::pair<int, int>> st;
-  std::vector<std::pair<int, int>> cluster;
+  FrameCallback frame_callback;
+  bool offline = false;
 };
 
 CYBER_REGISTER_COMPONENT(ImageProjection)
@@ -0,0 +1,265 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-7-18
+//  Author: daohu527
+
+
+#include "modules/tools/ilego_loam/src/keyframe_store.h"
+
+#include <cstdio>
+#include <vector>
+
+#include "cyber/cyber.h"
+
+#include "modules/tools/ilego_loam/src/lib/quantized_cloud.h"
+
+namespace apollo {
+namespace tools {
+
+namespace {
+
+// Smaller pose changes do not move a point 100m away by more than 1mm
+constexpr float kTranslationTolerance = 1e-4;
+constexpr float kRotationTolerance = 1e-5;
+
+CloudConstPtr TransformCloud(const pcl::PointCloud<PointType>& body,
+                             const Eigen::Affine3f& pose) {
+  auto world = std::make_shared<pcl::PointCloud<PointType>>();
+  world->points.resize(body.points.size());
+  for (size_t i = 0; i < body.points.size(); ++i) {
+    PointType& point = world->points[i];
+    point = body.points[i];
+    point.getVector3fMap() = pose * body.points[i].getVector3fMap();
+  }
+  world->width = body.width;
+  world->height = body.height;
+  world->is_dense = body.is_dense;
+  return world;
+}
+
+size_t CloudMemory(const CloudConstPtr& cloud) {
+  return cloud ? cloud->points.capacity() * sizeof(PointType) : 0;
+}
+
+}  // namespace
+
+KeyframeStore::~KeyframeStore() {
+  if (spill_.is_open()) {
+    spill_.close();
+    std::remove(spill_file_.c_str());
+  }
+}
+
+bool KeyframeStore::Init(size_t memory_limit, const std::string& spill_file) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  memory_limit_ = 0;
+  if (memory_limit == 0)
+    return true;
+
+  spill_.open(spill_file, std::ios::in | std::ios::out | std::ios::binary |
+                              std::ios::trunc);
+  if (!spill_.is_open()) {
+    AERROR << "Can not create key frame spill file " << spill_file
+           << ", key frames are kept in memory";
+    return false;
+  }
+  spill_file_ = spill_file;
+  spill_size_ = 0;
+  memory_limit_ = memory_limit;
+  AINFO << "Key frames over " << (memory_limit >> 20) << "MB are spilled to "
+        << spill_file;
+  return true;
+}
+
+int KeyframeStore::Add(CloudConstPtr corner, CloudConstPtr surf,
+                       CloudConstPtr outlier, const Eigen::Affine3f& pose) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const int id = static_cast<int>(entries_.size());
+  entries_.emplace_back();
+  Entry& entry = entries_.back();
+  entry.pose = pose;
+  entry.body[CORNER] = std::move(corner);
+  entry.body[SURF] = std::move(surf);
+  entry.body[OUTLIER] = std::move(outlier);
+  for (const CloudConstPtr& cloud : entry.body)
+    entry.memory += CloudMemory(cloud);
+  memory_ += entry.memory;
+  entry.lru = lru_.insert(lru_.begin(), id);
+  Shrink();
+  return id;
+}
+
+size_t KeyframeStore::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+size_t KeyframeStore::memory() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return memory_;
+}
+
+KeyframeStore::Entry& KeyframeStore::Get(int id) {
+  CHECK(id >= 0 && id < static_cast<int>(entries_.size()))
+      << "unknown key frame " << id;
+  return entries_[id];
+}
+
+const KeyframeStore::Entry& KeyframeStore::Get(int id) const {
+  CHECK(id >= 0 && id < static_cast<int>(entries_.size()))
+      << "unknown key frame " << id;
+  return entries_[id];
+}
+
+CloudConstPtr KeyframeStore::Body(int id, CloudType type) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Entry& entry = Get(id);
+  if (!Touch(id, &entry))
+    return std::make_shared<pcl::PointCloud<PointType>>();
+  return entry.body[type];
+}
+
+CloudConstPtr KeyframeStore::World(int id, CloudType type) {
+  // Transformed under the lock, so a cloud is transformed once even if two
+  // threads ask for it at the same time
+  std::lock_guard<std::mutex> lock(mutex_);
+  Entry& entry = Get(id);
+  if (!Touch(id, &entry))
+    return std::make_shared<pcl::PointCloud<PointType>>();
+  if (!entry.world[type]) {
+    entry.world[type] = TransformCloud(*entry.body[type], entry.pose);
+    const size_t memory = CloudMemory(entry.world[type]);
+    entry.memory += memory;
+    memory_ += memory;
+    Shrink();
+  }
+  return entry.world[type];
+}
+
+Eigen::Affine3f KeyframeStore::Pose(int id) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return Get(id).pose;
+}
+
+bool KeyframeStore::SetPose(int id, const Eigen::Affine3f& pose) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Entry& entry = Get(id);
+  const Eigen::Affine3f delta = entry.pose.inverse() * pose;
+  const float angle = Eigen::AngleAxisf(delta.linear()).angle();
+  if (delta.translation().norm() <= kTranslationTolerance &&
+      angle <= kRotationTolerance)
+    return false;
+
+  entry.pose = pose;
+  for (CloudConstPtr& world : entry.world) {
+    const size_t memory = CloudMemory(world);
+    entry.memory -= memory;
+    memory_ -= memory;
+    world.reset();
+  }
+  return true;
+}
+
+bool KeyframeStore::Touch(int id, Entry* entry) {
+  if (entry->resident) {
+    lru_.splice(lru_.begin(), lru_, entry->lru);
+    return true;
+  }
+  if (!Load(entry))
+    return false;
+  entry->lru = lru_.insert(lru_.begin(), id);
+  Shrink();
+  return true;
+}
+
+bool KeyframeStore::Load(Entry* entry) {
+  uint32_t total = 0;
+  for (uint32_t length : entry->length)
+    total += length;
+  std::vector<char> data(total);
+  spill_.seekg(entry->offset);
+  spill_.read(data.data(), total);
+  if (!spill_) {
+    spill_.clear();
+    AERROR << "Failed to read key frame at " << entry->offset << " of "
+           << spill_file_;
+    return false;
+  }
+
+  const char* p = data.data();
+  for (int type = 0; type < CLOUD_TYPE_NUM; ++type) {
+    auto cloud = std::make_shared<pcl::PointCloud<PointType>>();
+    if (!lib::DecodeCloud(p, entry->length[type], cloud.get())) {
+      AERROR << "Malformed key frame at " << entry->offset << " of "
+             << spill_file_;
+      return false;
+    }
+    p += entry->length[type];
+    entry->body[type] = std::move(cloud);
+  }
+
+  entry->memory = 0;
+  for (const CloudConstPtr& cloud : entry->body)
+    entry->memory += CloudMemory(cloud);
+  memory_ += entry->memory;
+  entry->resident = true;
+  return true;
+}
+
+bool KeyframeStore::Spill(Entry* entry) {
+  if (entry->offset < 0) {
+    std::string data[CLOUD_TYPE_NUM];
+    for (int type = 0; type < CLOUD_TYPE_NUM; ++type) {
+      lib::EncodeCloud(*entry->body[type], &data[type]);
+      entry->length[type] = static_cast<uint32_t>(data[type].size());
+    }
+    spill_.seekp(spill_size_);
+    for (const std::string& d : data)
+      spill_.write(d.data(), d.size());
+    spill_.flush();
+    if (!spill_) {
+      spill_.clear();
+      AERROR << "Failed to write " << spill_file_
+             << ", key frames are kept in memory from now on";
+      return false;
+    }
+    entry->offset = spill_size_;
+    for (uint32_t length : entry->length)
+      spill_size_ += length;
+  }
+
+  for (CloudConstPtr& cloud : entry->body)
+    cloud.reset();
+  for (CloudConstPtr& cloud : entry->world)
+    cloud.reset();
+  memory_ -= entry->memory;
+  entry->memory = 0;
+  entry->resident = false;
+  return true;
+}
+
+void KeyframeStore::Shrink() {
+  while (memory_limit_ > 0 && memory_ > memory_limit_ && lru_.size() > 1) {
+    Entry& entry = entries_[lru_.back()];
+    if (!Spill(&entry)) {
+      memory_limit_ = 0;
+      return;
+    }
+    lru_.pop_back();
+  }
+}
+
+}  // namespace tools
+}  // namespace apollo
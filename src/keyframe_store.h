@@ -0,0 +1,130 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-7-18
+//  Author: daohu527
+
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "Eigen/Geometry"
+
+#include "modules/tools/ilego_loam/src/utility.h"
+
+namespace apollo {
+namespace tools {
+
+using CloudConstPtr = std::shared_ptr<const pcl::PointCloud<PointType>>;
+
+// The key frame clouds of the mapping, in the body frame, with a cache of
+// their world frame versions.
+//
+// A world cloud is transformed the first time it is asked for and then
+// shared by everyone, the submap extraction, the loop closure and the
+// global map, until the pose of the key frame really changes. The clouds
+// are immutable, a reader keeps its shared_ptr while the cache moves on.
+//
+// With a memory limit the clouds of the least recently used key frames are
+// spilled to a file, quantized (see quantized_cloud.h), and read back when
+// they are asked for again, e.g. by a loop closure in an old region. The
+// limit counts the clouds held by the store, clouds still referenced by a
+// reader are only freed when it lets them go. Thread safe.
+class KeyframeStore {
+ public:
+  enum CloudType {
+    CORNER = 0,
+    SURF,
+    OUTLIER,
+    CLOUD_TYPE_NUM,
+  };
+
+  KeyframeStore() = default;
+  ~KeyframeStore();
+
+  KeyframeStore(const KeyframeStore&) = delete;
+  KeyframeStore& operator=(const KeyframeStore&) = delete;
+
+  // memory_limit is in bytes, 0 means everything stays in memory. Returns
+  // false if the spill file can not be created, the store then keeps
+  // everything in memory.
+  bool Init(size_t memory_limit, const std::string& spill_file);
+
+  // Returns the id of the key frame, ids are given in order from 0
+  int Add(CloudConstPtr corner, CloudConstPtr surf, CloudConstPtr outlier,
+          const Eigen::Affine3f& pose);
+
+  size_t size() const;
+  // Bytes of the clouds in memory
+  size_t memory() const;
+
+  CloudConstPtr Body(int id, CloudType type);
+  CloudConstPtr World(int id, CloudType type);
+
+  Eigen::Affine3f Pose(int id) const;
+
+  // Moves a key frame, e.g. after a loop closure. A pose within the
+  // tolerance of the old one is ignored and keeps the cached clouds.
+  // Returns true if the pose changed.
+  bool SetPose(int id, const Eigen::Affine3f& pose);
+
+ private:
+  struct Entry {
+    Eigen::Affine3f pose;
+    CloudConstPtr body[CLOUD_TYPE_NUM];
+    CloudConstPtr world[CLOUD_TYPE_NUM];
+    // bytes of body and world
+    size_t memory = 0;
+    bool resident = true;
+    std::list<int>::iterator lru;
+    // where the body clouds are in the spill file, offset -1 if they are
+    // not written yet. They never change, so they are written once.
+    int64_t offset = -1;
+    uint32_t length[CLOUD_TYPE_NUM] = {0, 0, 0};
+  };
+
+  Entry& Get(int id);
+  const Entry& Get(int id) const;
+
+  // Marks the key frame as the most recently used one, reading it back in
+  // first if it was spilled
+  bool Touch(int id, Entry* entry);
+  bool Load(Entry* entry);
+  bool Spill(Entry* entry);
+  // Spills the least recently used key frames until the memory is under
+  // the limit, the most recently used one always stays
+  void Shrink();
+
+  mutable std::mutex mutex_;
+  // a deque so the entries never move
+  std::deque<Entry> entries_;
+  // resident key frames, the most recently used first
+  std::list<int> lru_;
+  size_t memory_ = 0;
+  size_t memory_limit_ = 0;
+
+  std::string spill_file_;
+  std::fstream spill_;
+  int64_t spill_size_ = 0;
+};
+
+}  // namespace tools
+}  // namespace apollo
@@ -0,0 +1,190 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-7-25
+//  Author: daohu527
+
+#include "modules/tools/ilego_loam/src/keyframe_store.h"
+
+#include <cmath>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+
+#include "gtest/gtest.h"
+
+namespace apollo {
+namespace tools {
+
+constexpr int kPoints = 1000;
+// bytes of the three body clouds of a key frame
+constexpr size_t kFrameMemory = 3 * kPoints * sizeof(PointType);
+
+CloudConstPtr MakeCloud(unsigned seed) {
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> u(-50.0f, 50.0f);
+  auto cloud = std::make_shared<pcl::PointCloud<PointType>>();
+  cloud->points.reserve(kPoints);
+  for (int i = 0; i < kPoints; ++i) {
+    PointType point;
+    point.x = u(rng);
+    point.y = u(rng);
+    point.z = 0.1f * u(rng);
+    point.intensity = i % 16 + 0.05f;
+    cloud->push_back(point);
+  }
+  return cloud;
+}
+
+Eigen::Affine3f MakePose(float yaw, float x) {
+  Eigen::Affine3f pose = Eigen::Affine3f::Identity();
+  pose.rotate(Eigen::AngleAxisf(yaw, Eigen::Vector3f::UnitY()));
+  pose.translation() = Eigen::Vector3f(x, 0.0f, 1.0f);
+  return pose;
+}
+
+// Points within the quantization error of a cloud 100m across
+void ExpectNearCloud(const pcl::PointCloud<PointType>& expected,
+                     const pcl::PointCloud<PointType>& actual) {
+  ASSERT_EQ(expected.size(), actual.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    EXPECT_NEAR(expected.points[i].x, actual.points[i].x, 1e-3f);
+    EXPECT_NEAR(expected.points[i].y, actual.points[i].y, 1e-3f);
+    EXPECT_NEAR(expected.points[i].z, actual.points[i].z, 1e-3f);
+    EXPECT_EQ(expected.points[i].intensity, actual.points[i].intensity);
+  }
+}
+
+class KeyframeStoreTest : public ::testing::Test {
+ protected:
+  // Adds a key frame of clouds made from seed
+  int Add(KeyframeStore* store, unsigned seed, const Eigen::Affine3f& pose) {
+    return store->Add(MakeCloud(3 * seed), MakeCloud(3 * seed + 1),
+                      MakeCloud(3 * seed + 2), pose);
+  }
+
+  const std::string spill_file_ =
+      ::testing::TempDir() + "keyframe_store_test.spill";
+};
+
+TEST_F(KeyframeStoreTest, KeepsEverythingWithoutALimit) {
+  KeyframeStore store;
+  ASSERT_TRUE(store.Init(0, spill_file_));
+  for (unsigned i = 0; i < 5; ++i)
+    EXPECT_EQ(Add(&store, i, MakePose(0.0f, i)), static_cast<int>(i));
+  EXPECT_EQ(store.size(), 5u);
+  EXPECT_EQ(store.memory(), 5 * kFrameMemory);
+
+  // the clouds are shared, not copied
+  CloudConstPtr surf = store.Body(2, KeyframeStore::SURF);
+  EXPECT_EQ(surf, store.Body(2, KeyframeStore::SURF));
+  ExpectNearCloud(*MakeCloud(7), *surf);
+}
+
+TEST_F(KeyframeStoreTest, SpillsTheLeastRecentlyUsed) {
+  KeyframeStore store;
+  // room for two key frames
+  ASSERT_TRUE(store.Init(2 * kFrameMemory + kFrameMemory / 2, spill_file_));
+  Add(&store, 0, MakePose(0.0f, 0.0f));
+  Add(&store, 1, MakePose(0.0f, 1.0f));
+  CloudConstPtr resident = store.Body(0, KeyframeStore::CORNER);
+  // 0 was used last, so 1 goes
+  Add(&store, 2, MakePose(0.0f, 2.0f));
+  EXPECT_LE(store.memory(), 2 * kFrameMemory + kFrameMemory / 2);
+  EXPECT_EQ(resident, store.Body(0, KeyframeStore::CORNER));
+
+  // read back from the spill file, quantized
+  CloudConstPtr reloaded = store.Body(1, KeyframeStore::OUTLIER);
+  EXPECT_NE(reloaded, nullptr);
+  ExpectNearCloud(*MakeCloud(5), *reloaded);
+  EXPECT_LE(store.memory(), 2 * kFrameMemory + kFrameMemory / 2);
+  // which spilled 2, the least recently used then
+  EXPECT_EQ(resident, store.Body(0, KeyframeStore::CORNER));
+  for (unsigned i = 0; i < 3; ++i) {
+    ExpectNearCloud(*MakeCloud(3 * i),
+                    *store.Body(i, KeyframeStore::CORNER));
+  }
+  EXPECT_EQ(store.size(), 3u);
+}
+
+TEST_F(KeyframeStoreTest, KeepsTheNewestOverTheLimit) {
+  KeyframeStore store;
+  ASSERT_TRUE(store.Init(kFrameMemory / 2, spill_file_));
+  Add(&store, 0, MakePose(0.0f, 0.0f));
+  EXPECT_EQ(store.memory(), kFrameMemory);
+  Add(&store, 1, MakePose(0.0f, 1.0f));
+  EXPECT_EQ(store.memory(), kFrameMemory);
+  ExpectNearCloud(*MakeCloud(0), *store.Body(0, KeyframeStore::CORNER));
+}
+
+TEST_F(KeyframeStoreTest, FailedLoadGivesAnEmptyCloud) {
+  KeyframeStore store;
+  ASSERT_TRUE(store.Init(kFrameMemory, spill_file_));
+  Add(&store, 0, MakePose(0.0f, 0.0f));
+  Add(&store, 1, MakePose(0.0f, 1.0f));
+  // key frame 0 is in the file only, which is cut off
+  std::ofstream(spill_file_, std::ios::binary | std::ios::trunc).close();
+  CloudConstPtr cloud = store.Body(0, KeyframeStore::SURF);
+  ASSERT_NE(cloud, nullptr);
+  EXPECT_TRUE(cloud->empty());
+  EXPECT_TRUE(store.World(0, KeyframeStore::SURF)->empty());
+  // the resident key frame is still there
+  ExpectNearCloud(*MakeCloud(4), *store.Body(1, KeyframeStore::SURF));
+}
+
+TEST_F(KeyframeStoreTest, NoSpillFileKeepsEverything) {
+  KeyframeStore store;
+  EXPECT_FALSE(store.Init(kFrameMemory, "/nonexistent/dir/spill"));
+  for (unsigned i = 0; i < 3; ++i)
+    Add(&store, i, MakePose(0.0f, i));
+  EXPECT_EQ(store.memory(), 3 * kFrameMemory);
+}
+
+TEST_F(KeyframeStoreTest, SetPoseInvalidatesTheWorldClouds) {
+  KeyframeStore store;
+  ASSERT_TRUE(store.Init(0, spill_file_));
+  const Eigen::Affine3f pose = MakePose(0.3f, 4.0f);
+  Add(&store, 0, pose);
+  CloudConstPtr body = store.Body(0, KeyframeStore::CORNER);
+  CloudConstPtr world = store.World(0, KeyframeStore::CORNER);
+  EXPECT_EQ(world, store.World(0, KeyframeStore::CORNER));
+  ASSERT_EQ(world->size(), body->size());
+  for (size_t i = 0; i < body->size(); ++i) {
+    const Eigen::Vector3f expected = pose * body->points[i].getVector3fMap();
+    EXPECT_TRUE(world->points[i].getVector3fMap().isApprox(expected, 1e-5f));
+  }
+  EXPECT_EQ(store.memory(), kFrameMemory + kPoints * sizeof(PointType));
+
+  // within the tolerance the cache stays
+  Eigen::Affine3f nudged = pose;
+  nudged.translation().x() += 1e-5f;
+  EXPECT_FALSE(store.SetPose(0, nudged));
+  EXPECT_EQ(world, store.World(0, KeyframeStore::CORNER));
+
+  // a loop closure moves it, the reader keeps the old cloud
+  const Eigen::Affine3f moved = MakePose(0.35f, 4.5f);
+  EXPECT_TRUE(store.SetPose(0, moved));
+  EXPECT_EQ(store.memory(), kFrameMemory);
+  EXPECT_TRUE(store.Pose(0).isApprox(moved));
+  CloudConstPtr moved_world = store.World(0, KeyframeStore::CORNER);
+  EXPECT_NE(world, moved_world);
+  const Eigen::Vector3f expected = moved * body->points[0].getVector3fMap();
+  EXPECT_TRUE(moved_world->points[0].getVector3fMap().isApprox(expected, 1e-5f));
+  EXPECT_TRUE(world->points[0].getVector3fMap().isApprox(
+      pose * body->points[0].getVector3fMap(), 1e-5f));
+}
+
+}  // namespace tools
+}  // namespace apollo
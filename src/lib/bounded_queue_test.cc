@@ -0,0 +1,109 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "modules/tools/ilego_loam/src/lib/bounded_queue.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+namespace apollo {
+namespace lib {
+
+TEST(BoundedQueueTest, PushPopInOrder) {
+  BoundedQueue<int> queue(3);
+  EXPECT_EQ(queue.capacity(), 3u);
+  for (int i = 0; i < 3; ++i)
+    EXPECT_TRUE(queue.Push(i));
+  EXPECT_EQ(queue.size(), 3u);
+
+  int value = -1;
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_TRUE(queue.Pop(&value));
+    EXPECT_EQ(value, i);
+  }
+  EXPECT_EQ(queue.size(), 0u);
+}
+
+TEST(BoundedQueueTest, PushBlocksWhileFull) {
+  BoundedQueue<int> queue(1);
+  EXPECT_TRUE(queue.Push(0));
+
+  std::atomic<bool> pushed(false);
+  std::thread producer([&] {
+    queue.Push(1);
+    pushed = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_FALSE(pushed);
+
+  int value = -1;
+  EXPECT_TRUE(queue.Pop(&value));
+  EXPECT_EQ(value, 0);
+  producer.join();
+  EXPECT_TRUE(pushed);
+  EXPECT_TRUE(queue.Pop(&value));
+  EXPECT_EQ(value, 1);
+}
+
+TEST(BoundedQueueTest, CloseDrainsAndWakes) {
+  BoundedQueue<int> queue(2);
+  queue.Push(7);
+
+  int value = -1;
+  std::thread consumer([&] {
+    int v;
+    while (queue.Pop(&v))
+      value = v;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  queue.Close();
+  consumer.join();
+  EXPECT_EQ(value, 7);
+  EXPECT_FALSE(queue.Push(8));
+  EXPECT_FALSE(queue.Pop(&value));
+}
+
+TEST(BoundedQueueTest, PipelineKeepsOrder) {
+  constexpr int kCount = 10000;
+  BoundedQueue<int> first(2);
+  BoundedQueue<int> second(2);
+
+  std::thread stage([&] {
+    int v;
+    while (first.Pop(&v))
+      second.Push(v * 2);
+    second.Close();
+  });
+  std::thread producer([&] {
+    for (int i = 0; i < kCount; ++i)
+      first.Push(i);
+    first.Close();
+  });
+
+  int expect = 0;
+  int v;
+  while (second.Pop(&v)) {
+    ASSERT_EQ(v, expect * 2);
+    ++expect;
+  }
+  EXPECT_EQ(expect, kCount);
+  producer.join();
+  stage.join();
+}
+
+}  // namespace lib
+}  // namespace apollo
@@ -12,67 +12,213 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
 #include <iterator>
+#include <type_traits>
 
 namespace apollo {
 namespace lib {
 
+// A fixed size single producer single consumer ring, lock free.
+//
+// The producer thread only calls push_back, full and capacity. All the
+// other functions belong to the consumer thread, which owns the elements
+// in [begin(), end()) until it pops them. end() is a snapshot, elements
+// pushed after it was taken are seen by the next call.
 template<typename T, std::size_t SIZE = 100>
 class CircularBuffer {
- public:
-  CircularBuffer() : idx_(0), size_(0) {}
-  ~CircularBuffer() {}
+  static_assert(SIZE > 0, "CircularBuffer SIZE must be positive");
 
-  void push_back(const T& t);
-  void pop_back();
+  template <bool kConst>
+  class IteratorImpl;
 
-  std::size_t size() const;
+ public:
+  using value_type = T;
+  using size_type = std::size_t;
+  using iterator = IteratorImpl<false>;
+  using const_iterator = IteratorImpl<true>;
+
+  CircularBuffer() : head_(0), tail_(0) {}
+  ~CircularBuffer() {}
 
-  bool empty() const;
+  CircularBuffer(const CircularBuffer&) = delete;
+  CircularBuffer& operator=(const CircularBuffer&) = delete;
+
+  // Producer. Returns false and drops t if the buffer is full, never blocks.
+  bool push_back(const T& t) {
+    const std::size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) >= SIZE)
+      return false;
+    arr_[head % SIZE] = t;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool full() const { return size() >= SIZE; }
+  static constexpr std::size_t capacity() { return SIZE; }
+
+  // Consumer.
+  void pop_front() {
+    const std::size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail != head_.load(std::memory_order_acquire))
+      tail_.store(tail + 1, std::memory_order_release);
+  }
+
+  // Pops elements until "first" is the front, first must be in
+  // [begin(), end()].
+  void pop_front(const_iterator first) {
+    tail_.store(first.pos_, std::memory_order_release);
+  }
+
+  T& front() { return arr_[tail_.load(std::memory_order_relaxed) % SIZE]; }
+  const T& front() const {
+    return arr_[tail_.load(std::memory_order_relaxed) % SIZE];
+  }
+  T& back() { return arr_[(head_.load(std::memory_order_acquire) - 1) % SIZE]; }
+  const T& back() const {
+    return arr_[(head_.load(std::memory_order_acquire) - 1) % SIZE];
+  }
+
+  T& operator[](std::size_t i) { return *(begin() + i); }
+  const T& operator[](std::size_t i) const { return *(begin() + i); }
+
+  std::size_t size() const {
+    return head_.load(std::memory_order_acquire) -
+        tail_.load(std::memory_order_acquire);
+  }
+
+  bool empty() const { return size() == 0; }
+
+  iterator begin() { return iterator(this, tail_.load(std::memory_order_relaxed)); }
+  iterator end() { return iterator(this, head_.load(std::memory_order_acquire)); }
+  const_iterator begin() const {
+    return const_iterator(this, tail_.load(std::memory_order_relaxed));
+  }
+  const_iterator end() const {
+    return const_iterator(this, head_.load(std::memory_order_acquire));
+  }
+
+  // First element whose key(element) is not less than value, or end(). The
+  // keys must be sorted, e.g. timestamps in arrival order.
+  template <typename V, typename Key>
+  iterator lower_bound(const V& value, Key key) {
+    iterator first = begin();
+    std::ptrdiff_t count = end() - first;
+    while (count > 0) {
+      std::ptrdiff_t step = count / 2;
+      iterator it = first + step;
+      if (key(*it) < value) {
+        first = ++it;
+        count -= step + 1;
+      } else {
+        count = step;
+      }
+    }
+    return first;
+  }
 
-  Iterator begin() {}
-  Iterator end() {}
+ private:
+  template <bool kConst>
+  class IteratorImpl {
+    using Buffer = typename std::conditional<kConst, const CircularBuffer,
+                                             CircularBuffer>::type;
 
-  struct Iterator {
    public:
     using value_type = T;
     using difference_type = std::ptrdiff_t;
-    using pointer = T*;
-    using reference = T&;
-    using iterator_category = std::forward_iterator_tag;
-
-    Iterator() : m_ptr_(nullptr) {}
-    Iterator(pointer ptr) : m_ptr_(ptr) {}
+    using pointer = typename std::conditional<kConst, const T*, T*>::type;
+    using reference = typename std::conditional<kConst, const T&, T&>::type;
+    using iterator_category = std::random_access_iterator_tag;
+
+    IteratorImpl() : buffer_(nullptr), pos_(0) {}
+    IteratorImpl(Buffer* buffer, std::size_t pos) : buffer_(buffer), pos_(pos) {}
+    // iterator converts to const_iterator
+    operator IteratorImpl<true>() const {
+      return IteratorImpl<true>(buffer_, pos_);
+    }
 
-    reference operator*() const { return *m_ptr_; }
-    pointer operator->() const { return m_ptr_; }
+    reference operator*() const { return buffer_->arr_[pos_ % SIZE]; }
+    pointer operator->() const { return &buffer_->arr_[pos_ % SIZE]; }
+    reference operator[](difference_type n) const { return *(*this + n); }
 
-    Iterator& operator++() {
-      ++m_ptr_;
+    IteratorImpl& operator++() {
+      ++pos_;
       return *this;
     }
-
-    Iterator& operator--() {
-      --m_ptr;
+    IteratorImpl operator++(int) {
+      IteratorImpl it = *this;
+      ++pos_;
+      return it;
+    }
+    IteratorImpl& operator--() {
+      --pos_;
       return *this;
     }
+    IteratorImpl operator--(int) {
+      IteratorImpl it = *this;
+      --pos_;
+      return it;
+    }
 
-    friend bool operator==(const Iterator& lhs, const Iterator& rhs) {
-      return lhs.m_ptr_ == rhs.m_ptr_;
+    IteratorImpl& operator+=(difference_type n) {
+      pos_ += n;
+      return *this;
+    }
+    IteratorImpl& operator-=(difference_type n) {
+      pos_ -= n;
+      return *this;
+    }
+    friend IteratorImpl operator+(IteratorImpl it, difference_type n) {
+      return it += n;
+    }
+    friend IteratorImpl operator+(difference_type n, IteratorImpl it) {
+      return it += n;
+    }
+    friend IteratorImpl operator-(IteratorImpl it, difference_type n) {
+      return it -= n;
+    }
+    friend difference_type operator-(const IteratorImpl& lhs,
+                                     const IteratorImpl& rhs) {
+      return static_cast<difference_type>(lhs.pos_ - rhs.pos_);
     }
 
-    friend bool operator!=(const Iterator& lhs, const Iterator& rhs) {
-      return lhs.m_ptr_ != rhs.m_ptr_;
+    friend bool operator==(const IteratorImpl& lhs, const IteratorImpl& rhs) {
+      return lhs.pos_ == rhs.pos_;
+    }
+    friend bool operator!=(const IteratorImpl& lhs, const IteratorImpl& rhs) {
+      return lhs.pos_ != rhs.pos_;
+    }
+    friend bool operator<(const IteratorImpl& lhs, const IteratorImpl& rhs) {
+      return lhs - rhs < 0;
+    }
+    friend bool operator>(const IteratorImpl& lhs, const IteratorImpl& rhs) {
+      return rhs < lhs;
+    }
+    friend bool operator<=(const IteratorImpl& lhs, const IteratorImpl& rhs) {
+      return !(rhs < lhs);
+    }
+    friend bool operator>=(const IteratorImpl& lhs, const IteratorImpl& rhs) {
+      return !(lhs < rhs);
     }
-  };
 
- private:
-  std::size_t idx_;
-  std::size_t size_;
-  T arr[SIZE];
-};
+   private:
+    friend class CircularBuffer;
 
+    Buffer* buffer_;
+    // position since the buffer was created, the slot is pos_ % SIZE
+    std::size_t pos_;
+  };
 
+  // head_ is written by the producer and tail_ by the consumer, keep them
+  // on separate cache lines
+  alignas(64) std::atomic<std::size_t> head_;
+  alignas(64) std::atomic<std::size_t> tail_;
+  std::array<T, SIZE> arr_;
+};
 
 }  // namespace lib
 }  // namespace apollo
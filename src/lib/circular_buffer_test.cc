@@ -0,0 +1,133 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "modules/tools/ilego_loam/src/lib/circular_buffer.h"
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace apollo {
+namespace lib {
+
+struct Stamped {
+  double timestamp;
+  int value;
+};
+
+TEST(CircularBufferTest, PushPop) {
+  CircularBuffer<int, 4> buffer;
+  EXPECT_TRUE(buffer.empty());
+  EXPECT_EQ(buffer.capacity(), 4u);
+
+  for (int i = 0; i < 4; ++i)
+    EXPECT_TRUE(buffer.push_back(i));
+  EXPECT_TRUE(buffer.full());
+  EXPECT_FALSE(buffer.push_back(4));
+  EXPECT_EQ(buffer.size(), 4u);
+  EXPECT_EQ(buffer.front(), 0);
+  EXPECT_EQ(buffer.back(), 3);
+
+  buffer.pop_front();
+  EXPECT_EQ(buffer.front(), 1);
+  EXPECT_TRUE(buffer.push_back(4));
+  EXPECT_EQ(buffer.back(), 4);
+  EXPECT_EQ(buffer[3], 4);
+
+  while (!buffer.empty())
+    buffer.pop_front();
+  // pop on empty buffer is a no-op
+  buffer.pop_front();
+  EXPECT_EQ(buffer.size(), 0u);
+}
+
+TEST(CircularBufferTest, IterateAcrossWrap) {
+  CircularBuffer<int, 5> buffer;
+  for (int round = 0; round < 3; ++round) {
+    for (int i = 0; i < 3; ++i)
+      buffer.push_back(round * 3 + i);
+    std::vector<int> values(buffer.begin(), buffer.end());
+    std::vector<int> expect = {round * 3, round * 3 + 1, round * 3 + 2};
+    EXPECT_EQ(values, expect);
+    EXPECT_EQ(std::distance(buffer.begin(), buffer.end()), 3);
+    for (int i = 0; i < 3; ++i)
+      buffer.pop_front();
+  }
+
+  buffer.push_back(1);
+  buffer.push_back(2);
+  for (auto& value : buffer)
+    value *= 10;
+  const auto& const_buffer = buffer;
+  auto it = const_buffer.end();
+  EXPECT_EQ(*--it, 20);
+  EXPECT_EQ(*--it, 10);
+  EXPECT_TRUE(it == const_buffer.begin());
+}
+
+TEST(CircularBufferTest, LowerBoundByTimestamp) {
+  CircularBuffer<Stamped, 8> buffer;
+  // wrap the storage before searching
+  for (int i = 0; i < 6; ++i)
+    buffer.push_back({0.0, -1});
+  for (int i = 0; i < 6; ++i)
+    buffer.pop_front();
+  for (int i = 0; i < 8; ++i)
+    buffer.push_back({1.0 + 0.1 * i, i});
+
+  auto key = [](const Stamped& s) { return s.timestamp; };
+  EXPECT_TRUE(buffer.lower_bound(0.5, key) == buffer.begin());
+  EXPECT_EQ(buffer.lower_bound(1.25, key)->value, 3);
+  EXPECT_EQ(buffer.lower_bound(1.3, key)->value,
+            std::lower_bound(buffer.begin(), buffer.end(), 1.3,
+                [](const Stamped& s, double t) { return s.timestamp < t; })->value);
+  EXPECT_TRUE(buffer.lower_bound(2.0, key) == buffer.end());
+
+  buffer.pop_front(buffer.lower_bound(1.45, key));
+  EXPECT_EQ(buffer.front().value, 5);
+  EXPECT_EQ(buffer.size(), 3u);
+}
+
+TEST(CircularBufferTest, SingleProducerSingleConsumer) {
+  constexpr int kCount = 200000;
+  CircularBuffer<int, 64> buffer;
+
+  std::thread producer([&] {
+    for (int i = 0; i < kCount; ++i) {
+      while (!buffer.push_back(i))
+        std::this_thread::yield();
+    }
+  });
+
+  int expect = 0;
+  while (expect < kCount) {
+    if (buffer.empty()) {
+      std::this_thread::yield();
+      continue;
+    }
+    auto last = buffer.end();
+    for (auto it = buffer.begin(); it != last; ++it) {
+      ASSERT_EQ(*it, expect);
+      ++expect;
+    }
+    buffer.pop_front(last);
+  }
+  producer.join();
+  EXPECT_TRUE(buffer.empty());
+}
+
+}  // namespace lib
+}  // namespace apollo
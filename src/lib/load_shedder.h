@@ -0,0 +1,79 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include <algorithm>
+
+namespace apollo {
+namespace lib {
+
+// Load level of a stage that has a fixed time budget per input, e.g. the
+// period of the lidar. Level 0 does the full work, every level above it
+// does less, the stage decides what to leave out.
+//
+// The level steps up while the smoothed processing time is over
+// kStepUpLoad of the budget and back down once it is under kStepDownLoad.
+// A level is held for kHoldInputs inputs, so a step has time to show in
+// the average before the next one, and the gap between the two loads
+// keeps a stage that just stepped up from stepping right back down. Not
+// thread safe.
+class LoadShedder {
+ public:
+  static constexpr double kStepUpLoad = 0.9;
+  static constexpr double kStepDownLoad = 0.5;
+  static constexpr int kHoldInputs = 10;
+
+  // budget in seconds per input, levels from 0 to max_level
+  LoadShedder(double budget, int max_level)
+      : budget_(budget), max_level_(std::max(0, max_level)) {}
+
+  // Adds the processing time of one input in seconds, returns the level
+  // for the next one
+  int Update(double duration) {
+    average_ = has_average_ ? average_ + kSmoothing * (duration - average_) :
+        duration;
+    has_average_ = true;
+    if (++held_ < kHoldInputs)
+      return level_;
+
+    if (average_ > kStepUpLoad * budget_ && level_ < max_level_) {
+      ++level_;
+      held_ = 0;
+    } else if (average_ < kStepDownLoad * budget_ && level_ > 0) {
+      --level_;
+      held_ = 0;
+    }
+    return level_;
+  }
+
+  int level() const { return level_; }
+  // smoothed processing time in seconds
+  double average() const { return average_; }
+
+ private:
+  static constexpr double kSmoothing = 0.1;
+
+  double budget_;
+  int max_level_;
+  int level_ = 0;
+  double average_ = 0.0;
+  bool has_average_ = false;
+  // inputs since the last step
+  int held_ = 0;
+};
+
+}  // namespace lib
+}  // namespace apollo
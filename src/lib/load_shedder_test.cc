@@ -0,0 +1,63 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "modules/tools/ilego_loam/src/lib/load_shedder.h"
+
+#include "gtest/gtest.h"
+
+namespace apollo {
+namespace lib {
+
+// Feeds count inputs of duration, returns the last level
+int Feed(LoadShedder* shedder, double duration, int count) {
+  int level = shedder->level();
+  for (int i = 0; i < count; ++i)
+    level = shedder->Update(duration);
+  return level;
+}
+
+TEST(LoadShedderTest, StepsUpUnderOverload) {
+  LoadShedder shedder(0.1, 2);
+  EXPECT_EQ(Feed(&shedder, 0.08, 50), 0);
+  // the average crosses 0.09 on the second input
+  EXPECT_EQ(Feed(&shedder, 0.15, 1), 0);
+  EXPECT_EQ(Feed(&shedder, 0.15, 1), 1);
+  // then the level is held
+  EXPECT_EQ(Feed(&shedder, 0.15, LoadShedder::kHoldInputs - 1), 1);
+  EXPECT_EQ(Feed(&shedder, 0.15, 1), 2);
+  // never over max_level
+  EXPECT_EQ(Feed(&shedder, 0.5, 100), 2);
+  EXPECT_NEAR(shedder.average(), 0.5, 1e-3);
+}
+
+TEST(LoadShedderTest, StepsDownWithRoom) {
+  LoadShedder shedder(0.1, 2);
+  Feed(&shedder, 0.2, 3 * LoadShedder::kHoldInputs);
+  ASSERT_EQ(shedder.level(), 2);
+  // between the two loads the level stays
+  EXPECT_EQ(Feed(&shedder, 0.07, 100), 2);
+  EXPECT_EQ(Feed(&shedder, 0.03, 3 * LoadShedder::kHoldInputs), 0);
+}
+
+TEST(LoadShedderTest, IgnoresSpikes) {
+  LoadShedder shedder(0.1, 1);
+  for (int i = 0; i < 100; ++i) {
+    shedder.Update(i % 20 == 10 ? 0.2 : 0.05);
+    EXPECT_EQ(shedder.level(), 0);
+  }
+}
+
+}  // namespace lib
+}  // namespace apollo
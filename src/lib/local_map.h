@@ -0,0 +1,204 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "modules/tools/ilego_loam/src/lib/voxel_hash_map.h"
+#include "modules/tools/ilego_loam/src/lib/voxel_key.h"
+
+namespace apollo {
+namespace lib {
+
+// Voxel downsampled union of a set of frames, with frames added and removed
+// by id.
+//
+// The map is the same as a VoxelFilter over all the frames, the centroid
+// of every leaf voxel. Each voxel keeps its sums, and each frame the part
+// it added to every voxel, so removing a frame only subtracts its own part
+// and nothing is downsampled again. The centroids are kept in a search
+// index which is updated for the voxels that changed. The cost of Add and
+// Remove is the size of the frame, not of the map.
+//
+// The frame clouds must already be in the map frame. Not thread safe, the
+// index may be searched concurrently between updates.
+template <typename PointT>
+class LocalMap {
+ public:
+  // index_resolution 0 keeps no index, for a map that is never searched
+  LocalMap(float leaf_size, float index_resolution)
+      : inverse_leaf_(1.0f / leaf_size),
+        indexed_(index_resolution > 0.0f),
+        index_(indexed_ ? index_resolution : 1.0f) {}
+
+  // CloudT is pcl::PointCloud<PointT> or any type with points. A frame
+  // already in the map is replaced.
+  template <typename CloudT>
+  void Add(int id, const CloudT& cloud) {
+    const CloudT* clouds[] = {&cloud};
+    Add(id, std::begin(clouds), std::end(clouds));
+  }
+
+  // A frame made of several clouds, e.g. surf and outlier points
+  template <typename CloudT>
+  void Add(int id, std::initializer_list<const CloudT*> clouds) {
+    Add(id, clouds.begin(), clouds.end());
+  }
+
+  // [first, last) dereference to pointers of clouds
+  template <typename InputIt>
+  void Add(int id, InputIt first, InputIt last) {
+    Remove(id);
+
+    // Sum the frame per voxel first, then touch every voxel once
+    std::vector<Contribution>& parts = frames_[id];
+    slot_of_.clear();
+    for (InputIt cloud = first; cloud != last; ++cloud) {
+      for (const PointT& point : (**cloud).points) {
+        if (!std::isfinite(point.x) || !std::isfinite(point.y) ||
+            !std::isfinite(point.z))
+          continue;
+        const VoxelKey key = ToVoxelKey(point.x, point.y, point.z,
+                                        inverse_leaf_, inverse_leaf_,
+                                        inverse_leaf_);
+        auto it = slot_of_.emplace(key, parts.size()).first;
+        if (it->second == parts.size())
+          parts.push_back(Contribution{key, 0.0, 0.0, 0.0, 0.0, 0});
+        Contribution& part = parts[it->second];
+        part.x += point.x;
+        part.y += point.y;
+        part.z += point.z;
+        part.intensity += point.intensity;
+        ++part.count;
+      }
+    }
+
+    for (const Contribution& part : parts)
+      Update(part, 1);
+  }
+
+  // Returns false if the frame is not in the map
+  bool Remove(int id) {
+    auto it = frames_.find(id);
+    if (it == frames_.end())
+      return false;
+    for (const Contribution& part : it->second)
+      Update(part, -1);
+    frames_.erase(it);
+    return true;
+  }
+
+  void Clear() {
+    frames_.clear();
+    voxels_.clear();
+    index_.Clear();
+  }
+
+  bool Contains(int id) const { return frames_.count(id) > 0; }
+  size_t frame_size() const { return frames_.size(); }
+
+  // Number of downsampled points
+  size_t size() const { return voxels_.size(); }
+
+  // The downsampled points
+  const VoxelHashMap<PointT>& index() const { return index_; }
+
+  template <typename CloudT>
+  void ToCloud(CloudT* cloud) const {
+    cloud->points.clear();
+    AppendTo(cloud);
+  }
+
+  // Adds the downsampled points to the ones already in cloud
+  template <typename CloudT>
+  void AppendTo(CloudT* cloud) const {
+    cloud->points.reserve(cloud->points.size() + voxels_.size());
+    for (const auto& voxel : voxels_)
+      cloud->points.push_back(voxel.second.centroid);
+    cloud->width = static_cast<uint32_t>(cloud->points.size());
+    cloud->height = 1;
+    cloud->is_dense = true;
+  }
+
+ private:
+  // Sums of the points of a frame in one voxel
+  struct Contribution {
+    VoxelKey key;
+    double x;
+    double y;
+    double z;
+    double intensity;
+    int count;
+  };
+
+  struct Voxel {
+    double x = 0.0;
+    double y = 0.0;
+    double z = 0.0;
+    double intensity = 0.0;
+    int count = 0;
+    // the indexed point
+    PointT centroid;
+  };
+
+  // Adds (sign 1) or subtracts (sign -1) a frame part, and moves the
+  // centroid of the voxel in the index
+  void Update(const Contribution& part, int sign) {
+    auto it = voxels_.find(part.key);
+    if (it == voxels_.end())
+      it = voxels_.emplace(part.key, Voxel()).first;
+    Voxel& voxel = it->second;
+    if (indexed_ && voxel.count > 0)
+      index_.Erase(voxel.centroid);
+
+    voxel.count += sign * part.count;
+    if (voxel.count <= 0) {
+      voxels_.erase(it);
+      return;
+    }
+    voxel.x += sign * part.x;
+    voxel.y += sign * part.y;
+    voxel.z += sign * part.z;
+    voxel.intensity += sign * part.intensity;
+
+    const double inverse_count = 1.0 / voxel.count;
+    voxel.centroid = PointT();
+    voxel.centroid.x = static_cast<float>(voxel.x * inverse_count);
+    voxel.centroid.y = static_cast<float>(voxel.y * inverse_count);
+    voxel.centroid.z = static_cast<float>(voxel.z * inverse_count);
+    voxel.centroid.intensity = static_cast<float>(voxel.intensity * inverse_count);
+    if (indexed_)
+      index_.Insert(voxel.centroid);
+  }
+
+  float inverse_leaf_;
+  bool indexed_;
+  std::unordered_map<VoxelKey, Voxel, VoxelKeyHash> voxels_;
+  std::unordered_map<int, std::vector<Contribution>> frames_;
+  VoxelHashMap<PointT> index_;
+
+  // scratch buffer of Add
+  std::unordered_map<VoxelKey, size_t, VoxelKeyHash> slot_of_;
+};
+
+}  // namespace lib
+}  // namespace apollo
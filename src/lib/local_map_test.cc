@@ -0,0 +1,141 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "modules/tools/ilego_loam/src/lib/local_map.h"
+
+#include <algorithm>
+#include <map>
+#include <random>
+#include <tuple>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "modules/tools/ilego_loam/src/lib/voxel_filter.h"
+
+namespace apollo {
+namespace lib {
+
+struct Point {
+  float x = 0;
+  float y = 0;
+  float z = 0;
+  float intensity = 0;
+};
+
+struct Cloud {
+  std::vector<Point> points;
+  uint32_t width = 0;
+  uint32_t height = 0;
+  bool is_dense = false;
+};
+
+void SortPoints(std::vector<Point>* points) {
+  std::sort(points->begin(), points->end(), [](const Point& a, const Point& b) {
+    return std::tie(a.x, a.y, a.z) < std::tie(b.x, b.y, b.z);
+  });
+}
+
+class LocalMapTest : public ::testing::Test {
+ protected:
+  Cloud MakeFrame(float offset) {
+    std::uniform_real_distribution<float> dist(-5, 5);
+    Cloud cloud;
+    for (int i = 0; i < 2000; ++i) {
+      cloud.points.push_back(
+          {dist(rng_) + offset, dist(rng_), dist(rng_) * 0.2f, dist(rng_)});
+    }
+    return cloud;
+  }
+
+  // The map must be the same as downsampling the frames from scratch
+  void ExpectMatchesFilter(const LocalMap<Point>& map,
+                           const std::map<int, Cloud>& frames) {
+    std::vector<const Cloud*> inputs;
+    for (const auto& frame : frames)
+      inputs.push_back(&frame.second);
+    Cloud expect;
+    VoxelFilter<Point> filter(0.5f, 0.5f, 0.5f);
+    filter.Filter(inputs.begin(), inputs.end(), &expect);
+
+    Cloud actual;
+    map.ToCloud(&actual);
+    ASSERT_EQ(actual.points.size(), expect.points.size());
+    EXPECT_EQ(map.size(), expect.points.size());
+    EXPECT_EQ(map.index().size(), expect.points.size());
+    SortPoints(&actual.points);
+    SortPoints(&expect.points);
+    for (size_t i = 0; i < actual.points.size(); ++i) {
+      EXPECT_NEAR(actual.points[i].x, expect.points[i].x, 1e-4);
+      EXPECT_NEAR(actual.points[i].y, expect.points[i].y, 1e-4);
+      EXPECT_NEAR(actual.points[i].z, expect.points[i].z, 1e-4);
+      EXPECT_NEAR(actual.points[i].intensity, expect.points[i].intensity, 1e-3);
+    }
+  }
+
+  std::mt19937 rng_{5};
+};
+
+TEST_F(LocalMapTest, AddAndRemoveFrames) {
+  LocalMap<Point> map(0.5f, 1.0f);
+  std::map<int, Cloud> frames;
+  // a sliding window of overlapping frames
+  for (int id = 0; id < 12; ++id) {
+    frames[id] = MakeFrame(id * 2.0f);
+    map.Add(id, frames[id]);
+    if (id >= 4) {
+      EXPECT_TRUE(map.Remove(id - 4));
+      frames.erase(id - 4);
+    }
+  }
+  EXPECT_EQ(map.frame_size(), 4u);
+  EXPECT_TRUE(map.Contains(11));
+  EXPECT_FALSE(map.Contains(7));
+  EXPECT_FALSE(map.Remove(7));
+  ExpectMatchesFilter(map, frames);
+
+  // replacing a frame removes its old points
+  frames[9] = MakeFrame(30.0f);
+  map.Add(9, frames[9]);
+  ExpectMatchesFilter(map, frames);
+
+  // a frame of two clouds
+  Cloud extra = MakeFrame(4.0f);
+  map.Add(10, {&frames[10], &extra});
+  frames[10].points.insert(frames[10].points.end(), extra.points.begin(),
+                           extra.points.end());
+  ExpectMatchesFilter(map, frames);
+
+  map.Clear();
+  EXPECT_EQ(map.size(), 0u);
+  EXPECT_TRUE(map.index().empty());
+}
+
+TEST_F(LocalMapTest, IndexFindsCentroids) {
+  LocalMap<Point> map(0.5f, 1.0f);
+  map.Add(0, MakeFrame(0.0f));
+  map.Add(1, MakeFrame(1.0f));
+  map.Remove(0);
+
+  Cloud centroids;
+  map.ToCloud(&centroids);
+  std::vector<Point> found;
+  std::vector<float> sq_distances;
+  for (const Point& p : centroids.points) {
+    ASSERT_EQ(map.index().NearestKSearch(p, 1, 0.1f, &found, &sq_distances), 1u);
+    EXPECT_EQ(sq_distances[0], 0.0f);
+  }
+}
+
+}  // namespace lib
+}  // namespace apollo
@@ -0,0 +1,102 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace apollo {
+namespace lib {
+
+// Writes a binary PCD file of x, y, z and intensity one cloud at a time, so
+// a large map is streamed out without being concatenated first.
+//
+// The point count is unknown until the end, the header is written with a
+// fixed width count and written again by Close.
+class PcdWriter {
+ public:
+  PcdWriter() = default;
+  ~PcdWriter() { Close(); }
+
+  PcdWriter(const PcdWriter&) = delete;
+  PcdWriter& operator=(const PcdWriter&) = delete;
+
+  bool Open(const std::string& path) {
+    file_.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    size_ = 0;
+    WriteHeader();
+    return file_.good();
+  }
+
+  // PointT needs float x, y, z and intensity members
+  template <typename CloudT>
+  bool Write(const CloudT& cloud) {
+    buffer_.resize(cloud.points.size() * 4);
+    float* data = buffer_.data();
+    for (const auto& point : cloud.points) {
+      *data++ = point.x;
+      *data++ = point.y;
+      *data++ = point.z;
+      *data++ = point.intensity;
+    }
+    file_.write(reinterpret_cast<const char*>(buffer_.data()),
+                buffer_.size() * sizeof(float));
+    size_ += cloud.points.size();
+    return file_.good();
+  }
+
+  // Returns false if any write failed
+  bool Close() {
+    if (!file_.is_open())
+      return true;
+    file_.seekp(0);
+    WriteHeader();
+    const bool good = file_.good();
+    file_.close();
+    return good;
+  }
+
+  size_t size() const { return size_; }
+
+ private:
+  void WriteHeader() {
+    char header[256];
+    const int length = std::snprintf(
+        header, sizeof(header),
+        "# .PCD v0.7 - Point Cloud Data file format\n"
+        "VERSION 0.7\n"
+        "FIELDS x y z intensity\n"
+        "SIZE 4 4 4 4\n"
+        "TYPE F F F F\n"
+        "COUNT 1 1 1 1\n"
+        "WIDTH %012zu\n"
+        "HEIGHT 1\n"
+        "VIEWPOINT 0 0 0 1 0 0 0\n"
+        "POINTS %012zu\n"
+        "DATA binary\n",
+        size_, size_);
+    file_.write(header, length);
+  }
+
+  std::ofstream file_;
+  size_t size_ = 0;
+  std::vector<float> buffer_;
+};
+
+}  // namespace lib
+}  // namespace apollo
@@ -0,0 +1,83 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "modules/tools/ilego_loam/src/lib/pcd_writer.h"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace apollo {
+namespace lib {
+
+struct Point {
+  float x = 0;
+  float y = 0;
+  float z = 0;
+  float intensity = 0;
+};
+
+struct Cloud {
+  std::vector<Point> points;
+};
+
+TEST(PcdWriterTest, StreamsClouds) {
+  const std::string path = ::testing::TempDir() + "pcd_writer_test.pcd";
+  Cloud first;
+  first.points = {{1, 2, 3, 4}, {5, 6, 7, 8}};
+  Cloud second;
+  second.points = {{-1, -2, -3, 0.5f}};
+  {
+    PcdWriter writer;
+    ASSERT_TRUE(writer.Open(path));
+    EXPECT_TRUE(writer.Write(first));
+    EXPECT_TRUE(writer.Write(Cloud()));
+    EXPECT_TRUE(writer.Write(second));
+    EXPECT_EQ(writer.size(), 3u);
+    EXPECT_TRUE(writer.Close());
+  }
+
+  std::ifstream file(path, std::ios::binary);
+  std::string line;
+  int width = -1;
+  int points = -1;
+  while (std::getline(file, line) && line != "DATA binary") {
+    std::istringstream fields(line);
+    std::string name;
+    fields >> name;
+    if (name == "WIDTH")
+      fields >> width;
+    else if (name == "POINTS")
+      fields >> points;
+  }
+  EXPECT_EQ(line, "DATA binary");
+  EXPECT_EQ(width, 3);
+  EXPECT_EQ(points, 3);
+
+  std::vector<float> data(12);
+  file.read(reinterpret_cast<char*>(data.data()), data.size() * sizeof(float));
+  ASSERT_TRUE(file.good());
+  EXPECT_EQ(data[4], 5.0f);
+  EXPECT_EQ(data[8], -1.0f);
+  EXPECT_EQ(data[11], 0.5f);
+  EXPECT_EQ(file.peek(), EOF);
+  std::remove(path.c_str());
+}
+
+}  // namespace lib
+}  // namespace apollo
@@ -0,0 +1,130 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace apollo {
+namespace lib {
+
+// Polynomial approximation of atan2, max error is about 1e-5 rad which is
+// far below the horizontal resolution of any lidar.
+inline float FastAtan2(float y, float x) {
+  float ax = std::fabs(x);
+  float ay = std::fabs(y);
+  float a = std::min(ax, ay) / (std::max(ax, ay) + 1e-30f);
+  float s = a * a;
+  float r = a * (0.99997726f + s * (-0.33262347f + s * (0.19354346f +
+      s * (-0.11643287f + s * (0.05265332f - s * 0.01172120f)))));
+  if (ay > ax)
+    r = static_cast<float>(M_PI_2) - r;
+  if (x < 0)
+    r = static_cast<float>(M_PI) - r;
+  if (y < 0)
+    r = -r;
+  return r;
+}
+
+// Bins lidar points into range image rows and columns without calling
+// atan2, the row is looked up from the sine of the elevation (z / range)
+// in a table built from the sensor calibration.
+class ProjectionTable {
+ public:
+  ProjectionTable() : n_scan_(0), horizon_scan_(0), col_scale_(0),
+                      sin_min_(0), bin_scale_(0) {}
+
+  // elevations: vertical angle of each ring in degrees, sorted ascending
+  // ang_res_x: horizontal resolution in degrees
+  bool Init(const std::vector<float>& elevations, float ang_res_x,
+            int horizon_scan) {
+    if (elevations.size() < 2 || ang_res_x <= 0 || horizon_scan <= 0 ||
+        !std::is_sorted(elevations.begin(), elevations.end()))
+      return false;
+
+    n_scan_ = elevations.size();
+    horizon_scan_ = horizon_scan;
+    col_scale_ = 180.0 / M_PI / ang_res_x;
+
+    // Boundary i separates row i and row i + 1, the first and last rows
+    // extend half a ring spacing beyond their elevation.
+    upper_.resize(n_scan_);
+    float min_gap = 180.0;
+    for (int i = 0; i + 1 < n_scan_; ++i) {
+      upper_[i] = SinDeg((elevations[i] + elevations[i + 1]) / 2);
+      min_gap = std::min(min_gap, elevations[i + 1] - elevations[i]);
+    }
+    upper_[n_scan_ - 1] = SinDeg(elevations[n_scan_ - 1] +
+        (elevations[n_scan_ - 1] - elevations[n_scan_ - 2]) / 2);
+    sin_min_ = SinDeg(elevations[0] - (elevations[1] - elevations[0]) / 2);
+
+    // Quantize sin(elevation) finer than the smallest ring spacing, so at
+    // most one boundary falls into a bin.
+    float bin_width = std::max(SinDeg(min_gap) / 2, 1e-5f);
+    int bins = std::min(static_cast<int>(
+        (upper_[n_scan_ - 1] - sin_min_) / bin_width) + 1, kMaxBins);
+    bin_scale_ = bins / (upper_[n_scan_ - 1] - sin_min_);
+
+    lut_.resize(bins + 1);
+    int row = 0;
+    for (int i = 0; i <= bins; ++i) {
+      float s = sin_min_ + i / bin_scale_;
+      while (row + 1 < n_scan_ && s >= upper_[row])
+        ++row;
+      lut_[i] = row;
+    }
+    return true;
+  }
+
+  // Returns -1 if the point is out of the vertical field of view.
+  int Row(float z, float range) const {
+    float s = z / range;
+    if (!(s >= sin_min_ && s < upper_[n_scan_ - 1]))
+      return -1;
+    int row = lut_[static_cast<int>((s - sin_min_) * bin_scale_)];
+    while (row + 1 < n_scan_ && s >= upper_[row])
+      ++row;
+    return row;
+  }
+
+  // Same convention as round(atan2(x, y) / ang_res_x) + horizon_scan / 2
+  int Column(float x, float y) const {
+    int col = static_cast<int>(std::lround(FastAtan2(x, y) * col_scale_)) +
+        horizon_scan_ / 2;
+    if (col >= horizon_scan_)
+      col -= horizon_scan_;
+    return col;
+  }
+
+  int n_scan() const { return n_scan_; }
+
+ private:
+  static float SinDeg(float deg) { return std::sin(deg / 180.0 * M_PI); }
+
+  static constexpr int kMaxBins = 1 << 16;
+
+  int n_scan_;
+  int horizon_scan_;
+  float col_scale_;
+
+  float sin_min_;
+  float bin_scale_;
+  std::vector<float> upper_;
+  std::vector<int> lut_;
+};
+
+}  // namespace lib
+}  // namespace apollo
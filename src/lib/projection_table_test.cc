@@ -0,0 +1,90 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "modules/tools/ilego_loam/src/lib/projection_table.h"
+
+#include "gtest/gtest.h"
+
+namespace apollo {
+namespace lib {
+
+TEST(ProjectionTableTest, FastAtan2) {
+  for (float y = -10; y <= 10; y += 0.37) {
+    for (float x = -10; x <= 10; x += 0.41) {
+      EXPECT_NEAR(FastAtan2(y, x), std::atan2(y, x), 2e-5);
+    }
+  }
+}
+
+TEST(ProjectionTableTest, UniformRowsMatchAngleBinning) {
+  // VLP-16: 2 degree spacing, bins start at -15.1 degree
+  const float ang_res_y = 2.0;
+  const float ang_bottom = 15.0 + 0.1;
+  std::vector<float> elevations;
+  for (int i = 0; i < 16; ++i)
+    elevations.push_back(i * ang_res_y - ang_bottom + ang_res_y / 2);
+
+  ProjectionTable table;
+  ASSERT_TRUE(table.Init(elevations, 0.2, 1800));
+
+  for (float angle = -16.0; angle <= 18.0; angle += 0.013) {
+    float rad = angle / 180.0 * M_PI;
+    float z = 10 * std::sin(rad);
+    int expected = std::floor((angle + ang_bottom) / ang_res_y);
+    if (expected < 0 || expected >= 16)
+      expected = -1;
+    EXPECT_EQ(table.Row(z, 10), expected) << angle;
+  }
+}
+
+TEST(ProjectionTableTest, NonUniformRows) {
+  std::vector<float> elevations = {-25.0, -15.0, -10.0, -5.0, -3.0, -2.0,
+                                   -1.0, 0.0, 1.0, 3.0, 7.0, 15.0};
+  ProjectionTable table;
+  ASSERT_TRUE(table.Init(elevations, 0.1, 3600));
+
+  for (size_t i = 0; i < elevations.size(); ++i) {
+    float rad = elevations[i] / 180.0 * M_PI;
+    EXPECT_EQ(table.Row(std::sin(rad), 1), static_cast<int>(i));
+  }
+  EXPECT_EQ(table.Row(-1, 1), -1);
+  EXPECT_EQ(table.Row(0.5, 1), -1);
+}
+
+TEST(ProjectionTableTest, Column) {
+  ProjectionTable table;
+  ASSERT_TRUE(table.Init({-1.0, 1.0}, 0.2, 1800));
+
+  for (float angle = -179.9; angle < 180; angle += 0.07) {
+    float rad = angle / 180.0 * M_PI;
+    float x = std::sin(rad);
+    float y = std::cos(rad);
+    int expected = std::lround(std::atan2(x, y) * 180 / M_PI / 0.2) + 900;
+    if (expected >= 1800)
+      expected -= 1800;
+    int col = table.Column(x, y);
+    // rounding may differ exactly on a bin border
+    EXPECT_LE(std::abs(col - expected) % 1799, 1) << angle;
+  }
+}
+
+TEST(ProjectionTableTest, InvalidInit) {
+  ProjectionTable table;
+  EXPECT_FALSE(table.Init({1.0}, 0.2, 1800));
+  EXPECT_FALSE(table.Init({1.0, -1.0}, 0.2, 1800));
+  EXPECT_FALSE(table.Init({-1.0, 1.0}, 0, 1800));
+}
+
+}  // namespace lib
+}  // namespace apollo
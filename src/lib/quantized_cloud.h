@@ -0,0 +1,122 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+
+namespace apollo {
+namespace lib {
+
+// Compact encoding of a point cloud, 10 bytes a point instead of the 32 of
+// pcl::PointXYZI.
+//
+// x, y and z are quantized to 16 bits over the bounding box of the cloud,
+// so the error is at most extent / 131070, e.g. 1.5mm for a cloud 200m
+// across. Intensity is kept as a float, it holds the ring and the scan
+// time. Non finite points are dropped. The encoding uses the byte order of
+// the machine, it is meant for a spill file, not for exchange.
+//
+//   uint32 count, float min[3], float step[3],
+//   uint16 xyz[count][3], float intensity[count]
+template <typename CloudT>
+void EncodeCloud(const CloudT& cloud, std::string* out) {
+  uint32_t count = 0;
+  float min[3] = {std::numeric_limits<float>::max(),
+                  std::numeric_limits<float>::max(),
+                  std::numeric_limits<float>::max()};
+  float max[3] = {std::numeric_limits<float>::lowest(),
+                  std::numeric_limits<float>::lowest(),
+                  std::numeric_limits<float>::lowest()};
+  for (const auto& p : cloud.points) {
+    if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z))
+      continue;
+    ++count;
+    const float xyz[3] = {p.x, p.y, p.z};
+    for (int k = 0; k < 3; ++k) {
+      min[k] = std::min(min[k], xyz[k]);
+      max[k] = std::max(max[k], xyz[k]);
+    }
+  }
+
+  float step[3] = {0.0f, 0.0f, 0.0f};
+  for (int k = 0; k < 3 && count > 0; ++k)
+    step[k] = (max[k] - min[k]) / std::numeric_limits<uint16_t>::max();
+
+  const size_t header = sizeof(count) + sizeof(min) + sizeof(step);
+  out->resize(header + count * (3 * sizeof(uint16_t) + sizeof(float)));
+  char* data = &(*out)[0];
+  std::memcpy(data, &count, sizeof(count));
+  std::memcpy(data + sizeof(count), min, sizeof(min));
+  std::memcpy(data + sizeof(count) + sizeof(min), step, sizeof(step));
+
+  char* xyz_data = data + header;
+  char* intensity_data = xyz_data + count * 3 * sizeof(uint16_t);
+  for (const auto& p : cloud.points) {
+    if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z))
+      continue;
+    const float xyz[3] = {p.x, p.y, p.z};
+    uint16_t q[3];
+    for (int k = 0; k < 3; ++k) {
+      q[k] = step[k] > 0.0f ?
+          static_cast<uint16_t>(std::lround((xyz[k] - min[k]) / step[k])) : 0;
+    }
+    std::memcpy(xyz_data, q, sizeof(q));
+    xyz_data += sizeof(q);
+    std::memcpy(intensity_data, &p.intensity, sizeof(float));
+    intensity_data += sizeof(float);
+  }
+}
+
+// Replaces the points of cloud, returns false if data is malformed
+template <typename CloudT>
+bool DecodeCloud(const char* data, size_t size, CloudT* cloud) {
+  uint32_t count = 0;
+  float min[3];
+  float step[3];
+  const size_t header = sizeof(count) + sizeof(min) + sizeof(step);
+  if (size < header)
+    return false;
+  std::memcpy(&count, data, sizeof(count));
+  std::memcpy(min, data + sizeof(count), sizeof(min));
+  std::memcpy(step, data + sizeof(count) + sizeof(min), sizeof(step));
+  if (size != header + count * (3 * sizeof(uint16_t) + sizeof(float)))
+    return false;
+
+  const char* xyz_data = data + header;
+  const char* intensity_data = xyz_data + count * 3 * sizeof(uint16_t);
+  cloud->points.resize(count);
+  for (uint32_t i = 0; i < count; ++i) {
+    uint16_t q[3];
+    std::memcpy(q, xyz_data + i * sizeof(q), sizeof(q));
+    auto& p = cloud->points[i];
+    p.x = min[0] + q[0] * step[0];
+    p.y = min[1] + q[1] * step[1];
+    p.z = min[2] + q[2] * step[2];
+    std::memcpy(&p.intensity, intensity_data + i * sizeof(float),
+                sizeof(float));
+  }
+  cloud->width = count;
+  cloud->height = 1;
+  cloud->is_dense = true;
+  return true;
+}
+
+}  // namespace lib
+}  // namespace apollo
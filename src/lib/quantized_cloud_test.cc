@@ -0,0 +1,88 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "modules/tools/ilego_loam/src/lib/quantized_cloud.h"
+
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace apollo {
+namespace lib {
+
+struct Point {
+  float x = 0;
+  float y = 0;
+  float z = 0;
+  float intensity = 0;
+};
+
+struct Cloud {
+  std::vector<Point> points;
+  uint32_t width = 0;
+  uint32_t height = 0;
+  bool is_dense = false;
+};
+
+TEST(QuantizedCloudTest, RoundTrip) {
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<float> dist(-100, 100);
+  Cloud cloud;
+  for (int i = 0; i < 1000; ++i)
+    cloud.points.push_back({dist(rng), dist(rng), dist(rng) * 0.1f, 3.0571f});
+  cloud.points.push_back({std::numeric_limits<float>::quiet_NaN(), 0, 0, 0});
+
+  std::string data;
+  EncodeCloud(cloud, &data);
+  EXPECT_EQ(data.size(), 28u + 1000u * 10u);
+
+  Cloud decoded;
+  ASSERT_TRUE(DecodeCloud(data.data(), data.size(), &decoded));
+  ASSERT_EQ(decoded.points.size(), 1000u);
+  EXPECT_EQ(decoded.width, 1000u);
+  // 200m quantized to 16 bits
+  const float tolerance = 200.0f / 65535 / 2 + 1e-4f;
+  for (size_t i = 0; i < decoded.points.size(); ++i) {
+    EXPECT_NEAR(decoded.points[i].x, cloud.points[i].x, tolerance);
+    EXPECT_NEAR(decoded.points[i].y, cloud.points[i].y, tolerance);
+    EXPECT_NEAR(decoded.points[i].z, cloud.points[i].z, tolerance);
+    EXPECT_EQ(decoded.points[i].intensity, cloud.points[i].intensity);
+  }
+}
+
+TEST(QuantizedCloudTest, EmptyAndMalformed) {
+  Cloud cloud;
+  std::string data;
+  EncodeCloud(cloud, &data);
+  Cloud decoded;
+  decoded.points.resize(3);
+  ASSERT_TRUE(DecodeCloud(data.data(), data.size(), &decoded));
+  EXPECT_TRUE(decoded.points.empty());
+
+  // a single point has no extent
+  cloud.points.push_back({1.5f, -2.0f, 0.25f, 7.0f});
+  EncodeCloud(cloud, &data);
+  ASSERT_TRUE(DecodeCloud(data.data(), data.size(), &decoded));
+  ASSERT_EQ(decoded.points.size(), 1u);
+  EXPECT_EQ(decoded.points[0].x, 1.5f);
+  EXPECT_EQ(decoded.points[0].z, 0.25f);
+
+  EXPECT_FALSE(DecodeCloud(data.data(), data.size() - 1, &decoded));
+  EXPECT_FALSE(DecodeCloud(data.data(), 3, &decoded));
+}
+
+}  // namespace lib
+}  // namespace apollo
@@ -0,0 +1,231 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <utility>
+#include <vector>
+
+namespace apollo {
+namespace lib {
+
+// Scan Context global descriptor of a scan, as described in
+//   G. Kim and A. Kim. Scan Context: Egocentric Spatial Descriptor for Place
+//     Recognition within 3D Point Cloud Map. IROS 2018.
+//
+// The horizontal plane around the sensor is split into kRings rings and
+// kSectors sectors, each bin keeps the highest point in it. The descriptor
+// does not depend on the pose of the scan, so a place is recognized however
+// much the odometry drifted, and a yaw between two scans is a shift of the
+// sectors.
+class ScanContext {
+ public:
+  static constexpr int kRings = 20;
+  static constexpr int kSectors = 60;
+
+  // Points beyond max_range are ignored. Heights are offset by
+  // sensor_height, so the ground is about 0 and higher than an empty bin.
+  ScanContext(float max_range, float sensor_height)
+      : max_range_(max_range), sensor_height_(sensor_height) {
+    bins_.fill(0.0f);
+  }
+
+  // z is up
+  void Add(float x, float y, float z) {
+    const float range = std::sqrt(x * x + y * y);
+    if (!(range < max_range_) || !std::isfinite(z))
+      return;
+    float angle = std::atan2(y, x);
+    if (angle < 0)
+      angle += 2 * static_cast<float>(M_PI);
+    const int ring =
+        std::min(static_cast<int>(range / max_range_ * kRings), kRings - 1);
+    const int sector = std::min(
+        static_cast<int>(angle / (2 * static_cast<float>(M_PI)) * kSectors),
+        kSectors - 1);
+    float& bin = bins_[ring * kSectors + sector];
+    bin = std::max(bin, z + sensor_height_);
+  }
+
+  float at(int ring, int sector) const { return bins_[ring * kSectors + sector]; }
+
+  // Mean of each ring, it does not change with the yaw of the scan
+  std::array<float, kRings> RingKey() const {
+    std::array<float, kRings> key;
+    for (int r = 0; r < kRings; ++r) {
+      float sum = 0.0f;
+      for (int s = 0; s < kSectors; ++s)
+        sum += at(r, s);
+      key[r] = sum / kSectors;
+    }
+    return key;
+  }
+
+  // Mean of each sector, its shift gives a first guess of the yaw
+  std::array<float, kSectors> SectorKey() const {
+    std::array<float, kSectors> key;
+    for (int s = 0; s < kSectors; ++s) {
+      float sum = 0.0f;
+      for (int r = 0; r < kRings; ++r)
+        sum += at(r, s);
+      key[s] = sum / kRings;
+    }
+    return key;
+  }
+
+  // 1 - the mean cosine similarity of the sectors, sector s of this against
+  // sector s + shift of other. Sectors empty in either are skipped, 1 if no
+  // sector is left.
+  float Distance(const ScanContext& other, int shift) const {
+    float similarity = 0.0f;
+    int count = 0;
+    for (int s = 0; s < kSectors; ++s) {
+      const int t = (s + shift % kSectors + kSectors) % kSectors;
+      float dot = 0.0f;
+      float norm = 0.0f;
+      float other_norm = 0.0f;
+      for (int r = 0; r < kRings; ++r) {
+        dot += at(r, s) * other.at(r, t);
+        norm += at(r, s) * at(r, s);
+        other_norm += other.at(r, t) * other.at(r, t);
+      }
+      if (norm == 0.0f || other_norm == 0.0f)
+        continue;
+      similarity += dot / std::sqrt(norm * other_norm);
+      ++count;
+    }
+    return count == 0 ? 1.0f : 1.0f - similarity / count;
+  }
+
+  // The distance at the best shift. The sector keys give a first shift,
+  // only the shifts within kShiftSearch of it are compared in full. If the
+  // scans are of the same place, shift sectors are the yaw of this scan in
+  // the frame of other.
+  float Distance(const ScanContext& other, int* shift) const {
+    const std::array<float, kSectors> key = SectorKey();
+    const std::array<float, kSectors> other_key = other.SectorKey();
+    int guess = 0;
+    float best = std::numeric_limits<float>::max();
+    for (int k = 0; k < kSectors; ++k) {
+      float sum = 0.0f;
+      for (int s = 0; s < kSectors; ++s) {
+        const float d = key[s] - other_key[(s + k) % kSectors];
+        sum += d * d;
+      }
+      if (sum < best) {
+        best = sum;
+        guess = k;
+      }
+    }
+
+    float distance = std::numeric_limits<float>::max();
+    for (int k = guess - kShiftSearch; k <= guess + kShiftSearch; ++k) {
+      const float d = Distance(other, k);
+      if (d < distance) {
+        distance = d;
+        *shift = (k + kSectors) % kSectors;
+      }
+    }
+    return distance;
+  }
+
+ private:
+  static constexpr int kShiftSearch = 3;
+
+  float max_range_;
+  float sensor_height_;
+  // ring major
+  std::array<float, kRings * kSectors> bins_;
+};
+
+// Flat index of the scan contexts of the key frames.
+//
+// A search compares the ring keys of all the entries, kept contiguous so
+// the pass is a plain vectorized L2 over a few floats each, and compares
+// only the closest k in full. Not thread safe.
+class ScanContextIndex {
+ public:
+  struct Candidate {
+    int id = -1;
+    float distance = 1.0f;
+    // sectors, see ScanContext::Distance
+    int shift = 0;
+  };
+
+  void Add(int id, const ScanContext& context) {
+    const std::array<float, ScanContext::kRings> key = context.RingKey();
+    ring_keys_.insert(ring_keys_.end(), key.begin(), key.end());
+    ids_.push_back(id);
+    contexts_.push_back(context);
+  }
+
+  size_t size() const { return ids_.size(); }
+  bool empty() const { return ids_.empty(); }
+  // in the order they were added
+  int id(size_t i) const { return ids_[i]; }
+  const ScanContext& context(size_t i) const { return contexts_[i]; }
+
+  // The k entries with the ring keys closest to the one of query among the
+  // ids accept is true for, the closest by Distance first
+  template <typename Accept>
+  std::vector<Candidate> Search(const ScanContext& query, size_t k,
+                                Accept accept) const {
+    const std::array<float, ScanContext::kRings> key = query.RingKey();
+    std::vector<std::pair<float, size_t>> nearest;
+    for (size_t i = 0; i < ids_.size(); ++i) {
+      if (!accept(ids_[i]))
+        continue;
+      const float* other = &ring_keys_[i * ScanContext::kRings];
+      float sum = 0.0f;
+      for (int r = 0; r < ScanContext::kRings; ++r) {
+        const float d = key[r] - other[r];
+        sum += d * d;
+      }
+      nearest.emplace_back(sum, i);
+    }
+    if (nearest.size() > k) {
+      std::nth_element(nearest.begin(), nearest.begin() + k, nearest.end());
+      nearest.resize(k);
+    }
+
+    std::vector<Candidate> candidates;
+    candidates.reserve(nearest.size());
+    for (const auto& entry : nearest) {
+      Candidate candidate;
+      candidate.id = ids_[entry.second];
+      candidate.distance =
+          query.Distance(contexts_[entry.second], &candidate.shift);
+      candidates.push_back(candidate);
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              [](const Candidate& a, const Candidate& b) {
+                return a.distance < b.distance;
+              });
+    return candidates;
+  }
+
+ private:
+  std::vector<int> ids_;
+  // kRings floats an entry
+  std::vector<float> ring_keys_;
+  std::vector<ScanContext> contexts_;
+};
+
+}  // namespace lib
+}  // namespace apollo
@@ -0,0 +1,105 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "modules/tools/ilego_loam/src/lib/scan_context.h"
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace apollo {
+namespace lib {
+
+struct Point {
+  float x = 0;
+  float y = 0;
+  float z = 0;
+};
+
+class ScanContextTest : public ::testing::Test {
+ protected:
+  // Boxes of random height scattered around a place
+  std::vector<Point> MakePlace(unsigned seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> position(-40, 40);
+    std::uniform_real_distribution<float> height(0, 8);
+    std::uniform_real_distribution<float> offset(-1, 1);
+    std::vector<Point> place;
+    for (int b = 0; b < 60; ++b) {
+      const float x = position(rng);
+      const float y = position(rng);
+      const float h = height(rng);
+      for (int i = 0; i < 50; ++i)
+        place.push_back({x + offset(rng), y + offset(rng), h * (i / 50.0f)});
+    }
+    return place;
+  }
+
+  // The place seen by a sensor at (x, y) with the yaw
+  ScanContext Observe(const std::vector<Point>& place, float x, float y,
+                      float yaw) {
+    ScanContext context(80.0f, 2.0f);
+    const float c = std::cos(yaw);
+    const float s = std::sin(yaw);
+    for (const Point& p : place) {
+      const float dx = p.x - x;
+      const float dy = p.y - y;
+      context.Add(c * dx + s * dy, -s * dx + c * dy, p.z - 2.0f);
+    }
+    return context;
+  }
+};
+
+TEST_F(ScanContextTest, DistanceFindsYaw) {
+  const std::vector<Point> place = MakePlace(1);
+  const ScanContext context = Observe(place, 0, 0, 0);
+  // 30 degrees is 5 sectors
+  const ScanContext rotated = Observe(place, 0, 0, M_PI / 6);
+
+  EXPECT_GT(context.Distance(rotated, 0), 0.1f);
+  int shift = -1;
+  EXPECT_LT(rotated.Distance(context, &shift), 0.05f);
+  EXPECT_EQ(shift, 5);
+
+  const ScanContext other = Observe(MakePlace(2), 0, 0, 0);
+  EXPECT_GT(rotated.Distance(other, &shift), 0.2f);
+}
+
+TEST_F(ScanContextTest, IndexFindsPlace) {
+  ScanContextIndex index;
+  for (int id = 0; id < 50; ++id)
+    index.Add(id, Observe(MakePlace(100 + id), 0, 0, 0));
+  EXPECT_EQ(index.size(), 50u);
+  EXPECT_EQ(index.id(17), 17);
+
+  // back to place 17, a little off and turned around
+  const ScanContext query = Observe(MakePlace(117), 0.5f, -0.3f, M_PI);
+  auto candidates = index.Search(query, 5, [](int) { return true; });
+  ASSERT_EQ(candidates.size(), 5u);
+  EXPECT_EQ(candidates[0].id, 17);
+  EXPECT_LT(candidates[0].distance, 0.2f);
+  EXPECT_NEAR(candidates[0].shift, 30, 1);
+  for (size_t i = 1; i < candidates.size(); ++i)
+    EXPECT_LE(candidates[i - 1].distance, candidates[i].distance);
+
+  candidates = index.Search(query, 5, [](int id) { return id != 17; });
+  ASSERT_EQ(candidates.size(), 5u);
+  EXPECT_NE(candidates[0].id, 17);
+  EXPECT_TRUE(index.Search(query, 5, [](int) { return false; }).empty());
+}
+
+}  // namespace lib
+}  // namespace apollo
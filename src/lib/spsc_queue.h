@@ -0,0 +1,80 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace apollo {
+namespace lib {
+
+// A lock free FIFO of bounded size between exactly one producer thread and
+// one consumer thread.
+//
+// Neither side ever waits for the other, TryPush fails when the queue is
+// full and TryPop when it is empty. It is meant for a background worker
+// handing results to a thread that must not block on it.
+template <typename T>
+class SpscQueue {
+ public:
+  explicit SpscQueue(std::size_t capacity) : buffer_(capacity + 1) {}
+
+  SpscQueue(const SpscQueue&) = delete;
+  SpscQueue& operator=(const SpscQueue&) = delete;
+
+  // Producer only, returns false and drops t if the queue is full
+  bool TryPush(T t) {
+    const std::size_t tail = tail_.load(std::memory_order_relaxed);
+    const std::size_t next = Next(tail);
+    if (next == head_.load(std::memory_order_acquire))
+      return false;
+    buffer_[tail] = std::move(t);
+    tail_.store(next, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only, returns false if the queue is empty
+  bool TryPop(T* t) {
+    const std::size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire))
+      return false;
+    *t = std::move(buffer_[head]);
+    head_.store(Next(head), std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const {
+    return head_.load(std::memory_order_acquire) ==
+           tail_.load(std::memory_order_acquire);
+  }
+
+  std::size_t capacity() const { return buffer_.size() - 1; }
+
+ private:
+  std::size_t Next(std::size_t i) const {
+    return i + 1 == buffer_.size() ? 0 : i + 1;
+  }
+
+  // one slot stays empty to tell a full queue from an empty one
+  std::vector<T> buffer_;
+  // on their own cache lines, each is written by one side only
+  alignas(64) std::atomic<std::size_t> head_{0};
+  alignas(64) std::atomic<std::size_t> tail_{0};
+};
+
+}  // namespace lib
+}  // namespace apollo
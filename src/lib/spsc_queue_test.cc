@@ -0,0 +1,68 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "modules/tools/ilego_loam/src/lib/spsc_queue.h"
+
+#include <memory>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+namespace apollo {
+namespace lib {
+
+TEST(SpscQueueTest, FullAndEmpty) {
+  SpscQueue<std::unique_ptr<int>> queue(2);
+  EXPECT_EQ(queue.capacity(), 2u);
+  EXPECT_TRUE(queue.empty());
+
+  std::unique_ptr<int> value;
+  EXPECT_FALSE(queue.TryPop(&value));
+  EXPECT_TRUE(queue.TryPush(std::make_unique<int>(1)));
+  EXPECT_TRUE(queue.TryPush(std::make_unique<int>(2)));
+  EXPECT_FALSE(queue.TryPush(std::make_unique<int>(3)));
+
+  ASSERT_TRUE(queue.TryPop(&value));
+  EXPECT_EQ(*value, 1);
+  // wraps around
+  EXPECT_TRUE(queue.TryPush(std::make_unique<int>(4)));
+  ASSERT_TRUE(queue.TryPop(&value));
+  EXPECT_EQ(*value, 2);
+  ASSERT_TRUE(queue.TryPop(&value));
+  EXPECT_EQ(*value, 4);
+  EXPECT_TRUE(queue.empty());
+}
+
+TEST(SpscQueueTest, ProducerAndConsumer) {
+  constexpr int kCount = 100000;
+  SpscQueue<int> queue(16);
+  std::thread producer([&queue] {
+    for (int i = 0; i < kCount; ++i) {
+      while (!queue.TryPush(i))
+        std::this_thread::yield();
+    }
+  });
+
+  int value = -1;
+  for (int i = 0; i < kCount; ++i) {
+    while (!queue.TryPop(&value))
+      std::this_thread::yield();
+    ASSERT_EQ(value, i);
+  }
+  producer.join();
+  EXPECT_TRUE(queue.empty());
+}
+
+}  // namespace lib
+}  // namespace apollo
@@ -0,0 +1,144 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace apollo {
+namespace lib {
+
+// Worker threads of their own for the data parallel loops of a stage, e.g.
+// the row bands of a range image.
+//
+// The stages run in reader callbacks on the cyber task pool. Waiting there
+// for tasks posted to the same pool holds a pool thread per waiting
+// callback and deadlocks once all of them wait, so the loops never go to
+// the task pool. The calling thread takes part in ParallelFor, a pool of
+// num_threads has num_threads - 1 workers and none for 1.
+class ThreadPool {
+ public:
+  explicit ThreadPool(int num_threads = 1) { Resize(num_threads); }
+  ~ThreadPool() { Stop(); }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // Not to be called during ParallelFor
+  void Resize(int num_threads) {
+    Stop();
+    num_threads_ = std::max(1, num_threads);
+    // new workers wait for the next ParallelFor, not the last one
+    uint64_t generation = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = false;
+      generation = generation_;
+    }
+    for (int i = 1; i < num_threads_; ++i)
+      workers_.emplace_back([this, generation] { WorkerLoop(generation); });
+  }
+
+  // Runs func(i) for every i in [0, n) and returns when all calls are done.
+  // The calls are spread over the threads in no particular order. One
+  // caller at a time.
+  void ParallelFor(int n, const std::function<void(int)>& func) {
+    if (num_threads_ == 1 || n <= 1) {
+      for (int i = 0; i < n; ++i)
+        func(i);
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      func_ = &func;
+      size_ = n;
+      next_ = 0;
+      busy_ = static_cast<int>(workers_.size());
+      ++generation_;
+    }
+    start_.notify_all();
+    RunTasks(func, n);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this] { return busy_ == 0; });
+    func_ = nullptr;
+  }
+
+  int num_threads() const { return num_threads_; }
+
+ private:
+  void WorkerLoop(uint64_t generation) {
+    while (true) {
+      const std::function<void(int)>* func = nullptr;
+      int size = 0;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        start_.wait(lock, [this, generation] {
+          return stop_ || generation_ != generation;
+        });
+        if (stop_)
+          return;
+        generation = generation_;
+        func = func_;
+        size = size_;
+      }
+      RunTasks(*func, size);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        --busy_;
+      }
+      done_.notify_one();
+    }
+  }
+
+  void RunTasks(const std::function<void(int)>& func, int size) {
+    for (int i = next_.fetch_add(1); i < size; i = next_.fetch_add(1))
+      func(i);
+  }
+
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    start_.notify_all();
+    for (std::thread& worker : workers_)
+      worker.join();
+    workers_.clear();
+  }
+
+  int num_threads_ = 1;
+  std::vector<std::thread> workers_;
+
+  std::mutex mutex_;
+  std::condition_variable start_;
+  std::condition_variable done_;
+  bool stop_ = false;
+  uint64_t generation_ = 0;
+  // the loop of the current ParallelFor, guarded by mutex_
+  const std::function<void(int)>* func_ = nullptr;
+  int size_ = 0;
+  int busy_ = 0;
+  std::atomic<int> next_{0};
+};
+
+}  // namespace lib
+}  // namespace apollo
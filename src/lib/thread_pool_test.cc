@@ -0,0 +1,109 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "modules/tools/ilego_loam/src/lib/thread_pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace apollo {
+namespace lib {
+
+TEST(ThreadPoolTest, RunsEveryIndexOnce) {
+  ThreadPool pool(4);
+  EXPECT_EQ(pool.num_threads(), 4);
+  for (int n : {0, 1, 3, 4, 100}) {
+    std::vector<std::atomic<int>> calls(n);
+    pool.ParallelFor(n, [&calls](int i) { ++calls[i]; });
+    for (int i = 0; i < n; ++i)
+      EXPECT_EQ(calls[i], 1) << "n " << n << " i " << i;
+  }
+}
+
+TEST(ThreadPoolTest, SingleThreadRunsInOrderOnTheCaller) {
+  ThreadPool pool(1);
+  std::vector<int> order;
+  pool.ParallelFor(5, [&order](int i) {
+    order.push_back(i);
+  });
+  EXPECT_EQ(order, std::vector<int>({0, 1, 2, 3, 4}));
+}
+
+TEST(ThreadPoolTest, UsesTheWorkers) {
+  ThreadPool pool(3);
+  std::mutex mutex;
+  std::set<std::thread::id> threads;
+  std::atomic<int> waiting(0);
+  // every task waits for the others, so each runs on its own thread
+  pool.ParallelFor(3, [&](int) {
+    ++waiting;
+    while (waiting < 3)
+      std::this_thread::yield();
+    std::lock_guard<std::mutex> lock(mutex);
+    threads.insert(std::this_thread::get_id());
+  });
+  EXPECT_EQ(threads.size(), 3u);
+  EXPECT_EQ(threads.count(std::this_thread::get_id()), 1u);
+}
+
+TEST(ThreadPoolTest, ReturnsAfterAllTasks) {
+  ThreadPool pool(4);
+  for (int round = 0; round < 200; ++round) {
+    std::atomic<int> done(0);
+    pool.ParallelFor(8, [&done](int) {
+      std::this_thread::yield();
+      ++done;
+    });
+    ASSERT_EQ(done, 8);
+  }
+}
+
+TEST(ThreadPoolTest, Resize) {
+  ThreadPool pool;
+  EXPECT_EQ(pool.num_threads(), 1);
+  pool.Resize(0);
+  EXPECT_EQ(pool.num_threads(), 1);
+  pool.Resize(2);
+  EXPECT_EQ(pool.num_threads(), 2);
+  std::atomic<int> sum(0);
+  pool.ParallelFor(10, [&sum](int i) { sum += i; });
+  EXPECT_EQ(sum, 45);
+}
+
+TEST(ThreadPoolTest, ResizeAfterParallelFor) {
+  ThreadPool pool(3);
+  // The new workers must not take the finished loop for a new one, they
+  // get the time to wake up for it before the next loop. A worker that did
+  // would run a null loop and drive busy_ below zero, UBSan reports it.
+  for (int round = 0; round < 100; ++round) {
+    std::atomic<int> sum(0);
+    pool.ParallelFor(10, [&sum](int i) {
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+      sum += i;
+    });
+    ASSERT_EQ(sum, 45) << "round " << round;
+    pool.Resize(2 + round % 3);
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+  }
+}
+
+}  // namespace lib
+}  // namespace apollo
@@ -0,0 +1,273 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "modules/tools/ilego_loam/src/lib/voxel_key.h"
+
+namespace apollo {
+namespace lib {
+
+// Voxel downsampled map of a whole mission, split into cubic tiles.
+//
+// Every tile keeps the sums of its leaf voxels and the ids of the frames
+// with points in it, nothing per frame and voxel, so the map grows with
+// the mapped volume and not with the number of frames. The frames are not
+// kept either, the map reads them back through clouds_of(id), which
+// returns the clouds of a frame at its current pose, e.g. from the key
+// frame store. A new frame is only summed into its tiles. A moved frame
+// rebuilds the tiles it leaves, from the frames left in them, and is then
+// summed into the tiles it enters.
+//
+// The tile size is a multiple of the leaf size, so no leaf voxel crosses
+// a tile and the union of the tiles is the same as one VoxelFilter over
+// all the frames. The map can be read a tile at a time, so even a large
+// map is written out without being concatenated first.
+//
+// The frame clouds must be in the map frame. Not thread safe.
+template <typename PointT>
+class TileMap {
+ public:
+  // tile_size is rounded to a multiple of leaf_size
+  TileMap(float leaf_size, float tile_size)
+      : inverse_leaf_(1.0f / leaf_size),
+        leaves_per_tile_(std::max(
+            1, static_cast<int32_t>(std::round(tile_size / leaf_size)))),
+        tile_size_(leaves_per_tile_ * leaf_size) {}
+
+  float tile_size() const { return tile_size_; }
+  size_t tile_count() const { return tiles_.size(); }
+  size_t frame_size() const { return frames_.size(); }
+
+  // Number of downsampled points
+  size_t size() const {
+    size_t total = 0;
+    for (const auto& tile : tiles_)
+      total += tile.second.voxels.size();
+    return total;
+  }
+
+  // Adds the frames of ids that are not in the map and moves the ones that
+  // are. clouds_of(id) returns a container of pointers to the clouds of a
+  // frame, it is also called for the frames sharing a tile with a moved
+  // one. An id may be given more than once.
+  template <typename CloudsOf>
+  void Update(std::vector<int> ids, CloudsOf clouds_of) {
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    std::vector<int> moved;
+    std::vector<int> added;
+    for (int id : ids) {
+      if (frames_.count(id) > 0) {
+        moved.push_back(id);
+      } else {
+        added.push_back(id);
+      }
+    }
+    Rebuild(moved, clouds_of);
+    for (int id : added)
+      AddFrame(id, clouds_of(id), nullptr);
+    for (int id : moved)
+      AddFrame(id, clouds_of(id), nullptr);
+  }
+
+  // Returns false if the frame is not in the map
+  template <typename CloudsOf>
+  bool Remove(int id, CloudsOf clouds_of) {
+    if (frames_.count(id) == 0)
+      return false;
+    Rebuild({id}, clouds_of);
+    return true;
+  }
+
+  void Clear() {
+    tiles_.clear();
+    frames_.clear();
+  }
+
+  // Calls func(const CloudT&) with the points of every tile, buffer is
+  // reused from one tile to the next
+  template <typename CloudT, typename Func>
+  void ForEachTile(CloudT* buffer, Func func) const {
+    for (const auto& tile : tiles_) {
+      buffer->points.clear();
+      AppendTo(tile.second, buffer);
+      func(*buffer);
+    }
+  }
+
+  template <typename CloudT>
+  void ToCloud(CloudT* cloud) const {
+    cloud->points.clear();
+    for (const auto& tile : tiles_)
+      AppendTo(tile.second, cloud);
+  }
+
+  // The points of the tiles that come within radius of center
+  template <typename CloudT>
+  void ToCloud(const PointT& center, float radius, CloudT* cloud) const {
+    cloud->points.clear();
+    for (const auto& tile : tiles_) {
+      const VoxelKey& key = tile.first;
+      const float dx = Outside(center.x, key.x);
+      const float dy = Outside(center.y, key.y);
+      const float dz = Outside(center.z, key.z);
+      if (dx * dx + dy * dy + dz * dz <= radius * radius)
+        AppendTo(tile.second, cloud);
+    }
+  }
+
+ private:
+  using KeySet = std::unordered_set<VoxelKey, VoxelKeyHash>;
+
+  struct Voxel {
+    double x = 0.0;
+    double y = 0.0;
+    double z = 0.0;
+    double intensity = 0.0;
+    int count = 0;
+  };
+
+  struct Tile {
+    std::unordered_map<VoxelKey, Voxel, VoxelKeyHash> voxels;
+    std::unordered_set<int> frames;
+  };
+
+  // Takes the frames of ids out of the map, and sums the tiles they were
+  // in again from the other frames there
+  template <typename CloudsOf>
+  void Rebuild(const std::vector<int>& ids, CloudsOf& clouds_of) {
+    if (ids.empty())
+      return;
+    KeySet dirty;
+    for (int id : ids) {
+      auto frame = frames_.find(id);
+      if (frame == frames_.end())
+        continue;
+      for (const VoxelKey& key : frame->second) {
+        dirty.insert(key);
+        tiles_[key].frames.erase(id);
+      }
+      frames_.erase(frame);
+    }
+
+    std::vector<int> others;
+    for (const VoxelKey& key : dirty) {
+      Tile& tile = tiles_[key];
+      tile.voxels.clear();
+      others.insert(others.end(), tile.frames.begin(), tile.frames.end());
+    }
+    std::sort(others.begin(), others.end());
+    others.erase(std::unique(others.begin(), others.end()), others.end());
+    for (int id : others)
+      AddFrame(id, clouds_of(id), &dirty);
+
+    for (const VoxelKey& key : dirty) {
+      auto it = tiles_.find(key);
+      if (it != tiles_.end() && it->second.frames.empty())
+        tiles_.erase(it);
+    }
+  }
+
+  // Sums the points of a frame into its tiles, only into the ones in only
+  // if given
+  template <typename Clouds>
+  void AddFrame(int id, const Clouds& clouds, const KeySet* only) {
+    std::vector<VoxelKey>& keys = frames_[id];
+    // points of a frame mostly fall in the tile of the point before
+    Tile* tile = nullptr;
+    VoxelKey tile_key{0, 0, 0};
+    for (const auto& cloud : clouds) {
+      for (const PointT& point : (*cloud).points) {
+        if (!std::isfinite(point.x) || !std::isfinite(point.y) ||
+            !std::isfinite(point.z))
+          continue;
+        const VoxelKey leaf = ToVoxelKey(point.x, point.y, point.z,
+                                         inverse_leaf_, inverse_leaf_,
+                                         inverse_leaf_);
+        const VoxelKey key = TileKey(leaf);
+        if (only != nullptr && only->count(key) == 0)
+          continue;
+        if (tile == nullptr || tile_key != key) {
+          tile = &tiles_[key];
+          tile_key = key;
+          if (tile->frames.insert(id).second && only == nullptr)
+            keys.push_back(key);
+        }
+        Voxel& voxel = tile->voxels[leaf];
+        voxel.x += point.x;
+        voxel.y += point.y;
+        voxel.z += point.z;
+        voxel.intensity += point.intensity;
+        ++voxel.count;
+      }
+    }
+    if (keys.empty())
+      frames_.erase(id);
+  }
+
+  template <typename CloudT>
+  static void AppendTo(const Tile& tile, CloudT* cloud) {
+    cloud->points.reserve(cloud->points.size() + tile.voxels.size());
+    for (const auto& it : tile.voxels) {
+      const Voxel& voxel = it.second;
+      const double inverse_count = 1.0 / voxel.count;
+      PointT centroid = PointT();
+      centroid.x = static_cast<float>(voxel.x * inverse_count);
+      centroid.y = static_cast<float>(voxel.y * inverse_count);
+      centroid.z = static_cast<float>(voxel.z * inverse_count);
+      centroid.intensity = static_cast<float>(voxel.intensity * inverse_count);
+      cloud->points.push_back(centroid);
+    }
+    cloud->width = static_cast<uint32_t>(cloud->points.size());
+    cloud->height = 1;
+    cloud->is_dense = true;
+  }
+
+  // From the leaf voxel of the point, so a leaf voxel is never split by
+  // rounding
+  VoxelKey TileKey(const VoxelKey& leaf) const {
+    return VoxelKey{FloorDiv(leaf.x), FloorDiv(leaf.y), FloorDiv(leaf.z)};
+  }
+
+  int32_t FloorDiv(int32_t k) const {
+    return k >= 0 ? k / leaves_per_tile_
+                  : -((-k + leaves_per_tile_ - 1) / leaves_per_tile_);
+  }
+
+  // Distance of v outside the range of tile index k along one axis
+  float Outside(float v, int32_t k) const {
+    const float low = k * tile_size_;
+    const float high = low + tile_size_;
+    return v < low ? low - v : (v > high ? v - high : 0.0f);
+  }
+
+  float inverse_leaf_;
+  int32_t leaves_per_tile_;
+  float tile_size_;
+  std::unordered_map<VoxelKey, Tile, VoxelKeyHash> tiles_;
+  // the tiles of every frame
+  std::unordered_map<int, std::vector<VoxelKey>> frames_;
+};
+
+}  // namespace lib
+}  // namespace apollo
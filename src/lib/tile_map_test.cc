@@ -0,0 +1,185 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "modules/tools/ilego_loam/src/lib/tile_map.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <random>
+#include <tuple>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "modules/tools/ilego_loam/src/lib/voxel_filter.h"
+
+namespace apollo {
+namespace lib {
+
+struct Point {
+  float x = 0;
+  float y = 0;
+  float z = 0;
+  float intensity = 0;
+};
+
+struct Cloud {
+  std::vector<Point> points;
+  uint32_t width = 0;
+  uint32_t height = 0;
+  bool is_dense = false;
+};
+
+// By the voxel of leaf_size of the centroids, the same on both sides while
+// the centroids themselves may differ in the last bit
+void SortPoints(float leaf_size, std::vector<Point>* points) {
+  auto key = [leaf_size](const Point& p) {
+    return std::make_tuple(std::floor(p.x / leaf_size),
+                           std::floor(p.y / leaf_size),
+                           std::floor(p.z / leaf_size));
+  };
+  std::sort(points->begin(), points->end(),
+            [&key](const Point& a, const Point& b) { return key(a) < key(b); });
+}
+
+class TileMapTest : public ::testing::Test {
+ protected:
+  Cloud MakeFrame(float offset) {
+    std::uniform_real_distribution<float> dist(-8, 8);
+    Cloud cloud;
+    for (int i = 0; i < 3000; ++i)
+      cloud.points.push_back({dist(rng_) + offset, dist(rng_), dist(rng_) - 3, 1});
+    return cloud;
+  }
+
+  void ExpectMatchesFilter(const TileMap<Point>& map,
+                           const std::map<int, Cloud>& frames) {
+    std::vector<const Cloud*> inputs;
+    for (const auto& frame : frames)
+      inputs.push_back(&frame.second);
+    Cloud expect;
+    VoxelFilter<Point> filter(0.5f, 0.5f, 0.5f);
+    filter.Filter(inputs.begin(), inputs.end(), &expect);
+
+    Cloud actual;
+    map.ToCloud(&actual);
+    ASSERT_EQ(actual.points.size(), expect.points.size());
+    EXPECT_EQ(map.size(), expect.points.size());
+    SortPoints(0.5f, &actual.points);
+    SortPoints(0.5f, &expect.points);
+    for (size_t i = 0; i < actual.points.size(); ++i) {
+      EXPECT_NEAR(actual.points[i].x, expect.points[i].x, 1e-4);
+      EXPECT_NEAR(actual.points[i].y, expect.points[i].y, 1e-4);
+      EXPECT_NEAR(actual.points[i].z, expect.points[i].z, 1e-4);
+    }
+  }
+
+  // The clouds of a frame as the map reads them back, counting the reads
+  std::vector<const Cloud*> CloudsOf(const std::map<int, Cloud>& frames,
+                                     int id) {
+    ++reads_;
+    return {&frames.at(id)};
+  }
+
+  std::mt19937 rng_{3};
+  int reads_ = 0;
+};
+
+TEST_F(TileMapTest, AddMoveAndRemoveFrames) {
+  // 4.9 is rounded to 10 leaves
+  TileMap<Point> map(0.5f, 4.9f);
+  EXPECT_FLOAT_EQ(map.tile_size(), 5.0f);
+  std::map<int, Cloud> frames;
+  auto clouds_of = [this, &frames](int id) { return CloudsOf(frames, id); };
+  for (int id = 0; id < 6; ++id) {
+    frames[id] = MakeFrame(id * 6.0f);
+    map.Update({id}, clouds_of);
+  }
+  EXPECT_EQ(map.frame_size(), 6u);
+  // a new frame is read once
+  EXPECT_EQ(reads_, 6);
+  ExpectMatchesFilter(map, frames);
+
+  // frames moved by a loop closure, given twice
+  frames[2] = MakeFrame(40.0f);
+  frames[3] = MakeFrame(-20.0f);
+  map.Update({2, 3, 2, 6}, [&](int id) {
+    if (id == 6)
+      frames[6] = MakeFrame(90.0f);
+    return CloudsOf(frames, id);
+  });
+  ExpectMatchesFilter(map, frames);
+  EXPECT_EQ(map.frame_size(), 7u);
+
+  EXPECT_TRUE(map.Remove(4, clouds_of));
+  EXPECT_FALSE(map.Remove(4, clouds_of));
+  frames.erase(4);
+  ExpectMatchesFilter(map, frames);
+
+  // the tiles together are the map
+  Cloud buffer;
+  size_t total = 0;
+  map.ForEachTile(&buffer, [&total](const Cloud& tile) {
+    total += tile.points.size();
+  });
+  EXPECT_EQ(total, map.size());
+
+  map.Clear();
+  EXPECT_EQ(map.size(), 0u);
+  EXPECT_EQ(map.tile_count(), 0u);
+}
+
+TEST_F(TileMapTest, MovingAFrameOnlyReadsItsTiles) {
+  TileMap<Point> map(0.5f, 5.0f);
+  std::map<int, Cloud> frames;
+  auto clouds_of = [this, &frames](int id) { return CloudsOf(frames, id); };
+  // frames far apart do not share a tile
+  for (int id = 0; id < 10; ++id)
+    frames[id] = MakeFrame(id * 100.0f);
+  map.Update({0, 1, 2, 3, 4, 5, 6, 7, 8, 9}, clouds_of);
+  EXPECT_EQ(reads_, 10);
+
+  // frame 3 moves onto frame 4, only frame 3 is read
+  reads_ = 0;
+  frames[3] = MakeFrame(400.0f);
+  map.Update({3}, clouds_of);
+  EXPECT_EQ(reads_, 1);
+  ExpectMatchesFilter(map, frames);
+
+  // moving it away again rebuilds the tiles shared with frame 4
+  reads_ = 0;
+  frames[3] = MakeFrame(300.0f);
+  map.Update({3}, clouds_of);
+  EXPECT_EQ(reads_, 2);
+  ExpectMatchesFilter(map, frames);
+}
+
+TEST_F(TileMapTest, TilesWithinRadius) {
+  TileMap<Point> map(0.5f, 5.0f);
+  std::map<int, Cloud> frames = {{0, MakeFrame(0.0f)}, {1, MakeFrame(100.0f)}};
+  map.Update({0, 1}, [this, &frames](int id) { return CloudsOf(frames, id); });
+
+  Cloud near;
+  map.ToCloud(Point{0, 0, 0, 0}, 20.0f, &near);
+  EXPECT_FALSE(near.points.empty());
+  for (const Point& p : near.points)
+    EXPECT_LT(p.x, 50.0f);
+
+  Cloud all;
+  map.ToCloud(&all);
+  EXPECT_GT(all.points.size(), near.points.size());
+}
+
+}  // namespace lib
+}  // namespace apollo
@@ -0,0 +1,116 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <utility>
+
+namespace apollo {
+namespace lib {
+
+// Matches the messages of several channels by their timestamp, e.g. a
+// cloud, its info and its outliers written for the same scan.
+//
+// Each channel keeps its last queue_size messages. When every channel has
+// one within tolerance of the others, the set is handed to the callback
+// and the older messages of all channels are dropped, a message that never
+// finds its partners is dropped by the newer ones. The readers may call Add
+// from different threads, the callback runs on the one completing the set
+// and never on two threads at once.
+template <typename... Ts>
+class TimestampSync {
+ public:
+  using Callback = std::function<void(const std::shared_ptr<Ts>&...)>;
+
+  template <std::size_t I>
+  using Message = typename std::tuple_element<I, std::tuple<Ts...>>::type;
+
+  TimestampSync(std::size_t queue_size, double tolerance, Callback callback)
+      : queue_size_(queue_size), tolerance_(tolerance),
+        callback_(std::move(callback)) {}
+
+  TimestampSync(const TimestampSync&) = delete;
+  TimestampSync& operator=(const TimestampSync&) = delete;
+
+  // Adds the message of channel I, runs the callback if it completes a set
+  template <std::size_t I>
+  void Add(double timestamp, std::shared_ptr<Message<I>> message) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& queue = std::get<I>(queues_);
+    queue.emplace_back(timestamp, std::move(message));
+    if (queue.size() > queue_size_) {
+      queue.pop_front();
+      ++dropped_;
+    }
+    Match(std::index_sequence_for<Ts...>());
+  }
+
+  // Messages dropped without a match so far
+  std::size_t dropped() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return dropped_;
+  }
+
+ private:
+  template <typename T>
+  using Queue = std::deque<std::pair<double, std::shared_ptr<T>>>;
+
+  template <std::size_t... Is>
+  void Match(std::index_sequence<Is...>) {
+    while (!(std::get<Is>(queues_).empty() || ...)) {
+      // The newest of the oldest messages, anything older than it by more
+      // than the tolerance has no partner left
+      double latest = -std::numeric_limits<double>::infinity();
+      ((latest = std::max(latest, std::get<Is>(queues_).front().first)), ...);
+      bool matched = true;
+      (DropBefore(latest, &std::get<Is>(queues_), &matched), ...);
+      if (!matched)
+        continue;
+
+      auto messages = std::make_tuple(std::get<Is>(queues_).front().second...);
+      (std::get<Is>(queues_).pop_front(), ...);
+      callback_(std::get<Is>(messages)...);
+    }
+  }
+
+  // Clears matched if the queue has no message at latest
+  template <typename T>
+  void DropBefore(double latest, Queue<T>* queue, bool* matched) {
+    while (!queue->empty() && queue->front().first < latest - tolerance_) {
+      queue->pop_front();
+      ++dropped_;
+    }
+    if (queue->empty() || std::fabs(queue->front().first - latest) > tolerance_)
+      *matched = false;
+  }
+
+  const std::size_t queue_size_;
+  const double tolerance_;
+  Callback callback_;
+  mutable std::mutex mutex_;
+  std::tuple<Queue<Ts>...> queues_;
+  std::size_t dropped_ = 0;
+};
+
+}  // namespace lib
+}  // namespace apollo
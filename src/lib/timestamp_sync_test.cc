@@ -0,0 +1,133 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "modules/tools/ilego_loam/src/lib/timestamp_sync.h"
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace apollo {
+namespace lib {
+
+struct Matched {
+  int a;
+  std::string b;
+  double c;
+};
+
+class TimestampSyncTest : public ::testing::Test {
+ protected:
+  TimestampSync<int, std::string, double> sync_{
+      4, 1e-3,
+      [this](const std::shared_ptr<int>& a, const std::shared_ptr<std::string>& b,
+             const std::shared_ptr<double>& c) {
+        matched_.push_back({*a, *b, *c});
+      }};
+  std::vector<Matched> matched_;
+};
+
+TEST_F(TimestampSyncTest, MatchesOnceAllChannelsArrive) {
+  sync_.Add<0>(1.0, std::make_shared<int>(1));
+  sync_.Add<1>(1.0, std::make_shared<std::string>("one"));
+  EXPECT_TRUE(matched_.empty());
+  sync_.Add<2>(1.0, std::make_shared<double>(1.5));
+  ASSERT_EQ(matched_.size(), 1u);
+  EXPECT_EQ(matched_[0].a, 1);
+  EXPECT_EQ(matched_[0].b, "one");
+  EXPECT_EQ(matched_[0].c, 1.5);
+  EXPECT_EQ(sync_.dropped(), 0u);
+}
+
+TEST_F(TimestampSyncTest, MatchesWithinTolerance) {
+  sync_.Add<0>(1.0, std::make_shared<int>(1));
+  sync_.Add<1>(1.0005, std::make_shared<std::string>("one"));
+  sync_.Add<2>(0.9995, std::make_shared<double>(1.5));
+  EXPECT_EQ(matched_.size(), 1u);
+
+  sync_.Add<0>(2.0, std::make_shared<int>(2));
+  sync_.Add<1>(2.01, std::make_shared<std::string>("two"));
+  sync_.Add<2>(2.0, std::make_shared<double>(2.5));
+  EXPECT_EQ(matched_.size(), 1u);
+}
+
+TEST_F(TimestampSyncTest, DropsMessagesWithoutPartner) {
+  // the info of scan 1 was lost, scan 2 still matches
+  sync_.Add<0>(1.0, std::make_shared<int>(1));
+  sync_.Add<2>(1.0, std::make_shared<double>(1.5));
+  sync_.Add<0>(2.0, std::make_shared<int>(2));
+  sync_.Add<2>(2.0, std::make_shared<double>(2.5));
+  sync_.Add<1>(2.0, std::make_shared<std::string>("two"));
+  ASSERT_EQ(matched_.size(), 1u);
+  EXPECT_EQ(matched_[0].a, 2);
+  EXPECT_EQ(matched_[0].c, 2.5);
+  EXPECT_EQ(sync_.dropped(), 2u);
+}
+
+TEST_F(TimestampSyncTest, MatchesOutOfOrderChannels) {
+  for (int i = 0; i < 3; ++i)
+    sync_.Add<1>(i, std::make_shared<std::string>(std::to_string(i)));
+  for (int i = 0; i < 3; ++i)
+    sync_.Add<2>(i, std::make_shared<double>(i));
+  for (int i = 0; i < 3; ++i)
+    sync_.Add<0>(i, std::make_shared<int>(i));
+  ASSERT_EQ(matched_.size(), 3u);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(matched_[i].a, i);
+    EXPECT_EQ(matched_[i].b, std::to_string(i));
+  }
+}
+
+TEST_F(TimestampSyncTest, BoundsTheQueues) {
+  for (int i = 0; i < 10; ++i)
+    sync_.Add<0>(i, std::make_shared<int>(i));
+  EXPECT_EQ(sync_.dropped(), 6u);
+  sync_.Add<1>(9, std::make_shared<std::string>("nine"));
+  sync_.Add<2>(9, std::make_shared<double>(9));
+  ASSERT_EQ(matched_.size(), 1u);
+  EXPECT_EQ(matched_[0].a, 9);
+  EXPECT_EQ(sync_.dropped(), 9u);
+}
+
+TEST(TimestampSyncThreadTest, MatchesAcrossThreads) {
+  constexpr int kScans = 1000;
+  int matched = 0;
+  bool ordered = true;
+  int last = -1;
+  TimestampSync<int, int> sync(
+      kScans, 1e-3,
+      [&](const std::shared_ptr<int>& a, const std::shared_ptr<int>& b) {
+        ordered = ordered && *a == *b && *a > last;
+        last = *a;
+        ++matched;
+      });
+  std::thread first([&] {
+    for (int i = 0; i < kScans; ++i)
+      sync.Add<0>(i, std::make_shared<int>(i));
+  });
+  std::thread second([&] {
+    for (int i = 0; i < kScans; ++i)
+      sync.Add<1>(i, std::make_shared<int>(i));
+  });
+  first.join();
+  second.join();
+  EXPECT_EQ(matched, kScans);
+  EXPECT_TRUE(ordered);
+}
+
+}  // namespace lib
+}  // namespace apollo
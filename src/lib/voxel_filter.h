@@ -0,0 +1,168 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
+#include <vector>
+
+#include "modules/tools/ilego_loam/src/lib/voxel_key.h"
+
+namespace apollo {
+namespace lib {
+
+// Voxel grid downsampling, the same output as pcl::VoxelGrid (the centroid
+// of x, y, z and intensity of each voxel) apart from the point order, which
+// is the order the voxels are first seen in.
+//
+// The voxels are found with an open addressing hash table instead of
+// sorting, and the table and the voxel sums are kept between calls, so a
+// filter used every frame does not allocate once it has grown. CloudT is
+// pcl::PointCloud<PointT> or any type with the same points, width, height
+// and is_dense members. Not thread safe, use one filter per thread.
+template <typename PointT>
+class VoxelFilter {
+ public:
+  VoxelFilter() = default;
+  VoxelFilter(float leaf_x, float leaf_y, float leaf_z) {
+    SetLeafSize(leaf_x, leaf_y, leaf_z);
+  }
+
+  void SetLeafSize(float leaf_x, float leaf_y, float leaf_z) {
+    inverse_leaf_x_ = 1.0f / leaf_x;
+    inverse_leaf_y_ = 1.0f / leaf_y;
+    inverse_leaf_z_ = 1.0f / leaf_z;
+  }
+
+  // output is replaced and may be the input itself
+  template <typename CloudT>
+  void Filter(const CloudT& input, CloudT* output) {
+    const CloudT* inputs[] = {&input};
+    Filter(std::begin(inputs), std::end(inputs), output);
+  }
+
+  // Downsamples the union of the inputs in one pass, without concatenating
+  // them first
+  template <typename CloudT>
+  void Filter(std::initializer_list<const CloudT*> inputs, CloudT* output) {
+    Filter(inputs.begin(), inputs.end(), output);
+  }
+
+  // [first, last) dereference to pointers of clouds, e.g. a container of
+  // pcl::PointCloud<PointT>::Ptr
+  template <typename InputIt, typename CloudT>
+  void Filter(InputIt first, InputIt last, CloudT* output) {
+    size_t total = 0;
+    for (InputIt it = first; it != last; ++it)
+      total += (**it).points.size();
+    Reset(total);
+
+    for (InputIt it = first; it != last; ++it) {
+      for (const PointT& point : (**it).points)
+        Add(point);
+    }
+
+    // All the inputs are read before the output is written
+    output->points.resize(voxels_.size());
+    for (size_t i = 0; i < voxels_.size(); ++i) {
+      const Voxel& voxel = voxels_[i];
+      const float inverse_count = 1.0f / voxel.count;
+      PointT& point = output->points[i];
+      point = PointT();
+      point.x = voxel.x * inverse_count;
+      point.y = voxel.y * inverse_count;
+      point.z = voxel.z * inverse_count;
+      point.intensity = voxel.intensity * inverse_count;
+    }
+    output->width = static_cast<uint32_t>(voxels_.size());
+    output->height = 1;
+    output->is_dense = true;
+  }
+
+ private:
+  struct Voxel {
+    float x;
+    float y;
+    float z;
+    float intensity;
+    int count;
+  };
+
+  // Grows the table to at least twice the number of points, slots written
+  // in earlier calls are invalidated by the generation instead of cleared
+  void Reset(size_t points) {
+    voxels_.clear();
+    size_t capacity = 16;
+    while (capacity < 2 * points)
+      capacity <<= 1;
+    if (capacity > keys_.size()) {
+      keys_.resize(capacity);
+      slots_.resize(capacity);
+      generation_of_.assign(capacity, 0);
+      generation_ = 0;
+    }
+    mask_ = keys_.size() - 1;
+    if (++generation_ == 0) {
+      std::fill(generation_of_.begin(), generation_of_.end(), 0);
+      generation_ = 1;
+    }
+  }
+
+  void Add(const PointT& point) {
+    if (!std::isfinite(point.x) || !std::isfinite(point.y) ||
+        !std::isfinite(point.z))
+      return;
+
+    VoxelKey key = ToVoxelKey(point.x, point.y, point.z, inverse_leaf_x_,
+                              inverse_leaf_y_, inverse_leaf_z_);
+
+    size_t h = VoxelKeyHash()(key) & mask_;
+    while (generation_of_[h] == generation_ && keys_[h] != key)
+      h = (h + 1) & mask_;
+
+    if (generation_of_[h] != generation_) {
+      generation_of_[h] = generation_;
+      keys_[h] = key;
+      slots_[h] = static_cast<int>(voxels_.size());
+      voxels_.push_back({point.x, point.y, point.z, point.intensity, 1});
+      return;
+    }
+
+    Voxel& voxel = voxels_[slots_[h]];
+    voxel.x += point.x;
+    voxel.y += point.y;
+    voxel.z += point.z;
+    voxel.intensity += point.intensity;
+    ++voxel.count;
+  }
+
+  float inverse_leaf_x_ = 1.0f;
+  float inverse_leaf_y_ = 1.0f;
+  float inverse_leaf_z_ = 1.0f;
+
+  std::vector<VoxelKey> keys_;
+  std::vector<int> slots_;
+  std::vector<uint32_t> generation_of_;
+  uint32_t generation_ = 0;
+  size_t mask_ = 0;
+
+  std::vector<Voxel> voxels_;
+};
+
+}  // namespace lib
+}  // namespace apollo
@@ -0,0 +1,146 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "modules/tools/ilego_loam/src/lib/voxel_filter.h"
+
+#include <cmath>
+#include <limits>
+#include <map>
+#include <memory>
+#include <random>
+#include <tuple>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace apollo {
+namespace lib {
+
+struct Point {
+  float x = 0;
+  float y = 0;
+  float z = 0;
+  float intensity = 0;
+};
+
+// same members as pcl::PointCloud
+struct Cloud {
+  std::vector<Point> points;
+  uint32_t width = 0;
+  uint32_t height = 0;
+  bool is_dense = false;
+};
+
+Cloud RandomCloud(int size, float extent, std::mt19937* rng) {
+  std::uniform_real_distribution<float> dist(-extent, extent);
+  Cloud cloud;
+  for (int i = 0; i < size; ++i)
+    cloud.points.push_back({dist(*rng), dist(*rng), dist(*rng), dist(*rng)});
+  return cloud;
+}
+
+// Reference centroids keyed by voxel, as pcl::VoxelGrid computes them
+std::map<std::tuple<int, int, int>, Point> ReferenceVoxels(
+    const std::vector<const Cloud*>& inputs, float leaf) {
+  std::map<std::tuple<int, int, int>, std::pair<Point, int>> sums;
+  for (const Cloud* cloud : inputs) {
+    for (const Point& p : cloud->points) {
+      if (!std::isfinite(p.x))
+        continue;
+      auto key = std::make_tuple(static_cast<int>(std::floor(p.x / leaf)),
+                                 static_cast<int>(std::floor(p.y / leaf)),
+                                 static_cast<int>(std::floor(p.z / leaf)));
+      auto& sum = sums[key];
+      sum.first.x += p.x;
+      sum.first.y += p.y;
+      sum.first.z += p.z;
+      sum.first.intensity += p.intensity;
+      ++sum.second;
+    }
+  }
+  std::map<std::tuple<int, int, int>, Point> voxels;
+  for (const auto& sum : sums) {
+    const Point& p = sum.second.first;
+    int n = sum.second.second;
+    voxels[sum.first] = {p.x / n, p.y / n, p.z / n, p.intensity / n};
+  }
+  return voxels;
+}
+
+void ExpectSameVoxels(const std::vector<const Cloud*>& inputs, float leaf,
+                      const Cloud& output) {
+  auto expect = ReferenceVoxels(inputs, leaf);
+  ASSERT_EQ(output.points.size(), expect.size());
+  EXPECT_EQ(output.width, expect.size());
+  EXPECT_EQ(output.height, 1u);
+  for (const Point& p : output.points) {
+    auto key = std::make_tuple(static_cast<int>(std::floor(p.x / leaf)),
+                               static_cast<int>(std::floor(p.y / leaf)),
+                               static_cast<int>(std::floor(p.z / leaf)));
+    auto it = expect.find(key);
+    ASSERT_TRUE(it != expect.end());
+    EXPECT_NEAR(p.x, it->second.x, 1e-4);
+    EXPECT_NEAR(p.y, it->second.y, 1e-4);
+    EXPECT_NEAR(p.z, it->second.z, 1e-4);
+    EXPECT_NEAR(p.intensity, it->second.intensity, 1e-4);
+  }
+}
+
+TEST(VoxelFilterTest, MatchesCentroidPerVoxel) {
+  std::mt19937 rng(7);
+  VoxelFilter<Point> filter(0.5, 0.5, 0.5);
+  Cloud output;
+  // reuse the filter and the output with growing and shrinking inputs
+  for (int size : {100, 5000, 20, 20000, 0}) {
+    Cloud input = RandomCloud(size, 5.0, &rng);
+    filter.Filter(input, &output);
+    ExpectSameVoxels({&input}, 0.5, output);
+  }
+}
+
+TEST(VoxelFilterTest, MultipleInputs) {
+  std::mt19937 rng(11);
+  Cloud a = RandomCloud(3000, 4.0, &rng);
+  Cloud b = RandomCloud(1000, 8.0, &rng);
+  std::vector<std::shared_ptr<Cloud>> frames = {
+      std::make_shared<Cloud>(a), std::make_shared<Cloud>(b)};
+
+  VoxelFilter<Point> filter(1.0, 1.0, 1.0);
+  Cloud output;
+  filter.Filter({&a, &b}, &output);
+  ExpectSameVoxels({&a, &b}, 1.0, output);
+
+  Cloud from_range;
+  filter.Filter(frames.begin(), frames.end(), &from_range);
+  ASSERT_EQ(from_range.points.size(), output.points.size());
+  for (size_t i = 0; i < output.points.size(); ++i)
+    EXPECT_EQ(from_range.points[i].x, output.points[i].x);
+}
+
+TEST(VoxelFilterTest, InPlaceAndNaN) {
+  Cloud cloud;
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  cloud.points = {{0.1, 0.1, 0.1, 1}, {0.3, 0.3, 0.3, 3}, {nan, 0, 0, 5},
+                  {-0.1, 0.1, 0.1, 7}};
+  VoxelFilter<Point> filter(1.0, 1.0, 1.0);
+  filter.Filter(cloud, &cloud);
+  ASSERT_EQ(cloud.points.size(), 2u);
+  EXPECT_FLOAT_EQ(cloud.points[0].x, 0.2);
+  EXPECT_FLOAT_EQ(cloud.points[0].intensity, 2);
+  EXPECT_FLOAT_EQ(cloud.points[1].x, -0.1);
+  EXPECT_TRUE(cloud.is_dense);
+}
+
+}  // namespace lib
+}  // namespace apollo
@@ -0,0 +1,400 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "modules/tools/ilego_loam/src/lib/voxel_key.h"
+
+namespace apollo {
+namespace lib {
+
+// Incremental spatial index, points are bucketed into a hash map of cubic
+// voxels. Unlike a kd tree it has no global structure, so inserting points
+// and deleting boxes are local updates and nothing needs rebalancing.
+//
+// Nearest neighbor searches visit the voxels around the query in growing
+// cubic shells, resolution should be about the search radius used by the
+// caller. PointT needs float x, y and z members. The searches may run
+// concurrently with each other but not with an update.
+template <typename PointT>
+class VoxelHashMap {
+ public:
+  // max_points_per_voxel is the number of points a voxel keeps, further
+  // points in a full voxel are dropped, 0 means unlimited
+  explicit VoxelHashMap(float resolution = 1.0f, size_t max_points_per_voxel = 0)
+      : resolution_(resolution),
+        inverse_resolution_(1.0f / resolution),
+        max_points_per_voxel_(max_points_per_voxel) {}
+
+  float resolution() const { return resolution_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  size_t voxel_size() const { return voxels_.size(); }
+
+  // Removes all the points, the voxel buffers are kept for reuse
+  void Clear() {
+    for (Voxel& voxel : voxels_)
+      voxel.points.clear();
+    free_voxels_.insert(free_voxels_.end(),
+                        std::make_move_iterator(voxels_.begin()),
+                        std::make_move_iterator(voxels_.end()));
+    voxels_.clear();
+    index_.clear();
+    size_ = 0;
+  }
+
+  void Insert(const PointT& point) {
+    if (!std::isfinite(point.x) || !std::isfinite(point.y) ||
+        !std::isfinite(point.z))
+      return;
+
+    const VoxelKey key = Key(point.x, point.y, point.z);
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+      it = index_.emplace(key, voxels_.size()).first;
+      voxels_.push_back(NewVoxel(key));
+    }
+    auto& points = voxels_[it->second].points;
+    if (max_points_per_voxel_ > 0 && points.size() >= max_points_per_voxel_)
+      return;
+    points.push_back(point);
+    ++size_;
+  }
+
+  // CloudT is pcl::PointCloud<PointT> or any type with points
+  template <typename CloudT>
+  void Insert(const CloudT& cloud) {
+    for (const PointT& point : cloud.points)
+      Insert(point);
+  }
+
+  // Deletes one point with the same x, y and z as point, returns false if
+  // there is none
+  bool Erase(const PointT& point) {
+    auto it = index_.find(Key(point.x, point.y, point.z));
+    if (it == index_.end())
+      return false;
+    const size_t i = it->second;
+    auto& points = voxels_[i].points;
+    for (size_t j = 0; j < points.size(); ++j) {
+      if (points[j].x == point.x && points[j].y == point.y &&
+          points[j].z == point.z) {
+        points[j] = points.back();
+        points.pop_back();
+        --size_;
+        if (points.empty())
+          RemoveVoxel(i);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Deletes the points in the box [min, max], returns the number deleted
+  size_t DeleteBox(const PointT& min, const PointT& max) {
+    return DeleteIf(min, max, [&](const PointT& p) {
+      return InBox(p, min, max);
+    });
+  }
+
+  // Deletes the points outside of the box [min, max], e.g. to keep a local
+  // map around the vehicle, returns the number deleted
+  size_t DeleteOutsideBox(const PointT& min, const PointT& max) {
+    const VoxelKey lo = Key(min.x, min.y, min.z);
+    const VoxelKey hi = Key(max.x, max.y, max.z);
+    size_t deleted = 0;
+    for (size_t i = 0; i < voxels_.size();) {
+      Voxel& voxel = voxels_[i];
+      if (KeyInRange(voxel.key, lo, hi) && !KeyOnBorder(voxel.key, lo, hi)) {
+        ++i;
+        continue;
+      }
+      deleted += EraseIf(&voxel, [&](const PointT& p) {
+        return !InBox(p, min, max);
+      });
+      if (voxel.points.empty()) {
+        RemoveVoxel(i);
+      } else {
+        ++i;
+      }
+    }
+    return deleted;
+  }
+
+  // The k nearest points within max_distance, sorted by distance.
+  // Returns the number of points found.
+  size_t NearestKSearch(const PointT& query, size_t k, float max_distance,
+                        std::vector<PointT>* points,
+                        std::vector<float>* sq_distances) const {
+    points->clear();
+    sq_distances->clear();
+    if (k == 0 || empty())
+      return 0;
+
+    const float max_sq_distance = max_distance * max_distance;
+    const VoxelKey center = Key(query.x, query.y, query.z);
+    const int max_shell = static_cast<int>(
+        std::ceil(max_distance * inverse_resolution_));
+
+    // max heap on the distance of the k best candidates
+    std::vector<std::pair<float, const PointT*>>& heap = SearchBuffer();
+    for (int shell = 0; shell <= max_shell; ++shell) {
+      // A point in shell s is at least (s - 1) * resolution away
+      if (heap.size() == k && shell > 0) {
+        float bound = (shell - 1) * resolution_;
+        if (bound * bound > heap.front().first)
+          break;
+      }
+      VisitShell(center, shell, [&](const Voxel& voxel) {
+        for (const PointT& p : voxel.points) {
+          float d = SquaredDistance(p, query);
+          if (d > max_sq_distance)
+            continue;
+          if (heap.size() < k) {
+            heap.emplace_back(d, &p);
+            std::push_heap(heap.begin(), heap.end(), HeapLess);
+          } else if (d < heap.front().first) {
+            std::pop_heap(heap.begin(), heap.end(), HeapLess);
+            heap.back() = std::make_pair(d, &p);
+            std::push_heap(heap.begin(), heap.end(), HeapLess);
+          }
+        }
+      });
+    }
+
+    std::sort_heap(heap.begin(), heap.end(), HeapLess);
+    for (const auto& candidate : heap) {
+      sq_distances->push_back(candidate.first);
+      points->push_back(*candidate.second);
+    }
+    return points->size();
+  }
+
+  // All the points within radius, sorted by distance.
+  // Returns the number of points found.
+  size_t RadiusSearch(const PointT& query, float radius,
+                      std::vector<PointT>* points,
+                      std::vector<float>* sq_distances) const {
+    points->clear();
+    sq_distances->clear();
+
+    const float sq_radius = radius * radius;
+    std::vector<std::pair<float, const PointT*>>& found = SearchBuffer();
+    VisitBox(Key(query.x - radius, query.y - radius, query.z - radius),
+             Key(query.x + radius, query.y + radius, query.z + radius),
+             [&](const Voxel& voxel) {
+      for (const PointT& p : voxel.points) {
+        float d = SquaredDistance(p, query);
+        if (d <= sq_radius)
+          found.emplace_back(d, &p);
+      }
+    });
+
+    std::sort(found.begin(), found.end(), HeapLess);
+    for (const auto& candidate : found) {
+      sq_distances->push_back(candidate.first);
+      points->push_back(*candidate.second);
+    }
+    return points->size();
+  }
+
+  // Calls func(point) for every point
+  template <typename Func>
+  void ForEach(Func func) const {
+    for (const Voxel& voxel : voxels_) {
+      for (const PointT& p : voxel.points)
+        func(p);
+    }
+  }
+
+ private:
+  struct Voxel {
+    VoxelKey key;
+    std::vector<PointT> points;
+  };
+
+  // per thread, so concurrent searches do not allocate
+  static std::vector<std::pair<float, const PointT*>>& SearchBuffer() {
+    static thread_local std::vector<std::pair<float, const PointT*>> buffer;
+    buffer.clear();
+    return buffer;
+  }
+
+  static bool HeapLess(const std::pair<float, const PointT*>& l,
+                       const std::pair<float, const PointT*>& r) {
+    return l.first < r.first;
+  }
+
+  static float SquaredDistance(const PointT& a, const PointT& b) {
+    float dx = a.x - b.x;
+    float dy = a.y - b.y;
+    float dz = a.z - b.z;
+    return dx * dx + dy * dy + dz * dz;
+  }
+
+  static bool InBox(const PointT& p, const PointT& min, const PointT& max) {
+    return p.x >= min.x && p.x <= max.x && p.y >= min.y && p.y <= max.y &&
+        p.z >= min.z && p.z <= max.z;
+  }
+
+  static bool KeyInRange(const VoxelKey& key, const VoxelKey& lo,
+                         const VoxelKey& hi) {
+    return key.x >= lo.x && key.x <= hi.x && key.y >= lo.y && key.y <= hi.y &&
+        key.z >= lo.z && key.z <= hi.z;
+  }
+
+  // Border voxels are only partly covered by the box
+  static bool KeyOnBorder(const VoxelKey& key, const VoxelKey& lo,
+                          const VoxelKey& hi) {
+    return key.x == lo.x || key.x == hi.x || key.y == lo.y || key.y == hi.y ||
+        key.z == lo.z || key.z == hi.z;
+  }
+
+  VoxelKey Key(float x, float y, float z) const {
+    return ToVoxelKey(x, y, z, inverse_resolution_, inverse_resolution_,
+                      inverse_resolution_);
+  }
+
+  Voxel NewVoxel(const VoxelKey& key) {
+    if (free_voxels_.empty())
+      return Voxel{key, {}};
+    Voxel voxel = std::move(free_voxels_.back());
+    free_voxels_.pop_back();
+    voxel.key = key;
+    return voxel;
+  }
+
+  template <typename Pred>
+  size_t EraseIf(Voxel* voxel, Pred pred) {
+    auto& points = voxel->points;
+    size_t before = points.size();
+    points.erase(std::remove_if(points.begin(), points.end(), pred),
+                 points.end());
+    size_t erased = before - points.size();
+    size_ -= erased;
+    return erased;
+  }
+
+  // Swaps the voxel with the last one, so the voxels stay contiguous
+  void RemoveVoxel(size_t i) {
+    index_.erase(voxels_[i].key);
+    if (i + 1 != voxels_.size()) {
+      std::swap(voxels_[i], voxels_.back());
+      index_[voxels_[i].key] = i;
+    }
+    voxels_.back().points.clear();
+    free_voxels_.push_back(std::move(voxels_.back()));
+    voxels_.pop_back();
+  }
+
+  template <typename Pred>
+  size_t DeleteIf(const PointT& min, const PointT& max, Pred pred) {
+    const VoxelKey lo = Key(min.x, min.y, min.z);
+    const VoxelKey hi = Key(max.x, max.y, max.z);
+    // Gather the voxels first, removing one moves another one
+    std::vector<VoxelKey>& keys = keys_;
+    keys.clear();
+    VisitBox(lo, hi, [&](const Voxel& voxel) { keys.push_back(voxel.key); });
+
+    size_t deleted = 0;
+    for (const VoxelKey& key : keys) {
+      auto it = index_.find(key);
+      size_t i = it->second;
+      Voxel& voxel = voxels_[i];
+      if (KeyOnBorder(key, lo, hi)) {
+        deleted += EraseIf(&voxel, pred);
+      } else {
+        deleted += voxel.points.size();
+        size_ -= voxel.points.size();
+        voxel.points.clear();
+      }
+      if (voxel.points.empty())
+        RemoveVoxel(i);
+    }
+    return deleted;
+  }
+
+  // Visits the existing voxels with keys in [lo, hi], iterating the keys of
+  // a small box and the voxels of a large one
+  template <typename Func>
+  void VisitBox(const VoxelKey& lo, const VoxelKey& hi, Func func) const {
+    double box = static_cast<double>(hi.x - lo.x + 1) * (hi.y - lo.y + 1) *
+        (hi.z - lo.z + 1);
+    if (box > static_cast<double>(voxels_.size())) {
+      for (const Voxel& voxel : voxels_) {
+        if (KeyInRange(voxel.key, lo, hi))
+          func(voxel);
+      }
+      return;
+    }
+    for (int32_t x = lo.x; x <= hi.x; ++x) {
+      for (int32_t y = lo.y; y <= hi.y; ++y) {
+        for (int32_t z = lo.z; z <= hi.z; ++z) {
+          auto it = index_.find(VoxelKey{x, y, z});
+          if (it != index_.end())
+            func(voxels_[it->second]);
+        }
+      }
+    }
+  }
+
+  // Visits the existing voxels at Chebyshev distance shell from center
+  template <typename Func>
+  void VisitShell(const VoxelKey& center, int shell, Func func) const {
+    auto visit = [&](int32_t x, int32_t y, int32_t z) {
+      auto it = index_.find(VoxelKey{x, y, z});
+      if (it != index_.end())
+        func(voxels_[it->second]);
+    };
+    if (shell == 0) {
+      visit(center.x, center.y, center.z);
+      return;
+    }
+    for (int dx = -shell; dx <= shell; ++dx) {
+      for (int dy = -shell; dy <= shell; ++dy) {
+        if (std::abs(dx) == shell || std::abs(dy) == shell) {
+          for (int dz = -shell; dz <= shell; ++dz)
+            visit(center.x + dx, center.y + dy, center.z + dz);
+        } else {
+          visit(center.x + dx, center.y + dy, center.z - shell);
+          visit(center.x + dx, center.y + dy, center.z + shell);
+        }
+      }
+    }
+  }
+
+  float resolution_;
+  float inverse_resolution_;
+  size_t max_points_per_voxel_;
+  size_t size_ = 0;
+
+  std::vector<Voxel> voxels_;
+  std::unordered_map<VoxelKey, size_t, VoxelKeyHash> index_;
+  // cleared voxels whose point buffers are reused
+  std::vector<Voxel> free_voxels_;
+
+  // scratch buffer of DeleteBox
+  std::vector<VoxelKey> keys_;
+};
+
+}  // namespace lib
+}  // namespace apollo
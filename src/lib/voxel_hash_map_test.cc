@@ -0,0 +1,162 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "modules/tools/ilego_loam/src/lib/voxel_hash_map.h"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace apollo {
+namespace lib {
+
+struct Point {
+  float x = 0;
+  float y = 0;
+  float z = 0;
+};
+
+float SquaredDistance(const Point& a, const Point& b) {
+  return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y) +
+      (a.z - b.z) * (a.z - b.z);
+}
+
+std::vector<float> BruteForce(const std::vector<Point>& points,
+                              const Point& query, float max_distance) {
+  std::vector<float> distances;
+  for (const Point& p : points) {
+    float d = SquaredDistance(p, query);
+    if (d <= max_distance * max_distance)
+      distances.push_back(d);
+  }
+  std::sort(distances.begin(), distances.end());
+  return distances;
+}
+
+class VoxelHashMapTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    std::uniform_real_distribution<float> dist(-20, 20);
+    for (int i = 0; i < 5000; ++i)
+      points_.push_back({dist(rng_), dist(rng_), dist(rng_) * 0.2f});
+    map_.Insert(Cloud{points_});
+  }
+
+  struct Cloud {
+    const std::vector<Point>& points;
+  };
+
+  void ExpectSearchesMatch() {
+    std::uniform_real_distribution<float> dist(-25, 25);
+    std::vector<Point> found;
+    std::vector<float> sq_distances;
+    for (int i = 0; i < 200; ++i) {
+      Point query{dist(rng_), dist(rng_), dist(rng_) * 0.2f};
+
+      auto expect = BruteForce(points_, query, 5.0);
+      map_.NearestKSearch(query, 5, 5.0, &found, &sq_distances);
+      expect.resize(std::min<size_t>(expect.size(), 5));
+      ASSERT_EQ(sq_distances.size(), expect.size());
+      for (size_t j = 0; j < expect.size(); ++j) {
+        EXPECT_FLOAT_EQ(sq_distances[j], expect[j]);
+        EXPECT_FLOAT_EQ(SquaredDistance(found[j], query), expect[j]);
+      }
+
+      expect = BruteForce(points_, query, 3.0);
+      map_.RadiusSearch(query, 3.0, &found, &sq_distances);
+      EXPECT_EQ(sq_distances, expect);
+    }
+  }
+
+  std::mt19937 rng_{3};
+  std::vector<Point> points_;
+  VoxelHashMap<Point> map_{2.0};
+};
+
+TEST_F(VoxelHashMapTest, SearchMatchesBruteForce) {
+  EXPECT_EQ(map_.size(), points_.size());
+  ExpectSearchesMatch();
+}
+
+TEST_F(VoxelHashMapTest, DeleteBox) {
+  Point min{-5.5, -30, -30};
+  Point max{7.3, 3.1, 30};
+  size_t deleted = map_.DeleteBox(min, max);
+  auto in_box = [&](const Point& p) {
+    return p.x >= min.x && p.x <= max.x && p.y >= min.y && p.y <= max.y &&
+        p.z >= min.z && p.z <= max.z;
+  };
+  size_t before = points_.size();
+  points_.erase(std::remove_if(points_.begin(), points_.end(), in_box),
+                points_.end());
+  EXPECT_EQ(deleted, before - points_.size());
+  EXPECT_EQ(map_.size(), points_.size());
+  ExpectSearchesMatch();
+
+  // insert into the deleted region again
+  std::uniform_real_distribution<float> dist(-5, 3);
+  std::vector<Point> more;
+  for (int i = 0; i < 500; ++i)
+    more.push_back({dist(rng_), dist(rng_), dist(rng_) * 0.2f});
+  map_.Insert(Cloud{more});
+  points_.insert(points_.end(), more.begin(), more.end());
+  ExpectSearchesMatch();
+}
+
+TEST_F(VoxelHashMapTest, DeleteOutsideBox) {
+  Point min{-10.2, -8.7, -1};
+  Point max{9.9, 12.5, 1};
+  map_.DeleteOutsideBox(min, max);
+  points_.erase(std::remove_if(points_.begin(), points_.end(),
+                               [&](const Point& p) {
+    return !(p.x >= min.x && p.x <= max.x && p.y >= min.y && p.y <= max.y &&
+             p.z >= min.z && p.z <= max.z);
+  }), points_.end());
+  EXPECT_EQ(map_.size(), points_.size());
+  ExpectSearchesMatch();
+
+  map_.Clear();
+  EXPECT_TRUE(map_.empty());
+  points_.clear();
+  ExpectSearchesMatch();
+}
+
+TEST_F(VoxelHashMapTest, Erase) {
+  // erase every other point
+  std::vector<Point> kept;
+  for (size_t i = 0; i < points_.size(); ++i) {
+    if (i % 2 == 0) {
+      EXPECT_TRUE(map_.Erase(points_[i]));
+    } else {
+      kept.push_back(points_[i]);
+    }
+  }
+  points_.swap(kept);
+  EXPECT_EQ(map_.size(), points_.size());
+  EXPECT_FALSE(map_.Erase(Point{100, 100, 100}));
+  ExpectSearchesMatch();
+}
+
+TEST(VoxelHashMapCapacityTest, MaxPointsPerVoxel) {
+  VoxelHashMap<Point> map(1.0, 2);
+  for (int i = 0; i < 10; ++i)
+    map.Insert(Point{0.1f * i, 0.5, 0.5});
+  EXPECT_EQ(map.size(), 2u);
+  EXPECT_EQ(map.voxel_size(), 1u);
+}
+
+}  // namespace lib
+}  // namespace apollo
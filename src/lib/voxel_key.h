@@ -0,0 +1,53 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+namespace apollo {
+namespace lib {
+
+// Integer coordinates of a voxel
+struct VoxelKey {
+  int32_t x;
+  int32_t y;
+  int32_t z;
+
+  bool operator==(const VoxelKey& other) const {
+    return x == other.x && y == other.y && z == other.z;
+  }
+  bool operator!=(const VoxelKey& other) const { return !(*this == other); }
+};
+
+inline VoxelKey ToVoxelKey(float x, float y, float z, float inverse_leaf_x,
+                           float inverse_leaf_y, float inverse_leaf_z) {
+  return VoxelKey{static_cast<int32_t>(std::floor(x * inverse_leaf_x)),
+                  static_cast<int32_t>(std::floor(y * inverse_leaf_y)),
+                  static_cast<int32_t>(std::floor(z * inverse_leaf_z))};
+}
+
+struct VoxelKeyHash {
+  size_t operator()(const VoxelKey& key) const {
+    uint64_t h = static_cast<uint64_t>(static_cast<uint32_t>(key.x)) * 73856093u ^
+        static_cast<uint64_t>(static_cast<uint32_t>(key.y)) * 19349669u ^
+        static_cast<uint64_t>(static_cast<uint32_t>(key.z)) * 83492791u;
+    return static_cast<size_t>((h * 0x9E3779B97F4A7C15ull) >> 32);
+  }
+};
+
+}  // namespace lib
+}  // namespace apollo
@@ -27,226 +27,363 @@
 //  Created Date: 2022-5-5
 //  Author: daohu527
 
-#include "src/map_optmization.h"
+#include "modules/tools/ilego_loam/src/map_optmization.h"
+
+#include "gtsam/geometry/Rot3.h"
+#include "pcl/common/angles.h"
+#include "pcl/common/eigen.h"
+#include "pcl/common/transforms.h"
+
+#include "modules/localization/proto/localization.pb.h"
+
+#include "modules/tools/ilego_loam/flags/lego_loam_gflags.h"
+#include "modules/tools/ilego_loam/src/camera_frame.h"
 
 namespace apollo {
 namespace tools {
 
-void LoopClosureThread() {
-  if (!loopClosureEnableFlag)
-    return;
+using gtsam::Point3;
+using gtsam::Pose3;
+using gtsam::Rot3;
+
+namespace {
+
+constexpr float kScanContextRange = 80.0f;
+constexpr float kScanContextSensorHeight = 2.0f;
+// Leaf sizes of the scan downsampling by load level, a coarser scan is
+// matched faster. The local maps keep their own leaf sizes.
+constexpr float kCornerLeafSizes[] = {0.2f, 0.3f, 0.4f};
+constexpr float kSurfLeafSizes[] = {0.4f, 0.6f, 0.8f};
+
+// The transform of a key pose, rotated in the z, x, y order of the camera
+// frame
+Eigen::Affine3f keyPoseToAffine(const PointTypePose& pose) {
+  return Eigen::Translation3f(pose.x, pose.y, pose.z) *
+         Eigen::AngleAxisf(pose.pitch, Eigen::Vector3f::UnitY()) *
+         Eigen::AngleAxisf(pose.roll, Eigen::Vector3f::UnitX()) *
+         Eigen::AngleAxisf(pose.yaw, Eigen::Vector3f::UnitZ());
+}
+
+PointTypePose trans2PointTypePose(const float transformIn[6]) {
+  PointTypePose thisPose6D;
+  thisPose6D.x = transformIn[3];
+  thisPose6D.y = transformIn[4];
+  thisPose6D.z = transformIn[5];
+  thisPose6D.roll = transformIn[0];
+  thisPose6D.pitch = transformIn[1];
+  thisPose6D.yaw = transformIn[2];
+  return thisPose6D;
+}
 
-  PerformLoopClosure();
+// The key pose in the lidar frame, x forward, y left, z up
+Eigen::Affine3f pclPointToAffine3fCameraToLidar(const PointTypePose& thisPoint) {
+  return pcl::getTransformation(thisPoint.z, thisPoint.x, thisPoint.y,
+                                thisPoint.yaw, thisPoint.roll, thisPoint.pitch);
 }
 
-bool DetectLoopClosure() {
-  latestSurfKeyFrameCloud->clear();
-  nearHistorySurfKeyFrameCloud->clear();
-  nearHistorySurfKeyFrameCloudDS->clear();
+Pose3 pclPointTogtsamPose3(const PointTypePose& thisPoint) {
+  return Pose3(Rot3::RzRyRx(double(thisPoint.yaw), double(thisPoint.roll), double(thisPoint.pitch)),
+               Point3(double(thisPoint.z), double(thisPoint.x), double(thisPoint.y)));
+}
 
-  std::lock_guard<std::mutex> lock(mtx);
-  // find the closest history key frame
-  std::vector<int> pointSearchIndLoop;
-  std::vector<float> pointSearchSqDisLoop;
-  kdtreeHistoryKeyPoses->setInputCloud(cloudKeyPoses3D);
-  kdtreeHistoryKeyPoses->radiusSearch(currentRobotPosPoint, historyKeyframeSearchRadius, pointSearchIndLoop, pointSearchSqDisLoop, 0);
-
-  closestHistoryFrameID = -1;
-  for (int i = 0; i < pointSearchIndLoop.size(); ++i) {
-    int id = pointSearchIndLoop[i];
-    if (abs(cloudKeyPoses6D->points[id].time - timeLaserOdometry) > 30.0) {
-      closestHistoryFrameID = id;
-      break;
+lib::ScanContext MakeScanContext(const MappingFrame& frame) {
+  lib::ScanContext context(kScanContextRange, kScanContextSensorHeight);
+  for (const auto& cloud : {frame.cornerLastDS, frame.surfLastDS, frame.outlierLastDS}) {
+    // the camera frame is y up, z forward
+    for (const PointType& point : cloud->points)
+      context.Add(point.z, point.x, point.y);
+  }
+  return context;
+}
+
+// Streams the tiles of the maps into one binary PCD file
+bool SaveGlobalMap(const std::string& path,
+                   std::initializer_list<const lib::TileMap<PointType>*> maps) {
+  lib::PcdWriter writer;
+  bool good = writer.Open(path);
+  pcl::PointCloud<PointType> tile;
+  for (const lib::TileMap<PointType>* map : maps) {
+    map->ForEachTile(&tile, [&writer, &good](const pcl::PointCloud<PointType>& cloud) {
+      good = writer.Write(cloud) && good;
+    });
+  }
+  good = writer.Close() && good;
+  if (!good)
+    AERROR << "Failed to write " << path;
+  return good;
+}
+
+}  // namespace
+
+bool MapOptmization::NeedPublish(const CloudWriterPtr& writer) {
+  return FLAGS_publish_debug_clouds || writer->HasReader();
+}
+
+void MapOptmization::PublishCloud(const pcl::PointCloud<PointType>& cloud, double time,
+                                  const CloudWriterPtr& writer) {
+  drivers::PointCloud msg;
+  msg.mutable_header()->set_timestamp_sec(time);
+  msg.mutable_header()->set_frame_id("camera_init");
+  msg.set_frame_id("camera_init");
+  ToDriverPointCloud(cloud, msg);
+  writer->Write(msg);
+}
+
+// A newer correction replaces an older one, it already includes it
+void MapOptmization::PostGraphCorrection(const GraphCorrection& correction) {
+  std::lock_guard<std::mutex> lock(correctionMtx);
+  graphCorrection = correction;
+  graphCorrection.valid = true;
+}
+
+bool MapOptmization::TakeGraphCorrection(GraphCorrection* correction) {
+  std::lock_guard<std::mutex> lock(correctionMtx);
+  if (!graphCorrection.valid)
+    return false;
+  *correction = graphCorrection;
+  graphCorrection.valid = false;
+  return true;
+}
+
+// The key frame that looks the most like the latest one by its scan
+// context, whatever the drift in between. Returns -1 if none is close
+// enough, otherwise sets the yaw of the latest key frame in the frame of the
+// one found.
+int MapOptmization::DetectLoopByScanContext(const pcl::PointCloud<PointTypePose>& keyPoses,
+                                            int latestID, float* yaw) {
+  const double latestTime = keyPoses.points[latestID].time;
+  auto accept = [&keyPoses, latestID, latestTime](int id) {
+    return id < latestID && abs(keyPoses.points[id].time - latestTime) > 30.0;
+  };
+
+  std::lock_guard<std::mutex> lock(scanContextMtx);
+  auto candidates = scanContexts.Search(scanContexts.context(latestID),
+                                        FLAGS_loop_candidates, accept);
+  if (candidates.empty() || candidates[0].distance > FLAGS_scan_context_threshold)
+    return -1;
+  *yaw = candidates[0].shift * 2 * M_PI / lib::ScanContext::kSectors;
+  return candidates[0].id;
+}
+
+// The latest key frame against the key frame closest to it that is old
+// enough, both from the snapshot of the key poses. guess moves the latest
+// key frame onto the history ones for the registration.
+bool MapOptmization::DetectLoopClosure(const pcl::PointCloud<PointTypePose>& keyPoses,
+                                       int* latestID, int* closestID, Eigen::Affine3f* guess,
+                                       PointCloudPtr latestCloud) {
+  *latestID = keyPoses.points.size() - 1;
+  const PointTypePose& latestPose = keyPoses.points[*latestID];
+  *guess = Eigen::Affine3f::Identity();
+  // by the scan context first, the drift may be larger than the radius
+  *closestID = -1;
+  float yaw = 0.0f;
+  if (FLAGS_loop_candidates > 0)
+    *closestID = DetectLoopByScanContext(keyPoses, *latestID, &yaw);
+  if (*closestID != -1) {
+    *guess = keyPoseToAffine(keyPoses.points[*closestID]) *
+             Eigen::AngleAxisf(yaw, Eigen::Vector3f::UnitY()) *
+             keyPoseToAffine(latestPose).inverse();
+  } else {
+    // find the closest history key frame
+    float closestSqDis = historyKeyframeSearchRadius * historyKeyframeSearchRadius;
+    for (int i = 0; i < *latestID; ++i) {
+      const PointTypePose& pose = keyPoses.points[i];
+      if (abs(pose.time - latestPose.time) <= 30.0)
+        continue;
+      float sqDis = (pose.x - latestPose.x) * (pose.x - latestPose.x) +
+                    (pose.y - latestPose.y) * (pose.y - latestPose.y) +
+                    (pose.z - latestPose.z) * (pose.z - latestPose.z);
+      if (sqDis <= closestSqDis) {
+        closestSqDis = sqDis;
+        *closestID = i;
+      }
     }
   }
-  if (closestHistoryFrameID == -1) {
+  if (*closestID == -1) {
     return false;
   }
   // save latest key frames
-  latestFrameIDLoopCloure = cloudKeyPoses3D->points.size() - 1;
-  *latestSurfKeyFrameCloud += *transformPointCloud(cornerCloudKeyFrames[latestFrameIDLoopCloure], &cloudKeyPoses6D->points[latestFrameIDLoopCloure]);
-  *latestSurfKeyFrameCloud += *transformPointCloud(surfCloudKeyFrames[latestFrameIDLoopCloure], &cloudKeyPoses6D->points[latestFrameIDLoopCloure]);
-
-  pcl::PointCloud<PointType>::Ptr hahaCloud(new pcl::PointCloud<PointType>());
-  int cloudSize = latestSurfKeyFrameCloud->points.size();
-  for (int i = 0; i < cloudSize; ++i) {
-    if ((int)latestSurfKeyFrameCloud->points[i].intensity >= 0) {
-      hahaCloud->push_back(latestSurfKeyFrameCloud->points[i]);
+  latestCloud->clear();
+  for (auto type : {KeyframeStore::CORNER, KeyframeStore::SURF}) {
+    for (const PointType& point : keyFrames.World(*latestID, type)->points) {
+      if ((int)point.intensity >= 0)
+        latestCloud->push_back(point);
     }
   }
-  latestSurfKeyFrameCloud->clear();
-  *latestSurfKeyFrameCloud = *hahaCloud;
-  // save history near key frames
+  return true;
+}
+
+// The history key frames around closestID become the registration target
+void MapOptmization::SetLoopTarget(const pcl::PointCloud<PointTypePose>& keyPoses,
+                                   int latestID, int closestID, int64_t key) {
+  // save history near key frames, the cached world clouds are downsampled
+  // together without concatenating them first
+  std::vector<CloudConstPtr> historyKeyFrames;
   for (int j = -historyKeyframeSearchNum; j <= historyKeyframeSearchNum; ++j) {
-    if (closestHistoryFrameID + j < 0 || closestHistoryFrameID + j > latestFrameIDLoopCloure)
+    if (closestID + j < 0 || closestID + j > latestID)
       continue;
-    *nearHistorySurfKeyFrameCloud += *transformPointCloud(cornerCloudKeyFrames[closestHistoryFrameID + j], &cloudKeyPoses6D->points[closestHistoryFrameID + j]);
-    *nearHistorySurfKeyFrameCloud += *transformPointCloud(surfCloudKeyFrames[closestHistoryFrameID + j], &cloudKeyPoses6D->points[closestHistoryFrameID + j]);
+    historyKeyFrames.push_back(keyFrames.World(closestID + j, KeyframeStore::CORNER));
+    historyKeyFrames.push_back(keyFrames.World(closestID + j, KeyframeStore::SURF));
   }
 
-  downSizeFilterHistoryKeyFrames.setInputCloud(nearHistorySurfKeyFrameCloud);
-  downSizeFilterHistoryKeyFrames.filter(*nearHistorySurfKeyFrameCloudDS);
+  PointCloudPtr historyCloudDS(new pcl::PointCloud<PointType>());
+  downSizeFilterHistoryKeyFrames.Filter(historyKeyFrames.begin(), historyKeyFrames.end(),
+                                        historyCloudDS.get());
   // publish history near key frames
-  if (pubHistoryKeyFrames.getNumSubscribers() != 0)
-  {
-    sensor_msgs::PointCloud2 cloudMsgTemp;
-    pcl::toROSMsg(*nearHistorySurfKeyFrameCloudDS, cloudMsgTemp);
-    cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLaserOdometry);
-    cloudMsgTemp.header.frame_id = "/camera_init";
-    pubHistoryKeyFrames.publish(cloudMsgTemp);
-  }
+  if (NeedPublish(pubHistoryKeyFrames))
+    PublishCloud(*historyCloudDS, keyPoses.points[latestID].time, pubHistoryKeyFrames);
 
-  return true;
+  loopRegistration.SetTarget(key, *historyCloudDS);
 }
 
-void PerformLoopClosure() {
-  if (cloudKeyPoses3D->points.empty())
-    return;
-  // try to find close key frame if there are any
-  if (potentialLoopFlag == false) {
-    if (DetectLoopClosure() == true) {
-      potentialLoopFlag = true; // find some key frames that is old enough or close enough for loop closure
-      timeSaveFirstCurrentScanForLoopClosure = timeLaserOdometry;
-    }
-    if (potentialLoopFlag == false)
+// Only mtx is shared with the graph stage and it is held just to copy the
+// key poses. The search, the clouds and the registration run without it,
+// an accepted loop goes to the graph stage through loopFactorQueue.
+void MapOptmization::PerformLoopClosure() {
+  pcl::PointCloud<PointTypePose> keyPoses;
+  int version = 0;
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    // nothing new since the last try
+    if (static_cast<int>(cloudKeyPoses6D->points.size()) <= loopLatestID + 1)
       return;
+    keyPoses = *cloudKeyPoses6D;
+    version = keyPosesVersion;
   }
-  // reset the flag first no matter icp successes or not
-  potentialLoopFlag = false;
-  // ICP Settings
-  pcl::IterativeClosestPoint<PointType, PointType> icp;
-  icp.setMaxCorrespondenceDistance(100);
-  icp.setMaximumIterations(100);
-  icp.setTransformationEpsilon(1e-6);
-  icp.setEuclideanFitnessEpsilon(1e-6);
-  icp.setRANSACIterations(0);
-  // Align clouds
-  icp.setInputSource(latestSurfKeyFrameCloud);
-  icp.setInputTarget(nearHistorySurfKeyFrameCloudDS);
-  pcl::PointCloud<PointType>::Ptr unused_result(new pcl::PointCloud<PointType>());
-  icp.align(*unused_result);
-
-  if (!icp.hasConverged() || icp.getFitnessScore() > historyKeyframeFitnessScore)
+
+  int latestID = -1;
+  int closestID = -1;
+  PointCloudPtr latestCloud(new pcl::PointCloud<PointType>());
+  Eigen::Affine3f guess;
+  bool found = DetectLoopClosure(keyPoses, &latestID, &closestID, &guess, latestCloud);
+  loopLatestID = latestID;
+  if (!found)
+    return;
+  // The target of the last try is still good if the history key frames
+  // did not move since
+  const int64_t targetKey = (static_cast<int64_t>(version) << 32) | closestID;
+  if (!loopRegistration.HasTarget(targetKey))
+    SetLoopTarget(keyPoses, latestID, closestID, targetKey);
+  Registration::Result result = loopRegistration.Align(*latestCloud, guess);
+
+  if (!result.converged || result.fitness > historyKeyframeFitnessScore)
     return;
   // publish corrected cloud
-  if (pubIcpKeyFrames.getNumSubscribers() != 0) {
-    pcl::PointCloud<PointType>::Ptr closed_cloud(new pcl::PointCloud<PointType>());
-    pcl::transformPointCloud(*latestSurfKeyFrameCloud, *closed_cloud, icp.getFinalTransformation());
-    sensor_msgs::PointCloud2 cloudMsgTemp;
-    pcl::toROSMsg(*closed_cloud, cloudMsgTemp);
-    cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLaserOdometry);
-    cloudMsgTemp.header.frame_id = "/camera_init";
-    pubIcpKeyFrames.publish(cloudMsgTemp);
+  if (NeedPublish(pubIcpKeyFrames)) {
+    pcl::PointCloud<PointType> closed_cloud;
+    pcl::transformPointCloud(*latestCloud, closed_cloud, result.transform);
+    PublishCloud(closed_cloud, keyPoses.points[latestID].time, pubIcpKeyFrames);
   }
 
-  // get pose constraint
+  // get pose constraint, both poses are from the same snapshot so the
+  // relative constraint holds even if the graph moved them since
   float x, y, z, roll, pitch, yaw;
   Eigen::Affine3f correctionCameraFrame;
-  correctionCameraFrame = icp.getFinalTransformation(); // get transformation in camera frame (because points are in camera frame)
+  correctionCameraFrame = result.transform; // get transformation in camera frame (because points are in camera frame)
   pcl::getTranslationAndEulerAngles(correctionCameraFrame, x, y, z, roll, pitch, yaw);
   Eigen::Affine3f correctionLidarFrame = pcl::getTransformation(z, x, y, yaw, roll, pitch);
   // transform from world origin to wrong pose
-  Eigen::Affine3f tWrong = pclPointToAffine3fCameraToLidar(cloudKeyPoses6D->points[latestFrameIDLoopCloure]);
+  Eigen::Affine3f tWrong = pclPointToAffine3fCameraToLidar(keyPoses.points[latestID]);
   // transform from world origin to corrected pose
   Eigen::Affine3f tCorrect = correctionLidarFrame * tWrong; // pre-multiplying -> successive rotation about a fixed frame
   pcl::getTranslationAndEulerAngles(tCorrect, x, y, z, roll, pitch, yaw);
   gtsam::Pose3 poseFrom = Pose3(Rot3::RzRyRx(roll, pitch, yaw), Point3(x, y, z));
-  gtsam::Pose3 poseTo = pclPointTogtsamPose3(cloudKeyPoses6D->points[closestHistoryFrameID]);
-  gtsam::Vector Vector6(6);
-  float noiseScore = icp.getFitnessScore();
-  Vector6 << noiseScore, noiseScore, noiseScore, noiseScore, noiseScore, noiseScore;
-  constraintNoise = noiseModel::Diagonal::Variances(Vector6);
-  /*
-        	add constraints
-        	*/
-  std::lock_guard<std::mutex> lock(mtx);
-  gtSAMgraph.add(BetweenFactor<Pose3>(latestFrameIDLoopCloure, closestHistoryFrameID, poseFrom.between(poseTo), constraintNoise));
-  isam->update(gtSAMgraph);
-  isam->update();
-  gtSAMgraph.resize(0);
+  gtsam::Pose3 poseTo = pclPointTogtsamPose3(keyPoses.points[closestID]);
+
+  LoopFactor factor;
+  factor.from = latestID;
+  factor.to = closestID;
+  factor.between = poseFrom.between(poseTo);
+  factor.noiseScore = result.fitness;
+  if (!loopFactorQueue.TryPush(factor))
+    AWARN << "Loop closure queue is full, drop loop " << latestID << " -> " << closestID;
+}
 
-  aLoopIsClosed = true;
+void MapOptmization::LoopClosureThread() {
+  std::unique_lock<std::mutex> lock(loopMtx);
+  const auto period = std::chrono::duration<double>(kLoopClosurePeriod);
+  while (!loopCv.wait_for(lock, period, [this] { return loopStop; })) {
+    lock.unlock();
+    PerformLoopClosure();
+    lock.lock();
+  }
 }
 
-void publishGlobalMap() {
-  if (pubLaserCloudSurround.getNumSubscribers() == 0)
-    return;
+// Adds the key frames added or moved since the last call to the global
+// map, only their tiles change
+void MapOptmization::UpdateGlobalMap() {
+  std::vector<int> ids;
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    ids.swap(globalMapPendingIDs);
+  }
+  // the tiles read the key frames back from the store
+  globalCornerMap.Update(ids, [this](int id) {
+    return std::array<CloudConstPtr, 1>{
+        keyFrames.World(id, KeyframeStore::CORNER)};
+  });
+  globalSurfMap.Update(ids, [this](int id) {
+    return std::array<CloudConstPtr, 2>{
+        keyFrames.World(id, KeyframeStore::SURF),
+        keyFrames.World(id, KeyframeStore::OUTLIER)};
+  });
+}
 
-  if (cloudKeyPoses3D->points.empty())
+void MapOptmization::publishGlobalMap() {
+  UpdateGlobalMap();
+  if (!NeedPublish(pubLaserCloudSurround))
     return;
-  // kd-tree to find near key frames to visualize
-  std::vector<int> pointSearchIndGlobalMap;
-  std::vector<float> pointSearchSqDisGlobalMap;
-  // search near key frames to visualize
-  mtx.lock();
-  kdtreeGlobalMap->setInputCloud(cloudKeyPoses3D);
-  kdtreeGlobalMap->radiusSearch(currentRobotPosPoint, globalMapVisualizationSearchRadius, pointSearchIndGlobalMap, pointSearchSqDisGlobalMap, 0);
-  mtx.unlock();
-
-  for (int i = 0; i < pointSearchIndGlobalMap.size(); ++i)
-    globalMapKeyPoses->points.push_back(cloudKeyPoses3D->points[pointSearchIndGlobalMap[i]]);
-  // downsample near selected key frames
-  downSizeFilterGlobalMapKeyPoses.setInputCloud(globalMapKeyPoses);
-  downSizeFilterGlobalMapKeyPoses.filter(*globalMapKeyPosesDS);
-  // extract visualized and downsampled key frames
-  for (int i = 0; i < globalMapKeyPosesDS->points.size(); ++i) {
-    int thisKeyInd = (int)globalMapKeyPosesDS->points[i].intensity;
-    *globalMapKeyFrames += *transformPointCloud(cornerCloudKeyFrames[thisKeyInd], &cloudKeyPoses6D->points[thisKeyInd]);
-    *globalMapKeyFrames += *transformPointCloud(surfCloudKeyFrames[thisKeyInd], &cloudKeyPoses6D->points[thisKeyInd]);
-    *globalMapKeyFrames += *transformPointCloud(outlierCloudKeyFrames[thisKeyInd], &cloudKeyPoses6D->points[thisKeyInd]);
-  }
-  // downsample visualized points
-  downSizeFilterGlobalMapKeyFrames.setInputCloud(globalMapKeyFrames);
-  downSizeFilterGlobalMapKeyFrames.filter(*globalMapKeyFramesDS);
-
-  sensor_msgs::PointCloud2 cloudMsgTemp;
-  pcl::toROSMsg(*globalMapKeyFramesDS, cloudMsgTemp);
-  cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLaserOdometry);
-  cloudMsgTemp.header.frame_id = "/camera_init";
-  pubLaserCloudSurround.publish(cloudMsgTemp);
-
-  globalMapKeyPoses->clear();
-  globalMapKeyPosesDS->clear();
-  globalMapKeyFrames->clear();
-  // globalMapKeyFramesDS->clear();
-}
-
-void VisualizeGlobalMapThread() {
-  ros::Rate rate(0.2);
-  while (ros::ok())
+
+  PointType robotPos;
   {
-    rate.sleep();
-    PublishGlobalMap();
+    std::lock_guard<std::mutex> lock(mtx);
+    if (cloudKeyPoses3D->points.empty())
+      return;
+    robotPos = currentRobotPosPoint;
   }
-  // save final point cloud
-  pcl::io::savePCDFileASCII(fileDirectory + "finalCloud.pcd", *globalMapKeyFramesDS);
+  // the tiles near the robot, they are already downsampled
+  pcl::PointCloud<PointType> surfTiles;
+  globalCornerMap.ToCloud(robotPos, globalMapVisualizationSearchRadius, globalMapKeyFramesDS.get());
+  globalSurfMap.ToCloud(robotPos, globalMapVisualizationSearchRadius, &surfTiles);
+  *globalMapKeyFramesDS += surfTiles;
 
-  std::string cornerMapString = "/tmp/cornerMap.pcd";
-  std::string surfaceMapString = "/tmp/surfaceMap.pcd";
-  std::string trajectoryString = "/tmp/trajectory.pcd";
-
-  pcl::PointCloud<PointType>::Ptr cornerMapCloud(new pcl::PointCloud<PointType>());
-  pcl::PointCloud<PointType>::Ptr cornerMapCloudDS(new pcl::PointCloud<PointType>());
-  pcl::PointCloud<PointType>::Ptr surfaceMapCloud(new pcl::PointCloud<PointType>());
-  pcl::PointCloud<PointType>::Ptr surfaceMapCloudDS(new pcl::PointCloud<PointType>());
+  PublishCloud(*globalMapKeyFramesDS, timeLaserOdometry, pubLaserCloudSurround);
+}
 
-  for (int i = 0; i < cornerCloudKeyFrames.size(); i++) {
-    *cornerMapCloud += *transformPointCloud(cornerCloudKeyFrames[i], &cloudKeyPoses6D->points[i]);
-    *surfaceMapCloud += *transformPointCloud(surfCloudKeyFrames[i], &cloudKeyPoses6D->points[i]);
-    *surfaceMapCloud += *transformPointCloud(outlierCloudKeyFrames[i], &cloudKeyPoses6D->points[i]);
+void MapOptmization::GlobalMapThread() {
+  std::unique_lock<std::mutex> lock(globalMapMtx);
+  while (!globalMapCv.wait_for(lock, std::chrono::seconds(5), [this] { return globalMapStop; })) {
+    lock.unlock();
+    publishGlobalMap();
+    lock.lock();
   }
+}
 
-  downSizeFilterCorner.setInputCloud(cornerMapCloud);
-  downSizeFilterCorner.filter(*cornerMapCloudDS);
-  downSizeFilterSurf.setInputCloud(surfaceMapCloud);
-  downSizeFilterSurf.filter(*surfaceMapCloudDS);
+// Writes the whole map and the trajectory, with the key frames added since
+// the last update. Called once the stages are stopped.
+void MapOptmization::SaveMap() {
+  UpdateGlobalMap();
+  SaveGlobalMap(FLAGS_map_directory + "finalCloud.pcd", {&globalCornerMap, &globalSurfMap});
+  SaveGlobalMap(FLAGS_map_directory + "cornerMap.pcd", {&globalCornerMap});
+  SaveGlobalMap(FLAGS_map_directory + "surfaceMap.pcd", {&globalSurfMap});
 
-  pcl::io::savePCDFileASCII(fileDirectory + "cornerMap.pcd", *cornerMapCloudDS);
-  pcl::io::savePCDFileASCII(fileDirectory + "surfaceMap.pcd", *surfaceMapCloudDS);
-  pcl::io::savePCDFileASCII(fileDirectory + "trajectory.pcd", *cloudKeyPoses3D);
+  std::lock_guard<std::mutex> lock(mtx);
+  lib::PcdWriter writer;
+  if (!writer.Open(FLAGS_map_directory + "trajectory.pcd") ||
+      !writer.Write(*cloudKeyPoses3D) || !writer.Close())
+    AERROR << "Failed to write " << FLAGS_map_directory << "trajectory.pcd";
+}
+
+// The mapped pose, the odometry pose it was mapped from is kept to associate
+// the next scan
+void MapOptmization::transformUpdate(const float transformSum[6]) {
+  for (int i = 0; i < 6; i++) {
+    transformBefMapped[i] = transformSum[i];
+    transformAftMapped[i] = transformTobeMapped[i];
+  }
 }
 
-void TransformAssociateToMap() {
+void MapOptmization::TransformAssociateToMap(const float transformSum[6]) {
   float x1 = cos(transformSum[1]) * (transformBefMapped[3] - transformSum[3]) - sin(transformSum[1]) * (transformBefMapped[5] - transformSum[5]);
   float y1 = transformBefMapped[4] - transformSum[4];
   float z1 = sin(transformSum[1]) * (transformBefMapped[3] - transformSum[3]) + cos(transformSum[1]) * (transformBefMapped[5] - transformSum[5]);
@@ -306,184 +443,153 @@ void TransformAssociateToMap() {
   transformTobeMapped[5] = transformAftMapped[5] - (-sin(transformTobeMapped[1]) * x2 + cos(transformTobeMapped[1]) * z2);
 }
 
-void ExtractSurroundingKeyFrames() {
+// Finds the key frames of the local map of the frame. Only the difference to
+// the previous frame is put into it, the key frames that left and the new
+// ones transformed to the map, which the match stage applies to the local
+// maps in frame order.
+void MapOptmization::ExtractSurroundingKeyFrames(MappingFrame* frame) {
+  // The key poses and frames are written by the graph stage
+  std::lock_guard<std::mutex> lock(mtx);
   if (cloudKeyPoses3D->points.empty())
     return;
 
+  // Key frames moved by a loop closure leave the local map and come back
+  // with their new world clouds
+  for (int id : submapMovedIDs) {
+    if (submapKeyFrameIDs.erase(id) > 0)
+      frame->submapRemoved.push_back(id);
+  }
+  submapMovedIDs.clear();
+
+  std::vector<int> surroundingIDs;
   if (loopClosureEnableFlag) {
     // only use recent key poses for graph building
-    if (recentCornerCloudKeyFrames.size() < surroundingKeyframeSearchNum)
-    { // queue is not full (the beginning of mapping or a loop is just closed)
-      // clear recent key frames queue
-      recentCornerCloudKeyFrames.clear();
-      recentSurfCloudKeyFrames.clear();
-      recentOutlierCloudKeyFrames.clear();
-      int numPoses = cloudKeyPoses3D->points.size();
-      for (int i = numPoses - 1; i >= 0; --i)
-      {
-        int thisKeyInd = (int)cloudKeyPoses3D->points[i].intensity;
-        PointTypePose thisTransformation = cloudKeyPoses6D->points[thisKeyInd];
-        updateTransformPointCloudSinCos(&thisTransformation);
-        // extract surrounding map
-        recentCornerCloudKeyFrames.push_front(transformPointCloud(cornerCloudKeyFrames[thisKeyInd]));
-        recentSurfCloudKeyFrames.push_front(transformPointCloud(surfCloudKeyFrames[thisKeyInd]));
-        recentOutlierCloudKeyFrames.push_front(transformPointCloud(outlierCloudKeyFrames[thisKeyInd]));
-        if (recentCornerCloudKeyFrames.size() >= surroundingKeyframeSearchNum)
-          break;
-      }
-    }
-    else
-    { // queue is full, pop the oldest key frame and push the latest key frame
-      if (latestFrameID != cloudKeyPoses3D->points.size() - 1)
-      { // if the robot is not moving, no need to update recent frames
-
-        recentCornerCloudKeyFrames.pop_front();
-        recentSurfCloudKeyFrames.pop_front();
-        recentOutlierCloudKeyFrames.pop_front();
-        // push latest scan to the end of queue
-        latestFrameID = cloudKeyPoses3D->points.size() - 1;
-        PointTypePose thisTransformation = cloudKeyPoses6D->points[latestFrameID];
-        updateTransformPointCloudSinCos(&thisTransformation);
-        recentCornerCloudKeyFrames.push_back(transformPointCloud(cornerCloudKeyFrames[latestFrameID]));
-        recentSurfCloudKeyFrames.push_back(transformPointCloud(surfCloudKeyFrames[latestFrameID]));
-        recentOutlierCloudKeyFrames.push_back(transformPointCloud(outlierCloudKeyFrames[latestFrameID]));
-      }
-    }
-
-    for (int i = 0; i < recentCornerCloudKeyFrames.size(); ++i)
-    {
-      *laserCloudCornerFromMap += *recentCornerCloudKeyFrames[i];
-      *laserCloudSurfFromMap += *recentSurfCloudKeyFrames[i];
-      *laserCloudSurfFromMap += *recentOutlierCloudKeyFrames[i];
-    }
+    int numPoses = cloudKeyPoses3D->points.size();
+    for (int i = std::max(0, numPoses - surroundingKeyframeSearchNum); i < numPoses; ++i)
+      surroundingIDs.push_back((int)cloudKeyPoses3D->points[i].intensity);
   }
   else
   {
-    surroundingKeyPoses->clear();
-    surroundingKeyPosesDS->clear();
     // extract all the nearby key poses and downsample them
-    kdtreeSurroundingKeyPoses->setInputCloud(cloudKeyPoses3D);
-    kdtreeSurroundingKeyPoses->radiusSearch(currentRobotPosPoint, (double)surroundingKeyframeSearchRadius, pointSearchInd, pointSearchSqDis, 0);
-    for (int i = 0; i < pointSearchInd.size(); ++i)
-      surroundingKeyPoses->points.push_back(cloudKeyPoses3D->points[pointSearchInd[i]]);
-    downSizeFilterSurroundingKeyPoses.setInputCloud(surroundingKeyPoses);
-    downSizeFilterSurroundingKeyPoses.filter(*surroundingKeyPosesDS);
-    // delete key frames that are not in surrounding region
-    int numSurroundingPosesDS = surroundingKeyPosesDS->points.size();
-    for (int i = 0; i < surroundingExistingKeyPosesID.size(); ++i)
-    {
-      bool existingFlag = false;
-      for (int j = 0; j < numSurroundingPosesDS; ++j)
-      {
-        if (surroundingExistingKeyPosesID[i] == (int)surroundingKeyPosesDS->points[j].intensity)
-        {
-          existingFlag = true;
-          break;
-        }
-      }
-      if (existingFlag == false)
-      {
-        surroundingExistingKeyPosesID.erase(surroundingExistingKeyPosesID.begin() + i);
-        surroundingCornerCloudKeyFrames.erase(surroundingCornerCloudKeyFrames.begin() + i);
-        surroundingSurfCloudKeyFrames.erase(surroundingSurfCloudKeyFrames.begin() + i);
-        surroundingOutlierCloudKeyFrames.erase(surroundingOutlierCloudKeyFrames.begin() + i);
-        --i;
-      }
+    std::vector<PointType> pointSearchKeyPoses;
+    keyPosesIndex.RadiusSearch(currentRobotPosPoint, surroundingKeyframeSearchRadius, &pointSearchKeyPoses, &pointSearchSqDis);
+    surroundingKeyPoses->points.assign(pointSearchKeyPoses.begin(), pointSearchKeyPoses.end());
+    downSizeFilterSurroundingKeyPoses.Filter(*surroundingKeyPoses, surroundingKeyPosesDS.get());
+    for (const PointType& keyPose : surroundingKeyPosesDS->points)
+      surroundingIDs.push_back((int)keyPose.intensity);
+  }
+
+  // delete key frames that are not in surrounding region
+  std::unordered_set<int> surroundingIDSet(surroundingIDs.begin(), surroundingIDs.end());
+  for (auto iter = submapKeyFrameIDs.begin(); iter != submapKeyFrameIDs.end();) {
+    if (surroundingIDSet.count(*iter) == 0) {
+      frame->submapRemoved.push_back(*iter);
+      iter = submapKeyFrameIDs.erase(iter);
+    } else {
+      ++iter;
     }
-    // add new key frames that are not in calculated existing key frames
-    for (int i = 0; i < numSurroundingPosesDS; ++i)
-    {
-      bool existingFlag = false;
-      for (auto iter = surroundingExistingKeyPosesID.begin(); iter != surroundingExistingKeyPosesID.end(); ++iter)
-      {
-        if ((*iter) == (int)surroundingKeyPosesDS->points[i].intensity)
-        {
-          existingFlag = true;
-          break;
-        }
-      }
-      if (existingFlag == true)
-      {
-        continue;
-      }
+  }
+  // add new key frames that are not in the local map yet
+  for (int thisKeyInd : surroundingIDs) {
+    if (!submapKeyFrameIDs.insert(thisKeyInd).second)
+      continue;
+    SubmapKeyFrame keyFrame;
+    keyFrame.id = thisKeyInd;
+    keyFrame.corner = keyFrames.World(thisKeyInd, KeyframeStore::CORNER);
+    keyFrame.surf = keyFrames.World(thisKeyInd, KeyframeStore::SURF);
+    keyFrame.outlier = keyFrames.World(thisKeyInd, KeyframeStore::OUTLIER);
+    frame->submapAdded.push_back(std::move(keyFrame));
+  }
+}
+
+void MapOptmization::downsampleCurrentScan(const OdometryFrame& odometry, MappingFrame* frame) {
+  downSizeFilterCorner.Filter(odometry.corner_last, frame->cornerLastDS.get());
+  downSizeFilterSurf.Filter(odometry.surf_last, frame->surfLastDS.get());
+  downSizeFilterOutlier.Filter(odometry.outlier_last, frame->outlierLastDS.get());
+
+  frame->surfTotalLast->clear();
+  *frame->surfTotalLast += *frame->surfLastDS;
+  *frame->surfTotalLast += *frame->outlierLastDS;
+  downSizeFilterSurf.Filter({frame->surfLastDS.get(), frame->outlierLastDS.get()},
+                            frame->surfTotalLastDS.get());
+}
+
+bool MapOptmization::LMOptimization(const NormalEquation& equation, int iterCount) {
+  if (equation.count < 50)
+    return false;
+
+  const NormalEquation::Matrix6d matAtA = equation.FullAtA();
+  NormalEquation::Vector6d matX = matAtA.colPivHouseholderQr().solve(equation.atb);
+
+  // Directions with small eigenvalues are not constrained by the scene,
+  // e.g. along a corridor, the update is projected out of them
+  if (iterCount == 0) {
+    Eigen::SelfAdjointEigenSolver<NormalEquation::Matrix6d> solver(matAtA);
+    const float eignThre = 100;
+    isDegenerate = false;
+    matP.setZero();
+    // eigenvalues are ascending
+    int i = 0;
+    for (; i < 6; ++i) {
+      if (solver.eigenvalues()(i) < eignThre)
+        isDegenerate = true;
       else
-      {
-        int thisKeyInd = (int)surroundingKeyPosesDS->points[i].intensity;
-        PointTypePose thisTransformation = cloudKeyPoses6D->points[thisKeyInd];
-        updateTransformPointCloudSinCos(&thisTransformation);
-        surroundingExistingKeyPosesID.push_back(thisKeyInd);
-        surroundingCornerCloudKeyFrames.push_back(transformPointCloud(cornerCloudKeyFrames[thisKeyInd]));
-        surroundingSurfCloudKeyFrames.push_back(transformPointCloud(surfCloudKeyFrames[thisKeyInd]));
-        surroundingOutlierCloudKeyFrames.push_back(transformPointCloud(outlierCloudKeyFrames[thisKeyInd]));
-      }
+        break;
     }
+    for (; i < 6; ++i)
+      matP += solver.eigenvectors().col(i) * solver.eigenvectors().col(i).transpose();
+  }
 
-    for (int i = 0; i < surroundingExistingKeyPosesID.size(); ++i)
-    {
-      *laserCloudCornerFromMap += *surroundingCornerCloudKeyFrames[i];
-      *laserCloudSurfFromMap += *surroundingSurfCloudKeyFrames[i];
-      *laserCloudSurfFromMap += *surroundingOutlierCloudKeyFrames[i];
-    }
+  if (isDegenerate)
+    matX = matP * matX;
+
+  for (int i = 0; i < 6; ++i)
+    transformTobeMapped[i] += matX(i);
+
+  float deltaR = sqrt(
+      pow(pcl::rad2deg(matX(0)), 2) +
+      pow(pcl::rad2deg(matX(1)), 2) +
+      pow(pcl::rad2deg(matX(2)), 2));
+  float deltaT = sqrt(
+      pow(matX(3) * 100, 2) +
+      pow(matX(4) * 100, 2) +
+      pow(matX(5) * 100, 2));
+
+  if (deltaR < 0.05 && deltaT < 0.05) {
+    return true;
   }
-  // Downsample the surrounding corner key frames (or map)
-  downSizeFilterCorner.setInputCloud(laserCloudCornerFromMap);
-  downSizeFilterCorner.filter(*laserCloudCornerFromMapDS);
-  laserCloudCornerFromMapDSNum = laserCloudCornerFromMapDS->points.size();
-  // Downsample the surrounding surf key frames (or map)
-  downSizeFilterSurf.setInputCloud(laserCloudSurfFromMap);
-  downSizeFilterSurf.filter(*laserCloudSurfFromMapDS);
-  laserCloudSurfFromMapDSNum = laserCloudSurfFromMapDS->points.size();
-}
-
-void downsampleCurrentScan() {
-  laserCloudCornerLastDS->clear();
-  downSizeFilterCorner.setInputCloud(laserCloudCornerLast);
-  downSizeFilterCorner.filter(*laserCloudCornerLastDS);
-  laserCloudCornerLastDSNum = laserCloudCornerLastDS->points.size();
-
-  laserCloudSurfLastDS->clear();
-  downSizeFilterSurf.setInputCloud(laserCloudSurfLast);
-  downSizeFilterSurf.filter(*laserCloudSurfLastDS);
-  laserCloudSurfLastDSNum = laserCloudSurfLastDS->points.size();
-
-  laserCloudOutlierLastDS->clear();
-  downSizeFilterOutlier.setInputCloud(laserCloudOutlierLast);
-  downSizeFilterOutlier.filter(*laserCloudOutlierLastDS);
-  laserCloudOutlierLastDSNum = laserCloudOutlierLastDS->points.size();
-
-  laserCloudSurfTotalLast->clear();
-  laserCloudSurfTotalLastDS->clear();
-  *laserCloudSurfTotalLast += *laserCloudSurfLastDS;
-  *laserCloudSurfTotalLast += *laserCloudOutlierLastDS;
-  downSizeFilterSurf.setInputCloud(laserCloudSurfTotalLast);
-  downSizeFilterSurf.filter(*laserCloudSurfTotalLastDS);
-  laserCloudSurfTotalLastDSNum = laserCloudSurfTotalLastDS->points.size();
-}
-
-void Scan2MapOptimization() {
-  if (laserCloudCornerFromMapDSNum > 10 && laserCloudSurfFromMapDSNum > 100) {
-    kdtreeCornerFromMap->setInputCloud(laserCloudCornerFromMapDS);
-    kdtreeSurfFromMap->setInputCloud(laserCloudSurfFromMapDS);
-
-    for (int iterCount = 0; iterCount < 10; iterCount++) {
-      laserCloudOri->clear();
-      coeffSel->clear();
-
-      cornerOptimization(iterCount);
-      surfOptimization(iterCount);
-
-      if (LMOptimization(iterCount) == true)
+  return false;
+}
+
+// Returns the LM iterations
+int MapOptmization::Scan2MapOptimization(const MappingFrame& frame) {
+  int iterCount = 0;
+  if (localCornerMap.size() > 10 && localSurfMap.size() > 100) {
+    // The corner and surf residuals are summed into JtJ and Jtb on the
+    // scanMatcher threads, see scan_matcher.h
+    for (; iterCount < 10; iterCount++) {
+      const NormalEquation& equation = scanMatcher.Accumulate(
+          transformTobeMapped, *frame.cornerLastDS, localCornerMap.index(),
+          *frame.surfTotalLastDS, localSurfMap.index());
+
+      if (LMOptimization(equation, iterCount) == true) {
+        ++iterCount;
         break;
+      }
     }
 
-    transformUpdate();
+    transformUpdate(frame.transformSum);
   }
+  return iterCount;
 }
 
-void saveKeyFramesAndFactor() {
-  currentRobotPosPoint.x = transformAftMapped[3];
-  currentRobotPosPoint.y = transformAftMapped[4];
-  currentRobotPosPoint.z = transformAftMapped[5];
+void MapOptmization::saveKeyFramesAndFactor(MappingFrame* frame) {
+  // The graph is shared with the loop closure thread, the key poses and
+  // frames with the submap stage of the next frames
+  std::lock_guard<std::mutex> lock(mtx);
+  currentRobotPosPoint.x = frame->transformAftMapped[3];
+  currentRobotPosPoint.y = frame->transformAftMapped[4];
+  currentRobotPosPoint.z = frame->transformAftMapped[5];
 
   bool saveThisKeyFrame = true;
   if (sqrt((previousRobotPosPoint.x - currentRobotPosPoint.x) * (previousRobotPosPoint.x - currentRobotPosPoint.x) + (previousRobotPosPoint.y - currentRobotPosPoint.y) * (previousRobotPosPoint.y - currentRobotPosPoint.y) + (previousRobotPosPoint.z - currentRobotPosPoint.z) * (previousRobotPosPoint.z - currentRobotPosPoint.z)) < 0.3)
@@ -496,47 +602,30 @@ void saveKeyFramesAndFactor() {
 
   previousRobotPosPoint = currentRobotPosPoint;
   /**
-         * update grsam graph
+         * update iSAM, loops found since the last key frame join the same update
          */
-  if (cloudKeyPoses3D->points.empty()) {
-    gtSAMgraph.add(PriorFactor<Pose3>(0, Pose3(Rot3::RzRyRx(transformTobeMapped[2], transformTobeMapped[0], transformTobeMapped[1]), Point3(transformTobeMapped[5], transformTobeMapped[3], transformTobeMapped[4])), priorNoise));
-    initialEstimate.insert(0, Pose3(Rot3::RzRyRx(transformTobeMapped[2], transformTobeMapped[0], transformTobeMapped[1]),
-                                    Point3(transformTobeMapped[5], transformTobeMapped[3], transformTobeMapped[4])));
-    for (int i = 0; i < 6; ++i)
-      transformLast[i] = transformTobeMapped[i];
-  } else {
-    gtsam::Pose3 poseFrom = Pose3(Rot3::RzRyRx(transformLast[2], transformLast[0], transformLast[1]),
-                                  Point3(transformLast[5], transformLast[3], transformLast[4]));
-    gtsam::Pose3 poseTo = Pose3(Rot3::RzRyRx(transformAftMapped[2], transformAftMapped[0], transformAftMapped[1]),
-                                Point3(transformAftMapped[5], transformAftMapped[3], transformAftMapped[4]));
-    gtSAMgraph.add(BetweenFactor<Pose3>(cloudKeyPoses3D->points.size() - 1, cloudKeyPoses3D->points.size(), poseFrom.between(poseTo), odometryNoise));
-    initialEstimate.insert(cloudKeyPoses3D->points.size(), Pose3(Rot3::RzRyRx(transformAftMapped[2], transformAftMapped[0], transformAftMapped[1]),
-                                                                 Point3(transformAftMapped[5], transformAftMapped[3], transformAftMapped[4])));
-  }
-  /**
-         * update iSAM
-         */
-  isam->update(gtSAMgraph, initialEstimate);
-  isam->update();
-
-  gtSAMgraph.resize(0);
-  initialEstimate.clear();
+  std::vector<LoopFactor> loops;
+  LoopFactor loop;
+  while (loopFactorQueue.TryPop(&loop))
+    loops.push_back(loop);
+  if (!loops.empty())
+    aLoopIsClosed = true;
+  Pose3 latestEstimate;
+  const bool updated =
+      poseGraph.AddKeyFrame(frame->transformAftMapped, loops, &latestEstimate);
 
   /**
          * save key poses
          */
   PointType thisPose3D;
   PointTypePose thisPose6D;
-  Pose3 latestEstimate;
-
-  isamCurrentEstimate = isam->calculateEstimate();
-  latestEstimate = isamCurrentEstimate.at<Pose3>(isamCurrentEstimate.size() - 1);
 
   thisPose3D.x = latestEstimate.translation().y();
   thisPose3D.y = latestEstimate.translation().z();
   thisPose3D.z = latestEstimate.translation().x();
   thisPose3D.intensity = cloudKeyPoses3D->points.size(); // this can be used as index
   cloudKeyPoses3D->push_back(thisPose3D);
+  keyPosesIndex.Insert(thisPose3D);
 
   thisPose6D.x = thisPose3D.x;
   thisPose6D.y = thisPose3D.y;
@@ -545,135 +634,332 @@ void saveKeyFramesAndFactor() {
   thisPose6D.roll = latestEstimate.rotation().pitch();
   thisPose6D.pitch = latestEstimate.rotation().yaw();
   thisPose6D.yaw = latestEstimate.rotation().roll(); // in camera frame
-  thisPose6D.time = timeLaserOdometry;
+  thisPose6D.time = frame->time;
   cloudKeyPoses6D->push_back(thisPose6D);
   /**
          * save updated transform
          */
-  if (cloudKeyPoses3D->points.size() > 1) {
-    transformAftMapped[0] = latestEstimate.rotation().pitch();
-    transformAftMapped[1] = latestEstimate.rotation().yaw();
-    transformAftMapped[2] = latestEstimate.rotation().roll();
-    transformAftMapped[3] = latestEstimate.translation().y();
-    transformAftMapped[4] = latestEstimate.translation().z();
-    transformAftMapped[5] = latestEstimate.translation().x();
-
-    for (int i = 0; i < 6; ++i) {
-      transformLast[i] = transformAftMapped[i];
-      transformTobeMapped[i] = transformAftMapped[i];
-    }
+  if (updated && cloudKeyPoses3D->points.size() > 1) {
+    GraphCorrection correction;
+    std::copy(frame->transformAftMapped, frame->transformAftMapped + 6,
+              correction.matched);
+    gtsamPose2Trans(latestEstimate, frame->transformAftMapped);
+
+    std::copy(frame->transformAftMapped, frame->transformAftMapped + 6,
+              frame->transformTobeMapped);
+    std::copy(frame->transformAftMapped, frame->transformAftMapped + 6,
+              correction.corrected);
+    PostGraphCorrection(correction);
   }
 
-  pcl::PointCloud<PointType>::Ptr thisCornerKeyFrame(new pcl::PointCloud<PointType>());
-  pcl::PointCloud<PointType>::Ptr thisSurfKeyFrame(new pcl::PointCloud<PointType>());
-  pcl::PointCloud<PointType>::Ptr thisOutlierKeyFrame(new pcl::PointCloud<PointType>());
-
-  pcl::copyPointCloud(*laserCloudCornerLastDS, *thisCornerKeyFrame);
-  pcl::copyPointCloud(*laserCloudSurfLastDS, *thisSurfKeyFrame);
-  pcl::copyPointCloud(*laserCloudOutlierLastDS, *thisOutlierKeyFrame);
-
-  cornerCloudKeyFrames.push_back(thisCornerKeyFrame);
-  surfCloudKeyFrames.push_back(thisSurfKeyFrame);
-  outlierCloudKeyFrames.push_back(thisOutlierKeyFrame);
+  // The downsampled clouds of the frame are not changed after the match
+  // stage, the key frame keeps them without a copy
+  keyFrames.Add(frame->cornerLastDS, frame->surfLastDS, frame->outlierLastDS,
+                keyPoseToAffine(thisPose6D));
+  globalMapPendingIDs.push_back(static_cast<int>(thisPose6D.intensity));
+  lib::ScanContext context = MakeScanContext(*frame);
+  std::lock_guard<std::mutex> contextLock(scanContextMtx);
+  scanContexts.Add(static_cast<int>(thisPose6D.intensity), context);
 }
 
-void correctPoses() {
+// Only the key poses iSAM changed since the last loop closure are copied
+// out of it, the earlier updates without a loop keep their poses as before
+void MapOptmization::correctPoses() {
+  std::lock_guard<std::mutex> lock(mtx);
   if (aLoopIsClosed == true) {
-    recentCornerCloudKeyFrames.clear();
-    recentSurfCloudKeyFrames.clear();
-    recentOutlierCloudKeyFrames.clear();
     // update key poses
-    int numPoses = isamCurrentEstimate.size();
-    for (int i = 0; i < numPoses; ++i) {
-      cloudKeyPoses3D->points[i].x = isamCurrentEstimate.at<Pose3>(i).translation().y();
-      cloudKeyPoses3D->points[i].y = isamCurrentEstimate.at<Pose3>(i).translation().z();
-      cloudKeyPoses3D->points[i].z = isamCurrentEstimate.at<Pose3>(i).translation().x();
+    for (int i : *poseGraph.changed()) {
+      // not saved yet, the key frame of this update follows
+      if (i >= static_cast<int>(cloudKeyPoses3D->points.size()))
+        continue;
+      const Pose3 estimate = poseGraph.Estimate(i);
+      keyPosesIndex.Erase(cloudKeyPoses3D->points[i]);
+      cloudKeyPoses3D->points[i].x = estimate.translation().y();
+      cloudKeyPoses3D->points[i].y = estimate.translation().z();
+      cloudKeyPoses3D->points[i].z = estimate.translation().x();
+      keyPosesIndex.Insert(cloudKeyPoses3D->points[i]);
 
       cloudKeyPoses6D->points[i].x = cloudKeyPoses3D->points[i].x;
       cloudKeyPoses6D->points[i].y = cloudKeyPoses3D->points[i].y;
       cloudKeyPoses6D->points[i].z = cloudKeyPoses3D->points[i].z;
-      cloudKeyPoses6D->points[i].roll = isamCurrentEstimate.at<Pose3>(i).rotation().pitch();
-      cloudKeyPoses6D->points[i].pitch = isamCurrentEstimate.at<Pose3>(i).rotation().yaw();
-      cloudKeyPoses6D->points[i].yaw = isamCurrentEstimate.at<Pose3>(i).rotation().roll();
+      cloudKeyPoses6D->points[i].roll = estimate.rotation().pitch();
+      cloudKeyPoses6D->points[i].pitch = estimate.rotation().yaw();
+      cloudKeyPoses6D->points[i].yaw = estimate.rotation().roll();
+
+      if (keyFrames.SetPose(i, keyPoseToAffine(cloudKeyPoses6D->points[i]))) {
+        submapMovedIDs.push_back(i);
+        globalMapPendingIDs.push_back(i);
+      }
     }
+    poseGraph.changed()->clear();
+    ++keyPosesVersion;
 
     aLoopIsClosed = false;
   }
 }
 
-void publishTF() {
-  geometry_msgs::Quaternion geoQuat = tf::createQuaternionMsgFromRollPitchYaw(transformAftMapped[2], -transformAftMapped[0], -transformAftMapped[1]);
-
-  odomAftMapped.header.stamp = ros::Time().fromSec(timeLaserOdometry);
-  odomAftMapped.pose.pose.orientation.x = -geoQuat.y;
-  odomAftMapped.pose.pose.orientation.y = -geoQuat.z;
-  odomAftMapped.pose.pose.orientation.z = geoQuat.x;
-  odomAftMapped.pose.pose.orientation.w = geoQuat.w;
-  odomAftMapped.pose.pose.position.x = transformAftMapped[3];
-  odomAftMapped.pose.pose.position.y = transformAftMapped[4];
-  odomAftMapped.pose.pose.position.z = transformAftMapped[5];
-  odomAftMapped.twist.twist.angular.x = transformBefMapped[0];
-  odomAftMapped.twist.twist.angular.y = transformBefMapped[1];
-  odomAftMapped.twist.twist.angular.z = transformBefMapped[2];
-  odomAftMapped.twist.twist.linear.x = transformBefMapped[3];
-  odomAftMapped.twist.twist.linear.y = transformBefMapped[4];
-  odomAftMapped.twist.twist.linear.z = transformBefMapped[5];
-  pubOdomAftMapped.publish(odomAftMapped);
-
-  aftMappedTrans.stamp_ = ros::Time().fromSec(timeLaserOdometry);
-  aftMappedTrans.setRotation(tf::Quaternion(-geoQuat.y, -geoQuat.z, geoQuat.x, geoQuat.w));
-  aftMappedTrans.setOrigin(tf::Vector3(transformAftMapped[3], transformAftMapped[4], transformAftMapped[5]));
-  tfBroadcaster.sendTransform(aftMappedTrans);
-}
-
-void publishKeyPosesAndFrames() {
-  if (pubKeyPoses.getNumSubscribers() != 0) {
-    sensor_msgs::PointCloud2 cloudMsgTemp;
-    pcl::toROSMsg(*cloudKeyPoses3D, cloudMsgTemp);
-    cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLaserOdometry);
-    cloudMsgTemp.header.frame_id = "/camera_init";
-    pubKeyPoses.publish(cloudMsgTemp);
-  }
-
-  if (pubRecentKeyFrames.getNumSubscribers() != 0) {
-    sensor_msgs::PointCloud2 cloudMsgTemp;
-    pcl::toROSMsg(*laserCloudSurfFromMapDS, cloudMsgTemp);
-    cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLaserOdometry);
-    cloudMsgTemp.header.frame_id = "/camera_init";
-    pubRecentKeyFrames.publish(cloudMsgTemp);
-  }
-
-  if (pubRegisteredCloud.getNumSubscribers() != 0) {
-    pcl::PointCloud<PointType>::Ptr cloudOut(new pcl::PointCloud<PointType>());
-    PointTypePose thisPose6D = trans2PointTypePose(transformTobeMapped);
-    *cloudOut += *transformPointCloud(laserCloudCornerLastDS, &thisPose6D);
-    *cloudOut += *transformPointCloud(laserCloudSurfTotalLast, &thisPose6D);
-
-    sensor_msgs::PointCloud2 cloudMsgTemp;
-    pcl::toROSMsg(*cloudOut, cloudMsgTemp);
-    cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLaserOdometry);
-    cloudMsgTemp.header.frame_id = "/camera_init";
-    pubRegisteredCloud.publish(cloudMsgTemp);
-  }
-}
-
-void ClearCloud() {
-  laserCloudCornerFromMap->clear();
-  laserCloudSurfFromMap->clear();
-  laserCloudCornerFromMapDS->clear();
-  laserCloudSurfFromMapDS->clear();
-}
-
-void Proc() {
-  TransformAssociateToMap();
-  extractSurroundingKeyFrames();
-  downsampleCurrentScan();
-  scan2MapOptimization();
-  saveKeyFramesAndFactor();
-  correctPoses();
-  publishTF();
-  publishKeyPosesAndFrames();
-  ClearCloud();
+void MapOptmization::publishTF(const MappingFrame& frame) {
+  CameraPoseToLocalization(transformAftMapped, frame.time, &odomAftMapped);
+  pubOdomAftMapped->Write(odomAftMapped);
+}
+
+void MapOptmization::publishKeyPosesAndFrames(const MappingFrame& frame) {
+  if (NeedPublish(pubKeyPoses))
+    PublishCloud(*cloudKeyPoses3D, frame.time, pubKeyPoses);
+
+  if (NeedPublish(pubRecentKeyFrames))
+    PublishCloud(*frame.surfFromMapDS, frame.time, pubRecentKeyFrames);
+
+  if (NeedPublish(pubRegisteredCloud)) {
+    const Eigen::Affine3f pose = keyPoseToAffine(trans2PointTypePose(frame.transformTobeMapped));
+    pcl::PointCloud<PointType> cloudOut;
+    pcl::PointCloud<PointType> cloudTemp;
+    pcl::transformPointCloud(*frame.cornerLastDS, cloudOut, pose);
+    pcl::transformPointCloud(*frame.surfTotalLast, cloudTemp, pose);
+    cloudOut += cloudTemp;
+    PublishCloud(cloudOut, frame.time, pubRegisteredCloud);
+  }
+}
+
+void MapOptmization::UpdateLocalMap(const MappingFrame& frame) {
+  for (int id : frame.submapRemoved) {
+    localCornerMap.Remove(id);
+    localSurfMap.Remove(id);
+  }
+  for (const SubmapKeyFrame& keyFrame : frame.submapAdded) {
+    localCornerMap.Add(keyFrame.id, *keyFrame.corner);
+    localSurfMap.Add(keyFrame.id, {keyFrame.surf.get(), keyFrame.outlier.get()});
+  }
+}
+
+// Matches the frame to its submap and publishes the pose, frames must come
+// in order
+void MapOptmization::MatchFrame(MappingFrame* frame) {
+  StageTimer timer(FLAGS_publish_telemetry ? &frame->telemetry : nullptr,
+                   cloud_msgs::FrameTelemetry::MATCH);
+  GraphCorrection correction;
+  if (TakeGraphCorrection(&correction)) {
+    // The graph moved the pose of an earlier frame, the frames matched since
+    // then are moved the same way
+    Pose3 delta = trans2gtsamPose(correction.corrected) *
+                  trans2gtsamPose(correction.matched).inverse();
+    gtsamPose2Trans(delta * trans2gtsamPose(transformAftMapped), transformAftMapped);
+  }
+
+  UpdateLocalMap(*frame);
+  TransformAssociateToMap(frame->transformSum);
+  frame->telemetry.set_lm_iterations(Scan2MapOptimization(*frame));
+  publishTF(*frame);
+  if (NeedPublish(pubRecentKeyFrames))
+    localSurfMap.ToCloud(frame->surfFromMapDS.get());
+
+  std::copy(transformTobeMapped, transformTobeMapped + 6, frame->transformTobeMapped);
+  std::copy(transformAftMapped, transformAftMapped + 6, frame->transformAftMapped);
+}
+
+// Adds the frame to the pose graph if it is a key frame
+void MapOptmization::UpdateGraph(MappingFrame* frame) {
+  {
+    StageTimer timer(FLAGS_publish_telemetry ? &frame->telemetry : nullptr,
+                     cloud_msgs::FrameTelemetry::GRAPH);
+    saveKeyFramesAndFactor(frame);
+    correctPoses();
+    publishKeyPosesAndFrames(*frame);
+  }
+  if (FLAGS_publish_telemetry)
+    pubTelemetry->Write(frame->telemetry);
+}
+
+void MapOptmization::MatchThread() {
+  std::shared_ptr<MappingFrame> frame;
+  while (matchQueue.Pop(&frame)) {
+    MatchFrame(frame.get());
+    graphQueue.Push(std::move(frame));
+  }
+  graphQueue.Close();
+}
+
+void MapOptmization::GraphThread() {
+  std::shared_ptr<MappingFrame> frame;
+  while (graphQueue.Pop(&frame))
+    UpdateGraph(frame.get());
+}
+
+// The submap of a frame is extracted here, it is matched and then added to
+// the graph. With FLAGS_mapping_pipeline, unless in lockstep, the match and
+// the graph stages run on their own threads, so the submap of frame N + 1,
+// the match of frame N and the iSAM update of frame N - 1 overlap. The
+// queues between the stages hold kPipelineDepth frames, a slow stage blocks
+// the ones before it instead of letting the latency grow.
+void MapOptmization::Proc(const OdometryFrame& odometry, uint32_t dropped) {
+  timeLaserOdometry = odometry.timestamp;
+  auto frame = std::make_shared<MappingFrame>();
+  frame->time = odometry.timestamp;
+  std::copy(odometry.transform_sum, odometry.transform_sum + 6,
+            frame->transformSum);
+
+  cloud_msgs::FrameTelemetry* stages =
+      FLAGS_publish_telemetry ? &frame->telemetry : nullptr;
+  if (stages) {
+    StartTelemetry(odometry.timestamp,
+                   cloud_msgs::FrameTelemetry::MAP_OPTIMIZATION, stages);
+    stages->set_dropped(dropped);
+    stages->set_load_level(mappingLoad.level());
+    stages->set_queue_depth(matchQueue.size() + graphQueue.size());
+    stages->set_input_points(odometry.corner_last.size() +
+                             odometry.surf_last.size() +
+                             odometry.outlier_last.size());
+  }
+  {
+    StageTimer timer(stages, cloud_msgs::FrameTelemetry::SUBMAP);
+    ExtractSurroundingKeyFrames(frame.get());
+  }
+  {
+    StageTimer timer(stages, cloud_msgs::FrameTelemetry::DOWNSAMPLE);
+    downsampleCurrentScan(odometry, frame.get());
+  }
+  if (stages) {
+    stages->set_corner_features(frame->cornerLastDS->size());
+    stages->set_surf_features(frame->surfTotalLastDS->size());
+  }
+
+  if (pipelined) {
+    matchQueue.Push(std::move(frame));
+    return;
+  }
+  MatchFrame(frame.get());
+  UpdateGraph(frame.get());
+}
+
+// Sets the downsampling of the next scans by the time of this one
+void MapOptmization::ShedMappingLoad(double duration) {
+  const int previous = mappingLoad.level();
+  const int level = mappingLoad.Update(duration);
+  if (level == previous)
+    return;
+  AINFO << "Mapping load level " << level << ", "
+        << mappingLoad.average() * 1e3 << "ms per scan";
+  const float corner = kCornerLeafSizes[level];
+  const float surf = kSurfLeafSizes[level];
+  downSizeFilterCorner.SetLeafSize(corner, corner, corner);
+  downSizeFilterSurf.SetLeafSize(surf, surf, surf);
+  downSizeFilterOutlier.SetLeafSize(surf, surf, surf);
+}
+
+void MapOptmization::MappingThread() {
+  while (true) {
+    OdometryFramePtr frame;
+    uint32_t dropped = 0;
+    {
+      std::unique_lock<std::mutex> lock(odometryMtx);
+      odometryCv.wait(lock, [this] { return mappingStop || odometryFrame; });
+      if (!odometryFrame)
+        return;
+      frame = std::move(odometryFrame);
+      odometryFrame.reset();
+      std::swap(dropped, droppedOdometryFrames);
+    }
+    const uint64_t start_us = MonotonicMicros();
+    Proc(*frame, dropped);
+    if (FLAGS_load_shedding)
+      ShedMappingLoad((MonotonicMicros() - start_us) * 1e-6);
+  }
+}
+
+void MapOptmization::OdometryFrameHandler(const OdometryFramePtr& frame) {
+  // The odometry is never held back by the mapping
+  {
+    std::lock_guard<std::mutex> lock(odometryMtx);
+    if (odometryFrame) {
+      AWARN_EVERY(10) << "Mapping is behind, drop the scan at "
+                      << odometryFrame->timestamp;
+      ++droppedOdometryFrames;
+    }
+    odometryFrame = frame;
+  }
+  odometryCv.notify_one();
+}
+
+void MapOptmization::ProcessOdometryFrame(const OdometryFrame& frame) {
+  Proc(frame, 0);
+  if (lockstep && loopClosureEnableFlag &&
+      frame.timestamp - lastLoopClosureTime >= kLoopClosurePeriod) {
+    lastLoopClosureTime = frame.timestamp;
+    PerformLoopClosure();
+  }
+  if (lockstep && frame.timestamp - lastGlobalMapTime >= kGlobalMapPeriod) {
+    lastGlobalMapTime = frame.timestamp;
+    publishGlobalMap();
+  }
+}
+
+void MapOptmization::SetLockstep() {
+  lockstep = true;
+}
+
+bool MapOptmization::Init() {
+  poseGraph.Init(FLAGS_isam_batch_size, FLAGS_isam_relinearize_threshold,
+                 FLAGS_isam_relinearize_skip);
+
+  pubKeyPoses = node_->CreateWriter<drivers::PointCloud>("/key_pose_origin");
+  pubLaserCloudSurround = node_->CreateWriter<drivers::PointCloud>("/laser_cloud_surround");
+  pubRecentKeyFrames = node_->CreateWriter<drivers::PointCloud>("/recent_cloud");
+  pubRegisteredCloud = node_->CreateWriter<drivers::PointCloud>("/registered_cloud");
+  pubHistoryKeyFrames = node_->CreateWriter<drivers::PointCloud>("/history_cloud");
+  pubIcpKeyFrames = node_->CreateWriter<drivers::PointCloud>("/corrected_cloud");
+  pubOdomAftMapped = node_->CreateWriter<localization::LocalizationEstimate>("/aft_mapped_to_init");
+  odomAftMapped.mutable_header()->set_frame_id("camera_init");
+
+  pubTelemetry = node_->CreateWriter<cloud_msgs::FrameTelemetry>(
+      kTelemetryChannel);
+
+  scanMatcher.Init(FLAGS_mapping_threads);
+  loopRegistration.Init(FLAGS_loop_threads);
+  keyFrames.Init(static_cast<size_t>(FLAGS_keyframe_memory_mb) << 20,
+                 FLAGS_keyframe_spill_file);
+  pipelined = FLAGS_mapping_pipeline && !lockstep;
+  if (pipelined) {
+    matchThread = std::thread(&MapOptmization::MatchThread, this);
+    graphThread = std::thread(&MapOptmization::GraphThread, this);
+  }
+  if (loopClosureEnableFlag && !lockstep)
+    loopThread = std::thread(&MapOptmization::LoopClosureThread, this);
+  mappingThread = std::thread(&MapOptmization::MappingThread, this);
+  if (!lockstep)
+    globalMapThread = std::thread(&MapOptmization::GlobalMapThread, this);
+  return true;
+}
+
+MapOptmization::~MapOptmization() {
+  // The scan waiting for the mapping is still mapped
+  {
+    std::lock_guard<std::mutex> lock(odometryMtx);
+    mappingStop = true;
+  }
+  odometryCv.notify_all();
+  if (mappingThread.joinable())
+    mappingThread.join();
+  {
+    std::lock_guard<std::mutex> lock(loopMtx);
+    loopStop = true;
+  }
+  loopCv.notify_all();
+  if (loopThread.joinable())
+    loopThread.join();
+  // The frames already queued are finished first
+  matchQueue.Close();
+  if (matchThread.joinable())
+    matchThread.join();
+  if (graphThread.joinable())
+    graphThread.join();
+  {
+    std::lock_guard<std::mutex> lock(globalMapMtx);
+    globalMapStop = true;
+  }
+  globalMapCv.notify_all();
+  if (globalMapThread.joinable())
+    globalMapThread.join();
+  SaveMap();
 }
 
 }  // namespace tools
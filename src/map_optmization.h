@@ -29,17 +29,283 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "Eigen/Dense"
+
 #include "cyber/cyber.h"
 
+#include "modules/localization/proto/localization.pb.h"
+
+#include "modules/tools/ilego_loam/src/lib/bounded_queue.h"
+#include "modules/tools/ilego_loam/src/lib/load_shedder.h"
+#include "modules/tools/ilego_loam/src/lib/local_map.h"
+#include "modules/tools/ilego_loam/src/lib/pcd_writer.h"
+#include "modules/tools/ilego_loam/src/lib/scan_context.h"
+#include "modules/tools/ilego_loam/src/lib/spsc_queue.h"
+#include "modules/tools/ilego_loam/src/lib/tile_map.h"
+#include "modules/tools/ilego_loam/src/lib/voxel_filter.h"
+#include "modules/tools/ilego_loam/src/lib/voxel_hash_map.h"
+#include "modules/tools/ilego_loam/src/frames.h"
+#include "modules/tools/ilego_loam/src/keyframe_store.h"
+#include "modules/tools/ilego_loam/src/pose_graph.h"
+#include "modules/tools/ilego_loam/src/registration.h"
+#include "modules/tools/ilego_loam/src/scan_matcher.h"
+#include "modules/tools/ilego_loam/src/telemetry.h"
+
 namespace apollo {
 namespace tools {
 
+// A key frame entering the local map, its world frame clouds
+struct SubmapKeyFrame {
+  int id = -1;
+  CloudConstPtr corner;
+  CloudConstPtr surf;
+  CloudConstPtr outlier;
+};
+
+// One odometry frame on its way through the stages of Proc. The frame owns
+// its downsampled scan and the changes of the local map, so consecutive
+// frames can be in different stages at the same time.
+struct MappingFrame {
+  double time = 0.0;
+  // odometry pose of the frame
+  float transformSum[6] = {0};
+  // result of the match stage, corrected by the graph stage
+  float transformTobeMapped[6] = {0};
+  float transformAftMapped[6] = {0};
+
+  PointCloudPtr cornerLastDS{new pcl::PointCloud<PointType>()};
+  PointCloudPtr surfLastDS{new pcl::PointCloud<PointType>()};
+  PointCloudPtr outlierLastDS{new pcl::PointCloud<PointType>()};
+  PointCloudPtr surfTotalLast{new pcl::PointCloud<PointType>()};
+  PointCloudPtr surfTotalLastDS{new pcl::PointCloud<PointType>()};
+  // only filled if the local map is published
+  PointCloudPtr surfFromMapDS{new pcl::PointCloud<PointType>()};
+
+  // Changes of the local map since the previous frame
+  std::vector<int> submapRemoved;
+  std::vector<SubmapKeyFrame> submapAdded;
+
+  // filled by the stages and written after the graph stage
+  cloud_msgs::FrameTelemetry telemetry;
+};
+
+// Pose of a key frame before and after the iSAM update
+struct GraphCorrection {
+  bool valid = false;
+  float matched[6] = {0};
+  float corrected[6] = {0};
+};
+
 class MapOptmization final : public cyber::Component<> {
  public:
+  ~MapOptmization();
   bool Init() override;
 
+  // Hands a scan of FeatureAssociation to the mapping thread and returns at
+  // once. The mapping takes the newest scan when it is done with the last
+  // one, a scan still waiting then is dropped. With --load_shedding a
+  // mapping slower than the scans also downsamples them coarser.
+  void OdometryFrameHandler(const OdometryFramePtr& frame);
+  // Maps the scan on the caller, for a driver that needs every scan mapped
+  // in order. Not to be mixed with OdometryFrameHandler.
+  void ProcessOdometryFrame(const OdometryFrame& frame);
+  // For a replay that gives the same map twice: ProcessOdometryFrame runs
+  // all the stages of a scan, the loop closure once per second and the
+  // global map once per five seconds of scan time, on the caller instead of
+  // on threads with wall clock timing. Set it before Init.
+  void SetLockstep();
+
  private:
+  using CloudWriterPtr = std::shared_ptr<cyber::Writer<drivers::PointCloud>>;
+
+  static constexpr size_t kPipelineDepth = 2;
+  static constexpr float kGlobalMapTileSize = 50.0f;
+  static constexpr double kLoopClosurePeriod = 1.0;
+  static constexpr double kGlobalMapPeriod = 5.0;
+  // FeatureAssociation hands on every skipFrameNum + 1 scan
+  static constexpr double kMappingPeriod = (skipFrameNum + 1) * SCAN_PERIOD;
+
+  // Debug clouds in the camera_init frame, written if
+  // FLAGS_publish_debug_clouds is set or a reader is attached
+  static bool NeedPublish(const CloudWriterPtr& writer);
+  static void PublishCloud(const pcl::PointCloud<PointType>& cloud,
+                           double time, const CloudWriterPtr& writer);
+
+  void PostGraphCorrection(const GraphCorrection& correction);
+  bool TakeGraphCorrection(GraphCorrection* correction);
+
+  // Loop closure
+  int DetectLoopByScanContext(const pcl::PointCloud<PointTypePose>& keyPoses,
+                              int latestID, float* yaw);
+  bool DetectLoopClosure(const pcl::PointCloud<PointTypePose>& keyPoses,
+                         int* latestID, int* closestID, Eigen::Affine3f* guess,
+                         PointCloudPtr latestCloud);
+  void SetLoopTarget(const pcl::PointCloud<PointTypePose>& keyPoses,
+                     int latestID, int closestID, int64_t key);
+  void PerformLoopClosure();
+  void LoopClosureThread();
+
+  // Global map
+  void UpdateGlobalMap();
+  void publishGlobalMap();
+  void GlobalMapThread();
+  void SaveMap();
+
+  // Submap and match stages
+  void transformUpdate(const float transformSum[6]);
+  void TransformAssociateToMap(const float transformSum[6]);
+  void ExtractSurroundingKeyFrames(MappingFrame* frame);
+  void downsampleCurrentScan(const OdometryFrame& odometry,
+                             MappingFrame* frame);
+  bool LMOptimization(const NormalEquation& equation, int iterCount);
+  int Scan2MapOptimization(const MappingFrame& frame);
+  void publishTF(const MappingFrame& frame);
+  void UpdateLocalMap(const MappingFrame& frame);
+  void MatchFrame(MappingFrame* frame);
+
+  // Graph stage
+  void saveKeyFramesAndFactor(MappingFrame* frame);
+  void correctPoses();
+  void publishKeyPosesAndFrames(const MappingFrame& frame);
+  void UpdateGraph(MappingFrame* frame);
+
+  void MatchThread();
+  void GraphThread();
+  void Proc(const OdometryFrame& odometry, uint32_t dropped);
+  void ShedMappingLoad(double duration);
+  void MappingThread();
+
+  // Key poses and the pose graph, shared by the graph stage, the submap
+  // stage, the loop closure thread and the global map thread
+  std::mutex mtx;
+  PointCloudPtr cloudKeyPoses3D{new pcl::PointCloud<PointType>()};
+  pcl::PointCloud<PointTypePose>::Ptr cloudKeyPoses6D{
+      new pcl::PointCloud<PointTypePose>()};
+  PointType currentRobotPosPoint;
+  PointType previousRobotPosPoint;
+  bool aLoopIsClosed = false;
+  // Poses of the match stage, in the camera frame of the odometry
+  float transformTobeMapped[6] = {0};
+  float transformBefMapped[6] = {0};
+  float transformAftMapped[6] = {0};
+  float transformIncre[6] = {0};
+  // odometry time of the scan being mapped
+  double timeLaserOdometry = 0.0;
+
+  lib::VoxelFilter<PointType> downSizeFilterCorner{0.2f, 0.2f, 0.2f};
+  lib::VoxelFilter<PointType> downSizeFilterSurf{0.4f, 0.4f, 0.4f};
+  lib::VoxelFilter<PointType> downSizeFilterOutlier{0.4f, 0.4f, 0.4f};
+  // for the history key frames of the loop closure
+  lib::VoxelFilter<PointType> downSizeFilterHistoryKeyFrames{0.4f, 0.4f, 0.4f};
+  // for the surrounding key poses of the submap stage
+  lib::VoxelFilter<PointType> downSizeFilterSurroundingKeyPoses{1.0f, 1.0f, 1.0f};
+  PointCloudPtr surroundingKeyPoses{new pcl::PointCloud<PointType>()};
+  PointCloudPtr surroundingKeyPosesDS{new pcl::PointCloud<PointType>()};
+  std::vector<float> pointSearchSqDis;
+  // only used by the global map thread
+  PointCloudPtr globalMapKeyFramesDS{new pcl::PointCloud<PointType>()};
+
+  CloudWriterPtr pubKeyPoses;
+  CloudWriterPtr pubLaserCloudSurround;
+  CloudWriterPtr pubRecentKeyFrames;
+  CloudWriterPtr pubRegisteredCloud;
+  CloudWriterPtr pubHistoryKeyFrames;
+  CloudWriterPtr pubIcpKeyFrames;
+  std::shared_ptr<cyber::Writer<localization::LocalizationEstimate>> pubOdomAftMapped;
+  localization::LocalizationEstimate odomAftMapped;
+
+  // Key poses, updated as key frames are added and searched by the submap
+  // stage and the global map thread, guarded by mtx
+  lib::VoxelHashMap<PointType> keyPosesIndex{10.0f};
+  // Surrounding map of the scan to map matching, updated by the match stage
+  // with the leaf sizes of downSizeFilterCorner and downSizeFilterSurf
+  lib::LocalMap<PointType> localCornerMap{0.2f, 1.0f};
+  lib::LocalMap<PointType> localSurfMap{0.4f, 1.0f};
+  // Key frames in the local maps, as sent by the submap stage
+  std::unordered_set<int> submapKeyFrameIDs;
+  // Key frames moved by a loop closure, guarded by mtx
+  std::vector<int> submapMovedIDs;
+  // Body frame key frame clouds and their cached world frame versions
+  KeyframeStore keyFrames;
+  // Whole map of the global map thread, with the leaf sizes of
+  // downSizeFilterCorner and downSizeFilterSurf
+  lib::TileMap<PointType> globalCornerMap{0.2f, kGlobalMapTileSize};
+  lib::TileMap<PointType> globalSurfMap{0.4f, kGlobalMapTileSize};
+  // Key frames added or moved since the last global map update, guarded by mtx
+  std::vector<int> globalMapPendingIDs;
+  // Publishes the global map every 5s, the map is saved after it stopped.
+  // In lockstep the global map is updated after the scan that is 5s of
+  // scan time past the last update instead, the thread would reorder the
+  // key frames the store keeps in memory by the wall clock.
+  double lastGlobalMapTime = -kGlobalMapPeriod;
+  std::thread globalMapThread;
+  std::mutex globalMapMtx;
+  std::condition_variable globalMapCv;
+  bool globalMapStop = false;
+  // Scan contexts of the key frames in id order, added by the graph stage
+  // under mtx and searched by the loop closure thread under scanContextMtx
+  lib::ScanContextIndex scanContexts;
+  std::mutex scanContextMtx;
+  // Residuals of the scan to map matching, threads set by FLAGS_mapping_threads
+  ScanMatcher scanMatcher;
+  // Update projection of a degenerate scene, found in the first iteration
+  bool isDegenerate = false;
+  NormalEquation::Matrix6d matP = NormalEquation::Matrix6d::Zero();
 
+  // Set by SetLockstep, the stages and the loop closure run on the caller
+  bool lockstep = false;
+  // Stages of Proc when FLAGS_mapping_pipeline is set, never in lockstep
+  bool pipelined = false;
+  lib::BoundedQueue<std::shared_ptr<MappingFrame>> matchQueue{kPipelineDepth};
+  lib::BoundedQueue<std::shared_ptr<MappingFrame>> graphQueue{kPipelineDepth};
+  std::thread matchThread;
+  std::thread graphThread;
+  // Latest pose correction of the graph stage, taken by the match stage
+  std::mutex correctionMtx;
+  GraphCorrection graphCorrection;
+  // Loop closure thread, runs once a second while loopClosureEnableFlag is
+  // set. In lockstep the loop closure runs after the scan that is a second
+  // of scan time past the last try instead.
+  double lastLoopClosureTime = -kLoopClosurePeriod;
+  std::thread loopThread;
+  std::mutex loopMtx;
+  std::condition_variable loopCv;
+  bool loopStop = false;
+  // Latest key frame tried by the loop closure thread, only used by it
+  int loopLatestID = -1;
+  // Registration of the loop closure thread, threads set by FLAGS_loop_threads
+  Registration loopRegistration;
+  // Bumped when a loop closure moves the key poses, guarded by mtx
+  int keyPosesVersion = 0;
+  // Pose graph of the graph stage, its parameters are set by the isam flags
+  PoseGraph poseGraph;
+  // Accepted loops, from the loop closure thread to the graph stage
+  lib::SpscQueue<LoopFactor> loopFactorQueue{16};
+  // Mapping thread, maps the newest scan of OdometryFrameHandler
+  std::thread mappingThread;
+  std::mutex odometryMtx;
+  std::condition_variable odometryCv;
+  OdometryFramePtr odometryFrame;
+  bool mappingStop = false;
+  // Scans replaced in odometryFrame before the mapping took them
+  uint32_t droppedOdometryFrames = 0;
+  std::shared_ptr<cyber::Writer<cloud_msgs::FrameTelemetry>> pubTelemetry;
+  // Load of the mapping thread, by the time of Proc including the wait for
+  // the pipeline, only used by it
+  lib::LoadShedder mappingLoad{kMappingPeriod, 2};
 };
 
 CYBER_REGISTER_COMPONENT(MapOptmization)
@@ -0,0 +1,123 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+//  Created Date: 2022-6-26
+//  Author: daohu527
+
+
+#include "modules/tools/ilego_loam/src/packed_cloud.h"
+
+#include <cstring>
+#include <string>
+
+namespace apollo {
+namespace tools {
+
+namespace {
+
+// x, y, z and intensity, in this order
+constexpr size_t kCompactStep = 4 * sizeof(float);
+
+void AddField(const char* name, size_t offset, cloud_msgs::PackedCloud* cloud) {
+  auto* field = cloud->add_field();
+  field->set_name(name);
+  field->set_offset(offset);
+}
+
+}  // namespace
+
+PackedCloudView::PackedCloudView(const cloud_msgs::PackedCloud& cloud)
+    : data_(cloud.data().data()),
+      size_(cloud.point_count()),
+      step_(cloud.point_step()) {
+  int found = 0;
+  for (const auto& field : cloud.field()) {
+    if (field.offset() + sizeof(float) > step_)
+      return;
+    if (field.name() == "x") {
+      offset_x_ = field.offset();
+    } else if (field.name() == "y") {
+      offset_y_ = field.offset();
+    } else if (field.name() == "z") {
+      offset_z_ = field.offset();
+    } else if (field.name() == "intensity") {
+      offset_intensity_ = field.offset();
+    } else {
+      continue;
+    }
+    ++found;
+  }
+  valid_ = found == 4 && cloud.data().size() == size_ * step_;
+  compact_ = valid_ && step_ == kCompactStep && offset_x_ == 0 &&
+      offset_y_ == sizeof(float) && offset_z_ == 2 * sizeof(float) &&
+      offset_intensity_ == 3 * sizeof(float);
+}
+
+float PackedCloudView::Field(size_t i, size_t offset) const {
+  float value;
+  std::memcpy(&value, data_ + i * step_ + offset, sizeof(float));
+  return value;
+}
+
+void PackPointCloud(const pcl::PointCloud<PointType>& from,
+                    const apollo::common::Header& header,
+                    cloud_msgs::PackedCloud* to) {
+  to->mutable_header()->CopyFrom(header);
+  to->set_point_count(from.points.size());
+  to->set_point_step(kCompactStep);
+  to->clear_field();
+  AddField("x", 0, to);
+  AddField("y", sizeof(float), to);
+  AddField("z", 2 * sizeof(float), to);
+  AddField("intensity", 3 * sizeof(float), to);
+
+  std::string* data = to->mutable_data();
+  data->resize(from.points.size() * kCompactStep);
+  char* out = &(*data)[0];
+  for (const PointType& point : from.points) {
+    const float packed[4] = {point.x, point.y, point.z, point.intensity};
+    std::memcpy(out, packed, kCompactStep);
+    out += kCompactStep;
+  }
+}
+
+bool UnpackPointCloud(const cloud_msgs::PackedCloud& from,
+                      pcl::PointCloud<PointType>* to) {
+  PackedCloudView view(from);
+  if (!view.Valid())
+    return false;
+
+  to->points.resize(view.size());
+  if (view.Compact()) {
+    const char* in = from.data().data();
+    for (PointType& point : to->points) {
+      float packed[4];
+      std::memcpy(packed, in, kCompactStep);
+      point = PointType(packed[0], packed[1], packed[2], packed[3]);
+      in += kCompactStep;
+    }
+  } else {
+    for (size_t i = 0; i < view.size(); ++i) {
+      to->points[i] = PointType(view.x(i), view.y(i), view.z(i),
+                                view.intensity(i));
+    }
+  }
+  to->width = view.size();
+  to->height = 1;
+  return true;
+}
+
+}  // namespace tools
+}  // namespace apollo
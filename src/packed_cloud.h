@@ -0,0 +1,75 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+//  Created Date: 2022-6-26
+//  Author: daohu527
+
+
+#pragma once
+
+#include <cstddef>
+
+#include "modules/tools/ilego_loam/proto/packed_cloud.pb.h"
+
+#include "modules/tools/ilego_loam/src/utility.h"
+
+namespace apollo {
+namespace tools {
+
+// Reads the points of a PackedCloud in place, the view must not outlive
+// the message.
+class PackedCloudView {
+ public:
+  explicit PackedCloudView(const cloud_msgs::PackedCloud& cloud);
+
+  // False if the blob is not point_count points long, or a field is
+  // missing or past the end of a point
+  bool Valid() const { return valid_; }
+  size_t size() const { return size_; }
+  // True if the blob has the layout of PackPointCloud
+  bool Compact() const { return compact_; }
+
+  float x(size_t i) const { return Field(i, offset_x_); }
+  float y(size_t i) const { return Field(i, offset_y_); }
+  float z(size_t i) const { return Field(i, offset_z_); }
+  float intensity(size_t i) const { return Field(i, offset_intensity_); }
+
+ private:
+  float Field(size_t i, size_t offset) const;
+
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  size_t step_ = 0;
+  size_t offset_x_ = 0;
+  size_t offset_y_ = 0;
+  size_t offset_z_ = 0;
+  size_t offset_intensity_ = 0;
+  bool compact_ = false;
+  bool valid_ = false;
+};
+
+// Packs "from" as x, y, z and intensity floats, 16 bytes a point. PointType
+// is padded to 32 bytes, the padding is not sent.
+void PackPointCloud(const pcl::PointCloud<PointType>& from,
+                    const apollo::common::Header& header,
+                    cloud_msgs::PackedCloud* to);
+
+// Replaces the points of "to", returns false and leaves "to" as it was if
+// "from" is malformed.
+bool UnpackPointCloud(const cloud_msgs::PackedCloud& from,
+                      pcl::PointCloud<PointType>* to);
+
+}  // namespace tools
+}  // namespace apollo
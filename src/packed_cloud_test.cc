@@ -0,0 +1,136 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-7-25
+//  Author: daohu527
+
+#include "modules/tools/ilego_loam/src/packed_cloud.h"
+
+#include <cstring>
+
+#include "gtest/gtest.h"
+
+namespace apollo {
+namespace tools {
+
+pcl::PointCloud<PointType> MakeCloud(int size) {
+  pcl::PointCloud<PointType> cloud;
+  for (int i = 0; i < size; ++i)
+    cloud.push_back(PointType(0.5f * i, -1.0f * i, 2.0f + i, 0.25f * i));
+  return cloud;
+}
+
+void ExpectSamePoints(const pcl::PointCloud<PointType>& expected,
+                      const pcl::PointCloud<PointType>& actual) {
+  ASSERT_EQ(actual.size(), expected.size());
+  EXPECT_EQ(actual.width, expected.size());
+  EXPECT_EQ(actual.height, 1u);
+  for (size_t i = 0; i < expected.size(); ++i) {
+    EXPECT_EQ(actual.points[i].x, expected.points[i].x);
+    EXPECT_EQ(actual.points[i].y, expected.points[i].y);
+    EXPECT_EQ(actual.points[i].z, expected.points[i].z);
+    EXPECT_EQ(actual.points[i].intensity, expected.points[i].intensity);
+  }
+}
+
+TEST(PackedCloudTest, RoundTrip) {
+  const pcl::PointCloud<PointType> cloud = MakeCloud(100);
+  apollo::common::Header header;
+  header.set_timestamp_sec(12.5);
+
+  cloud_msgs::PackedCloud packed;
+  PackPointCloud(cloud, header, &packed);
+  EXPECT_EQ(packed.header().timestamp_sec(), 12.5);
+  EXPECT_EQ(packed.point_count(), 100u);
+  // no padding of PointType
+  EXPECT_EQ(packed.point_step(), 16u);
+  EXPECT_EQ(packed.data().size(), 1600u);
+  EXPECT_TRUE(PackedCloudView(packed).Compact());
+
+  pcl::PointCloud<PointType> unpacked = MakeCloud(3);
+  ASSERT_TRUE(UnpackPointCloud(packed, &unpacked));
+  ExpectSamePoints(cloud, unpacked);
+
+  PackPointCloud(pcl::PointCloud<PointType>(), header, &packed);
+  EXPECT_TRUE(packed.data().empty());
+  ASSERT_TRUE(UnpackPointCloud(packed, &unpacked));
+  EXPECT_TRUE(unpacked.empty());
+}
+
+TEST(PackedCloudTest, ReadsOtherLayouts) {
+  // 20 byte points, intensity first and a field the reader does not know
+  const pcl::PointCloud<PointType> cloud = MakeCloud(10);
+  cloud_msgs::PackedCloud packed;
+  packed.set_point_count(cloud.size());
+  packed.set_point_step(20);
+  const char* names[] = {"intensity", "ring", "x", "y", "z"};
+  for (int j = 0; j < 5; ++j) {
+    auto* field = packed.add_field();
+    field->set_name(names[j]);
+    field->set_offset(4 * j);
+  }
+  std::string data(cloud.size() * 20, '\0');
+  for (size_t i = 0; i < cloud.size(); ++i) {
+    const PointType& p = cloud.points[i];
+    const float values[5] = {p.intensity, 7.0f, p.x, p.y, p.z};
+    std::memcpy(&data[i * 20], values, sizeof(values));
+  }
+  packed.set_data(data);
+
+  EXPECT_FALSE(PackedCloudView(packed).Compact());
+  pcl::PointCloud<PointType> unpacked;
+  ASSERT_TRUE(UnpackPointCloud(packed, &unpacked));
+  ExpectSamePoints(cloud, unpacked);
+}
+
+TEST(PackedCloudTest, RejectsMalformedSizes) {
+  const pcl::PointCloud<PointType> cloud = MakeCloud(10);
+  cloud_msgs::PackedCloud packed;
+  PackPointCloud(cloud, apollo::common::Header(), &packed);
+
+  const pcl::PointCloud<PointType> before = MakeCloud(2);
+  pcl::PointCloud<PointType> unpacked = before;
+  auto expect_rejected = [&](const cloud_msgs::PackedCloud& malformed) {
+    EXPECT_FALSE(PackedCloudView(malformed).Valid());
+    EXPECT_FALSE(UnpackPointCloud(malformed, &unpacked));
+    ExpectSamePoints(before, unpacked);
+  };
+
+  cloud_msgs::PackedCloud malformed = packed;
+  malformed.mutable_data()->pop_back();
+  expect_rejected(malformed);
+
+  malformed = packed;
+  malformed.mutable_data()->push_back('\0');
+  expect_rejected(malformed);
+
+  malformed = packed;
+  malformed.set_point_count(11);
+  expect_rejected(malformed);
+
+  malformed = packed;
+  malformed.set_point_step(12);
+  expect_rejected(malformed);
+
+  malformed = packed;
+  malformed.mutable_field()->RemoveLast();
+  expect_rejected(malformed);
+
+  malformed = packed;
+  malformed.mutable_field(0)->set_offset(13);
+  expect_rejected(malformed);
+}
+
+}  // namespace tools
+}  // namespace apollo
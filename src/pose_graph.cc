@@ -0,0 +1,135 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-8-2
+//  Author: daohu527
+
+#include "modules/tools/ilego_loam/src/pose_graph.h"
+
+#include <algorithm>
+
+#include "gtsam/geometry/Rot3.h"
+#include "gtsam/slam/BetweenFactor.h"
+#include "gtsam/slam/PriorFactor.h"
+
+namespace apollo {
+namespace tools {
+
+using gtsam::BetweenFactor;
+using gtsam::ISAM2;
+using gtsam::ISAM2Params;
+using gtsam::ISAM2Result;
+using gtsam::Point3;
+using gtsam::Pose3;
+using gtsam::PriorFactor;
+using gtsam::Rot3;
+namespace noiseModel = gtsam::noiseModel;
+
+Pose3 trans2gtsamPose(const float transformIn[6]) {
+  return Pose3(Rot3::RzRyRx(transformIn[2], transformIn[0], transformIn[1]),
+               Point3(transformIn[5], transformIn[3], transformIn[4]));
+}
+
+void gtsamPose2Trans(const Pose3& pose, float transformOut[6]) {
+  transformOut[0] = pose.rotation().pitch();
+  transformOut[1] = pose.rotation().yaw();
+  transformOut[2] = pose.rotation().roll();
+  transformOut[3] = pose.translation().y();
+  transformOut[4] = pose.translation().z();
+  transformOut[5] = pose.translation().x();
+}
+
+void PoseGraph::Init(int batch_size, double relinearize_threshold,
+                     int relinearize_skip) {
+  ISAM2Params parameters;
+  parameters.relinearizeThreshold = relinearize_threshold;
+  parameters.relinearizeSkip = relinearize_skip;
+  parameters.enableDetailedResults = true;
+  isam_.reset(new ISAM2(parameters));
+  batch_size_ = std::max(batch_size, 1);
+
+  gtsam::Vector Vector6(6);
+  Vector6 << 1e-6, 1e-6, 1e-6, 1e-8, 1e-8, 1e-6;
+  prior_noise_ = noiseModel::Diagonal::Variances(Vector6);
+  Vector6 << 1e-6, 1e-6, 1e-6, 1e-4, 1e-4, 1e-4;
+  odometry_noise_ = noiseModel::Diagonal::Variances(Vector6);
+}
+
+bool PoseGraph::AddKeyFrame(const float transform[6],
+                            const std::vector<LoopFactor>& loops,
+                            Pose3* estimate) {
+  const int key = size_;
+  const Pose3 pose = trans2gtsamPose(transform);
+  if (key == 0) {
+    pending_graph_.add(PriorFactor<Pose3>(0, pose, prior_noise_));
+  } else {
+    const Pose3 pose_from = trans2gtsamPose(transform_last_);
+    pending_graph_.add(BetweenFactor<Pose3>(key - 1, key,
+                                            pose_from.between(pose),
+                                            odometry_noise_));
+  }
+  pending_estimate_.insert(key, pose);
+  for (const LoopFactor& loop : loops) {
+    gtsam::Vector Vector6(6);
+    Vector6 << loop.noiseScore, loop.noiseScore, loop.noiseScore,
+        loop.noiseScore, loop.noiseScore, loop.noiseScore;
+    pending_graph_.add(BetweenFactor<Pose3>(
+        loop.from, loop.to, loop.between,
+        noiseModel::Diagonal::Variances(Vector6)));
+  }
+  ++size_;
+  ++pending_;
+
+  const bool updated = !loops.empty() || pending_ >= batch_size_;
+  if (updated) {
+    Update(loops.empty() ? 1 : 2);
+    // only the latest pose, the caller takes the others that changed
+    *estimate = isam_->calculateEstimate<Pose3>(key);
+    gtsamPose2Trans(*estimate, transform_last_);
+  } else {
+    // batched, the key frame keeps the pose of the match until the update
+    *estimate = pose;
+    std::copy(transform, transform + 6, transform_last_);
+  }
+  return updated;
+}
+
+Pose3 PoseGraph::Estimate(int id) const {
+  return isam_->calculateEstimate<Pose3>(id);
+}
+
+gtsam::NonlinearFactorGraph PoseGraph::Factors() const {
+  gtsam::NonlinearFactorGraph factors = isam_->getFactorsUnsafe();
+  factors.push_back(pending_graph_.begin(), pending_graph_.end());
+  return factors;
+}
+
+// The variables iSAM eliminated again are the ones whose estimate changed,
+// the others were left as they are or moved within the wildfire threshold
+void PoseGraph::Update(int iterations) {
+  for (int i = 0; i < iterations; ++i) {
+    ISAM2Result result = i == 0 ? isam_->update(pending_graph_, pending_estimate_)
+                                : isam_->update();
+    for (const auto& status : result.detail->variableStatus) {
+      if (status.second.isReeliminated)
+        changed_.insert(static_cast<int>(status.first));
+    }
+  }
+  pending_graph_.resize(0);
+  pending_estimate_.clear();
+  pending_ = 0;
+}
+
+}  // namespace tools
+}  // namespace apollo
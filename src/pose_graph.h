@@ -0,0 +1,93 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-8-2
+//  Author: daohu527
+
+#pragma once
+
+#include <memory>
+#include <set>
+#include <vector>
+
+#include "gtsam/geometry/Pose3.h"
+#include "gtsam/linear/NoiseModel.h"
+#include "gtsam/nonlinear/ISAM2.h"
+#include "gtsam/nonlinear/NonlinearFactorGraph.h"
+#include "gtsam/nonlinear/Values.h"
+
+namespace apollo {
+namespace tools {
+
+// A loop closure of the loop closure thread, the constraint between the
+// latest key frame and an old one, merged by the next key frame of the graph
+struct LoopFactor {
+  int from = -1;
+  int to = -1;
+  gtsam::Pose3 between;
+  float noiseScore = 0;
+};
+
+// A mapping transform (rx, ry, rz, tx, ty, tz) of the camera frame and its
+// pose in the graph, rotated in the z, x, y order
+gtsam::Pose3 trans2gtsamPose(const float transformIn[6]);
+void gtsamPose2Trans(const gtsam::Pose3& pose, float transformOut[6]);
+
+// Pose graph of the key frames: a prior on the first one, an odometry
+// factor between consecutive ones and the loop factors. The factors go to
+// iSAM every batch_size key frames, and at once with a loop. The odometry
+// factor of a key frame starts from the pose the previous key frame was
+// left at, the iSAM estimate after an update and the matched pose while it
+// is batched. Not thread safe.
+class PoseGraph {
+ public:
+  void Init(int batch_size, double relinearize_threshold,
+            int relinearize_skip);
+
+  // Adds key frame size() at its matched pose, with the loops found since
+  // the previous key frame. Returns whether iSAM was updated, estimate is
+  // then the pose iSAM gives the key frame, else the matched pose.
+  bool AddKeyFrame(const float transform[6],
+                   const std::vector<LoopFactor>& loops,
+                   gtsam::Pose3* estimate);
+
+  int size() const { return size_; }
+  // Pose of a key frame after the last update
+  gtsam::Pose3 Estimate(int id) const;
+  // Key frames whose estimate an update changed, the caller clears it
+  std::set<int>* changed() { return &changed_; }
+  // Factors in iSAM and the ones waiting for the next update
+  gtsam::NonlinearFactorGraph Factors() const;
+
+ private:
+  // An update after a loop runs one more relinearization pass
+  void Update(int iterations);
+
+  std::unique_ptr<gtsam::ISAM2> isam_;
+  int batch_size_ = 1;
+  gtsam::noiseModel::Diagonal::shared_ptr prior_noise_;
+  gtsam::noiseModel::Diagonal::shared_ptr odometry_noise_;
+
+  // Factors and poses added since the last update
+  gtsam::NonlinearFactorGraph pending_graph_;
+  gtsam::Values pending_estimate_;
+  int pending_ = 0;
+  int size_ = 0;
+  // Pose the next odometry factor starts from
+  float transform_last_[6] = {0};
+  std::set<int> changed_;
+};
+
+}  // namespace tools
+}  // namespace apollo
@@ -0,0 +1,119 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-8-2
+//  Author: daohu527
+
+#include "modules/tools/ilego_loam/src/pose_graph.h"
+
+#include <array>
+#include <cmath>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "gtsam/slam/BetweenFactor.h"
+
+namespace apollo {
+namespace tools {
+
+using gtsam::BetweenFactor;
+using gtsam::Pose3;
+
+constexpr int kKeyFrames = 12;
+constexpr int kBatchSize = 4;
+
+// Matched poses of key frames along a turn, in the camera frame
+std::vector<std::array<float, 6>> MakePath() {
+  std::vector<std::array<float, 6>> path;
+  for (int i = 0; i < kKeyFrames; ++i) {
+    const float yaw = 0.1f * i;
+    path.push_back({0.01f * i, yaw, -0.005f * i, 5.0f * std::sin(yaw),
+                    0.02f * i, 5.0f * (1.0f - std::cos(yaw)) + 1.5f * i});
+  }
+  return path;
+}
+
+void AddPath(const std::vector<std::array<float, 6>>& path, int batch_size,
+             PoseGraph* graph) {
+  graph->Init(batch_size, 0.01, 1);
+  for (const auto& matched : path) {
+    Pose3 estimate;
+    graph->AddKeyFrame(matched.data(), {}, &estimate);
+  }
+}
+
+const BetweenFactor<Pose3>* AsBetween(
+    const gtsam::NonlinearFactorGraph& factors, size_t i) {
+  return dynamic_cast<const BetweenFactor<Pose3>*>(factors[i].get());
+}
+
+TEST(PoseGraphTest, BatchedOdometryFactorsMatchUnbatched) {
+  const auto path = MakePath();
+  PoseGraph unbatched;
+  AddPath(path, 1, &unbatched);
+  PoseGraph batched;
+  AddPath(path, kBatchSize, &batched);
+  ASSERT_EQ(unbatched.size(), kKeyFrames);
+  ASSERT_EQ(batched.size(), kKeyFrames);
+
+  const gtsam::NonlinearFactorGraph expected = unbatched.Factors();
+  const gtsam::NonlinearFactorGraph factors = batched.Factors();
+  // the prior and an odometry factor for each key frame after the first
+  ASSERT_EQ(expected.size(), static_cast<size_t>(kKeyFrames));
+  ASSERT_EQ(factors.size(), expected.size());
+  for (size_t i = 1; i < factors.size(); ++i) {
+    const auto* between = AsBetween(factors, i);
+    const auto* expected_between = AsBetween(expected, i);
+    ASSERT_NE(between, nullptr);
+    ASSERT_NE(expected_between, nullptr);
+    EXPECT_EQ(between->keys(), expected_between->keys());
+    // the odometry between consecutive key frames, not from the last update
+    const Pose3 odometry = trans2gtsamPose(path[i - 1].data())
+                               .between(trans2gtsamPose(path[i].data()));
+    EXPECT_TRUE(between->measured().equals(odometry, 1e-4)) << i;
+    EXPECT_TRUE(between->measured().equals(expected_between->measured(), 1e-4))
+        << i;
+  }
+
+  // the last key frame completes a batch, both graphs are in iSAM
+  for (int i = 0; i < kKeyFrames; ++i) {
+    EXPECT_TRUE(batched.Estimate(i).equals(unbatched.Estimate(i), 1e-3)) << i;
+    EXPECT_TRUE(batched.Estimate(i).equals(trans2gtsamPose(path[i].data()), 1e-3))
+        << i;
+  }
+}
+
+TEST(PoseGraphTest, LoopUpdatesBeforeTheBatchIsFull) {
+  const auto path = MakePath();
+  PoseGraph graph;
+  graph.Init(kBatchSize, 0.01, 1);
+  Pose3 estimate;
+  for (int i = 0; i < kBatchSize - 2; ++i)
+    EXPECT_FALSE(graph.AddKeyFrame(path[i].data(), {}, &estimate));
+  EXPECT_TRUE(estimate.equals(trans2gtsamPose(path[kBatchSize - 3].data()), 1e-6));
+
+  LoopFactor loop;
+  loop.from = kBatchSize - 2;
+  loop.to = 0;
+  loop.between = trans2gtsamPose(path[loop.from].data())
+                     .between(trans2gtsamPose(path[0].data()));
+  loop.noiseScore = 0.1f;
+  EXPECT_TRUE(graph.AddKeyFrame(path[kBatchSize - 2].data(), {loop}, &estimate));
+  EXPECT_TRUE(estimate.equals(trans2gtsamPose(path[kBatchSize - 2].data()), 1e-3));
+  EXPECT_FALSE(graph.changed()->empty());
+  EXPECT_EQ(graph.Factors().size(), static_cast<size_t>(kBatchSize));
+}
+
+}  // namespace tools
+}  // namespace apollo
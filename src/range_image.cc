@@ -0,0 +1,273 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Copyright 2013, Ji Zhang, Carnegie Mellon University
+// Further contributions copyright (c) 2016, Southwest Research Institute
+// All rights reserved.
+//
+//
+// This is an implementation of the algorithm described in the following papers:
+//   J. Zhang and S. Singh. LOAM: Lidar Odometry and Mapping in Real-time.
+//     Robotics: Science and Systems Conference (RSS). Berkeley, CA, July 2014.
+//   T. Shan and B. Englot. LeGO-LOAM: Lightweight and Ground-Optimized Lidar Odometry and Mapping on Variable Terrain
+//      IEEE/RSJ International Conference on Intelligent Robots and Systems (IROS). October 2018.
+
+
+//  Created Date: 2022-6-15
+//  Author: daohu527
+
+
+#include "modules/tools/ilego_loam/src/range_image.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "cyber/cyber.h"
+#include "modules/tools/ilego_loam/flags/lego_loam_gflags.h"
+#include "modules/tools/ilego_loam/src/utility.h"
+
+namespace apollo {
+namespace tools {
+
+void RangeImage::Resize(int rows, int cols, int ground_rows) {
+  rows_ = rows;
+  cols_ = cols;
+  ground_rows_ = std::min(ground_rows, rows);
+
+  x_.assign(rows * cols, 0);
+  y_.assign(rows * cols, 0);
+  z_.assign(rows * cols, 0);
+  range_.assign(rows * cols, FLT_MAX);
+  label_.assign(rows * cols, LABEL_NONE);
+  ground_.assign(rows * cols, 0);
+
+  dirty_index_.clear();
+  dirty_index_.reserve(rows * cols);
+
+  ground_pair_.assign(cols, 0);
+  last_ground_pair_.assign(cols, 0);
+}
+
+void RangeImage::Reset() {
+  for (int index : dirty_index_) {
+    range_[index] = FLT_MAX;
+    label_[index] = LABEL_NONE;
+  }
+  dirty_index_.clear();
+
+  // ground is only written below ground_rows_
+  std::fill(ground_.begin(), ground_.begin() + ground_rows_ * cols_, 0);
+}
+
+template <int kRows, int kCols>
+void ProjectPointCloud(const apollo::drivers::PointCloud& cloud,
+                       const SensorProfile& profile,
+                       const lib::ProjectionTable& table,
+                       RangeImage* image) {
+  const int n_scan = kRows > 0 ? kRows : profile.n_scan;
+  const int horizon_scan = kCols > 0 ? kCols : profile.horizon_scan;
+  const float ang_res_x = profile.ang_res_x;
+  const float ang_res_y = profile.ang_res_y;
+  const float ang_bottom = profile.ang_bottom;
+
+  // Organized clouds store one ring per row, so the ring can be taken
+  // from the point index instead of the vertical angle.
+  bool organized = FLAGS_use_cloud_ring &&
+      cloud.height() == static_cast<uint32_t>(n_scan) &&
+      cloud.width() * cloud.height() ==
+          static_cast<uint32_t>(cloud.point_size());
+  if (FLAGS_use_cloud_ring && !organized) {
+    AWARN_EVERY(100) << "Point cloud is not organized by ring, "
+                     << "fall back to vertical angle";
+  }
+
+  // Read the driver points directly and write them into the range image,
+  // NaN and min-range points are rejected in the same pass.
+  for (int i = 0; i < cloud.point_size(); ++i) {
+    const auto& driver_point = cloud.point(i);
+    if (IsNaN(driver_point))
+      continue;
+
+    float x = driver_point.x();
+    float y = driver_point.y();
+    float z = driver_point.z();
+
+    float range = sqrt(x*x + y*y + z*z);
+    if (range < FLAGS_sensor_minimum_range)
+      continue;
+
+    int row_idn;
+    int column_idn;
+    if (FLAGS_use_projection_table) {
+      row_idn = organized ? i / cloud.width() : table.Row(z, range);
+      column_idn = table.Column(x, y);
+    } else {
+      if (organized) {
+        row_idn = i / cloud.width();
+      } else {
+        float vertical_angle = atan2(z, sqrt(x*x + y*y)) * 180 / M_PI;
+        row_idn = static_cast<int>((vertical_angle + ang_bottom) / ang_res_y);
+      }
+
+      float horizon_angle = atan2(x, y) * 180 / M_PI;
+      // todo(zero): horizon_angle [-180, 180]
+      column_idn = round(horizon_angle / ang_res_x) + horizon_scan / 2;
+      if (column_idn >= horizon_scan)
+        column_idn -= horizon_scan;
+    }
+
+    // Row() returns -1 out of the field of view, points below the lowest
+    // beam give a negative row as well
+    if (row_idn < 0 || row_idn >= n_scan)
+      continue;
+
+    if (column_idn < 0 || column_idn >= horizon_scan)
+      continue;
+
+    image->Set(row_idn, column_idn, x, y, z, range);
+  }
+}
+
+template <int kRows, int kCols>
+void GroundRemoval(const SensorProfile& profile, RangeImage* image) {
+  const int horizon_scan = kCols > 0 ? kCols : profile.horizon_scan;
+  const int ground_scan_ind = profile.ground_scan_ind;
+
+  // |atan2(dz, dxy) - mount_angle| <= 10 degree, compared on the slope so
+  // the inner loop has no branch and no atan2
+  const float tan_lower = std::tan((FLAGS_sensor_mount_angle - 10) / 180 * M_PI);
+  const float tan_upper = std::tan((FLAGS_sensor_mount_angle + 10) / 180 * M_PI);
+
+  const float* x = image->x();
+  const float* y = image->y();
+  const float* z = image->z();
+  const float* range = image->range();
+  int8_t* ground = image->mutable_ground();
+
+  // pair flag of the rows (i, i + 1): -1 invalid, 1 ground, 0 otherwise
+  int8_t* pair = image->ground_pair();
+  int8_t* last_pair = image->last_ground_pair();
+  std::fill(last_pair, last_pair + horizon_scan, 0);
+
+  for (int i = 0; i < ground_scan_ind; ++i) {
+    const int lower = i * horizon_scan;
+    const int upper = (i + 1) * horizon_scan;
+
+    for (int j = 0; j < horizon_scan; ++j) {
+      float diffx = x[upper + j] - x[lower + j];
+      float diffy = y[upper + j] - y[lower + j];
+      float diffz = z[upper + j] - z[lower + j];
+      float diff_xy = std::sqrt(diffx*diffx + diffy*diffy);
+
+      bool valid = (range[lower + j] != FLT_MAX) & (range[upper + j] != FLT_MAX);
+      bool is_ground = (diffz >= tan_lower * diff_xy) & (diffz <= tan_upper * diff_xy);
+      pair[j] = valid ? static_cast<int8_t>(is_ground) : -1;
+    }
+
+    // Same as writing ground[i] and ground[i + 1] row by row, an invalid
+    // pair overrides the ground flag set by the pair below.
+    int8_t* ground_row = ground + lower;
+    for (int j = 0; j < horizon_scan; ++j) {
+      ground_row[j] = pair[j] == -1 ? -1 :
+          static_cast<int8_t>((pair[j] == 1) | (last_pair[j] == 1));
+    }
+    std::swap(pair, last_pair);
+  }
+
+  int8_t* ground_row = ground + ground_scan_ind * horizon_scan;
+  for (int j = 0; j < horizon_scan; ++j) {
+    ground_row[j] = static_cast<int8_t>(last_pair[j] == 1);
+  }
+
+  // Empty cells are already labeled LABEL_NONE
+  int* label = image->mutable_label();
+  for (int index : image->dirty_index()) {
+    if (ground[index] == 1)
+      label[index] = LABEL_NONE;
+  }
+}
+
+template <int kRows, int kCols>
+void ExtractSegmentedCloud(const SensorProfile& profile,
+                           const RangeImage& image,
+                           cloud_msgs::CloudInfo* info,
+                           pcl::PointCloud<PointType>* segmented_cloud,
+                           pcl::PointCloud<PointType>* outlier_cloud) {
+  const int n_scan = kRows > 0 ? kRows : profile.n_scan;
+  const int horizon_scan = kCols > 0 ? kCols : profile.horizon_scan;
+  const int ground_scan_ind = profile.ground_scan_ind;
+
+  // Resize keeps the fields allocated when the size does not change
+  info->mutable_start_ring_index()->Resize(n_scan, 0);
+  info->mutable_end_ring_index()->Resize(n_scan, 0);
+  info->mutable_segmented_cloud_ground_flag()->Resize(n_scan * horizon_scan, false);
+  info->mutable_segmented_cloud_col_ind()->Resize(n_scan * horizon_scan, 0);
+  info->mutable_segmented_cloud_range()->Resize(n_scan * horizon_scan, 0);
+  segmented_cloud->clear();
+  outlier_cloud->clear();
+
+  const int* label = image.label();
+  const int8_t* ground = image.ground();
+  const float* range = image.range();
+
+  int size_of_seg_cloud = 0;
+  for (int i = 0; i < n_scan; ++i) {
+    info->set_start_ring_index(i, size_of_seg_cloud - 1 + 5);
+    for (int j = 0; j < horizon_scan; ++j) {
+      const int index = j + i * horizon_scan;
+      if (label[index] > 0 || ground[index] == 1) {
+        if (label[index] == LABEL_INVALID) {
+          if (i > ground_scan_ind && j % 5 == 0) {
+            outlier_cloud->push_back(CellPoint(image, index));
+          }
+          continue;
+        }
+
+        if (ground[index] == 1) {
+          if (j%5 != 0 && j > 5 && j < horizon_scan-5)
+            continue;
+        }
+
+        info->set_segmented_cloud_ground_flag(size_of_seg_cloud, ground[index] == 1);
+        info->set_segmented_cloud_col_ind(size_of_seg_cloud, j);
+        info->set_segmented_cloud_range(size_of_seg_cloud, range[index]);
+        segmented_cloud->push_back(CellPoint(image, index));
+        ++size_of_seg_cloud;
+      }
+    }
+    info->set_end_ring_index(i, size_of_seg_cloud - 1 - 5);
+  }
+}
+
+#define INSTANTIATE_RANGE_IMAGE_STAGES(ROWS, COLS)                          \
+  template void ProjectPointCloud<ROWS, COLS>(                              \
+      const apollo::drivers::PointCloud&, const SensorProfile&,             \
+      const lib::ProjectionTable&, RangeImage*);                            \
+  template void GroundRemoval<ROWS, COLS>(const SensorProfile&,             \
+                                          RangeImage*);                     \
+  template void ExtractSegmentedCloud<ROWS, COLS>(                          \
+      const SensorProfile&, const RangeImage&, cloud_msgs::CloudInfo*,      \
+      pcl::PointCloud<PointType>*, pcl::PointCloud<PointType>*);
+
+// keep in sync with DispatchGeometry
+INSTANTIATE_RANGE_IMAGE_STAGES(16, 1800)
+INSTANTIATE_RANGE_IMAGE_STAGES(32, 1800)
+INSTANTIATE_RANGE_IMAGE_STAGES(64, 1800)
+INSTANTIATE_RANGE_IMAGE_STAGES(128, 1800)
+INSTANTIATE_RANGE_IMAGE_STAGES(0, 0)
+
+#undef INSTANTIATE_RANGE_IMAGE_STAGES
+
+}  // namespace tools
+}  // namespace apollo
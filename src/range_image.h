@@ -0,0 +1,158 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Copyright 2013, Ji Zhang, Carnegie Mellon University
+// Further contributions copyright (c) 2016, Southwest Research Institute
+// All rights reserved.
+//
+//
+// This is an implementation of the algorithm described in the following papers:
+//   J. Zhang and S. Singh. LOAM: Lidar Odometry and Mapping in Real-time.
+//     Robotics: Science and Systems Conference (RSS). Berkeley, CA, July 2014.
+//   T. Shan and B. Englot. LeGO-LOAM: Lightweight and Ground-Optimized Lidar Odometry and Mapping on Variable Terrain
+//      IEEE/RSJ International Conference on Intelligent Robots and Systems (IROS). October 2018.
+
+
+//  Created Date: 2022-6-15
+//  Author: daohu527
+
+
+#pragma once
+
+#include <cfloat>
+#include <climits>
+#include <cstdint>
+#include <vector>
+
+#include "modules/drivers/proto/pointcloud.pb.h"
+#include "modules/tools/ilego_loam/proto/cloud_info.pb.h"
+
+#include "modules/tools/ilego_loam/src/lib/projection_table.h"
+#include "modules/tools/ilego_loam/src/sensor_profile.h"
+#include "modules/tools/ilego_loam/src/utility.h"
+
+namespace apollo {
+namespace tools {
+
+static constexpr int LABEL_NONE = -1;
+static constexpr int LABEL_INIT = 0;
+static constexpr int LABEL_INVALID = INT_MAX;
+
+// Range image stored as structure of arrays, every field is a contiguous
+// n_scan x horizon_scan array with index = col + row * horizon_scan.
+// Empty cells have range FLT_MAX and label LABEL_NONE, their x/y/z are
+// undefined.
+class RangeImage {
+ public:
+  void Resize(int rows, int cols, int ground_rows);
+
+  // Clear the cells written since the last reset.
+  void Reset();
+
+  // Write a point, returns the cell index.
+  int Set(int row, int col, float x, float y, float z, float range) {
+    int index = col + row * cols_;
+    if (range_[index] == FLT_MAX) {
+      dirty_index_.push_back(index);
+      label_[index] = LABEL_INIT;
+    }
+    x_[index] = x;
+    y_[index] = y;
+    z_[index] = z;
+    range_[index] = range;
+    return index;
+  }
+
+  bool Valid(int index) const { return range_[index] != FLT_MAX; }
+
+  int rows() const { return rows_; }
+  int cols() const { return cols_; }
+
+  const float* x() const { return x_.data(); }
+  const float* y() const { return y_.data(); }
+  const float* z() const { return z_.data(); }
+  const float* range() const { return range_.data(); }
+  const int* label() const { return label_.data(); }
+  const int8_t* ground() const { return ground_.data(); }
+
+  int* mutable_label() { return label_.data(); }
+  int8_t* mutable_ground() { return ground_.data(); }
+
+  // cells written in this frame, in projection order
+  const std::vector<int>& dirty_index() const { return dirty_index_; }
+
+  // scratch rows of GroundRemoval, horizon_scan cells each
+  int8_t* ground_pair() { return ground_pair_.data(); }
+  int8_t* last_ground_pair() { return last_ground_pair_.data(); }
+
+ private:
+  int rows_ = 0;
+  int cols_ = 0;
+  int ground_rows_ = 0;
+
+  std::vector<float> x_;
+  std::vector<float> y_;
+  std::vector<float> z_;
+  std::vector<float> range_;
+  std::vector<int> label_;
+  std::vector<int8_t> ground_;
+
+  std::vector<int> dirty_index_;
+
+  std::vector<int8_t> ground_pair_;
+  std::vector<int8_t> last_ground_pair_;
+};
+
+// The stages below only depend on the range image, so each of them can
+// run and be benchmarked on its own. kRows and kCols are the image size
+// for common sensors, 0 means the size is only known at runtime.
+
+// 1. Project the driver points into the range image.
+template <int kRows, int kCols>
+void ProjectPointCloud(const apollo::drivers::PointCloud& cloud,
+                       const SensorProfile& profile,
+                       const lib::ProjectionTable& table,
+                       RangeImage* image);
+
+// 2. Mark ground cells and label them LABEL_NONE.
+template <int kRows, int kCols>
+void GroundRemoval(const SensorProfile& profile, RangeImage* image);
+
+// 3. Segmentation, see ComponentLabeler
+
+// 4. The segmented cloud of the labeled image and its ring info for
+// FeatureAssociation. Points of invalid segments above the ground rows are
+// outliers, of every fifth column.
+template <int kRows, int kCols>
+void ExtractSegmentedCloud(const SensorProfile& profile,
+                           const RangeImage& image,
+                           cloud_msgs::CloudInfo* info,
+                           pcl::PointCloud<PointType>* segmented_cloud,
+                           pcl::PointCloud<PointType>* outlier_cloud);
+
+// The point of a cell, its row and column in the intensity as
+// row + column / 10000
+inline PointType CellPoint(const RangeImage& image, int index) {
+  const int horizon_scan = image.cols();
+  PointType point;
+  point.x = image.x()[index];
+  point.y = image.y()[index];
+  point.z = image.z()[index];
+  point.intensity = static_cast<float>(index / horizon_scan) +
+      static_cast<float>(index % horizon_scan) / 10000;
+  return point;
+}
+
+}  // namespace tools
+}  // namespace apollo
@@ -0,0 +1,201 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-7-25
+//  Author: daohu527
+
+
+
+#include "modules/tools/ilego_loam/src/registration.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Eigen/Dense"
+
+#include "modules/tools/ilego_loam/src/lib/voxel_filter.h"
+
+namespace apollo {
+namespace tools {
+
+namespace {
+
+struct LevelOptions {
+  // 0 keeps the clouds as they are
+  float leaf_size;
+  float max_distance;
+  int max_iterations;
+};
+
+// The loop candidates are within a few meters of each other, the finest
+// level works on the history key frames as they are downsampled
+constexpr LevelOptions kLevels[] = {
+    {2.0f, 10.0f, 20},
+    {1.0f, 3.0f, 20},
+    {0.0f, 1.0f, 30},
+};
+
+// A level matching fewer source points than this does not overlap
+constexpr float kMinOverlap = 0.3f;
+constexpr float kTranslationEpsilon = 1e-3f;
+constexpr float kRotationEpsilon = 1e-4f;
+
+void Downsample(const pcl::PointCloud<PointType>& input, float leaf_size,
+                pcl::PointCloud<PointType>* output) {
+  if (leaf_size <= 0.0f) {
+    *output = input;
+    return;
+  }
+  lib::VoxelFilter<PointType> filter(leaf_size, leaf_size, leaf_size);
+  filter.Filter(input, output);
+}
+
+}  // namespace
+
+void Registration::Correspondences::Clear() {
+  source_sum.setZero();
+  target_sum.setZero();
+  cross.setZero();
+  sq_distance = 0.0;
+  count = 0;
+}
+
+Registration::Correspondences& Registration::Correspondences::operator+=(
+    const Correspondences& other) {
+  source_sum += other.source_sum;
+  target_sum += other.target_sum;
+  cross += other.cross;
+  sq_distance += other.sq_distance;
+  count += other.count;
+  return *this;
+}
+
+void Registration::Init(int num_threads) {
+  num_threads_ = std::max(1, num_threads);
+  pool_.Resize(num_threads_);
+  partial_.resize(num_threads_);
+}
+
+void Registration::SetTarget(int64_t key,
+                             const pcl::PointCloud<PointType>& target) {
+  key_ = key;
+  levels_.clear();
+  pcl::PointCloud<PointType> downsampled;
+  for (const LevelOptions& options : kLevels) {
+    Level level{options.leaf_size, options.max_distance,
+                options.max_iterations,
+                lib::VoxelHashMap<PointType>(options.max_distance)};
+    Downsample(target, options.leaf_size, &downsampled);
+    level.target.Insert(downsampled);
+    levels_.push_back(std::move(level));
+  }
+}
+
+Registration::Result Registration::Align(
+    const pcl::PointCloud<PointType>& source, const Eigen::Affine3f& guess) {
+  Result result;
+  result.transform = guess;
+  if (levels_.empty() || source.points.empty())
+    return result;
+
+  pcl::PointCloud<PointType> downsampled;
+  for (const Level& level : levels_) {
+    Downsample(source, level.leaf_size, &downsampled);
+    const size_t min_count = static_cast<size_t>(
+        std::ceil(kMinOverlap * downsampled.points.size()));
+
+    for (int iteration = 0; iteration < level.max_iterations; ++iteration) {
+      const Correspondences& pairs = Match(downsampled, result.transform, level);
+      if (pairs.count < 3 || static_cast<size_t>(pairs.count) < min_count)
+        return result;
+
+      // Closed form rigid transform of the pairs, by the SVD of their
+      // cross covariance
+      const Eigen::Vector3d source_mean = pairs.source_sum / pairs.count;
+      const Eigen::Vector3d target_mean = pairs.target_sum / pairs.count;
+      const Eigen::Matrix3d covariance =
+          pairs.cross - pairs.count * source_mean * target_mean.transpose();
+      Eigen::JacobiSVD<Eigen::Matrix3d> svd(
+          covariance, Eigen::ComputeFullU | Eigen::ComputeFullV);
+      Eigen::Matrix3d v = svd.matrixV();
+      if ((v * svd.matrixU().transpose()).determinant() < 0)
+        v.col(2) = -v.col(2);
+      const Eigen::Matrix3d rotation = v * svd.matrixU().transpose();
+      const Eigen::Vector3d translation = target_mean - rotation * source_mean;
+
+      Eigen::Affine3f delta = Eigen::Affine3f::Identity();
+      delta.linear() = rotation.cast<float>();
+      delta.translation() = translation.cast<float>();
+      result.transform = delta * result.transform;
+
+      if (translation.norm() < kTranslationEpsilon &&
+          Eigen::AngleAxisd(rotation).angle() < kRotationEpsilon)
+        break;
+    }
+  }
+
+  // The fitness of the finest level, the source as it is
+  const Level& finest = levels_.back();
+  const Correspondences& pairs = Match(source, result.transform, finest);
+  if (static_cast<size_t>(pairs.count) <
+      std::ceil(kMinOverlap * source.points.size()))
+    return result;
+  const size_t unmatched = source.points.size() - pairs.count;
+  result.fitness = (pairs.sq_distance + unmatched * finest.max_distance *
+                                            finest.max_distance) /
+                   source.points.size();
+  result.converged = true;
+  return result;
+}
+
+const Registration::Correspondences& Registration::Match(
+    const pcl::PointCloud<PointType>& source, const Eigen::Affine3f& transform,
+    const Level& level) {
+  const size_t num = source.points.size();
+  pool_.ParallelFor(num_threads_, [&, this](int chunk) {
+    MatchRange(source, transform, level, num * chunk / num_threads_,
+               num * (chunk + 1) / num_threads_, &partial_[chunk]);
+  });
+
+  total_.Clear();
+  for (const Correspondences& correspondences : partial_)
+    total_ += correspondences;
+  return total_;
+}
+
+void Registration::MatchRange(const pcl::PointCloud<PointType>& source,
+                              const Eigen::Affine3f& transform,
+                              const Level& level, size_t begin, size_t end,
+                              Correspondences* correspondences) {
+  correspondences->Clear();
+  std::vector<PointType> nearest;
+  std::vector<float> sq_distances;
+  PointType point;
+  for (size_t i = begin; i < end; ++i) {
+    point.getVector3fMap() = transform * source.points[i].getVector3fMap();
+    if (level.target.NearestKSearch(point, 1, level.max_distance, &nearest,
+                                    &sq_distances) == 0)
+      continue;
+    const Eigen::Vector3d p = point.getVector3fMap().cast<double>();
+    const Eigen::Vector3d q = nearest[0].getVector3fMap().cast<double>();
+    correspondences->source_sum += p;
+    correspondences->target_sum += q;
+    correspondences->cross += p * q.transpose();
+    correspondences->sq_distance += sq_distances[0];
+    ++correspondences->count;
+  }
+}
+
+}  // namespace tools
+}  // namespace apollo
@@ -0,0 +1,103 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-7-25
+//  Author: daohu527
+
+
+
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "Eigen/Core"
+#include "Eigen/Geometry"
+
+#include "modules/tools/ilego_loam/src/lib/thread_pool.h"
+#include "modules/tools/ilego_loam/src/lib/voxel_hash_map.h"
+#include "modules/tools/ilego_loam/src/utility.h"
+
+namespace apollo {
+namespace tools {
+
+// Point to point ICP of the loop closure, a key frame against the clouds
+// around an older one.
+//
+// The target is downsampled and indexed once per level, coarse to fine,
+// and kept until it is replaced, so attempts against the same old key
+// frames reuse it. Each level starts where the coarser one ended, with a
+// shorter correspondence distance, and a level that matches too few source
+// points gives up early. The correspondences are searched in chunks on a
+// lib::ThreadPool and summed in chunk order like ScanMatcher.
+class Registration {
+ public:
+  struct Result {
+    bool converged = false;
+    // Mean squared distance of the source points to their nearest target
+    // points, as pcl getFitnessScore. Points without a target point within
+    // the finest correspondence distance count as that distance.
+    float fitness = std::numeric_limits<float>::max();
+    Eigen::Affine3f transform = Eigen::Affine3f::Identity();
+  };
+
+  void Init(int num_threads = 1);
+
+  // key names the target for HasTarget
+  void SetTarget(int64_t key, const pcl::PointCloud<PointType>& target);
+  bool HasTarget(int64_t key) const { return !levels_.empty() && key_ == key; }
+
+  // transform of the result moves source onto the target, starting at guess
+  Result Align(const pcl::PointCloud<PointType>& source,
+               const Eigen::Affine3f& guess);
+
+ private:
+  struct Level {
+    float leaf_size;
+    float max_distance;
+    int max_iterations;
+    lib::VoxelHashMap<PointType> target;
+  };
+
+  // Sums of the point pairs for the closed form rigid transform
+  struct Correspondences {
+    void Clear();
+    Correspondences& operator+=(const Correspondences& other);
+
+    Eigen::Vector3d source_sum;
+    Eigen::Vector3d target_sum;
+    Eigen::Matrix3d cross;
+    double sq_distance = 0.0;
+    int count = 0;
+  };
+
+  const Correspondences& Match(const pcl::PointCloud<PointType>& source,
+                               const Eigen::Affine3f& transform,
+                               const Level& level);
+  void MatchRange(const pcl::PointCloud<PointType>& source,
+                  const Eigen::Affine3f& transform, const Level& level,
+                  size_t begin, size_t end, Correspondences* correspondences);
+
+  int num_threads_ = 1;
+  lib::ThreadPool pool_;
+  std::vector<Correspondences> partial_{1};
+  Correspondences total_;
+
+  int64_t key_ = -1;
+  std::vector<Level> levels_;
+};
+
+}  // namespace tools
+}  // namespace apollo
@@ -0,0 +1,198 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-7-25
+//  Author: daohu527
+
+#include "modules/tools/ilego_loam/src/registration.h"
+
+#include <cmath>
+#include <random>
+
+#include "gtest/gtest.h"
+
+namespace apollo {
+namespace tools {
+
+// Points on a floor, two walls and a box, nothing symmetric for the ICP to
+// slide along
+pcl::PointCloud<PointType> MakeRoom(unsigned seed) {
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> u(-10.0f, 10.0f);
+  std::uniform_real_distribution<float> h(0.0f, 4.0f);
+  std::uniform_real_distribution<float> b(0.0f, 2.0f);
+  pcl::PointCloud<PointType> cloud;
+  auto add = [&cloud](float x, float y, float z) {
+    PointType point;
+    point.x = x;
+    point.y = y;
+    point.z = z;
+    point.intensity = 0.0f;
+    cloud.push_back(point);
+  };
+  for (int i = 0; i < 4000; ++i)
+    add(u(rng), u(rng), 0.0f);
+  for (int i = 0; i < 2000; ++i)
+    add(10.0f, u(rng), h(rng));
+  for (int i = 0; i < 2000; ++i)
+    add(u(rng), -10.0f, h(rng));
+  for (int i = 0; i < 1000; ++i) {
+    add(3.0f + b(rng), 4.0f, b(rng));
+    add(3.0f, 4.0f + b(rng), b(rng));
+    add(3.0f + b(rng), 4.0f + b(rng), 2.0f);
+  }
+  return cloud;
+}
+
+Eigen::Affine3f MakeTransform(float yaw, float x, float y, float z) {
+  Eigen::Affine3f transform = Eigen::Affine3f::Identity();
+  transform.rotate(Eigen::AngleAxisf(yaw, Eigen::Vector3f::UnitZ()));
+  transform.translation() = Eigen::Vector3f(x, y, z);
+  return transform;
+}
+
+// Every step-th point of cloud moved by transform
+pcl::PointCloud<PointType> Subset(const pcl::PointCloud<PointType>& cloud,
+                                  int step, const Eigen::Affine3f& transform) {
+  pcl::PointCloud<PointType> subset;
+  for (size_t i = 0; i < cloud.size(); i += step) {
+    PointType point = cloud.points[i];
+    point.getVector3fMap() = transform * point.getVector3fMap();
+    subset.push_back(point);
+  }
+  return subset;
+}
+
+void ExpectNearTransform(const Eigen::Affine3f& expected,
+                         const Eigen::Affine3f& actual) {
+  const Eigen::Affine3f error = expected.inverse() * actual;
+  EXPECT_LT(error.translation().norm(), 0.02f);
+  EXPECT_LT(Eigen::AngleAxisf(error.linear()).angle(), 0.002f);
+}
+
+TEST(RegistrationTest, ConvergesToTheOffset) {
+  const pcl::PointCloud<PointType> target = MakeRoom(1);
+  const Eigen::Affine3f offset = MakeTransform(0.05f, 0.8f, -0.5f, 0.2f);
+  const pcl::PointCloud<PointType> source = Subset(target, 3, offset.inverse());
+
+  Registration registration;
+  registration.Init();
+  registration.SetTarget(7, target);
+  EXPECT_TRUE(registration.HasTarget(7));
+  EXPECT_FALSE(registration.HasTarget(8));
+
+  const Registration::Result result =
+      registration.Align(source, Eigen::Affine3f::Identity());
+  ASSERT_TRUE(result.converged);
+  ExpectNearTransform(offset, result.transform);
+  // the source points are target points
+  EXPECT_LT(result.fitness, 1e-4f);
+  EXPECT_LT(result.fitness, historyKeyframeFitnessScore);
+}
+
+TEST(RegistrationTest, StartsAtTheGuess) {
+  const pcl::PointCloud<PointType> target = MakeRoom(2);
+  const Eigen::Affine3f offset = MakeTransform(-0.1f, 2.0f, 1.5f, 0.0f);
+  const pcl::PointCloud<PointType> source = Subset(target, 4, offset.inverse());
+
+  Registration registration;
+  registration.SetTarget(0, target);
+  const Registration::Result result =
+      registration.Align(source, MakeTransform(-0.08f, 1.8f, 1.4f, 0.0f));
+  ASSERT_TRUE(result.converged);
+  ExpectNearTransform(offset, result.transform);
+}
+
+TEST(RegistrationTest, UnmatchedPointsCountAsTheFinestDistance) {
+  const pcl::PointCloud<PointType> target = MakeRoom(3);
+  pcl::PointCloud<PointType> source =
+      Subset(target, 2, Eigen::Affine3f::Identity());
+  // a third of the source far off the target, the rest on it
+  const size_t matched = source.size();
+  const size_t outliers = matched / 2;
+  for (size_t i = 0; i < outliers; ++i) {
+    PointType point = source.points[i];
+    point.z += 5.0f + 0.01f * (i % 100);
+    source.push_back(point);
+  }
+
+  Registration registration;
+  registration.SetTarget(0, target);
+  const Registration::Result result =
+      registration.Align(source, Eigen::Affine3f::Identity());
+  ASSERT_TRUE(result.converged);
+  ExpectNearTransform(Eigen::Affine3f::Identity(), result.transform);
+  // the finest level matches within 1m, the outliers add 1m^2 each
+  const float expected = static_cast<float>(outliers) / source.size();
+  EXPECT_NEAR(result.fitness, expected, 1e-3f);
+  // too many for the loop closure
+  EXPECT_GT(result.fitness, historyKeyframeFitnessScore);
+}
+
+TEST(RegistrationTest, GivesUpOnLowOverlap) {
+  const pcl::PointCloud<PointType> target = MakeRoom(4);
+  // beyond the correspondence distance of the coarsest level
+  const Eigen::Affine3f away = MakeTransform(0.0f, 60.0f, 0.0f, 0.0f);
+  const pcl::PointCloud<PointType> source = Subset(target, 3, away);
+
+  Registration registration;
+  registration.SetTarget(0, target);
+  const Eigen::Affine3f guess = MakeTransform(0.01f, 0.1f, 0.0f, 0.0f);
+  const Registration::Result result = registration.Align(source, guess);
+  EXPECT_FALSE(result.converged);
+  EXPECT_EQ(result.fitness, std::numeric_limits<float>::max());
+  // stopped before the first step
+  EXPECT_TRUE(result.transform.isApprox(guess));
+
+  // a fifth of the source on the target is less than the overlap needed
+  pcl::PointCloud<PointType> partial =
+      Subset(target, 15, Eigen::Affine3f::Identity());
+  const size_t on_target = partial.size();
+  for (size_t i = 0; i < 4 * on_target; ++i)
+    partial.push_back(source.points[i]);
+  EXPECT_FALSE(
+      registration.Align(partial, Eigen::Affine3f::Identity()).converged);
+
+  // without a target nothing is aligned
+  Registration empty;
+  EXPECT_FALSE(empty.HasTarget(-1));
+  EXPECT_FALSE(empty.Align(source, guess).converged);
+}
+
+TEST(RegistrationTest, ThreadsMatchOneThread) {
+  const pcl::PointCloud<PointType> target = MakeRoom(5);
+  const Eigen::Affine3f offset = MakeTransform(0.03f, 0.5f, 0.3f, -0.1f);
+  const pcl::PointCloud<PointType> source = Subset(target, 3, offset.inverse());
+
+  Registration serial;
+  serial.SetTarget(0, target);
+  const Registration::Result expected =
+      serial.Align(source, Eigen::Affine3f::Identity());
+  ASSERT_TRUE(expected.converged);
+
+  for (int num_threads : {2, 4}) {
+    Registration parallel;
+    parallel.Init(num_threads);
+    parallel.SetTarget(0, target);
+    const Registration::Result actual =
+        parallel.Align(source, Eigen::Affine3f::Identity());
+    ASSERT_TRUE(actual.converged);
+    // the partial sums are added in another grouping only
+    EXPECT_TRUE(actual.transform.isApprox(expected.transform, 1e-4f));
+    EXPECT_NEAR(actual.fitness, expected.fitness, 1e-6f);
+  }
+}
+
+}  // namespace tools
+}  // namespace apollo
@@ -0,0 +1,213 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-7-25
+//  Author: daohu527
+
+
+// Offline replay of record files, as fast as the stages go.
+//
+//   ilego_loam_replay [--replay_lockstep] a.record b.record ...
+//
+// The clouds on FLAGS_lidar_topic and the imu on FLAGS_imu_topic are read
+// in the order of the files and handed from stage to stage directly,
+// without the scheduler or the channels. The imu goes through the feature
+// stage in record order with the clouds. Every stage runs on its own
+// thread, with --replay_lockstep a frame goes through all of them before
+// the next one is read, so two runs give the same result: the mapping
+// pipeline, the loop closure and the global map threads are off and the
+// loop closure and the global map run by the time of the scans. Unlike the
+// fused component the mapping never drops a scan, it holds back the stages
+// before it instead, and there is no lidar to fall behind, so
+// --load_shedding is off unless it is given, and always in lockstep.
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cyber/cyber.h"
+#include "cyber/record/record_message.h"
+#include "cyber/record/record_reader.h"
+#include "modules/localization/proto/imu.pb.h"
+
+#include "modules/tools/ilego_loam/flags/lego_loam_gflags.h"
+#include "modules/tools/ilego_loam/src/component_util.h"
+#include "modules/tools/ilego_loam/src/feature_association.h"
+#include "modules/tools/ilego_loam/src/image_projection.h"
+#include "modules/tools/ilego_loam/src/lib/bounded_queue.h"
+#include "modules/tools/ilego_loam/src/map_optmization.h"
+
+namespace apollo {
+namespace tools {
+namespace {
+
+// Tasks waiting in front of a stage, a slow stage holds back the reader
+constexpr size_t kStageDepth = 4;
+
+// A stage of the replay. Its tasks run in order on its own thread, or at
+// once on the caller in lockstep mode.
+class ReplayStage {
+ public:
+  explicit ReplayStage(bool lockstep) : queue_(kStageDepth) {
+    if (lockstep)
+      return;
+    thread_ = std::thread([this] {
+      std::function<void()> task;
+      while (queue_.Pop(&task))
+        task();
+    });
+  }
+
+  ~ReplayStage() { Finish(); }
+
+  ReplayStage(const ReplayStage&) = delete;
+  ReplayStage& operator=(const ReplayStage&) = delete;
+
+  void Post(std::function<void()> task) {
+    if (thread_.joinable())
+      queue_.Push(std::move(task));
+    else
+      task();
+  }
+
+  // Runs the tasks left and stops the thread
+  void Finish() {
+    queue_.Close();
+    if (thread_.joinable())
+      thread_.join();
+  }
+
+ private:
+  lib::BoundedQueue<std::function<void()>> queue_;
+  std::thread thread_;
+};
+
+bool Replay(const std::vector<std::string>& records) {
+  auto image_projection = std::make_shared<ImageProjection>();
+  auto feature_association = std::make_shared<FeatureAssociation>();
+  auto map_optmization = std::make_shared<MapOptmization>();
+
+  // Only touched by their stage until it is finished, declared before the
+  // stages so they outlive the tasks left on an early return
+  uint64_t frames = 0;
+  uint64_t mapped_frames = 0;
+
+  // Declared in the order of the chain, a stage is finished before the
+  // ones after it
+  ReplayStage mapping_stage(FLAGS_replay_lockstep);
+  ReplayStage feature_stage(FLAGS_replay_lockstep);
+  ReplayStage image_stage(FLAGS_replay_lockstep);
+
+  image_projection->SetFrameCallback([&](const SegmentedFramePtr& frame) {
+    feature_stage.Post([&, frame] {
+      feature_association->SegmentedFrameHandler(frame);
+      ++frames;
+    });
+  });
+  feature_association->SetOdometryCallback([&](const OdometryFramePtr& frame) {
+    mapping_stage.Post([&, frame] {
+      map_optmization->ProcessOdometryFrame(*frame);
+      ++mapped_frames;
+    });
+  });
+
+  // no readers, nothing on the channels reaches the stages
+  image_projection->SetOffline();
+  feature_association->SetOffline();
+  if (FLAGS_replay_lockstep)
+    map_optmization->SetLockstep();
+  if (!InitComponent("ilego_loam_replay_map_optmization", map_optmization) ||
+      !InitComponent("ilego_loam_replay_feature_association",
+                     feature_association) ||
+      !InitComponent("ilego_loam_replay_image_projection", image_projection))
+    return false;
+
+  uint64_t first_time = 0;
+  uint64_t last_time = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (const std::string& file : records) {
+    cyber::record::RecordReader reader(file);
+    if (!reader.IsValid()) {
+      AERROR << "Can not open record " << file;
+      return false;
+    }
+    AINFO << "Replay " << file;
+
+    cyber::record::RecordMessage message;
+    while (reader.ReadMessage(&message)) {
+      if (message.channel_name == FLAGS_imu_topic) {
+        auto imu = std::make_shared<apollo::localization::CorrectedImu>();
+        if (!imu->ParseFromString(message.content)) {
+          AWARN << "Malformed imu at " << message.time << " of " << file;
+          continue;
+        }
+        // through the image stage, so the feature stage gets the imu and
+        // the clouds in record order
+        image_stage.Post([&, imu] {
+          feature_stage.Post(
+              [&, imu] { feature_association->ImuHandler(imu); });
+        });
+        continue;
+      }
+      if (message.channel_name != FLAGS_lidar_topic)
+        continue;
+      auto cloud = std::make_shared<apollo::drivers::PointCloud>();
+      if (!cloud->ParseFromString(message.content)) {
+        AWARN << "Malformed point cloud at " << message.time << " of " << file;
+        continue;
+      }
+      if (first_time == 0)
+        first_time = message.time;
+      last_time = message.time;
+      image_stage.Post([&, cloud] { image_projection->CloudHandler(cloud); });
+    }
+  }
+  image_stage.Finish();
+  feature_stage.Finish();
+  mapping_stage.Finish();
+
+  const double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  const double recorded = static_cast<double>(last_time - first_time) * 1e-9;
+  AINFO << "Replayed " << frames << " frames of " << recorded << "s in "
+        << seconds << "s, " << frames / seconds << " frames/s, "
+        << recorded / seconds << " times real time, " << mapped_frames
+        << " frames mapped";
+  return true;
+}
+
+}  // namespace
+}  // namespace tools
+}  // namespace apollo
+
+int main(int argc, char* argv[]) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  if (argc < 2) {
+    AERROR << "Usage: " << argv[0] << " [flags] record...";
+    return 1;
+  }
+  // the load shedding goes by the wall clock, never in lockstep
+  if (FLAGS_replay_lockstep ||
+      google::GetCommandLineFlagInfoOrDie("load_shedding").is_default)
+    FLAGS_load_shedding = false;
+  apollo::cyber::Init(argv[0]);
+  const std::vector<std::string> records(argv + 1, argv + argc);
+  const bool ok = apollo::tools::Replay(records);
+  apollo::cyber::Clear();
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,241 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-7-12
+//  Author: daohu527
+
+
+#include "modules/tools/ilego_loam/src/scan_matcher.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Eigen/Dense"
+
+namespace apollo {
+namespace tools {
+
+namespace {
+
+constexpr size_t kNeighborNum = 5;
+// The 5 neighbors must all be within 1m of the point
+constexpr float kNeighborDistance = 1.0f;
+
+}  // namespace
+
+void ScanMatcher::Init(int num_threads) {
+  num_threads_ = std::max(1, num_threads);
+  pool_.Resize(num_threads_);
+  partial_.resize(num_threads_);
+}
+
+const NormalEquation& ScanMatcher::Accumulate(
+    const float transform[6],
+    const pcl::PointCloud<PointType>& corners,
+    const lib::VoxelHashMap<PointType>& corner_map,
+    const pcl::PointCloud<PointType>& surfs,
+    const lib::VoxelHashMap<PointType>& surf_map) {
+  const Trigonometric trig(transform);
+  const size_t corner_num = corners.points.size();
+  const size_t surf_num = surfs.points.size();
+
+  // Every chunk takes the same share of the corners and of the surfs
+  pool_.ParallelFor(num_threads_, [&, this](int chunk) {
+    NormalEquation* equation = &partial_[chunk];
+    equation->Clear();
+    AccumulateRange(trig, corners, corner_map, true,
+                    corner_num * chunk / num_threads_,
+                    corner_num * (chunk + 1) / num_threads_, equation);
+    AccumulateRange(trig, surfs, surf_map, false,
+                    surf_num * chunk / num_threads_,
+                    surf_num * (chunk + 1) / num_threads_, equation);
+  });
+
+  total_.Clear();
+  for (const NormalEquation& equation : partial_)
+    total_ += equation;
+  return total_;
+}
+
+void ScanMatcher::AccumulateRange(const Trigonometric& trig,
+                                  const pcl::PointCloud<PointType>& cloud,
+                                  const lib::VoxelHashMap<PointType>& map,
+                                  bool corner, size_t begin, size_t end,
+                                  NormalEquation* equation) {
+  // One buffer per call, reused for all the points of the chunk
+  std::vector<PointType> neighbors;
+  std::vector<float> sq_distances;
+  neighbors.reserve(kNeighborNum);
+  sq_distances.reserve(kNeighborNum);
+
+  PointType coeff;
+  for (size_t i = begin; i < end; ++i) {
+    const PointType& point_ori = cloud.points[i];
+    const PointType point_sel = trig.ToMap(point_ori);
+    if (map.NearestKSearch(point_sel, kNeighborNum, kNeighborDistance,
+                           &neighbors, &sq_distances) < kNeighborNum)
+      continue;
+
+    const bool valid = corner ?
+        CornerCoefficient(point_sel, neighbors, &coeff) :
+        SurfCoefficient(point_sel, neighbors, &coeff);
+    if (valid)
+      equation->Add(trig.Jacobian(point_ori, coeff), -coeff.intensity);
+  }
+}
+
+bool ScanMatcher::CornerCoefficient(const PointType& point_sel,
+                                    const std::vector<PointType>& neighbors,
+                                    PointType* coeff) {
+  Eigen::Vector3f center = Eigen::Vector3f::Zero();
+  for (const PointType& p : neighbors)
+    center += p.getVector3fMap();
+  center /= neighbors.size();
+
+  Eigen::Matrix3f covariance = Eigen::Matrix3f::Zero();
+  for (const PointType& p : neighbors) {
+    const Eigen::Vector3f a = p.getVector3fMap() - center;
+    covariance += a * a.transpose();
+  }
+  covariance /= neighbors.size();
+
+  // Eigenvalues are ascending, the neighbors are a line if the largest one
+  // is well above the others
+  Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f> solver(covariance);
+  const Eigen::Vector3f& values = solver.eigenvalues();
+  if (!(values(2) > 3 * values(1)))
+    return false;
+
+  const Eigen::Vector3f direction = solver.eigenvectors().col(2);
+  const float x0 = point_sel.x;
+  const float y0 = point_sel.y;
+  const float z0 = point_sel.z;
+  const float x1 = center.x() + 0.1f * direction.x();
+  const float y1 = center.y() + 0.1f * direction.y();
+  const float z1 = center.z() + 0.1f * direction.z();
+  const float x2 = center.x() - 0.1f * direction.x();
+  const float y2 = center.y() - 0.1f * direction.y();
+  const float z2 = center.z() - 0.1f * direction.z();
+
+  // (p0 - p1) x (p0 - p2), its norm is twice the triangle area
+  const float cxy = (x0 - x1) * (y0 - y2) - (x0 - x2) * (y0 - y1);
+  const float cxz = (x0 - x1) * (z0 - z2) - (x0 - x2) * (z0 - z1);
+  const float cyz = (y0 - y1) * (z0 - z2) - (y0 - y2) * (z0 - z1);
+  const float a012 = std::sqrt(cxy * cxy + cxz * cxz + cyz * cyz);
+  const float l12 = std::sqrt((x1 - x2) * (x1 - x2) + (y1 - y2) * (y1 - y2) +
+                              (z1 - z2) * (z1 - z2));
+  if (a012 == 0.0f)
+    return false;
+
+  const float la = ((y1 - y2) * cxy + (z1 - z2) * cxz) / a012 / l12;
+  const float lb = -((x1 - x2) * cxy - (z1 - z2) * cyz) / a012 / l12;
+  const float lc = -((x1 - x2) * cxz + (y1 - y2) * cyz) / a012 / l12;
+  const float ld2 = a012 / l12;
+
+  const float s = 1 - 0.9f * std::fabs(ld2);
+  if (!(s > 0.1f))
+    return false;
+
+  coeff->x = s * la;
+  coeff->y = s * lb;
+  coeff->z = s * lc;
+  coeff->intensity = s * ld2;
+  return true;
+}
+
+bool ScanMatcher::SurfCoefficient(const PointType& point_sel,
+                                  const std::vector<PointType>& neighbors,
+                                  PointType* coeff) {
+  // Plane pa * x + pb * y + pc * z + 1 = 0 through the neighbors
+  Eigen::Matrix<float, kNeighborNum, 3> a;
+  for (size_t j = 0; j < kNeighborNum; ++j)
+    a.row(j) = neighbors[j].getVector3fMap().transpose();
+  const Eigen::Matrix<float, kNeighborNum, 1> b =
+      -Eigen::Matrix<float, kNeighborNum, 1>::Ones();
+  Eigen::Vector3f normal = a.colPivHouseholderQr().solve(b);
+
+  const float ps = normal.norm();
+  if (!(ps > 0.0f))
+    return false;
+  normal /= ps;
+  const float pd = 1.0f / ps;
+
+  for (const PointType& p : neighbors) {
+    if (std::fabs(normal.dot(p.getVector3fMap()) + pd) > 0.2f)
+      return false;
+  }
+
+  const float pd2 = normal.dot(point_sel.getVector3fMap()) + pd;
+  const float s = 1 - 0.9f * std::fabs(pd2) /
+      std::sqrt(point_sel.getVector3fMap().norm());
+  if (!(s > 0.1f))
+    return false;
+
+  coeff->x = s * normal.x();
+  coeff->y = s * normal.y();
+  coeff->z = s * normal.z();
+  coeff->intensity = s * pd2;
+  return true;
+}
+
+ScanMatcher::Trigonometric::Trigonometric(const float transform[6])
+    : srx(std::sin(transform[0])), crx(std::cos(transform[0])),
+      sry(std::sin(transform[1])), cry(std::cos(transform[1])),
+      srz(std::sin(transform[2])), crz(std::cos(transform[2])),
+      tx(transform[3]), ty(transform[4]), tz(transform[5]) {}
+
+PointType ScanMatcher::Trigonometric::ToMap(const PointType& pi) const {
+  const float x1 = crz * pi.x - srz * pi.y;
+  const float y1 = srz * pi.x + crz * pi.y;
+  const float z1 = pi.z;
+
+  const float x2 = x1;
+  const float y2 = crx * y1 - srx * z1;
+  const float z2 = srx * y1 + crx * z1;
+
+  PointType po;
+  po.x = cry * x2 + sry * z2 + tx;
+  po.y = y2 + ty;
+  po.z = -sry * x2 + cry * z2 + tz;
+  po.intensity = pi.intensity;
+  return po;
+}
+
+NormalEquation::Vector6d ScanMatcher::Trigonometric::Jacobian(
+    const PointType& p, const PointType& coeff) const {
+  const float arx =
+      (crx * sry * srz * p.x + crx * crz * sry * p.y - srx * sry * p.z) * coeff.x +
+      (-srx * srz * p.x - crz * srx * p.y - crx * p.z) * coeff.y +
+      (crx * cry * srz * p.x + crx * cry * crz * p.y - cry * srx * p.z) * coeff.z;
+
+  const float ary =
+      ((cry * srx * srz - crz * sry) * p.x +
+       (sry * srz + cry * crz * srx) * p.y + crx * cry * p.z) * coeff.x +
+      ((-cry * crz - srx * sry * srz) * p.x +
+       (cry * srz - crz * srx * sry) * p.y - crx * sry * p.z) * coeff.z;
+
+  const float arz =
+      ((crz * srx * sry - cry * srz) * p.x +
+       (-cry * crz - srx * sry * srz) * p.y) * coeff.x +
+      (crx * crz * p.x - crx * srz * p.y) * coeff.y +
+      ((sry * srz + cry * crz * srx) * p.x +
+       (crz * sry - cry * srx * srz) * p.y) * coeff.z;
+
+  NormalEquation::Vector6d jacobian;
+  jacobian << arx, ary, arz, coeff.x, coeff.y, coeff.z;
+  return jacobian;
+}
+
+}  // namespace tools
+}  // namespace apollo
@@ -0,0 +1,130 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-7-12
+//  Author: daohu527
+
+
+#pragma once
+
+#include <vector>
+
+#include "Eigen/Core"
+
+#include "modules/tools/ilego_loam/src/lib/thread_pool.h"
+#include "modules/tools/ilego_loam/src/lib/voxel_hash_map.h"
+#include "modules/tools/ilego_loam/src/utility.h"
+
+namespace apollo {
+namespace tools {
+
+// Gauss-Newton normal equations JᵀJ dx = Jᵀb of a 6 dof pose, accumulated
+// one residual at a time instead of stacking the Jacobian rows.
+struct NormalEquation {
+  using Matrix6d = Eigen::Matrix<double, 6, 6>;
+  using Vector6d = Eigen::Matrix<double, 6, 1>;
+
+  void Clear() {
+    ata.setZero();
+    atb.setZero();
+    count = 0;
+  }
+
+  void Add(const Vector6d& jacobian, double residual) {
+    ata.selfadjointView<Eigen::Lower>().rankUpdate(jacobian);
+    atb += jacobian * residual;
+    ++count;
+  }
+
+  NormalEquation& operator+=(const NormalEquation& other) {
+    ata += other.ata;
+    atb += other.atb;
+    count += other.count;
+    return *this;
+  }
+
+  // Only the lower triangle of ata is written by Add
+  Matrix6d FullAtA() const {
+    return ata.selfadjointView<Eigen::Lower>();
+  }
+
+  Matrix6d ata = Matrix6d::Zero();
+  Vector6d atb = Vector6d::Zero();
+  int count = 0;
+};
+
+// Scan to map matching residuals of the mapping, corner points against
+// lines and surf points against planes of the surrounding map.
+//
+// transform is transformTobeMapped, (rx, ry, rz, tx, ty, tz) in the camera
+// frame rotated in the z, x, y order. Each scan point is moved to the map,
+// its 5 nearest map points give a line or a plane and the weighted distance
+// to it is one residual. The residuals and their Jacobian rows are the
+// same as LeGO-LOAM, but they are summed right into the normal equations,
+// so no per point coefficient cloud or Nx6 matrix is built.
+//
+// The points are split in chunks evaluated concurrently on a
+// lib::ThreadPool, every chunk has its own partial sums which are added in
+// chunk order, so the result does not depend on scheduling. The map
+// indexes are only read and their searches are thread safe.
+class ScanMatcher {
+ public:
+  void Init(int num_threads = 1);
+
+  // Returns the normal equations of one iteration at transform.
+  const NormalEquation& Accumulate(
+      const float transform[6],
+      const pcl::PointCloud<PointType>& corners,
+      const lib::VoxelHashMap<PointType>& corner_map,
+      const pcl::PointCloud<PointType>& surfs,
+      const lib::VoxelHashMap<PointType>& surf_map);
+
+  // Distance weighted coefficient of a point, the unit normal of the line
+  // or plane in x, y, z, and the weighted distance in intensity. Returns
+  // false if the neighbors do not make a line or a plane, or the point is
+  // too far from it.
+  static bool CornerCoefficient(const PointType& point_sel,
+                                const std::vector<PointType>& neighbors,
+                                PointType* coeff);
+  static bool SurfCoefficient(const PointType& point_sel,
+                              const std::vector<PointType>& neighbors,
+                              PointType* coeff);
+
+ private:
+  struct Trigonometric {
+    explicit Trigonometric(const float transform[6]);
+
+    // pointAssociateToMap
+    PointType ToMap(const PointType& point) const;
+    // Derivative of the coefficient weighted distance by the pose
+    NormalEquation::Vector6d Jacobian(const PointType& point,
+                                      const PointType& coeff) const;
+
+    float srx, crx, sry, cry, srz, crz;
+    float tx, ty, tz;
+  };
+
+  void AccumulateRange(const Trigonometric& trig,
+                       const pcl::PointCloud<PointType>& cloud,
+                       const lib::VoxelHashMap<PointType>& map, bool corner,
+                       size_t begin, size_t end, NormalEquation* equation);
+
+  int num_threads_ = 1;
+  lib::ThreadPool pool_;
+  std::vector<NormalEquation> partial_{1};
+  NormalEquation total_;
+};
+
+}  // namespace tools
+}  // namespace apollo
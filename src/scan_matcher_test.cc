@@ -0,0 +1,264 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-7-25
+//  Author: daohu527
+
+#include "modules/tools/ilego_loam/src/scan_matcher.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "Eigen/Geometry"
+#include "gtest/gtest.h"
+
+namespace apollo {
+namespace tools {
+
+// Camera frame, y is up. Poles of the corner map and the floor of the surf
+// map, both without noise so the lines and the plane are exact.
+constexpr float kFloor = -1.5f;
+const float kPoles[][2] = {{3.0f, 4.0f}, {-2.0f, 6.0f}, {5.0f, -3.0f}};
+
+// (rx, ry, rz, tx, ty, tz) of the scan in the map
+const float kTransform[6] = {0.05f, -0.1f, 0.08f, 0.3f, -0.2f, 0.5f};
+
+PointType MakePoint(float x, float y, float z) {
+  PointType point;
+  point.x = x;
+  point.y = y;
+  point.z = z;
+  point.intensity = 0.0f;
+  return point;
+}
+
+// pointAssociateToMap of LeGO-LOAM, rotated about z, x then y
+Eigen::Vector3d ToMap(const double transform[6], const Eigen::Vector3d& p) {
+  const Eigen::Matrix3d rotation =
+      (Eigen::AngleAxisd(transform[1], Eigen::Vector3d::UnitY()) *
+       Eigen::AngleAxisd(transform[0], Eigen::Vector3d::UnitX()) *
+       Eigen::AngleAxisd(transform[2], Eigen::Vector3d::UnitZ()))
+          .toRotationMatrix();
+  return rotation * p +
+         Eigen::Vector3d(transform[3], transform[4], transform[5]);
+}
+
+Eigen::Vector3d ToScan(const double transform[6], const Eigen::Vector3d& p) {
+  const Eigen::Matrix3d rotation =
+      (Eigen::AngleAxisd(transform[1], Eigen::Vector3d::UnitY()) *
+       Eigen::AngleAxisd(transform[0], Eigen::Vector3d::UnitX()) *
+       Eigen::AngleAxisd(transform[2], Eigen::Vector3d::UnitZ()))
+          .toRotationMatrix();
+  return rotation.transpose() *
+         (p - Eigen::Vector3d(transform[3], transform[4], transform[5]));
+}
+
+struct Scene {
+  lib::VoxelHashMap<PointType> corner_map;
+  lib::VoxelHashMap<PointType> surf_map;
+  pcl::PointCloud<PointType> corners;
+  pcl::PointCloud<PointType> surfs;
+};
+
+// Scan points up to 0.4m off the poles and the floor, and a few far from
+// both which have no neighbors
+Scene MakeScene(unsigned seed) {
+  Scene scene;
+  for (const auto& pole : kPoles) {
+    for (int i = 0; i <= 40; ++i)
+      scene.corner_map.Insert(MakePoint(pole[0], kFloor + 0.1f * i, pole[1]));
+  }
+  for (int i = -40; i <= 40; ++i) {
+    for (int j = -40; j <= 40; ++j)
+      scene.surf_map.Insert(MakePoint(0.2f * i, kFloor, 0.2f * j));
+  }
+
+  double transform[6];
+  std::copy(kTransform, kTransform + 6, transform);
+  auto add = [&transform](const Eigen::Vector3d& map_point,
+                          pcl::PointCloud<PointType>* cloud) {
+    const Eigen::Vector3d p = ToScan(transform, map_point);
+    cloud->push_back(MakePoint(p.x(), p.y(), p.z()));
+  };
+
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<double> off(-0.4, 0.4);
+  std::uniform_real_distribution<double> height(0.5, 2.0);
+  std::uniform_real_distribution<double> u(-6.0, 6.0);
+  for (int i = 0; i < 300; ++i) {
+    const auto& pole = kPoles[i % 3];
+    add(Eigen::Vector3d(pole[0] + off(rng) / 2, kFloor + height(rng),
+                        pole[1] + off(rng) / 2), &scene.corners);
+  }
+  for (int i = 0; i < 600; ++i)
+    add(Eigen::Vector3d(u(rng), kFloor + off(rng), u(rng)), &scene.surfs);
+  for (int i = 0; i < 20; ++i) {
+    add(Eigen::Vector3d(u(rng), 20.0, u(rng)), &scene.corners);
+    add(Eigen::Vector3d(u(rng), 20.0, u(rng)), &scene.surfs);
+  }
+  return scene;
+}
+
+// Sums of the LeGO-LOAM coefficients from the known lines and plane, with
+// the Jacobian of coeff . pointAssociateToMap(p) taken numerically
+NormalEquation Expected(const Scene& scene) {
+  double transform[6];
+  std::copy(kTransform, kTransform + 6, transform);
+
+  NormalEquation equation;
+  auto add = [&](const PointType& point, const Eigen::Vector3d& coeff,
+                 double distance) {
+    const Eigen::Vector3d p(point.x, point.y, point.z);
+    NormalEquation::Vector6d jacobian;
+    for (int k = 0; k < 6; ++k) {
+      const double h = 1e-6;
+      double plus[6], minus[6];
+      std::copy(transform, transform + 6, plus);
+      std::copy(transform, transform + 6, minus);
+      plus[k] += h;
+      minus[k] -= h;
+      jacobian(k) =
+          coeff.dot(ToMap(plus, p) - ToMap(minus, p)) / (2 * h);
+    }
+    equation.Add(jacobian, -distance);
+  };
+
+  for (const PointType& point : scene.corners.points) {
+    const Eigen::Vector3d sel =
+        ToMap(transform, Eigen::Vector3d(point.x, point.y, point.z));
+    if (sel.y() > 10.0)
+      continue;
+    // from the nearest pole to the point
+    Eigen::Vector3d normal;
+    double d = std::numeric_limits<double>::max();
+    for (const auto& pole : kPoles) {
+      const Eigen::Vector3d n(sel.x() - pole[0], 0.0, sel.z() - pole[1]);
+      if (n.norm() < d) {
+        normal = n;
+        d = n.norm();
+      }
+    }
+    const double s = 1 - 0.9 * d;
+    add(point, s * normal / d, s * d);
+  }
+  for (const PointType& point : scene.surfs.points) {
+    const Eigen::Vector3d sel =
+        ToMap(transform, Eigen::Vector3d(point.x, point.y, point.z));
+    if (sel.y() > 10.0)
+      continue;
+    // the plane y - kFloor = 0 with the origin on the positive side
+    const double d = sel.y() - kFloor;
+    const double s = 1 - 0.9 * std::fabs(d) / std::sqrt(sel.norm());
+    add(point, s * Eigen::Vector3d::UnitY(), s * d);
+  }
+  return equation;
+}
+
+void ExpectNearEquation(const NormalEquation& expected,
+                        const NormalEquation& actual, double tolerance) {
+  EXPECT_EQ(actual.count, expected.count);
+  const double ata_scale = expected.FullAtA().cwiseAbs().maxCoeff();
+  const double atb_scale = expected.atb.cwiseAbs().maxCoeff();
+  EXPECT_LT((actual.FullAtA() - expected.FullAtA()).cwiseAbs().maxCoeff(),
+            tolerance * ata_scale);
+  EXPECT_LT((actual.atb - expected.atb).cwiseAbs().maxCoeff(),
+            tolerance * atb_scale);
+}
+
+TEST(ScanMatcherTest, CornerCoefficientIsTheDistanceToTheLine) {
+  std::vector<PointType> neighbors;
+  for (int i = 0; i < 5; ++i)
+    neighbors.push_back(MakePoint(1.0f, 0.1f * i, 2.0f));
+
+  PointType coeff;
+  ASSERT_TRUE(ScanMatcher::CornerCoefficient(MakePoint(1.3f, 0.2f, 2.4f),
+                                             neighbors, &coeff));
+  // 0.5m off along (0.6, 0, 0.8), weighted by 1 - 0.9 * 0.5
+  const float s = 0.55f;
+  EXPECT_NEAR(coeff.x, s * 0.6f, 1e-4f);
+  EXPECT_NEAR(coeff.y, 0.0f, 1e-4f);
+  EXPECT_NEAR(coeff.z, s * 0.8f, 1e-4f);
+  EXPECT_NEAR(coeff.intensity, s * 0.5f, 1e-4f);
+
+  // too far from the line to be weighted
+  EXPECT_FALSE(ScanMatcher::CornerCoefficient(MakePoint(2.2f, 0.2f, 2.0f),
+                                              neighbors, &coeff));
+  // neighbors spread in a square are no line
+  neighbors = {MakePoint(0.0f, 0.0f, 0.0f), MakePoint(0.5f, 0.0f, 0.0f),
+               MakePoint(0.0f, 0.5f, 0.0f), MakePoint(0.5f, 0.5f, 0.0f),
+               MakePoint(0.25f, 0.25f, 0.0f)};
+  EXPECT_FALSE(ScanMatcher::CornerCoefficient(MakePoint(0.2f, 0.2f, 0.1f),
+                                              neighbors, &coeff));
+}
+
+TEST(ScanMatcherTest, SurfCoefficientIsTheDistanceToThePlane) {
+  std::vector<PointType> neighbors = {
+      MakePoint(0.0f, -1.0f, 4.0f), MakePoint(0.8f, -1.0f, 4.0f),
+      MakePoint(0.0f, -1.0f, 4.8f), MakePoint(0.8f, -1.0f, 4.8f),
+      MakePoint(0.4f, -1.0f, 4.4f)};
+
+  PointType coeff;
+  const PointType point = MakePoint(0.0f, -0.8f, 4.0f);
+  ASSERT_TRUE(ScanMatcher::SurfCoefficient(point, neighbors, &coeff));
+  // 0.2m above y = -1, the origin is on the positive side
+  const float s =
+      1 - 0.9f * 0.2f / std::sqrt(point.getVector3fMap().norm());
+  EXPECT_NEAR(coeff.x, 0.0f, 1e-4f);
+  EXPECT_NEAR(coeff.y, s, 1e-4f);
+  EXPECT_NEAR(coeff.z, 0.0f, 1e-4f);
+  EXPECT_NEAR(coeff.intensity, s * 0.2f, 1e-4f);
+
+  // a neighbor 0.5m off the others
+  neighbors[4].y = -0.5f;
+  EXPECT_FALSE(ScanMatcher::SurfCoefficient(point, neighbors, &coeff));
+}
+
+TEST(ScanMatcherTest, MatchesTheLegoLoamSums) {
+  const Scene scene = MakeScene(1);
+  ScanMatcher matcher;
+  matcher.Init();
+  const NormalEquation& actual =
+      matcher.Accumulate(kTransform, scene.corners, scene.corner_map,
+                         scene.surfs, scene.surf_map);
+  // the points far from the map are skipped
+  EXPECT_EQ(actual.count, 900);
+  ExpectNearEquation(Expected(scene), actual, 1e-4);
+}
+
+TEST(ScanMatcherTest, ThreadsMatchOneThread) {
+  const Scene scene = MakeScene(2);
+  ScanMatcher serial;
+  serial.Init();
+  const NormalEquation expected =
+      serial.Accumulate(kTransform, scene.corners, scene.corner_map,
+                        scene.surfs, scene.surf_map);
+  ASSERT_GT(expected.count, 0);
+
+  for (int num_threads : {2, 3, 4}) {
+    ScanMatcher parallel;
+    parallel.Init(num_threads);
+    // the partial sums are added in another grouping only
+    ExpectNearEquation(
+        expected,
+        parallel.Accumulate(kTransform, scene.corners, scene.corner_map,
+                            scene.surfs, scene.surf_map),
+        1e-9);
+  }
+}
+
+}  // namespace tools
+}  // namespace apollo
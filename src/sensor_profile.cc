@@ -0,0 +1,95 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+//  Created Date: 2022-6-8
+//  Author: daohu527
+
+
+#include "modules/tools/ilego_loam/src/sensor_profile.h"
+
+#include <sstream>
+
+#include "cyber/cyber.h"
+#include "modules/tools/ilego_loam/flags/lego_loam_gflags.h"
+
+namespace apollo {
+namespace tools {
+
+namespace {
+
+SensorProfile MakeProfile(const std::string& name, int n_scan,
+    int horizon_scan, float ang_res_x, float ang_res_y, float ang_bottom,
+    int ground_scan_ind) {
+  SensorProfile profile;
+  profile.name = name;
+  profile.n_scan = n_scan;
+  profile.horizon_scan = horizon_scan;
+  profile.ang_res_x = ang_res_x;
+  profile.ang_res_y = ang_res_y;
+  profile.ang_bottom = ang_bottom;
+  profile.ground_scan_ind = ground_scan_ind;
+  // ring centers of the uniform binning used by atan2 projection
+  for (int i = 0; i < n_scan; ++i)
+    profile.vertical_angles.push_back(i * ang_res_y - ang_bottom + ang_res_y / 2);
+  return profile;
+}
+
+const std::vector<SensorProfile>& BuiltinProfiles() {
+  static const std::vector<SensorProfile> profiles = {
+      MakeProfile("VLP-16", 16, 1800, 0.2, 2.0, 15.0 + 0.1, 7),
+      MakeProfile("HDL-32E", 32, 1800, 360.0 / 1800, 41.33 / 31, 30.67, 20),
+      MakeProfile("HDL-64E", 64, 1800, 360.0 / 1800, 26.9 / 63, 24.9 + 0.1, 50),
+      MakeProfile("VLS-128", 128, 1800, 0.2, 0.3, 25.0, 10),
+      MakeProfile("OS1-16", 16, 1024, 360.0 / 1024, 33.2 / 15, 16.6 + 0.1, 7),
+      MakeProfile("OS1-64", 64, 1024, 360.0 / 1024, 33.2 / 63, 16.6 + 0.1, 15),
+  };
+  return profiles;
+}
+
+}  // namespace
+
+bool LoadSensorProfile(SensorProfile* profile) {
+  if (!LoadSensorProfile(FLAGS_sensor_model, profile))
+    return false;
+
+  if (!FLAGS_sensor_vertical_angles.empty()) {
+    profile->vertical_angles.clear();
+    std::stringstream ss(FLAGS_sensor_vertical_angles);
+    std::string angle;
+    while (std::getline(ss, angle, ','))
+      profile->vertical_angles.push_back(std::stof(angle));
+  }
+
+  if (profile->vertical_angles.size() != static_cast<size_t>(profile->n_scan)) {
+    AERROR << "Sensor vertical angles size " << profile->vertical_angles.size()
+           << " not equal to n_scan " << profile->n_scan;
+    return false;
+  }
+  return true;
+}
+
+bool LoadSensorProfile(const std::string& name, SensorProfile* profile) {
+  for (const auto& builtin : BuiltinProfiles()) {
+    if (builtin.name == name) {
+      *profile = builtin;
+      return true;
+    }
+  }
+  AERROR << "Unknown sensor model: " << name;
+  return false;
+}
+
+}  // namespace tools
+}  // namespace apollo
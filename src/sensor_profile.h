@@ -0,0 +1,79 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+//  Created Date: 2022-6-8
+//  Author: daohu527
+
+
+#pragma once
+
+#include <cmath>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace apollo {
+namespace tools {
+
+// Range image geometry of a lidar, selected by --sensor_model.
+struct SensorProfile {
+  std::string name;
+  int n_scan = 0;
+  int horizon_scan = 0;
+
+  float ang_res_x = 0;
+  float ang_res_y = 0;
+  float ang_bottom = 0;
+  int ground_scan_ind = 0;
+
+  // ring elevations in degrees, ascending
+  std::vector<float> vertical_angles;
+
+  float segment_alpha_x() const { return ang_res_x / 180.0 * M_PI; }
+  float segment_alpha_y() const { return ang_res_y / 180.0 * M_PI; }
+};
+
+// Load the profile named by --sensor_model, --sensor_vertical_angles
+// overrides the uniform ring elevations of the profile.
+bool LoadSensorProfile(SensorProfile* profile);
+
+bool LoadSensorProfile(const std::string& name, SensorProfile* profile);
+
+// Calls func(rows, cols) with std::integral_constant dimensions, common
+// sensors get compile-time constants so the per-pixel loops are
+// specialized, other sensors get 0 and must use the runtime profile.
+template <typename Func>
+void DispatchGeometry(const SensorProfile& profile, Func&& func) {
+  using Dynamic = std::integral_constant<int, 0>;
+  if (profile.horizon_scan == 1800) {
+    using Cols = std::integral_constant<int, 1800>;
+    switch (profile.n_scan) {
+      case 16:
+        return func(std::integral_constant<int, 16>(), Cols());
+      case 32:
+        return func(std::integral_constant<int, 32>(), Cols());
+      case 64:
+        return func(std::integral_constant<int, 64>(), Cols());
+      case 128:
+        return func(std::integral_constant<int, 128>(), Cols());
+      default:
+        break;
+    }
+  }
+  func(Dynamic(), Dynamic());
+}
+
+}  // namespace tools
+}  // namespace apollo
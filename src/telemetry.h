@@ -0,0 +1,90 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//  Created Date: 2022-7-25
+//  Author: daohu527
+
+
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#include "cyber/cyber.h"
+#include "modules/tools/ilego_loam/proto/frame_telemetry.pb.h"
+
+namespace apollo {
+namespace tools {
+
+// Per frame telemetry of the components, see frame_telemetry.proto. A
+// component fills one message per scan and writes it on kTelemetryChannel
+// when --publish_telemetry is set. A null message turns the timers off, so
+// the stages need no checks of their own.
+//
+//   StartTelemetry(header.timestamp_sec(), FrameTelemetry::IMAGE_PROJECTION,
+//                  &telemetry);
+//   {
+//     StageTimer timer(&telemetry, FrameTelemetry::PROJECT);
+//     ...
+//   }
+constexpr char kTelemetryChannel[] = "/ilego_loam/telemetry";
+
+inline uint64_t MonotonicMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Clears message for the scan at timestamp_sec, the repeated fields keep
+// their memory for the next scan
+inline void StartTelemetry(double timestamp_sec,
+                           cloud_msgs::FrameTelemetry::Component component,
+                           cloud_msgs::FrameTelemetry* message) {
+  message->Clear();
+  message->set_timestamp_sec(timestamp_sec);
+  message->set_component(component);
+  // Only meaningful live, a replayed scan is older than the wall time
+  const double delay = cyber::Time::Now().ToSecond() - timestamp_sec;
+  message->set_input_delay_us(
+      delay > 0.0 ? static_cast<uint32_t>(delay * 1e6) : 0);
+}
+
+// Adds its scope as a stage of message
+class StageTimer {
+ public:
+  StageTimer(cloud_msgs::FrameTelemetry* message,
+             cloud_msgs::FrameTelemetry::Stage stage)
+      : message_(message), stage_(stage),
+        start_(message ? MonotonicMicros() : 0) {}
+
+  ~StageTimer() {
+    if (!message_)
+      return;
+    auto* time = message_->add_stage();
+    time->set_stage(stage_);
+    time->set_start_us(start_);
+    time->set_duration_us(static_cast<uint32_t>(MonotonicMicros() - start_));
+  }
+
+  StageTimer(const StageTimer&) = delete;
+  StageTimer& operator=(const StageTimer&) = delete;
+
+ private:
+  cloud_msgs::FrameTelemetry* message_;
+  cloud_msgs::FrameTelemetry::Stage stage_;
+  uint64_t start_;
+};
+
+}  // namespace tools
+}  // namespace apollo
@@ -0,0 +1,71 @@
+// Copyright 2022 daohu527@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+//  Created Date: 2022-6-25
+//  Author: daohu527
+
+
+#pragma once
+
+// Debug tracing for the ilego_loam components. The macros compile to
+// nothing unless the build defines ILEGO_LOAM_TRACE, e.g.
+//   bazel build --define ilego_loam_trace=true //modules/tools/ilego_loam/...
+//
+//   LOAM_TRACE_SCOPE("GroundRemoval");     // log the elapsed time of a scope
+//   LOAM_TRACE("segmented", cloud->size()); // log a value
+
+#ifdef ILEGO_LOAM_TRACE
+
+#include <chrono>
+
+#include "cyber/cyber.h"
+
+namespace apollo {
+namespace tools {
+
+class TraceScope {
+ public:
+  explicit TraceScope(const char* name)
+      : name_(name), start_(std::chrono::steady_clock::now()) {}
+
+  ~TraceScope() {
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start_);
+    AINFO << "[trace] " << name_ << ": " << elapsed.count() << " us";
+  }
+
+ private:
+  const char* name_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+}  // namespace tools
+}  // namespace apollo
+
+#define LOAM_TRACE_CONCAT_IMPL(a, b) a##b
+#define LOAM_TRACE_CONCAT(a, b) LOAM_TRACE_CONCAT_IMPL(a, b)
+
+#define LOAM_TRACE_SCOPE(name) \
+  ::apollo::tools::TraceScope LOAM_TRACE_CONCAT(loam_trace_scope_, __LINE__)(name)
+
+#define LOAM_TRACE(name, value) \
+  AINFO << "[trace] " << (name) << ": " << (value)
+
+#else
+
+#define LOAM_TRACE_SCOPE(name) do {} while (0)
+#define LOAM_TRACE(name, value) do {} while (0)
+
+#endif
@@ -33,30 +33,37 @@
 #include "pcl/point_cloud.h"
 #include "pcl/point_types.h"
 #include "pcl/filters/filter.h"
+#include "pcl/register_point_struct.h"
 
 #include "modules/drivers/proto/pointcloud.pb.h"
 
 namespace apollo {
 namespace tools {
 
-extern const int N_SCAN = 16;
-extern const int HORIZON_SCAN = 1800;
+// Sensor geometry is loaded at runtime, see sensor_profile.h
 
-extern const float ang_res_x = 0.2;
-extern const float ang_res_y = 2.0;
-extern const float ang_bottom = 15.0 + 0.1;
-extern const int groundScanInd = 7;
+constexpr float segmentTheta = 60.0/180.0*M_PI; // decrese this value may improve accuracy
+constexpr int segmentValidPointNum = 5;
+constexpr int segmentValidLineNum = 3;
 
 
-extern const float segmentTheta = 60.0/180.0*M_PI; // decrese this value may improve accuracy
-extern const int segmentValidPointNum = 5;
-extern const int segmentValidLineNum = 3;
-extern const float segmentAlphaX = ang_res_x / 180.0 * M_PI;
-extern const float segmentAlphaY = ang_res_y / 180.0 * M_PI;
+constexpr float SCAN_PERIOD = 0.1;
+constexpr int IMU_QUE_LENGTH = 200;
 
+// Feature association, every skipFrameNum + 1 scan goes on to the mapping
+constexpr int skipFrameNum = 1;
+constexpr float edgeThreshold = 0.1;
+constexpr float surfThreshold = 0.1;
+constexpr float nearestFeatureSearchSqDist = 25;
 
-extern const float SCAN_PERIOD = 0.1;
-extern const int IMU_QUE_LENGTH = 200;
+// Mapping
+constexpr bool loopClosureEnableFlag = true;
+constexpr float surroundingKeyframeSearchRadius = 50.0;
+constexpr int surroundingKeyframeSearchNum = 50;
+constexpr float historyKeyframeSearchRadius = 7.0;
+constexpr int historyKeyframeSearchNum = 25;
+constexpr float historyKeyframeFitnessScore = 0.3;
+constexpr float globalMapVisualizationSearchRadius = 500.0;
 
 
 using PointType = pcl::PointXYZI;
@@ -64,13 +71,26 @@ using PointCloudPtr = pcl::PointCloud<PointType>::Ptr;
 // using PointCloudRPtr = pcl::PointCloud<pcl::PointXYZIR>::Ptr;
 using DriverPointCloudPtr = std::shared_ptr<apollo::drivers::PointCloud>;
 
+// Pose of a key frame in the camera frame, the index in intensity
+struct PointXYZIRPYT {
+  PCL_ADD_POINT4D
+  PCL_ADD_INTENSITY;
+  float roll;
+  float pitch;
+  float yaw;
+  double time;
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+} EIGEN_ALIGN16;
+
+using PointTypePose = PointXYZIRPYT;
+
 
 struct smoothness_t {
   float value;
   size_t ind;
 };
 
-void ToPclPointCloud(const DriverPointCloudPtr& from, const PointCloudPtr& to) {
+inline void ToPclPointCloud(const DriverPointCloudPtr& from, const PointCloudPtr& to) {
   for (int i = 0; i < from->point().size(); ++i) {
     pcl::PointXYZI point(from->point(i).x(),
                          from->point(i).y(),
@@ -81,22 +101,47 @@ void ToPclPointCloud(const DriverPointCloudPtr& from, const PointCloudPtr& to) {
   to->is_dense = from->is_dense();
 }
 
-void ToDriverPointCloud(const PointCloudPtr& from, apollo::drivers::PointCloud& to) {
-  for (size_t i = 0; i < from->points.size(); ++i) {
-    auto pb_point = to.add_point();
-    pb_point->set_x(from->points[i].x);
-    pb_point->set_y(from->points[i].y);
-    pb_point->set_z(from->points[i].z);
-    pb_point->set_intensity(from->points[i].intensity);
+// Overwrites the points of "to" in place, so a message reused across frames
+// keeps its allocated points instead of regrowing them.
+inline void ToDriverPointCloud(const pcl::PointCloud<PointType>& from,
+                               apollo::drivers::PointCloud& to) {
+  auto* points = to.mutable_point();
+  const int size = static_cast<int>(from.points.size());
+  // RemoveLast keeps the removed points allocated for the next Add
+  while (points->size() > size)
+    points->RemoveLast();
+  points->Reserve(size);
+  for (int i = 0; i < size; ++i) {
+    auto pb_point = i < points->size() ? points->Mutable(i) : points->Add();
+    pb_point->set_x(from.points[i].x);
+    pb_point->set_y(from.points[i].y);
+    pb_point->set_z(from.points[i].z);
+    pb_point->set_intensity(from.points[i].intensity);
   }
 }
 
+inline void ToDriverPointCloud(const PointCloudPtr& from, apollo::drivers::PointCloud& to) {
+  ToDriverPointCloud(*from, to);
+}
+
 
-bool IsNaN(const pcl::PointXYZI& point) {
+inline bool IsNaN(const pcl::PointXYZI& point) {
   return (!std::isfinite(point.x) ||
           !std::isfinite(point.y) ||
           !std::isfinite(point.z));
 }
 
+inline bool IsNaN(const apollo::drivers::PointXYZIT& point) {
+  return (!std::isfinite(point.x()) ||
+          !std::isfinite(point.y()) ||
+          !std::isfinite(point.z()));
+}
+
 }  // namespace tools
 }  // namespace apollo
+
+POINT_CLOUD_REGISTER_POINT_STRUCT(apollo::tools::PointXYZIRPYT,
+                                  (float, x, x) (float, y, y)
+                                  (float, z, z) (float, intensity, intensity)
+                                  (float, roll, roll) (float, pitch, pitch)
+                                  (float, yaw, yaw) (double, time, time))